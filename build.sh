@@ -2,6 +2,9 @@
 
 BUILD_DIR="build"
 
+# Set BUILD_VIZ=OFF for a headless build without raylib
+BUILD_VIZ="${BUILD_VIZ:-ON}"
+
 if [ ! -d "$BUILD_DIR" ]; then
     mkdir "$BUILD_DIR"
 fi
@@ -9,9 +12,9 @@ fi
 cd "$BUILD_DIR"
 
 if [ ! -f "Makefile" ]; then
-    cmake ..
+    cmake -DBUILD_VIZ="$BUILD_VIZ" ..
 fi
 
 make
 
-./main
\ No newline at end of file
+./main "$@"
@@ -0,0 +1,230 @@
+#include "augment.h"
+#include "nn.h"
+#include "configs.h"
+#include <math.h>
+#include <string.h>
+
+// Added before truncating sample coordinates so truncation floors them; far larger than any
+// coordinate the AUGMENT_* ranges can push outside the image
+#define AUGMENT_FLOOR_OFFSET 1024
+
+// The kernels below are branch-free loops over fixed-size arrays so the compiler can vectorize
+// them; nothing here touches global state, any number of threads can augment at once.
+
+void augment_rng_seed(AugmentRng *rng, uint64_t seed)
+{
+    // splitmix64, so nearby seeds give unrelated streams
+    uint64_t z = seed + 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    rng->state = (z ^ (z >> 31)) | 1;
+}
+
+// xorshift64*
+uint32_t augment_rng_next(AugmentRng *rng)
+{
+    rng->state ^= rng->state >> 12;
+    rng->state ^= rng->state << 25;
+    rng->state ^= rng->state >> 27;
+    return (uint32_t)((rng->state * 0x2545f4914f6cdd1dull) >> 32);
+}
+
+float augment_rng_uniform(AugmentRng *rng, float lo, float hi)
+{
+    return lo + (hi - lo) * (float)(augment_rng_next(rng) >> 8) * (1.0f / 16777216.0f);
+}
+
+AugmentParams augment_params_identity()
+{
+    return (AugmentParams){.angle = 0, .scale = 1, .dx = 0, .dy = 0, .elastic = 0, .noise = 0};
+}
+
+// Draw every transform at once, within the AUGMENT_* ranges of configs.h
+AugmentParams augment_params_random(AugmentRng *rng)
+{
+    AugmentParams params;
+    params.angle = augment_rng_uniform(rng, -AUGMENT_MAX_ROTATION, AUGMENT_MAX_ROTATION);
+    params.scale = augment_rng_uniform(rng, 1 - AUGMENT_MAX_SCALE, 1 + AUGMENT_MAX_SCALE);
+    params.dx = augment_rng_uniform(rng, -AUGMENT_MAX_SHIFT, AUGMENT_MAX_SHIFT);
+    params.dy = augment_rng_uniform(rng, -AUGMENT_MAX_SHIFT, AUGMENT_MAX_SHIFT);
+    params.elastic = AUGMENT_ELASTIC;
+    params.noise = AUGMENT_NOISE;
+    return params;
+}
+
+// Smooth displacement field: random offsets on a coarse grid, bilinearly interpolated per pixel.
+// Adds to ex and ey, which the caller zeroes.
+static void elastic_field(float elastic, AugmentRng *rng, float *ex, float *ey)
+{
+    float grid_x[AUGMENT_ELASTIC_GRID * AUGMENT_ELASTIC_GRID];
+    float grid_y[AUGMENT_ELASTIC_GRID * AUGMENT_ELASTIC_GRID];
+    for (int i = 0; i < AUGMENT_ELASTIC_GRID * AUGMENT_ELASTIC_GRID; i++)
+    {
+        grid_x[i] = augment_rng_uniform(rng, -elastic, elastic);
+        grid_y[i] = augment_rng_uniform(rng, -elastic, elastic);
+    }
+
+    // Hat weights of each grid point along one axis, shared by rows and columns. Dense weights
+    // instead of a cell lookup keep the per-pixel loop a plain multiply-add the compiler vectorizes.
+    float hat[AUGMENT_ELASTIC_GRID][MNIST_IMG_SIZE];
+    for (int g = 0; g < AUGMENT_ELASTIC_GRID; g++)
+    {
+        for (int i = 0; i < MNIST_IMG_SIZE; i++)
+        {
+            float dist = fabsf((float)i * (AUGMENT_ELASTIC_GRID - 1) / (MNIST_IMG_SIZE - 1) - g);
+            hat[g][i] = dist < 1 ? 1 - dist : 0;
+        }
+    }
+
+    for (int y = 0; y < MNIST_IMG_SIZE; y++)
+    {
+        // Interpolate the grid rows down to this image row, then along it
+        float row_x[AUGMENT_ELASTIC_GRID] = {0};
+        float row_y[AUGMENT_ELASTIC_GRID] = {0};
+        for (int h = 0; h < AUGMENT_ELASTIC_GRID; h++)
+        {
+            for (int g = 0; g < AUGMENT_ELASTIC_GRID; g++)
+            {
+                row_x[g] += hat[h][y] * grid_x[h * AUGMENT_ELASTIC_GRID + g];
+                row_y[g] += hat[h][y] * grid_y[h * AUGMENT_ELASTIC_GRID + g];
+            }
+        }
+
+        float *row_ex = &ex[y * MNIST_IMG_SIZE];
+        float *row_ey = &ey[y * MNIST_IMG_SIZE];
+        for (int g = 0; g < AUGMENT_ELASTIC_GRID; g++)
+        {
+            for (int x = 0; x < MNIST_IMG_SIZE; x++)
+            {
+                row_ex[x] += hat[g][x] * row_x[g];
+                row_ey[x] += hat[g][x] * row_y[g];
+            }
+        }
+    }
+}
+
+// Compose the inverse transform of params into map; rng is only used for the elastic grid
+void augment_map_build(AugmentMap *map, const AugmentParams *params, AugmentRng *rng)
+{
+    float ex[MNIST_IMG_DATA_LEN] = {0};
+    float ey[MNIST_IMG_DATA_LEN] = {0};
+    if (params->elastic > 0)
+    {
+        elastic_field(params->elastic, rng, ex, ey);
+    }
+
+    // Each output pixel looks up where it came from: undo the shift, then the scaled rotation
+    float center = (MNIST_IMG_SIZE - 1) * 0.5f;
+    float radians = params->angle * (float)M_PI / 180.0f;
+    float cos_a = cosf(radians) / params->scale;
+    float sin_a = sinf(radians) / params->scale;
+
+    for (int y = 0; y < MNIST_IMG_SIZE; y++)
+    {
+        float v = (float)y - center - params->dy;
+        float row_x = sin_a * v + center + 1;
+        float row_y = cos_a * v + center + 1;
+        for (int x = 0; x < MNIST_IMG_SIZE; x++)
+        {
+            int i = y * MNIST_IMG_SIZE + x;
+            float u = (float)x - center - params->dx;
+
+            // Padded source coordinates, the border pixel is at 0
+            float px = cos_a * u + row_x + ex[i];
+            float py = -sin_a * u + row_y + ey[i];
+            // Floor through an offset truncation and integer bounds checks keep the loop free of
+            // branches, so the compiler vectorizes it
+            int x0 = (int)(px + AUGMENT_FLOOR_OFFSET) - AUGMENT_FLOOR_OFFSET;
+            int y0 = (int)(py + AUGMENT_FLOOR_OFFSET) - AUGMENT_FLOOR_OFFSET;
+            float fx = px - (float)x0;
+            float fy = py - (float)y0;
+            int inside = ((unsigned)x0 <= MNIST_IMG_SIZE) & ((unsigned)y0 <= MNIST_IMG_SIZE);
+            float mask = (float)inside;
+            x0 *= inside;
+            y0 *= inside;
+            map->idx[i] = y0 * AUGMENT_PADDED_SIZE + x0;
+            map->w00[i] = mask * (1 - fx) * (1 - fy);
+            map->w01[i] = mask * fx * (1 - fy);
+            map->w10[i] = mask * (1 - fx) * fy;
+            map->w11[i] = mask * fx * fy;
+        }
+    }
+}
+
+// Bilinear resample of pixels through map into out (which must not alias pixels)
+void augment_map_apply(const AugmentMap *map, const float *pixels, float *out)
+{
+    float padded[AUGMENT_PADDED_LEN] = {0};
+    for (int y = 0; y < MNIST_IMG_SIZE; y++)
+    {
+        memcpy(&padded[(y + 1) * AUGMENT_PADDED_SIZE + 1], &pixels[y * MNIST_IMG_SIZE], MNIST_IMG_SIZE * sizeof(float));
+    }
+
+    for (int i = 0; i < MNIST_IMG_DATA_LEN; i++)
+    {
+        const float *tap = &padded[map->idx[i]];
+        out[i] = map->w00[i] * tap[0] + map->w01[i] * tap[1] + map->w10[i] * tap[AUGMENT_PADDED_SIZE] +
+                 map->w11[i] * tap[AUGMENT_PADDED_SIZE + 1];
+    }
+}
+
+void augment_image(const float *pixels, const AugmentParams *params, AugmentRng *rng, float *out)
+{
+    AugmentMap map;
+    augment_map_build(&map, params, rng);
+    augment_map_apply(&map, pixels, out);
+    if (params->noise > 0)
+    {
+        add_noise(out, params->noise, augment_rng_next(rng));
+    }
+}
+
+// Randomly rotate, scale, shift, distort and add noise to a record
+void augment_mnist_record(const MnistRecord *record, AugmentRng *rng, MnistRecord *out)
+{
+    AugmentParams params = augment_params_random(rng);
+    augment_image(record->pixels, &params, rng, out->pixels);
+    out->label = record->label;
+}
+
+// Rotate an image by angle degrees around its center
+void rotate_image(const float *pixels, float angle, float *out)
+{
+    AugmentParams params = augment_params_identity();
+    params.angle = angle;
+    augment_image(pixels, &params, NULL, out);
+}
+
+// Shift an image by whole pixels, uncovered pixels are blank
+void shift_image(const float *pixels, int dx, int dy, float *out)
+{
+    AugmentParams params = augment_params_identity();
+    params.dx = (float)dx;
+    params.dy = (float)dy;
+    augment_image(pixels, &params, NULL, out);
+}
+
+// Add roughly gaussian noise to the ink, clamped to [0, 1]. Blank pixels stay blank so augmented
+// images keep the sparsity the first layer relies on. Each pixel hashes its index with seed and
+// sums the four bytes of the hash (Irwin-Hall), which needs no per-pixel state or libm calls.
+void add_noise(float *pixels, float noise_level, uint32_t seed)
+{
+    const float inv_std = 1.0f / 147.8f; // sqrt(4 * (256^2 - 1) / 12)
+    for (int i = 0; i < MNIST_IMG_DATA_LEN; i++)
+    {
+        uint32_t h = (uint32_t)i * 0x9e3779b1u + seed;
+        h ^= h >> 16;
+        h *= 0x7feb352du;
+        h ^= h >> 15;
+        h *= 0x846ca68bu;
+        h ^= h >> 16;
+        int sum = (int)(h & 255) + (int)((h >> 8) & 255) + (int)((h >> 16) & 255) + (int)(h >> 24);
+
+        float p = pixels[i];
+        // Ternaries rather than fminf/fmaxf, whose NaN rules keep the loop scalar
+        float noisy = p + noise_level * (sum - 510) * inv_std;
+        noisy = noisy > 0 ? noisy : 0;
+        noisy = noisy < 1 ? noisy : 1;
+        pixels[i] = p > 0 ? noisy : 0.0f;
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef AUGMENT_H
+#define AUGMENT_H
+
+#include <stdint.h>
+#include "nn.h"
+
+// Images are sampled from a copy with a one pixel zero border so every bilinear tap is in bounds
+#define AUGMENT_PADDED_SIZE (MNIST_IMG_SIZE + 2)
+#define AUGMENT_PADDED_LEN (AUGMENT_PADDED_SIZE * AUGMENT_PADDED_SIZE)
+// Control points per axis of the elastic displacement grid
+#define AUGMENT_ELASTIC_GRID 4
+
+typedef struct
+{
+    float angle;   // Degrees, clockwise on screen
+    float scale;   // > 1 enlarges the digit
+    float dx, dy;  // Pixels
+    float elastic; // Largest displacement of an elastic grid point in pixels, 0 disables it
+    float noise;   // Standard deviation of the noise added to ink pixels, 0 disables it
+} AugmentParams;
+
+// Random state owned by the caller, so augmentation threads never share one (typedef in nn.h)
+struct AugmentRng
+{
+    uint64_t state;
+};
+
+// Rotation, scale, shift and elastic distortion composed into one sampling map: output
+// pixel i blends the padded source taps at idx[i], idx[i] + 1 and the same pair one row down
+typedef struct
+{
+    int32_t idx[MNIST_IMG_DATA_LEN];
+    float w00[MNIST_IMG_DATA_LEN];
+    float w01[MNIST_IMG_DATA_LEN];
+    float w10[MNIST_IMG_DATA_LEN];
+    float w11[MNIST_IMG_DATA_LEN];
+} AugmentMap;
+
+void augment_rng_seed(AugmentRng *rng, uint64_t seed);
+uint32_t augment_rng_next(AugmentRng *rng);
+float augment_rng_uniform(AugmentRng *rng, float lo, float hi);
+
+AugmentParams augment_params_identity();
+AugmentParams augment_params_random(AugmentRng *rng);
+void augment_map_build(AugmentMap *map, const AugmentParams *params, AugmentRng *rng);
+void augment_map_apply(const AugmentMap *map, const float *pixels, float *out);
+void augment_image(const float *pixels, const AugmentParams *params, AugmentRng *rng, float *out);
+void augment_mnist_record(const MnistRecord *record, AugmentRng *rng, MnistRecord *out);
+
+void rotate_image(const float *pixels, float angle, float *out);
+void shift_image(const float *pixels, int dx, int dy, float *out);
+void add_noise(float *pixels, float noise_level, uint32_t seed);
+
+#endif
@@ -0,0 +1,356 @@
+#include "bench.h"
+#include "nn.h"
+#include "conv.h"
+#include "train.h"
+#include "augment.h"
+#include "parallel.h"
+#include "numa.h"
+#include "configs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "mem.h"
+
+#define MEM_TAG MEM_TAG_BENCH
+
+// Monotonic wall clock in seconds
+double get_time_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Fill records with MNIST-like synthetic data (mostly blank background)
+static void fill_bench_records(MnistRecord *records, int len)
+{
+    for (int i = 0; i < len; i++)
+    {
+        records[i].label = (uint8_t)(i % MNIST_NUM_LABELS);
+        for (int j = 0; j < MNIST_IMG_DATA_LEN; j++)
+        {
+            bool is_ink = rand() % 5 == 0;
+            records[i].pixels[j] = is_ink ? (float)rand() / RAND_MAX : 0.0f;
+        }
+    }
+}
+
+// Time one previous-layer error kernel in us per call; weights change every BATCH_SIZE calls, as in
+// training, so the transposed kernel pays for its refresh
+double bench_time_backprop_kernel(Layer *layer, const float *error, float *prev_error, BackpropKernel kernel, int iters)
+{
+    double start = get_time_sec();
+    for (int i = 0; i < iters; i++)
+    {
+        if (i % BATCH_SIZE == 0)
+        {
+            layer->w_t_valid = false;
+        }
+        layer_backprop_error(layer, error, prev_error, kernel);
+    }
+    return (get_time_sec() - start) * 1e6 / iters;
+}
+
+// Print the time of each backward error kernel on one layer
+static void bench_backprop_layer(Layer *layer, const char *label, int iters)
+{
+    // About half the nodes are inactive ReLUs with zero error
+    float *error = (float *)MEM_MALLOC(layer->num_nodes * sizeof(float));
+    float *prev_error = (float *)MEM_MALLOC(layer->num_inputs * sizeof(float));
+    for (int j = 0; j < layer->num_nodes; j++)
+    {
+        error[j] = rand() % 2 ? (float)rand() / RAND_MAX - 0.5f : 0.0f;
+    }
+
+    // Same number of weight reads for every shape
+    int layer_iters = (int)((long long)iters * 1000 / (layer->num_inputs * layer->num_nodes)) + 1;
+    double rows_us = bench_time_backprop_kernel(layer, error, prev_error, BACKPROP_KERNEL_ROWS, layer_iters);
+    double transposed_us = bench_time_backprop_kernel(layer, error, prev_error, BACKPROP_KERNEL_TRANSPOSED, layer_iters);
+    double strided_us = bench_time_backprop_kernel(layer, error, prev_error, BACKPROP_KERNEL_STRIDED, layer_iters);
+
+    char shape[32];
+    snprintf(shape, sizeof(shape), "%s%d x %d", label, layer->num_inputs, layer->num_nodes);
+    printf("%-22s %8.3f %8.3f %8.3f\n", shape, rows_us, transposed_us, strided_us);
+
+    MEM_FREE(error);
+    MEM_FREE(prev_error);
+}
+
+// Compare the backward error kernels on the network's layers and a sweep of layer shapes
+static void bench_backprop_kernels(Net *net, int iters)
+{
+    static const uint32_t sweep[][2] = {{8, 256}, {16, 128}, {32, 32}, {64, 256}, {128, 64}, {256, 256}, {784, 128}};
+
+    printf("%-22s %8s %8s %8s\n", "backprop us (in x out)", "rows", "transp", "strided");
+    // The first layer never propagates an error further back
+    for (int i = 1; i < net->num_layers; i++)
+    {
+        bench_backprop_layer(&net->layers[i], "net ", iters);
+    }
+
+    for (int s = 0; s < (int)(sizeof(sweep) / sizeof(sweep[0])); s++)
+    {
+        // Hidden sizes {in, out} make the second layer in x out
+        Net single = {};
+        net_init_mem_arch(&single, sweep[s], 2, false);
+        net_init_values(&single);
+        bench_backprop_layer(&single.layers[1], "", iters);
+        net_free(&single);
+    }
+}
+
+// Time a conv layer's forward and backward (filter gradients and input error) in us per image
+static void bench_conv_layer(Layer *layer, Layer *grad, const char *shape, int iters)
+{
+    float *input = (float *)MEM_MALLOC(layer->num_inputs * sizeof(float));
+    float *output = (float *)MEM_MALLOC(layer->num_nodes * sizeof(float));
+    float *error = (float *)MEM_MALLOC(layer->num_nodes * sizeof(float));
+    float *input_error = (float *)MEM_MALLOC(layer->num_inputs * sizeof(float));
+    for (int i = 0; i < layer->num_inputs; i++)
+    {
+        input[i] = rand() % 2 ? (float)rand() / RAND_MAX : 0.0f;
+    }
+    // About half the error is zero, as behind a ReLU
+    for (int i = 0; i < layer->num_nodes; i++)
+    {
+        error[i] = rand() % 2 ? (float)rand() / RAND_MAX - 0.5f : 0.0f;
+    }
+
+    double us[2][2];
+    const ConvKernel kernels[] = {CONV_KERNEL_IM2COL, CONV_KERNEL_DIRECT};
+    for (int c = 0; c < 2; c++)
+    {
+        layer->conv_kernel = kernels[c];
+        double start = get_time_sec();
+        for (int i = 0; i < iters; i++)
+        {
+            conv_forward(layer, input, output);
+        }
+        us[c][0] = (get_time_sec() - start) * 1e6 / iters;
+        start = get_time_sec();
+        for (int i = 0; i < iters; i++)
+        {
+            conv_backward_weights(layer, input, error, grad);
+            conv_backward_input(layer, error, input_error);
+        }
+        us[c][1] = (get_time_sec() - start) * 1e6 / iters;
+    }
+    printf("%-26s %8.2f %8.2f %8.2f %8.2f\n", shape, us[0][0], us[1][0], us[0][1], us[1][1]);
+
+    MEM_FREE(input);
+    MEM_FREE(output);
+    MEM_FREE(error);
+    MEM_FREE(input_error);
+}
+
+// Compare the im2col and direct conv kernels on the conv layer at the end of each arch
+static void bench_conv_kernels(int iters)
+{
+    static const uint32_t archs[][3] = {
+        {ARCH_CONV(8, 5, 1, 2)},
+        {ARCH_CONV(8, 3, 2, 1)},
+        {ARCH_CONV(8, 5, 1, 2), ARCH_POOL(LAYER_MAX_POOL, 2), ARCH_CONV(16, 3, 1, 1)},
+        {ARCH_CONV(8, 5, 1, 2), ARCH_POOL(LAYER_MAX_POOL, 4), ARCH_CONV(32, 3, 1, 1)},
+    };
+    static const int arch_lens[] = {1, 1, 3, 3};
+
+    printf("%-26s %8s %8s %8s %8s\n", "conv us (in -> out)", "fw i2c", "fw dir", "bw i2c", "bw dir");
+    for (int a = 0; a < (int)(sizeof(arch_lens) / sizeof(arch_lens[0])); a++)
+    {
+        Net net = {};
+        Net grad = {};
+        net_init_mem_arch(&net, archs[a], arch_lens[a], false);
+        net_init_values(&net);
+        net_init_mem_like(&grad, &net, false);
+        Layer *layer = &net.layers[arch_lens[a] - 1];
+        const ConvShape *s = &layer->conv;
+        char shape[48];
+        snprintf(shape, sizeof(shape), "%dx%dx%d k%d s%d -> %dx%dx%d", s->in_channels, s->in_h, s->in_w, s->kernel,
+                 s->stride, s->out_channels, s->out_h, s->out_w);
+        bench_conv_layer(layer, &grad.layers[arch_lens[a] - 1], shape, iters / 10 + 1);
+        net_free(&grad);
+        net_free(&net);
+    }
+}
+
+// Training time against activation memory per example for a conv net of equally wide layers,
+// keeping every activation and then every 2nd and 3rd. Each run starts from the same weights.
+static void bench_checkpointing(MnistRecord *records, int num_records, int iters)
+{
+    static const uint32_t arch[] = {ARCH_CONV(8, 3, 1, 1), ARCH_CONV(8, 3, 1, 1), ARCH_CONV(8, 3, 1, 1),
+                                    ARCH_CONV(8, 3, 1, 1), ARCH_POOL(LAYER_MAX_POOL, 2), 32};
+    Net net = {};
+    net_init_mem_arch(&net, arch, sizeof(arch) / sizeof(arch[0]), false);
+    net_init_values(&net);
+
+    int steps = iters / 50 / num_records + 1;
+    for (int stride = 1; stride <= 3; stride++)
+    {
+        Net copy = {};
+        net_copy(&copy, &net);
+        copy.checkpoint_stride = stride;
+        double start = get_time_sec();
+        for (int i = 0; i < steps; i++)
+        {
+            train_step(&copy, records, num_records, LEARNING_RATE);
+        }
+        double elapsed = get_time_sec() - start;
+        char name[32];
+        snprintf(name, sizeof(name), "checkpoint %d:", stride);
+        printf("%-18s %8d imgs  %10.3f us/img  %12.1f KB/img\n", name, steps * num_records,
+               elapsed * 1e6 / (steps * num_records), net_activation_floats(&copy) * sizeof(float) / 1024.0);
+        net_free(&copy);
+    }
+    net_free(&net);
+}
+
+// Threaded training on every CPU, with each thread's gradients, shard and weights on its own
+// NUMA node versus interleaved over all nodes. Both start from a copy of net.
+static void bench_numa_placement(Net *net, MnistRecord *records, int num_records, int steps)
+{
+    NumaTopology topo;
+    bool from_sys = numa_topology_read(&topo);
+    int num_threads = topo.num_cpus < num_records ? topo.num_cpus : num_records;
+    printf("threads: %d on %d NUMA node(s)%s\n", num_threads, topo.num_nodes,
+           from_sys ? "" : " (no NUMA topology in /sys)");
+    numa_topology_free(&topo);
+
+    TrainConfig cfg = train_config_default();
+    cfg.num_steps = steps;
+    cfg.batch_size = num_records;
+    cfg.save_path = NULL;
+    const MemPlacement placements[] = {PLACEMENT_LOCAL, PLACEMENT_INTERLEAVED};
+    const char *placement_names[] = {"threads (local):", "threads (interl):"};
+    int num_imgs = steps * (num_records / num_threads) * num_threads;
+    for (int p = 0; p < 2; p++)
+    {
+        Net copy = {};
+        net_copy(&copy, net);
+        double elapsed = threaded_train(&copy, records, num_records, NULL, &cfg, num_threads, placements[p]);
+        printf("%-18s %8d imgs  %10.3f us/img  %12.1f imgs/s\n",
+               placement_names[p], num_imgs, elapsed * 1e6 / num_imgs, num_imgs / elapsed);
+        net_free(&copy);
+    }
+}
+
+// Confidence thresholds the early-exit curve is measured at
+static const float EXIT_CURVE_THRESHOLDS[] = {0.5f, 0.7f, 0.8f, 0.9f, 0.95f, 0.99f, 0.999f};
+
+// Accuracy, average layers run and latency of early-exit inference on data at a sweep of
+// confidence thresholds, against the full forward pass
+void bench_early_exit(Net *net, MnistRecord *data, int len)
+{
+    printf("%-10s %9s %11s %10s\n", "threshold", "accuracy", "avg layers", "us/img");
+
+    int correct = 0;
+    double start = get_time_sec();
+    for (int i = 0; i < len; i++)
+    {
+        float **activations = net_forward(net, &data[i], NULL, false);
+        correct += get_prediction_index(activations[net->num_layers]) == data[i].label;
+        net_free_activations(net, activations);
+    }
+    double full_us = (get_time_sec() - start) * 1e6 / len;
+    printf("%-10s %9.4f %11.2f %10.3f\n", "full", (float)correct / len, (float)net->num_layers, full_us);
+
+    for (int t = 0; t < (int)(sizeof(EXIT_CURVE_THRESHOLDS) / sizeof(EXIT_CURVE_THRESHOLDS[0])); t++)
+    {
+        correct = 0;
+        long long layers = 0;
+        start = get_time_sec();
+        for (int i = 0; i < len; i++)
+        {
+            int layers_run;
+            correct += net_predict_early_exit(net, &data[i], EXIT_CURVE_THRESHOLDS[t], &layers_run) == data[i].label;
+            layers += layers_run;
+        }
+        double us = (get_time_sec() - start) * 1e6 / len;
+        printf("%-10g %9.4f %11.2f %10.3f\n", EXIT_CURVE_THRESHOLDS[t], (float)correct / len, (double)layers / len, us);
+    }
+}
+
+// Benchmark inference and training throughput on synthetic data
+void run_bench(Net *net, int iters)
+{
+    int num_records = BATCH_SIZE;
+    MnistRecord *records = (MnistRecord *)MEM_MALLOC(num_records * sizeof(MnistRecord));
+    fill_bench_records(records, num_records);
+
+    // Inference, dense versus sparse first layer
+    SparseInputMode saved_mode = net->sparse_input_mode;
+    const SparseInputMode modes[] = {SPARSE_INPUT_NEVER, SPARSE_INPUT_ALWAYS, saved_mode};
+    const char *mode_names[] = {"forward (dense):", "forward (sparse):", "forward (auto):"};
+    double start, elapsed;
+    for (int m = 0; m < 3; m++)
+    {
+        net->sparse_input_mode = modes[m];
+        start = get_time_sec();
+        for (int i = 0; i < iters; i++)
+        {
+            float **activations = net_forward(net, &records[i % num_records], NULL, false);
+            for (int l = 1; l <= net->num_layers; l++)
+            {
+                MEM_FREE(activations[l]);
+            }
+            MEM_FREE(activations);
+        }
+        elapsed = get_time_sec() - start;
+        printf("%-18s %8d imgs  %10.3f us/img  %12.1f imgs/s\n",
+               mode_names[m], iters, elapsed * 1e6 / iters, iters / elapsed);
+    }
+    net->sparse_input_mode = saved_mode;
+
+    // Incremental inference, each iteration edits a 3x3 brush of pixels
+    IncrementalInput inc = {};
+    net_incremental_init(net, &inc, records[0].pixels);
+    start = get_time_sec();
+    for (int i = 0; i < iters; i++)
+    {
+        int idx[9];
+        float values[9];
+        int center = (i * 29) % MNIST_IMG_DATA_LEN;
+        for (int n = 0; n < 9; n++)
+        {
+            idx[n] = (center + (n / 3) * MNIST_IMG_SIZE + n % 3) % MNIST_IMG_DATA_LEN;
+            values[n] = (i & 1) ? 1.0f : 0.0f;
+        }
+        net_incremental_set_pixels(net, &inc, idx, values, 9);
+        net_free_activations(net, net_incremental_forward(net, &inc));
+    }
+    elapsed = get_time_sec() - start;
+    printf("%-18s %8d imgs  %10.3f us/img  %12.1f imgs/s\n",
+           "forward (edit):", iters, elapsed * 1e6 / iters, iters / elapsed);
+    net_incremental_free(&inc);
+
+    // Augmentation, which has to stay well ahead of training
+    AugmentRng rng;
+    augment_rng_seed(&rng, 1);
+    MnistRecord augmented;
+    start = get_time_sec();
+    for (int i = 0; i < iters; i++)
+    {
+        augment_mnist_record(&records[i % num_records], &rng, &augmented);
+    }
+    elapsed = get_time_sec() - start;
+    printf("%-18s %8d imgs  %10.3f us/img  %12.1f imgs/s\n",
+           "augment:", iters, elapsed * 1e6 / iters, iters / elapsed);
+
+    bench_backprop_kernels(net, iters);
+    bench_conv_kernels(iters);
+
+    // Training
+    int steps = iters / num_records > 0 ? iters / num_records : 1;
+    start = get_time_sec();
+    for (int i = 0; i < steps; i++)
+    {
+        train_step(net, records, num_records, LEARNING_RATE);
+    }
+    elapsed = get_time_sec() - start;
+    printf("%-18s %8d imgs  %10.3f us/img  %12.1f imgs/s\n",
+           "train_step:", steps * num_records, elapsed * 1e6 / (steps * num_records), steps * num_records / elapsed);
+
+    bench_checkpointing(records, num_records, iters);
+    bench_numa_placement(net, records, num_records, steps);
+
+    MEM_FREE(records);
+}
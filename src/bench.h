@@ -0,0 +1,11 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "nn.h"
+
+double get_time_sec();
+double bench_time_backprop_kernel(Layer *layer, const float *error, float *prev_error, BackpropKernel kernel, int iters);
+void bench_early_exit(Net *net, MnistRecord *data, int len);
+void run_bench(Net *net, int iters);
+
+#endif
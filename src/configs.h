@@ -16,6 +16,13 @@
 #define TEST_DATA_LEN 10000
 #define DATA_AUGMENTATION_COUNT 5
 
+// Augmentation, every augmented record gets all of these at random strengths
+#define AUGMENT_MAX_ROTATION 15.0f // Degrees
+#define AUGMENT_MAX_SCALE 0.1f     // Fraction of the digit size
+#define AUGMENT_MAX_SHIFT 2.5f     // Pixels
+#define AUGMENT_ELASTIC 1.0f       // Largest elastic displacement in pixels
+#define AUGMENT_NOISE 0.05f        // Standard deviation of the noise added to ink
+
 // Train
 #define BATCH_SIZE 50
 #define NUM_STEPS 5000000
@@ -23,6 +30,33 @@
 #define DROPOUT_RATE 0.01
 #define NET_ARCH \
     (uint32_t[]) { 32, 24, 16 }
+#define MAX_NET_ARCH_LEN 8
+// Importance sampling draws this share of examples uniformly, which caps every weight at 1 / share
+#define SAMPLER_UNIFORM_MIX 0.2
+// Losses above this are tracked as this, so a few mislabeled examples cannot take over the draws
+#define SAMPLER_MAX_LOSS 5.0
+// Examples below the --skip-loss threshold still run the backward pass with at least this probability
+#define SKIP_MIN_KEEP 0.1f
+// Weight of each early-exit head's cross entropy in the joint training loss, the output layer's is 1
+#define EXIT_LOSS_WEIGHT 0.3f
+
+// Distillation
+#define TEACHER_LOGITS_CACHE_FILE_PATH (NETWORK_SAVE_DIRECTORY "/teacher_logits.bin")
+#define DISTILL_TEMPERATURE 4.0
+#define DISTILL_ALPHA 0.9
+
+// Inference
+// The first layer only visits nonzero inputs when at most this fraction is nonzero, unless autotuned
+#define SPARSE_INPUT_DENSITY_THRESHOLD 0.5
+// Kernel choices autotune measured on each machine, read at startup by train, eval and predict
+#define TUNING_FILE_PATH (NETWORK_SAVE_DIRECTORY "/tuning.tsv")
+// Incremental inference recomputes the first layer in full after this many pixel deltas
+#define INCREMENTAL_REFRESH_INTERVAL 4096
+// Ensemble evaluation classifies this many images, times every view, per batched pass
+#define ENSEMBLE_BATCH_SIZE 32
+// Test-time augmentation views besides the image itself: rotation both ways, then zoom out and in
+#define TTA_ROTATION 6.0f // Degrees
+#define TTA_SCALE 0.08f   // Fraction of the digit size
 
 // Viz
 #define WINDOW_W 1080
@@ -34,4 +68,28 @@
 #define CAM_REVOLUTION_RADIUS 60
 #define BG_COLOR_DARK_BLUE 0x162432ff
 
+// Live training viz
+#define LIVE_SNAPSHOT_NAME "/c-mnist-nn-live"
+// Training publishes a weight snapshot every this many steps
+#define LIVE_SNAPSHOT_INTERVAL 10
+
+// Inference server
+#define SERVER_SOCKET_PATH "/tmp/c-mnist-nn.sock"
+#define SERVER_NUM_WORKERS 4
+#define SERVER_MAX_BATCH 32
+// The first request of a batch waits at most this long for others to join it
+#define SERVER_MAX_LATENCY_US 500
+#define SERVER_QUERY_CLIENTS 8
+
+// Shared dataset
+#define DATASET_SHARED_NAME "/c-mnist-nn-data"
+// Published datasets are sized in whole huge pages
+#define DATASET_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+// Data-parallel training
+// With the TCP all-reduce, rank r listens on this port + r unless --port is given
+#define PARALLEL_BASE_PORT 29500
+// A rank gives up when its ring neighbours have not connected after this long
+#define PARALLEL_CONNECT_TIMEOUT_MS 10000
+
 #endif
\ No newline at end of file
@@ -0,0 +1,494 @@
+#include "conv.h"
+#include <stdbool.h>
+#include <string.h>
+#include "mem.h"
+
+// Shared core: buffers are charged to the calling subsystem
+#define MEM_TAG mem_scope_tag()
+
+// Output positions [lo, hi) whose input position pos * stride + offset lies in [0, in_len)
+static void tap_range(int in_len, int out_len, int offset, int stride, int *lo, int *hi)
+{
+    *lo = offset >= 0 ? 0 : (-offset + stride - 1) / stride;
+    *hi = in_len - 1 - offset < 0 ? 0 : (in_len - 1 - offset) / stride + 1;
+    if (*hi > out_len)
+    {
+        *hi = out_len;
+    }
+    if (*hi < *lo)
+    {
+        *hi = *lo;
+    }
+}
+
+// Unfold the input into a matrix of taps (in_channels * kernel * kernel) by output positions
+// (out_h * out_w): entry (r, p) is the input position p sees at filter tap r, zero where the tap
+// falls in the padding. by_position stores it transposed, one row of taps per position.
+static float *im2col(const ConvShape *s, const float *input, bool by_position)
+{
+    int num_pos = s->out_h * s->out_w;
+    int taps = s->in_channels * s->kernel * s->kernel;
+    int tap_stride = by_position ? 1 : num_pos;
+    int pos_stride = by_position ? taps : 1;
+    float *cols = (float *)MEM_CALLOC((size_t)taps * num_pos, sizeof(float));
+    for (int c = 0; c < s->in_channels; c++)
+    {
+        for (int ky = 0; ky < s->kernel; ky++)
+        {
+            for (int kx = 0; kx < s->kernel; kx++)
+            {
+                float *tap = &cols[(size_t)((c * s->kernel + ky) * s->kernel + kx) * tap_stride];
+                int y_lo, y_hi, x_lo, x_hi;
+                tap_range(s->in_h, s->out_h, ky - s->padding, s->stride, &y_lo, &y_hi);
+                tap_range(s->in_w, s->out_w, kx - s->padding, s->stride, &x_lo, &x_hi);
+                for (int oy = y_lo; oy < y_hi; oy++)
+                {
+                    const float *in_row = &input[(c * s->in_h + oy * s->stride + ky - s->padding) * s->in_w + kx - s->padding];
+                    for (int ox = x_lo; ox < x_hi; ox++)
+                    {
+                        tap[(size_t)(oy * s->out_w + ox) * pos_stride] = in_row[ox * s->stride];
+                    }
+                }
+            }
+        }
+    }
+    return cols;
+}
+
+// Inverse of im2col: add every entry of cols back onto the input position it was read from
+static void col2im(const ConvShape *s, const float *cols, bool by_position, float *input)
+{
+    int num_pos = s->out_h * s->out_w;
+    int taps = s->in_channels * s->kernel * s->kernel;
+    int tap_stride = by_position ? 1 : num_pos;
+    int pos_stride = by_position ? taps : 1;
+    memset(input, 0, (size_t)s->in_channels * s->in_h * s->in_w * sizeof(float));
+    for (int c = 0; c < s->in_channels; c++)
+    {
+        for (int ky = 0; ky < s->kernel; ky++)
+        {
+            for (int kx = 0; kx < s->kernel; kx++)
+            {
+                const float *tap = &cols[(size_t)((c * s->kernel + ky) * s->kernel + kx) * tap_stride];
+                int y_lo, y_hi, x_lo, x_hi;
+                tap_range(s->in_h, s->out_h, ky - s->padding, s->stride, &y_lo, &y_hi);
+                tap_range(s->in_w, s->out_w, kx - s->padding, s->stride, &x_lo, &x_hi);
+                for (int oy = y_lo; oy < y_hi; oy++)
+                {
+                    float *in_row = &input[(c * s->in_h + oy * s->stride + ky - s->padding) * s->in_w + kx - s->padding];
+                    for (int ox = x_lo; ox < x_hi; ox++)
+                    {
+                        in_row[ox * s->stride] += tap[(size_t)(oy * s->out_w + ox) * pos_stride];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Partial sums of dot_lanes, enough for one vector register of floats
+#define DOT_LANES 8
+
+// Sum of a[q] * b[q]; the lanes keep separate sums, which lets the compiler vectorize the
+// reduction without reordering floating point adds itself
+static float dot_lanes(const float *a, const float *b, int len)
+{
+    float lanes[DOT_LANES] = {0};
+    int q = 0;
+    for (; q + DOT_LANES <= len; q += DOT_LANES)
+    {
+        for (int l = 0; l < DOT_LANES; l++)
+        {
+            lanes[l] += a[q + l] * b[q + l];
+        }
+    }
+    float sum = 0;
+    for (; q < len; q++)
+    {
+        sum += a[q] * b[q];
+    }
+    for (int l = 0; l < DOT_LANES; l++)
+    {
+        sum += lanes[l];
+    }
+    return sum;
+}
+
+// out[q] += scale * in[q] over two separate buffers
+static inline void axpy(float *restrict out, const float *restrict in, float scale, int len)
+{
+    for (int q = 0; q < len; q++)
+    {
+        out[q] += scale * in[q];
+    }
+}
+
+// Two axpys into one output, which halves its loads and stores
+static inline void axpy2(float *restrict out, const float *restrict in_a, float scale_a, const float *restrict in_b,
+                         float scale_b, int len)
+{
+    for (int q = 0; q < len; q++)
+    {
+        out[q] += scale_a * in_a[q] + scale_b * in_b[q];
+    }
+}
+
+// The direct kernels read the zero-padded input split into stride x stride phase planes: plane
+// (py, px) of a channel holds padded pixel (y * stride + py, x * stride + px) at (y, x). Filter
+// tap (ky, kx) then reads one plane at a fixed offset from every output position, so with the
+// output rows laid end to end at the plane width ("wide" layout, the columns past out_w are
+// scratch), each tap is one contiguous loop over all positions.
+typedef struct
+{
+    int width;     // Plane width, also the row pitch of the wide layout
+    int plane_len; // Floats per plane
+    int span;      // Wide positions up to the last output: (out_h - 1) * width + out_w
+} PhaseLayout;
+
+static PhaseLayout phase_layout(const ConvShape *s)
+{
+    PhaseLayout l;
+    l.width = (s->in_w + 2 * s->padding + s->stride - 1) / s->stride;
+    l.plane_len = l.width * ((s->in_h + 2 * s->padding + s->stride - 1) / s->stride);
+    l.span = (s->out_h - 1) * l.width + s->out_w;
+    return l;
+}
+
+// Start of the plane each filter tap (c, ky, kx) reads, offset so that entry q lines up with wide
+// position q; one per weight of a filter row, shared by all filters
+static size_t *phase_taps(const ConvShape *s, const PhaseLayout *l)
+{
+    size_t *taps = (size_t *)MEM_MALLOC((size_t)s->in_channels * s->kernel * s->kernel * sizeof(size_t));
+    for (int c = 0; c < s->in_channels; c++)
+    {
+        for (int ky = 0; ky < s->kernel; ky++)
+        {
+            for (int kx = 0; kx < s->kernel; kx++)
+            {
+                int plane = (c * s->stride + ky % s->stride) * s->stride + kx % s->stride;
+                taps[(c * s->kernel + ky) * s->kernel + kx] =
+                    (size_t)plane * l->plane_len + (ky / s->stride) * l->width + kx / s->stride;
+            }
+        }
+    }
+    return taps;
+}
+
+// Copy the input into its phase planes, or with merge back out of them; the padding is skipped
+static void phase_copy(const ConvShape *s, const PhaseLayout *l, float *planes, float *input, bool merge)
+{
+    int height = l->plane_len / l->width;
+    for (int c = 0; c < s->in_channels; c++)
+    {
+        for (int py = 0; py < s->stride; py++)
+        {
+            for (int px = 0; px < s->stride; px++)
+            {
+                float *plane = &planes[(size_t)((c * s->stride + py) * s->stride + px) * l->plane_len];
+                int y_lo, y_hi, x_lo, x_hi;
+                tap_range(s->in_h, height, py - s->padding, s->stride, &y_lo, &y_hi);
+                tap_range(s->in_w, l->width, px - s->padding, s->stride, &x_lo, &x_hi);
+                for (int y = y_lo; y < y_hi; y++)
+                {
+                    float *row = &plane[y * l->width];
+                    float *in_row = &input[(c * s->in_h + y * s->stride + py - s->padding) * s->in_w + px - s->padding];
+                    for (int x = x_lo; x < x_hi; x++)
+                    {
+                        if (merge)
+                        {
+                            in_row[x * s->stride] = row[x];
+                        }
+                        else
+                        {
+                            row[x] = in_row[x * s->stride];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Phase planes of the input, zero in the padding
+static float *phase_split(const ConvShape *s, const PhaseLayout *l, const float *input)
+{
+    float *planes = (float *)MEM_CALLOC((size_t)s->in_channels * s->stride * s->stride * l->plane_len, sizeof(float));
+    phase_copy(s, l, planes, (float *)input, false);
+    return planes;
+}
+
+// One output channel's error in the wide layout, zero in the scratch columns
+static void spread_wide(const ConvShape *s, const PhaseLayout *l, const float *error, float *wide)
+{
+    for (int oy = 0; oy < s->out_h; oy++)
+    {
+        float *row = &wide[oy * l->width];
+        memcpy(row, &error[oy * s->out_w], s->out_w * sizeof(float));
+        if (oy < s->out_h - 1)
+        {
+            memset(row + s->out_w, 0, (l->width - s->out_w) * sizeof(float));
+        }
+    }
+}
+
+// Pre-activations of a conv layer, (out_channels, out_h, out_w)
+void conv_forward(const Layer *layer, const float *input, float *output)
+{
+    const ConvShape *s = &layer->conv;
+    int num_pos = s->out_h * s->out_w;
+    int taps = layer->row_len;
+
+    if (layer->conv_kernel == CONV_KERNEL_IM2COL)
+    {
+        // Filters (out_channels x taps) times cols (taps x positions), one output row at a time
+        float *cols = im2col(s, input, false);
+        for (int oc = 0; oc < s->out_channels; oc++)
+        {
+            float *out = &output[oc * num_pos];
+            for (int p = 0; p < num_pos; p++)
+            {
+                out[p] = layer->b[oc];
+            }
+            for (int r = 0; r < taps; r++)
+            {
+                float w = layer->w[oc][r];
+                const float *row = &cols[(size_t)r * num_pos];
+                for (int p = 0; p < num_pos; p++)
+                {
+                    out[p] += w * row[p];
+                }
+            }
+        }
+        MEM_FREE(cols);
+        return;
+    }
+
+    // Direct: each filter tap adds its weight times a shifted view of the phase planes
+    PhaseLayout l = phase_layout(s);
+    float *planes = phase_split(s, &l, input);
+    size_t *tap_starts = phase_taps(s, &l);
+    int span = l.span; // Kept out of memory the stores below could alias
+    float *wide = (float *)MEM_MALLOC(span * sizeof(float));
+    for (int oc = 0; oc < s->out_channels; oc++)
+    {
+        for (int q = 0; q < span; q++)
+        {
+            wide[q] = layer->b[oc];
+        }
+        const float *w = layer->w[oc];
+        int r = 0;
+        for (; r + 1 < taps; r += 2)
+        {
+            axpy2(wide, &planes[tap_starts[r]], w[r], &planes[tap_starts[r + 1]], w[r + 1], span);
+        }
+        if (r < taps)
+        {
+            axpy(wide, &planes[tap_starts[r]], w[r], span);
+        }
+        for (int oy = 0; oy < s->out_h; oy++)
+        {
+            memcpy(&output[oc * num_pos + oy * s->out_w], &wide[oy * l.width], s->out_w * sizeof(float));
+        }
+    }
+    MEM_FREE(wide);
+    MEM_FREE(tap_starts);
+    MEM_FREE(planes);
+}
+
+// Accumulate the filter and bias gradients of a conv layer for the error at its pre-activations.
+// The im2col kernel walks the output positions and skips those with zero error, which ReLU and
+// max pooling leave at zero for most; the direct one runs dense contiguous loops instead.
+void conv_backward_weights(const Layer *layer, const float *input, const float *error, Layer *grad)
+{
+    const ConvShape *s = &layer->conv;
+    int num_pos = s->out_h * s->out_w;
+    int taps = layer->row_len;
+
+    for (int oc = 0; oc < s->out_channels; oc++)
+    {
+        const float *err = &error[oc * num_pos];
+        float sum = 0;
+        for (int p = 0; p < num_pos; p++)
+        {
+            sum += err[p];
+        }
+        grad->b[oc] += sum;
+    }
+
+    if (layer->conv_kernel == CONV_KERNEL_IM2COL)
+    {
+        // Error times the unfolded input, one row of taps per position
+        float *rows = im2col(s, input, true);
+        for (int oc = 0; oc < s->out_channels; oc++)
+        {
+            float *dw = grad->w[oc];
+            for (int p = 0; p < num_pos; p++)
+            {
+                float e = error[oc * num_pos + p];
+                if (e == 0)
+                    continue;
+                const float *row = &rows[(size_t)p * taps];
+                for (int r = 0; r < taps; r++)
+                {
+                    dw[r] += e * row[r];
+                }
+            }
+        }
+        MEM_FREE(rows);
+        return;
+    }
+
+    // Direct: each tap's gradient is the error dotted with the phase plane view it was read from
+    PhaseLayout l = phase_layout(s);
+    float *planes = phase_split(s, &l, input);
+    size_t *tap_starts = phase_taps(s, &l);
+    int span = l.span; // Kept out of memory the stores below could alias
+    float *wide = (float *)MEM_MALLOC(span * sizeof(float));
+    for (int oc = 0; oc < s->out_channels; oc++)
+    {
+        spread_wide(s, &l, &error[oc * num_pos], wide);
+        float *dw = grad->w[oc];
+        for (int r = 0; r < taps; r++)
+        {
+            dw[r] += dot_lanes(wide, &planes[tap_starts[r]], span);
+        }
+    }
+    MEM_FREE(wide);
+    MEM_FREE(tap_starts);
+    MEM_FREE(planes);
+}
+
+// Error at a conv layer's input for the error at its pre-activations
+void conv_backward_input(const Layer *layer, const float *error, float *input_error)
+{
+    const ConvShape *s = &layer->conv;
+    int num_pos = s->out_h * s->out_w;
+    int taps = layer->row_len;
+
+    if (layer->conv_kernel == CONV_KERNEL_IM2COL)
+    {
+        // Error times the filters, one row of taps per position, folded back onto the input
+        float *rows = (float *)MEM_CALLOC((size_t)taps * num_pos, sizeof(float));
+        for (int oc = 0; oc < s->out_channels; oc++)
+        {
+            const float *w = layer->w[oc];
+            for (int p = 0; p < num_pos; p++)
+            {
+                float e = error[oc * num_pos + p];
+                if (e == 0)
+                    continue;
+                float *row = &rows[(size_t)p * taps];
+                for (int r = 0; r < taps; r++)
+                {
+                    row[r] += e * w[r];
+                }
+            }
+        }
+        col2im(s, rows, true, input_error);
+        MEM_FREE(rows);
+        return;
+    }
+
+    // Direct: each tap adds its weight times the error onto the phase plane view it was read from
+    PhaseLayout l = phase_layout(s);
+    float *planes = (float *)MEM_CALLOC((size_t)s->in_channels * s->stride * s->stride * l.plane_len, sizeof(float));
+    size_t *tap_starts = phase_taps(s, &l);
+    int span = l.span; // Kept out of memory the stores below could alias
+    float *wide = (float *)MEM_MALLOC(2 * (size_t)span * sizeof(float));
+    float *wide_b = &wide[span];
+    int oc = 0;
+    // Filters in pairs, which halves the passes over the planes
+    for (; oc + 1 < s->out_channels; oc += 2)
+    {
+        spread_wide(s, &l, &error[oc * num_pos], wide);
+        spread_wide(s, &l, &error[(oc + 1) * num_pos], wide_b);
+        const float *w = layer->w[oc];
+        const float *w_b = layer->w[oc + 1];
+        for (int r = 0; r < taps; r++)
+        {
+            axpy2(&planes[tap_starts[r]], wide, w[r], wide_b, w_b[r], span);
+        }
+    }
+    for (; oc < s->out_channels; oc++)
+    {
+        spread_wide(s, &l, &error[oc * num_pos], wide);
+        const float *w = layer->w[oc];
+        for (int r = 0; r < taps; r++)
+        {
+            axpy(&planes[tap_starts[r]], wide, w[r], span);
+        }
+    }
+    phase_copy(s, &l, planes, input_error, true);
+    MEM_FREE(wide);
+    MEM_FREE(tap_starts);
+    MEM_FREE(planes);
+}
+
+// Max or average over non-overlapping kernel x kernel windows of each channel
+void pool_forward(const Layer *layer, const float *input, float *output)
+{
+    const ConvShape *s = &layer->conv;
+    float inv_area = 1.0f / (s->kernel * s->kernel);
+    for (int c = 0; c < s->out_channels; c++)
+    {
+        for (int oy = 0; oy < s->out_h; oy++)
+        {
+            for (int ox = 0; ox < s->out_w; ox++)
+            {
+                const float *window = &input[(c * s->in_h + oy * s->stride) * s->in_w + ox * s->stride];
+                float value = layer->type == LAYER_MAX_POOL ? window[0] : 0;
+                for (int ky = 0; ky < s->kernel; ky++)
+                {
+                    for (int kx = 0; kx < s->kernel; kx++)
+                    {
+                        float v = window[ky * s->in_w + kx];
+                        value = layer->type == LAYER_MAX_POOL ? (v > value ? v : value) : value + v;
+                    }
+                }
+                output[(c * s->out_h + oy) * s->out_w + ox] = layer->type == LAYER_MAX_POOL ? value : value * inv_area;
+            }
+        }
+    }
+}
+
+// Error at a pooling layer's input: max pooling routes each window's error to its first largest
+// input, average pooling spreads it evenly; inputs outside every window get none
+void pool_backward(const Layer *layer, const float *input, const float *error, float *input_error)
+{
+    const ConvShape *s = &layer->conv;
+    float inv_area = 1.0f / (s->kernel * s->kernel);
+    memset(input_error, 0, (size_t)layer->num_inputs * sizeof(float));
+    for (int c = 0; c < s->out_channels; c++)
+    {
+        for (int oy = 0; oy < s->out_h; oy++)
+        {
+            for (int ox = 0; ox < s->out_w; ox++)
+            {
+                int base = (c * s->in_h + oy * s->stride) * s->in_w + ox * s->stride;
+                float err = error[(c * s->out_h + oy) * s->out_w + ox];
+                if (layer->type == LAYER_AVG_POOL)
+                {
+                    for (int ky = 0; ky < s->kernel; ky++)
+                    {
+                        for (int kx = 0; kx < s->kernel; kx++)
+                        {
+                            input_error[base + ky * s->in_w + kx] += err * inv_area;
+                        }
+                    }
+                    continue;
+                }
+
+                int best = base;
+                for (int ky = 0; ky < s->kernel; ky++)
+                {
+                    for (int kx = 0; kx < s->kernel; kx++)
+                    {
+                        int idx = base + ky * s->in_w + kx;
+                        best = input[idx] > input[best] ? idx : best;
+                    }
+                }
+                input_error[best] += err;
+            }
+        }
+    }
+}
@@ -0,0 +1,12 @@
+#ifndef CONV_H
+#define CONV_H
+
+#include "nn.h"
+
+void conv_forward(const Layer *layer, const float *input, float *output);
+void conv_backward_weights(const Layer *layer, const float *input, const float *error, Layer *grad);
+void conv_backward_input(const Layer *layer, const float *error, float *input_error);
+void pool_forward(const Layer *layer, const float *input, float *output);
+void pool_backward(const Layer *layer, const float *input, const float *error, float *input_error);
+
+#endif
@@ -0,0 +1,273 @@
+#include "dataset.h"
+#include "nn.h"
+#include "train.h"
+#include "bench.h"
+#include "configs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mem.h"
+
+#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+#define DATASET_UNSUPPORTED
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define MEM_TAG MEM_TAG_TRAIN
+
+#define DATASET_MAGIC 0x5344494d // "MIDS"
+#define DATASET_PATH_LEN 256
+
+#ifndef DATASET_UNSUPPORTED
+
+// Region layout: this header, then the train and test records at their offsets
+typedef struct
+{
+    _Atomic uint32_t magic; // Stored last, once the records are written
+    uint32_t record_size;   // sizeof(MnistRecord) of the publisher, which attachers must share
+    uint32_t train_len;
+    uint32_t test_len;
+    uint64_t train_offset;
+    uint64_t test_offset;
+    char train_path[DATASET_PATH_LEN]; // CSVs the records were decoded from, matched by load_mnist_data
+    char test_path[DATASET_PATH_LEN];
+} DatasetHeader;
+
+// The dataset this process attached, read-only
+static struct
+{
+    void *mem;
+    size_t size;
+} g_dataset;
+
+// "/name" is a POSIX shared memory object, anything with a further slash a regular file
+static bool is_file_name(const char *name)
+{
+    return name[0] != '\0' && strchr(name + 1, '/') != NULL;
+}
+
+static int open_region(const char *name, int flags, mode_t mode)
+{
+    if (name[0] == '\0')
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return is_file_name(name) ? open(name, flags, mode) : shm_open(name, flags, mode);
+}
+
+static int unlink_region(const char *name)
+{
+    if (name[0] == '\0')
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return is_file_name(name) ? unlink(name) : shm_unlink(name);
+}
+
+// Decode the first train_len and test_len records of two CSVs straight into a new region. An older
+// region of the same name is unlinked first rather than truncated, so processes still attached to
+// it keep valid pages.
+bool dataset_publish_csv(const char *name, const char *train_path, int train_len, const char *test_path, int test_len)
+{
+    double start = get_time_sec();
+    unlink_region(name);
+    int fd = open_region(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+    {
+        perror(name);
+        return false;
+    }
+
+    // Whole huge pages, which hugetlbfs requires and shared memory may back with huge pages
+    size_t train_offset = (sizeof(DatasetHeader) + 63) / 64 * 64;
+    size_t test_offset = train_offset + (size_t)train_len * sizeof(MnistRecord);
+    size_t size = test_offset + (size_t)test_len * sizeof(MnistRecord);
+    size = (size + DATASET_HUGEPAGE_SIZE - 1) / DATASET_HUGEPAGE_SIZE * DATASET_HUGEPAGE_SIZE;
+    if (ftruncate(fd, (off_t)size) != 0)
+    {
+        perror("ftruncate");
+        close(fd);
+        unlink_region(name);
+        return false;
+    }
+
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+    {
+        perror("mmap");
+        unlink_region(name);
+        return false;
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(mem, size, MADV_HUGEPAGE);
+#endif
+
+    DatasetHeader *header = (DatasetHeader *)mem;
+    MnistRecord *train = (MnistRecord *)((char *)mem + train_offset);
+    MnistRecord *test = (MnistRecord *)((char *)mem + test_offset);
+    printf("Loading Training data ...\n");
+    bool loaded = read_mnist_csv(train_path, train, train_len);
+    printf("Loading Testing data ...\n");
+    loaded = loaded && read_mnist_csv(test_path, test, test_len);
+    if (!loaded)
+    {
+        munmap(mem, size);
+        unlink_region(name);
+        return false;
+    }
+
+    header->record_size = sizeof(MnistRecord);
+    header->train_len = train_len;
+    header->test_len = test_len;
+    header->train_offset = train_offset;
+    header->test_offset = test_offset;
+    snprintf(header->train_path, DATASET_PATH_LEN, "%s", train_path);
+    snprintf(header->test_path, DATASET_PATH_LEN, "%s", test_path);
+    atomic_store_explicit(&header->magic, DATASET_MAGIC, memory_order_release);
+    munmap(mem, size);
+
+    printf("Published %d train and %d test records to %s (%.1f MB) in %.2f s\n", train_len, test_len, name,
+           size / (1024.0 * 1024.0), get_time_sec() - start);
+    return true;
+}
+
+// The full MNIST train and test sets
+bool dataset_publish(const char *name)
+{
+    return dataset_publish_csv(name, MNIST_TRAIN_FILE_PATH, TRAIN_DATA_LEN, MNIST_TEST_FILE_PATH, TEST_DATA_LEN);
+}
+
+bool dataset_unpublish(const char *name)
+{
+    if (unlink_region(name) != 0)
+    {
+        perror(name);
+        return false;
+    }
+    return true;
+}
+
+// Map a published dataset read-only for the rest of the process; a write to it faults
+bool dataset_attach(const char *name)
+{
+    int fd = open_region(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        perror(name);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(DatasetHeader))
+    {
+        printf("Dataset %s is not published\n", name);
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)st.st_size;
+    void *mem = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+    {
+        perror("mmap");
+        return false;
+    }
+
+    DatasetHeader *header = (DatasetHeader *)mem;
+    bool valid = atomic_load_explicit(&header->magic, memory_order_acquire) == DATASET_MAGIC &&
+                 header->record_size == sizeof(MnistRecord) &&
+                 header->train_offset + (uint64_t)header->train_len * sizeof(MnistRecord) <= size &&
+                 header->test_offset + (uint64_t)header->test_len * sizeof(MnistRecord) <= size;
+    if (!valid)
+    {
+        printf("Dataset %s is incomplete or from another build\n", name);
+        munmap(mem, size);
+        return false;
+    }
+
+    dataset_detach();
+    g_dataset.mem = mem;
+    g_dataset.size = size;
+    printf("Attached dataset %s (%u train, %u test records)\n", name, header->train_len, header->test_len);
+    return true;
+}
+
+void dataset_detach(void)
+{
+    if (g_dataset.mem)
+    {
+        munmap(g_dataset.mem, g_dataset.size);
+    }
+    g_dataset.mem = NULL;
+    g_dataset.size = 0;
+}
+
+// The first len records decoded from path, if the attached dataset has them
+MnistRecord *dataset_lookup(const char *path, int len)
+{
+    DatasetHeader *header = (DatasetHeader *)g_dataset.mem;
+    if (!header)
+        return NULL;
+
+    if (strcmp(path, header->train_path) == 0 && (uint32_t)len <= header->train_len)
+        return (MnistRecord *)((char *)header + header->train_offset);
+    if (strcmp(path, header->test_path) == 0 && (uint32_t)len <= header->test_len)
+        return (MnistRecord *)((char *)header + header->test_offset);
+    return NULL;
+}
+
+bool dataset_owns(const MnistRecord *data)
+{
+    const char *p = (const char *)data;
+    const char *mem = (const char *)g_dataset.mem;
+    return mem && p >= mem && p < mem + g_dataset.size;
+}
+
+#else
+
+bool dataset_publish_csv(const char *name, const char *train_path, int train_len, const char *test_path, int test_len)
+{
+    printf("Shared datasets are not supported on this platform\n");
+    return false;
+}
+
+bool dataset_publish(const char *name)
+{
+    return dataset_publish_csv(name, MNIST_TRAIN_FILE_PATH, TRAIN_DATA_LEN, MNIST_TEST_FILE_PATH, TEST_DATA_LEN);
+}
+
+bool dataset_unpublish(const char *name)
+{
+    return false;
+}
+
+bool dataset_attach(const char *name)
+{
+    printf("Shared datasets are not supported on this platform\n");
+    return false;
+}
+
+void dataset_detach(void)
+{
+}
+
+MnistRecord *dataset_lookup(const char *path, int len)
+{
+    return NULL;
+}
+
+bool dataset_owns(const MnistRecord *data)
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <stdbool.h>
+#include "nn.h"
+
+// The decoded MNIST train and test sets, published once into a named shared memory object
+// ("/name") or a file (any other path, e.g. on a hugetlbfs mount). Other processes attach the
+// pages read-only, and load_mnist_data hands out pointers into them instead of decoding the CSVs.
+bool dataset_publish(const char *name);
+bool dataset_publish_csv(const char *name, const char *train_path, int train_len, const char *test_path, int test_len);
+bool dataset_unpublish(const char *name);
+
+bool dataset_attach(const char *name);
+void dataset_detach(void);
+MnistRecord *dataset_lookup(const char *path, int len);
+bool dataset_owns(const MnistRecord *data);
+
+#endif
@@ -0,0 +1,110 @@
+#include "distill.h"
+#include "nn.h"
+#include "configs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mem.h"
+
+#define MEM_TAG MEM_TAG_DISTILL
+
+#define LOGITS_CACHE_MAGIC 0x474c4e4d // "MNLG"
+
+// Header of the teacher logits cache file, followed by len x MNIST_NUM_LABELS floats
+typedef struct
+{
+    uint32_t magic;
+    uint32_t len;
+    uint32_t num_labels;
+    uint32_t teacher_hash;
+    uint32_t data_hash;
+} LogitsCacheHeader;
+
+// FNV-1a over raw bytes
+static uint32_t hash_bytes(uint32_t hash, const void *data, size_t len)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t hash_net(Net *net)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < net->num_layers; i++)
+    {
+        Layer *layer = &net->layers[i];
+        if (layer->type != LAYER_DENSE)
+        {
+            // Pooling layers have no weights to tell them apart
+            uint32_t arch = layer_arch(layer);
+            hash = hash_bytes(hash, &arch, sizeof(arch));
+        }
+        hash = hash_bytes(hash, layer->b, layer->num_rows * sizeof(float));
+        for (int j = 0; j < layer->num_rows; j++)
+        {
+            hash = hash_bytes(hash, layer->w[j], layer->row_len * sizeof(float));
+        }
+    }
+    return hash;
+}
+
+static uint32_t hash_data(MnistRecord *data, int len)
+{
+    return hash_bytes(2166136261u, data, (size_t)len * sizeof(MnistRecord));
+}
+
+// Teacher output logits for len records, written to logits (len x MNIST_NUM_LABELS)
+void distill_compute_logits(Net *teacher, MnistRecord *data, int len, float *logits)
+{
+    for (int i = 0; i < len; i++)
+    {
+        net_forward_logits(teacher, &data[i], &logits[i * MNIST_NUM_LABELS]);
+    }
+}
+
+// Load teacher logits from the cache, or compute and store them when the cache is missing or stale
+float *distill_teacher_logits(Net *teacher, MnistRecord *data, int len, const char *cache_path)
+{
+    LogitsCacheHeader expected = {
+        .magic = LOGITS_CACHE_MAGIC,
+        .len = (uint32_t)len,
+        .num_labels = MNIST_NUM_LABELS,
+        .teacher_hash = hash_net(teacher),
+        .data_hash = hash_data(data, len),
+    };
+    size_t num_logits = (size_t)len * MNIST_NUM_LABELS;
+    float *logits = (float *)MEM_MALLOC(num_logits * sizeof(float));
+
+    FILE *file = fopen(cache_path, "rb");
+    if (file)
+    {
+        LogitsCacheHeader header;
+        bool ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(&header, &expected, sizeof(header)) == 0 &&
+                  fread(logits, sizeof(float), num_logits, file) == num_logits;
+        fclose(file);
+        if (ok)
+        {
+            printf("Loaded teacher logits from %s\n", cache_path);
+            return logits;
+        }
+    }
+
+    printf("Computing teacher logits ...\n");
+    distill_compute_logits(teacher, data, len, logits);
+
+    file = fopen(cache_path, "wb");
+    if (!file || fwrite(&expected, sizeof(expected), 1, file) != 1 || fwrite(logits, sizeof(float), num_logits, file) != num_logits)
+    {
+        printf("Failed to write teacher logits cache: %s\n", cache_path);
+    }
+    if (file)
+    {
+        fclose(file);
+    }
+
+    return logits;
+}
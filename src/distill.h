@@ -0,0 +1,10 @@
+#ifndef DISTILL_H
+#define DISTILL_H
+
+#include <stdint.h>
+#include "nn.h"
+
+float *distill_teacher_logits(Net *teacher, MnistRecord *data, int len, const char *cache_path);
+void distill_compute_logits(Net *teacher, MnistRecord *data, int len, float *logits);
+
+#endif
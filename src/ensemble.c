@@ -0,0 +1,304 @@
+#include "ensemble.h"
+#include "nn.h"
+#include "bench.h"
+#include "train.h"
+#include "configs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "mem.h"
+
+#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+#define ENSEMBLE_SINGLE_THREAD
+#else
+#include <pthread.h>
+#endif
+
+#define MEM_TAG MEM_TAG_EVAL
+
+// Views after the image itself, in the order ensembles with fewer views take them
+static AugmentParams tta_view_params(int view)
+{
+    AugmentParams params = augment_params_identity();
+    switch (view)
+    {
+    case 1:
+        params.angle = TTA_ROTATION;
+        break;
+    case 2:
+        params.angle = -TTA_ROTATION;
+        break;
+    case 3:
+        params.scale = 1 - TTA_SCALE;
+        break;
+    default:
+        params.scale = 1 + TTA_SCALE;
+        break;
+    }
+    return params;
+}
+
+void ensemble_init(Ensemble *ens, Net *models, int num_models, int num_views, int batch_size, int num_threads)
+{
+    ens->models = models;
+    ens->num_models = num_models;
+    ens->num_views = num_views;
+    ens->batch_size = batch_size;
+    ens->num_threads = num_threads;
+
+    ens->batched = (PrunedNet *)MEM_CALLOC(num_models, sizeof(PrunedNet));
+    ens->max_width = 0;
+    for (int m = 0; m < num_models; m++)
+    {
+        if (net_is_dense(&models[m]))
+        {
+            pruned_net_init(&ens->batched[m], &models[m], SPARSE_FORMAT_DENSE);
+            ens->max_width = ens->batched[m].max_width > ens->max_width ? ens->batched[m].max_width : ens->max_width;
+        }
+        else
+        {
+            // Threads share the model, so the lazily built transposed weights are built up front
+            net_refresh_transposed(&models[m]);
+        }
+    }
+
+    // The views are fixed transforms, so their sampling maps are built once. None is elastic,
+    // the rng is never drawn from.
+    AugmentRng rng;
+    augment_rng_seed(&rng, 1);
+    ens->views = (AugmentMap *)MEM_MALLOC((num_views > 1 ? num_views - 1 : 1) * sizeof(AugmentMap));
+    for (int v = 1; v < num_views; v++)
+    {
+        AugmentParams params = tta_view_params(v);
+        augment_map_build(&ens->views[v - 1], &params, &rng);
+    }
+}
+
+void ensemble_free(Ensemble *ens)
+{
+    for (int m = 0; m < ens->num_models; m++)
+    {
+        if (ens->batched[m].layers)
+        {
+            pruned_net_free(&ens->batched[m]);
+        }
+    }
+    MEM_FREE(ens->batched);
+    MEM_FREE(ens->views);
+    memset(ens, 0, sizeof(*ens));
+}
+
+// Buffers one thread reuses for every batch it classifies
+typedef struct
+{
+    float *inputs;     // num_views x batch_size images, all views of an image batched together
+    float *view_probs; // Probabilities of each row of inputs
+    float *gemm;       // Activations of the batched dense kernels
+    MnistRecord record; // Single image for the models without batched kernels
+} EnsembleScratch;
+
+static void ensemble_scratch_init(const Ensemble *ens, EnsembleScratch *scratch)
+{
+    int rows = ens->num_views * ens->batch_size;
+    scratch->inputs = (float *)MEM_MALLOC((size_t)rows * MNIST_IMG_DATA_LEN * sizeof(float));
+    scratch->view_probs = (float *)MEM_MALLOC((size_t)rows * MNIST_NUM_LABELS * sizeof(float));
+    scratch->gemm = (float *)MEM_MALLOC((size_t)2 * rows * (ens->max_width > 0 ? ens->max_width : 1) * sizeof(float));
+}
+
+static void ensemble_scratch_free(EnsembleScratch *scratch)
+{
+    MEM_FREE(scratch->inputs);
+    MEM_FREE(scratch->view_probs);
+    MEM_FREE(scratch->gemm);
+}
+
+// Averaged probabilities of n <= batch_size images, n x MNIST_NUM_LABELS
+static void ensemble_predict_batch(const Ensemble *ens, EnsembleScratch *scratch, const MnistRecord *images, int n,
+                                   float *probs)
+{
+    // Every view of the batch is built once and read by all the models
+    int rows = ens->num_views * n;
+    for (int v = 0; v < ens->num_views; v++)
+    {
+        for (int s = 0; s < n; s++)
+        {
+            float *input = &scratch->inputs[(size_t)(v * n + s) * MNIST_IMG_DATA_LEN];
+            if (v == 0)
+            {
+                memcpy(input, images[s].pixels, MNIST_IMG_DATA_LEN * sizeof(float));
+            }
+            else
+            {
+                augment_map_apply(&ens->views[v - 1], images[s].pixels, input);
+            }
+        }
+    }
+
+    memset(probs, 0, (size_t)n * MNIST_NUM_LABELS * sizeof(float));
+    for (int m = 0; m < ens->num_models; m++)
+    {
+        Net *model = &ens->models[m];
+        if (ens->batched[m].layers)
+        {
+            pruned_net_forward_scratch(&ens->batched[m], scratch->inputs, rows, scratch->view_probs, scratch->gemm);
+        }
+        else
+        {
+            assert(net_transposed_ready(model));
+            for (int r = 0; r < rows; r++)
+            {
+                memcpy(scratch->record.pixels, &scratch->inputs[(size_t)r * MNIST_IMG_DATA_LEN],
+                       MNIST_IMG_DATA_LEN * sizeof(float));
+                float **activations = net_forward(model, &scratch->record, NULL, false);
+                memcpy(&scratch->view_probs[r * MNIST_NUM_LABELS], activations[model->num_layers],
+                       MNIST_NUM_LABELS * sizeof(float));
+                net_free_activations(model, activations);
+            }
+        }
+
+        for (int r = 0; r < rows; r++)
+        {
+            float *out = &probs[(r % n) * MNIST_NUM_LABELS];
+            for (int j = 0; j < MNIST_NUM_LABELS; j++)
+            {
+                out[j] += scratch->view_probs[r * MNIST_NUM_LABELS + j];
+            }
+        }
+    }
+
+    float scale = 1.0f / (ens->num_models * ens->num_views);
+    for (int i = 0; i < n * MNIST_NUM_LABELS; i++)
+    {
+        probs[i] *= scale;
+    }
+}
+
+// Averaged probabilities of n images, n x MNIST_NUM_LABELS, on the calling thread
+void ensemble_predict(const Ensemble *ens, const MnistRecord *images, int n, float *probs)
+{
+    EnsembleScratch scratch;
+    ensemble_scratch_init(ens, &scratch);
+    for (int start = 0; start < n; start += ens->batch_size)
+    {
+        int len = n - start < ens->batch_size ? n - start : ens->batch_size;
+        ensemble_predict_batch(ens, &scratch, &images[start], len, &probs[start * MNIST_NUM_LABELS]);
+    }
+    ensemble_scratch_free(&scratch);
+}
+
+// One thread's share of ensemble_accuracy: batches worker, worker + num_workers, ...
+typedef struct
+{
+    const Ensemble *ens;
+    const MnistRecord *data;
+    int len;
+    int worker;
+    int num_workers;
+    int num_correct;
+} EnsembleWorker;
+
+static void *ensemble_worker_main(void *arg)
+{
+    EnsembleWorker *w = (EnsembleWorker *)arg;
+    const Ensemble *ens = w->ens;
+    EnsembleScratch scratch;
+    ensemble_scratch_init(ens, &scratch);
+    float *probs = (float *)MEM_MALLOC((size_t)ens->batch_size * MNIST_NUM_LABELS * sizeof(float));
+
+    for (int start = w->worker * ens->batch_size; start < w->len; start += w->num_workers * ens->batch_size)
+    {
+        int n = w->len - start < ens->batch_size ? w->len - start : ens->batch_size;
+        ensemble_predict_batch(ens, &scratch, &w->data[start], n, probs);
+        for (int s = 0; s < n; s++)
+        {
+            w->num_correct += get_prediction_index(&probs[s * MNIST_NUM_LABELS]) == w->data[start + s].label;
+        }
+    }
+
+    MEM_FREE(probs);
+    ensemble_scratch_free(&scratch);
+    return NULL;
+}
+
+// Accuracy of the averaged prediction over data, batches split across num_threads threads
+float ensemble_accuracy(const Ensemble *ens, const MnistRecord *data, int len)
+{
+    int num_workers = ens->num_threads > 1 ? ens->num_threads : 1;
+#ifdef ENSEMBLE_SINGLE_THREAD
+    num_workers = 1;
+#endif
+    EnsembleWorker *workers = (EnsembleWorker *)MEM_CALLOC(num_workers, sizeof(EnsembleWorker));
+    for (int t = 0; t < num_workers; t++)
+    {
+        workers[t] = (EnsembleWorker){ens, data, len, t, num_workers, 0};
+    }
+
+#ifdef ENSEMBLE_SINGLE_THREAD
+    ensemble_worker_main(&workers[0]);
+#else
+    pthread_t *threads = (pthread_t *)MEM_MALLOC(num_workers * sizeof(pthread_t));
+    for (int t = 1; t < num_workers; t++)
+    {
+        pthread_create(&threads[t], NULL, ensemble_worker_main, &workers[t]);
+    }
+    ensemble_worker_main(&workers[0]);
+    for (int t = 1; t < num_workers; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    MEM_FREE(threads);
+#endif
+
+    int num_correct = 0;
+    for (int t = 0; t < num_workers; t++)
+    {
+        num_correct += workers[t].num_correct;
+    }
+    MEM_FREE(workers);
+    return len > 0 ? (float)num_correct / len : 0;
+}
+
+// Evaluate every ensemble of the first 1..num_models models with the first 1..max_views views.
+// Prints the accuracy gain and throughput cost of each against the first model alone, marking
+// the operating points no faster configuration matches in accuracy.
+void run_ensemble_eval(Net *models, int num_models, int max_views, MnistRecord *data, int len, int num_threads)
+{
+    int num_configs = num_models * max_views;
+    float *accuracy = (float *)MEM_MALLOC(num_configs * sizeof(float));
+    double *imgs_per_sec = (double *)MEM_MALLOC(num_configs * sizeof(double));
+
+    for (int m = 1; m <= num_models; m++)
+    {
+        for (int v = 1; v <= max_views; v++)
+        {
+            int c = (m - 1) * max_views + v - 1;
+            Ensemble ens;
+            ensemble_init(&ens, models, m, v, ENSEMBLE_BATCH_SIZE, num_threads);
+            double start = get_time_sec();
+            accuracy[c] = ensemble_accuracy(&ens, data, len);
+            imgs_per_sec[c] = len / (get_time_sec() - start);
+            ensemble_free(&ens);
+        }
+    }
+
+    printf("Ensembles on %d images, %d thread(s), %d images per batched pass\n", len, num_threads > 1 ? num_threads : 1,
+           ENSEMBLE_BATCH_SIZE);
+    printf("%6s %6s %9s %9s %12s %8s\n", "models", "views", "accuracy", "gain", "imgs/s", "cost");
+    for (int c = 0; c < num_configs; c++)
+    {
+        bool best = true;
+        for (int o = 0; o < num_configs; o++)
+        {
+            if (imgs_per_sec[o] > imgs_per_sec[c] && accuracy[o] >= accuracy[c])
+            {
+                best = false;
+            }
+        }
+        printf("%6d %6d %9.4f %+9.4f %12.1f %7.2fx%s\n", c / max_views + 1, c % max_views + 1, accuracy[c],
+               accuracy[c] - accuracy[0], imgs_per_sec[c], imgs_per_sec[0] / imgs_per_sec[c], best ? " *" : "");
+    }
+
+    MEM_FREE(accuracy);
+    MEM_FREE(imgs_per_sec);
+}
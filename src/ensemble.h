@@ -0,0 +1,34 @@
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+
+#include "nn.h"
+#include "prune.h"
+#include "augment.h"
+
+// Most networks one ensemble averages
+#define ENSEMBLE_MAX_MODELS 8
+// Test-time augmentation views, the image itself included
+#define TTA_MAX_VIEWS 5
+
+// Several networks and test-time augmentation views evaluated as one: each image is augmented
+// once per view, every model classifies every view in one batched pass, and the probabilities
+// are averaged
+typedef struct
+{
+    Net *models;
+    int num_models;
+    PrunedNet *batched; // Batched dense kernels over each model, unused for models with conv layers
+    AugmentMap *views;  // num_views - 1 maps, view 0 is the image itself
+    int num_views;
+    int batch_size;  // Images per batched pass
+    int num_threads; // Threads splitting the batches of ensemble_accuracy
+    int max_width;   // Widest activation of any model
+} Ensemble;
+
+void ensemble_init(Ensemble *ens, Net *models, int num_models, int num_views, int batch_size, int num_threads);
+void ensemble_free(Ensemble *ens);
+void ensemble_predict(const Ensemble *ens, const MnistRecord *images, int n, float *probs);
+float ensemble_accuracy(const Ensemble *ens, const MnistRecord *data, int len);
+void run_ensemble_eval(Net *models, int num_models, int max_views, MnistRecord *data, int len, int num_threads);
+
+#endif
@@ -61,8 +61,8 @@ void ui_dropdown_list(DropdownList *menu)
     {
         Container *container = &menu->containers[i];
         bool is_active = i == *menu->active_menu_index;
-        char label_fmt[10];
-        sprintf(label_fmt, "%s %s", is_active ? "<" : ">", container->label);
+        char label_fmt[32];
+        snprintf(label_fmt, sizeof(label_fmt), "%s %s", is_active ? "<" : ">", container->label);
         int text_width = MeasureText(label_fmt, FONT_SIZE);
 
         DrawText(label_fmt, menu->pos.x + 5, menu->pos.y + total_height + 5, FONT_SIZE, WHITE);
@@ -1,128 +1,745 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <stdbool.h>
-#include "viz.h"
 #include "train.h"
 #include "nn.h"
-#include "raylib.h"
+#include "bench.h"
+#include "prune.h"
+#include "server.h"
+#include "sweep.h"
+#include "parallel.h"
+#include "dataset.h"
+#include "tune.h"
+#include "ensemble.h"
+#include "numa.h"
+#include "configs.h"
+#ifdef NN_WITH_VIZ
+#include "viz.h"
+#endif
+#include "mem.h"
 
-// Function prototypes
-void check_memory_allocations(void); // Now matches the required prototype
-void run_viz();
+#define MEM_TAG MEM_TAG_CLI
 
-// Memory tracking structure (simplified)
-typedef struct
+// Seed random number generator with current time in nanoseconds
+void seed_random()
 {
-    size_t size;
-    void *location;
-} AllocationEntry;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    srand((unsigned int)ts.tv_nsec); // Seeding with nanoseconds
+}
 
+// Command line options shared by all subcommands
 typedef struct
 {
-    AllocationEntry *allocation_map;
-    size_t allocation_count;
-    size_t *bad_free_array;
-    size_t bad_free_count;
-} TrackingAllocator;
+    const char *model_path;
+    const char *model_paths; // ensemble: comma separated networks
+    int tta_views;
+    const char *data_path;
+    const char *dataset_name;
+    int index;
+    int count;
+    int iters;
+    float sparsity;
+    int finetune_steps;
+    TrainConfig train;
+    ServerConfig server;
+    int clients;
+    SweepGrid sweep;
+    ParallelConfig parallel;
+} CliOptions;
 
-TrackingAllocator track; // Global variable for memory tracking
-
-// Mock of memory tracking (in lieu of Odin's tracking_allocator)
-void tracking_allocator_init(TrackingAllocator *track)
+static void print_usage(const char *prog)
 {
-    track->allocation_map = malloc(1024 * sizeof(AllocationEntry)); // Example allocation map size
-    track->allocation_count = 0;
-    track->bad_free_array = malloc(1024 * sizeof(size_t));
-    track->bad_free_count = 0;
+    printf("Usage: %s [command] [options]\n", prog);
+    printf("Commands:\n");
+#ifdef NN_WITH_VIZ
+    printf("  viz       Visualize the network (default)\n");
+#endif
+    printf("  train     Train a new network\n");
+    printf("  eval      Evaluate a network on the test set\n");
+    printf("  predict   Print predictions for test set images\n");
+    printf("  bench     Benchmark inference on synthetic data\n");
+    printf("  prune     Magnitude-prune a network and report accuracy and speed\n");
+    printf("  sweep     Train a grid of models together on one data stream\n");
+    printf("  serve     Serve predictions over a local socket with micro-batching\n");
+    printf("  publish   Decode the dataset once into shared memory for other processes\n");
+    printf("  unpublish Remove a published dataset\n");
+    printf("  query     Classify the test set through a running server and report latency\n");
+    printf("  autotune  Time the kernel choices for a network on this machine and cache the fastest\n");
+    printf("  ensemble  Evaluate ensembles of networks with test-time augmentation, accuracy against speed\n");
+    printf("Options:\n");
+    printf("  --model PATH   Network file to load (default %s)\n", NETWORK_LOAD_FILE_PATH);
+    printf("  --out PATH     Network file to save (default %s)\n", NETWORK_SAVE_FILE_PATH);
+    printf("  --data PATH    MNIST test CSV (default %s)\n", MNIST_TEST_FILE_PATH);
+    printf("  --dataset NAME Read the data from a published dataset: /name in shared memory or a file path,\n");
+    printf("                 e.g. on hugetlbfs (publish default %s)\n", DATASET_SHARED_NAME);
+    printf("  --steps N      Training steps (default %d)\n", NUM_STEPS);
+    printf("  --batch N      Batch size (default %d)\n", BATCH_SIZE);
+    printf("  --lr F         Learning rate (default %g)\n", LEARNING_RATE);
+    printf("  --aug N        Augmentation passes (default %d)\n", DATA_AUGMENTATION_COUNT);
+    printf("  --arch A,B     Hidden layers for train (default from NET_ARCH): dense sizes, conv layers\n");
+    printf("                 cF[kK][sS][pP] (F filters, K x K, stride S, padding P) and max or\n");
+    printf("                 average pooling mN / aN, e.g. c8k5p2,m2,c16p1,m2,64\n");
+    printf("  --teacher PATH Distill from this network's soft targets\n");
+    printf("  --temperature F  Distillation softmax temperature (default %g)\n", DISTILL_TEMPERATURE);
+    printf("  --alpha F      Weight of the distillation loss (default %g)\n", DISTILL_ALPHA);
+    printf("  --live NAME    train: publish weight snapshots to shared memory NAME, viz: watch them (e.g. %s)\n", LIVE_SNAPSHOT_NAME);
+    printf("  --importance 0|1  train: draw examples in proportion to their last loss, weighted (default 0)\n");
+    printf("  --skip-loss F  train --importance 1: skip the backward pass below this loss (default 0)\n");
+    printf("  --exits 0|1    train: add an early-exit head to every hidden layer, eval reports the\n");
+    printf("                 accuracy and latency of exiting at a sweep of confidences (default 0)\n");
+    printf("  --checkpoint N train: keep every N-th layer's activations and recompute the others during\n");
+    printf("                 backward, trading compute for activation memory (default 0, keep all)\n");
+    printf("  --archs A/B    sweep: architectures to try, e.g. 32,16/64\n");
+    printf("  --lrs F,G      sweep: learning rates to try\n");
+    printf("  --dropouts F,G sweep: dropout rates to try (default %g)\n", DROPOUT_RATE);
+    printf("  --procs N      train: data-parallel worker processes (default 1)\n");
+    printf("  --allreduce T  train: gradient all-reduce over shm or tcp (default shm)\n");
+    printf("  --peers A,B    train --allreduce tcp: address of every rank (default 127.0.0.1)\n");
+    printf("  --rank N       train --allreduce tcp: run only this rank, for ranks on several hosts\n");
+    printf("  --numa 0|1     train: pin rank r to NUMA node r %% nodes (default 0)\n");
+    printf("  --threads N    train: worker threads pinned across the NUMA nodes (default autotuned, else 1),\n");
+    printf("                 ensemble: evaluation threads (default all CPUs)\n");
+    printf("  --models A,B   ensemble: networks to average, the first alone is the baseline (default --model)\n");
+    printf("  --tta N        ensemble: most test-time augmentation views, the image itself included (default %d)\n",
+           TTA_MAX_VIEWS);
+    printf("  --tuning PATH  Autotune cache, read by train, eval, predict and serve (default %s)\n", TUNING_FILE_PATH);
+    printf("  --seed N       Random seed for training, 0 uses the clock (default 0)\n");
+    printf("  --index N      First test image for predict (default 0)\n");
+    printf("  --count N      Number of images for predict (default 1)\n");
+    printf("  --iters N      Iterations for bench (default 10000)\n");
+    printf("  --sparsity F   Target weight sparsity for prune (default 0.9)\n");
+    printf("  --finetune N   Fine-tuning steps after pruning (default 0)\n");
+    printf("  --socket PATH  Unix socket for serve and query (default %s)\n", SERVER_SOCKET_PATH);
+    printf("  --port N       serve/query: use TCP on 127.0.0.1:N instead of the Unix socket,\n");
+    printf("                 train --allreduce tcp: rank r listens on N + r (default %d)\n", PARALLEL_BASE_PORT);
+    printf("  --workers N    Inference threads for serve (default %d)\n", SERVER_NUM_WORKERS);
+    printf("  --max-batch N  Largest micro-batch for serve (default %d)\n", SERVER_MAX_BATCH);
+    printf("  --max-latency-us N  How long serve holds a batch open for more requests (default %d)\n",
+           SERVER_MAX_LATENCY_US);
+    printf("  --clients N    Concurrent connections for query (default %d)\n", SERVER_QUERY_CLIENTS);
 }
 
-void tracking_allocator_destroy(TrackingAllocator *track)
+// One hidden layer of --arch: a dense size N, a conv layer cF[kK][sS][pP] (F filters of K x K,
+// default 3, stride S, default 1, padding P, default 0), or a pooling layer mN / aN (max / average
+// over N x N windows). Returns the end of the entry, 0 for a malformed one.
+static uint32_t parse_arch_entry(const char *p, char **end)
 {
-    free(track->allocation_map);
-    free(track->bad_free_array);
+    char kind = *p;
+    if (kind != 'c' && kind != 'm' && kind != 'a')
+        return (uint32_t)strtoul(p, end, 10);
+
+    unsigned long size = strtoul(p + 1, end, 10);
+    if (*end == p + 1)
+        return 0;
+    if (kind != 'c')
+        return size <= 0xf ? ARCH_POOL(kind == 'm' ? LAYER_MAX_POOL : LAYER_AVG_POOL, size) : 0;
+
+    unsigned long params[3] = {3, 1, 0}; // Kernel, stride, padding
+    const char *names = "ksp";
+    while (**end && strchr(names, **end))
+    {
+        char *field = *end;
+        params[strchr(names, *field) - names] = strtoul(field + 1, end, 10);
+        if (*end == field + 1)
+            return 0;
+    }
+    if (size > 0xfff || params[0] > 0xf || params[1] > 0xf || params[2] > 0xf)
+        return 0;
+    return ARCH_CONV(size, params[0], params[1], params[2]);
 }
 
-void check_memory_allocations(void)
-{ // No parameters now, to be compatible with atexit()
-    if (track.allocation_count > 0)
+// Comma separated hidden layers, e.g. 16, 32,16 or c8k5p2,m2,64; stops at the first other separator.
+// False when there are more than MAX_NET_ARCH_LEN layers.
+static bool parse_arch(const char *value, uint32_t *arch, int *arch_len)
+{
+    *arch_len = 0;
+    const char *p = value;
+    while (true)
     {
-        printf("=== %zu allocations not freed: ===\n", track.allocation_count);
-        for (size_t i = 0; i < track.allocation_count; i++)
+        char *end;
+        if (*arch_len == MAX_NET_ARCH_LEN)
         {
-            printf("- %zu bytes @ %p\n", track.allocation_map[i].size, track.allocation_map[i].location);
+            printf("Too many layers in %s, at most %d\n", value, MAX_NET_ARCH_LEN);
+            return false;
         }
+        arch[(*arch_len)++] = parse_arch_entry(p, &end);
+        if (*end != ',')
+            return true;
+        p = end + 1;
     }
-    if (track.bad_free_count > 0)
+}
+
+// Comma separated floats, returns how many were read
+static int parse_float_list(const char *value, float *out, int max_len)
+{
+    int len = 0;
+    const char *p = value;
+    while (len < max_len)
     {
-        printf("=== %zu incorrect frees: ===\n", track.bad_free_count);
-        for (size_t i = 0; i < track.bad_free_count; i++)
+        char *end;
+        out[len++] = strtof(p, &end);
+        if (*end != ',')
+            break;
+        p = end + 1;
+    }
+    return len;
+}
+
+// Parse "--flag value" pairs, returns false on unknown flags or missing values
+static bool parse_options(int argc, char **argv, CliOptions *opts)
+{
+    for (int i = 0; i < argc; i++)
+    {
+        const char *flag = argv[i];
+        if (i + 1 >= argc)
+        {
+            printf("Missing value for %s\n", flag);
+            return false;
+        }
+        const char *value = argv[++i];
+
+        if (strcmp(flag, "--model") == 0)
+            opts->model_path = value;
+        else if (strcmp(flag, "--models") == 0)
+            opts->model_paths = value;
+        else if (strcmp(flag, "--tta") == 0)
+            opts->tta_views = atoi(value);
+        else if (strcmp(flag, "--out") == 0)
+            opts->train.save_path = value;
+        else if (strcmp(flag, "--data") == 0)
+            opts->data_path = value;
+        else if (strcmp(flag, "--dataset") == 0)
+            opts->dataset_name = value;
+        else if (strcmp(flag, "--steps") == 0)
+            opts->train.num_steps = atoi(value);
+        else if (strcmp(flag, "--batch") == 0)
+            opts->train.batch_size = atoi(value);
+        else if (strcmp(flag, "--lr") == 0)
+            opts->train.learning_rate = atof(value);
+        else if (strcmp(flag, "--aug") == 0)
+            opts->train.augmentation_count = atoi(value);
+        else if (strcmp(flag, "--arch") == 0)
+        {
+            if (!parse_arch(value, opts->train.arch, &opts->train.arch_len))
+                return false;
+        }
+        else if (strcmp(flag, "--archs") == 0)
+        {
+            // Slash separated architectures, e.g. 32,16/64
+            const char *p = value;
+            SweepGrid *grid = &opts->sweep;
+            grid->num_archs = 0;
+            while (p && grid->num_archs < SWEEP_MAX_VALUES)
+            {
+                if (!parse_arch(p, grid->archs[grid->num_archs], &grid->arch_lens[grid->num_archs]))
+                    return false;
+                // The stacked first layers of a sweep are dense
+                uint32_t *arch = grid->archs[grid->num_archs];
+                int arch_len = grid->arch_lens[grid->num_archs];
+                if (!net_arch_valid(arch, arch_len) || !net_arch_is_dense(arch, arch_len))
+                    return false;
+                grid->num_archs++;
+                p = strchr(p, '/');
+                p = p ? p + 1 : NULL;
+            }
+        }
+        else if (strcmp(flag, "--lrs") == 0)
+            opts->sweep.num_learning_rates = parse_float_list(value, opts->sweep.learning_rates, SWEEP_MAX_VALUES);
+        else if (strcmp(flag, "--dropouts") == 0)
+            opts->sweep.num_dropout_rates = parse_float_list(value, opts->sweep.dropout_rates, SWEEP_MAX_VALUES);
+        else if (strcmp(flag, "--teacher") == 0)
+            opts->train.teacher_path = value;
+        else if (strcmp(flag, "--temperature") == 0)
+            opts->train.temperature = atof(value);
+        else if (strcmp(flag, "--alpha") == 0)
+            opts->train.distill_alpha = atof(value);
+        else if (strcmp(flag, "--importance") == 0)
+            opts->train.importance_sampling = atoi(value) != 0;
+        else if (strcmp(flag, "--skip-loss") == 0)
+            opts->train.skip_loss = atof(value);
+        else if (strcmp(flag, "--exits") == 0)
+            opts->train.exit_heads = atoi(value) != 0;
+        else if (strcmp(flag, "--checkpoint") == 0)
+            opts->train.checkpoint_stride = atoi(value);
+        else if (strcmp(flag, "--live") == 0)
+            opts->train.live_name = value;
+        else if (strcmp(flag, "--procs") == 0)
+            opts->parallel.num_procs = atoi(value);
+        else if (strcmp(flag, "--allreduce") == 0)
+        {
+            if (strcmp(value, "shm") == 0)
+                opts->parallel.transport = ALLREDUCE_SHM;
+            else if (strcmp(value, "tcp") == 0)
+                opts->parallel.transport = ALLREDUCE_TCP;
+            else
+                return false;
+        }
+        else if (strcmp(flag, "--peers") == 0)
+            opts->parallel.peers = value;
+        else if (strcmp(flag, "--rank") == 0)
+            opts->parallel.rank = atoi(value);
+        else if (strcmp(flag, "--numa") == 0)
+            opts->parallel.pin_numa = atoi(value) != 0;
+        else if (strcmp(flag, "--threads") == 0)
+            opts->parallel.num_threads = atoi(value);
+        else if (strcmp(flag, "--tuning") == 0)
+            opts->train.tuning_path = value;
+        else if (strcmp(flag, "--seed") == 0)
+            opts->train.seed = (unsigned int)strtoul(value, NULL, 10);
+        else if (strcmp(flag, "--index") == 0)
+            opts->index = atoi(value);
+        else if (strcmp(flag, "--count") == 0)
+            opts->count = atoi(value);
+        else if (strcmp(flag, "--iters") == 0)
+            opts->iters = atoi(value);
+        else if (strcmp(flag, "--sparsity") == 0)
+            opts->sparsity = atof(value);
+        else if (strcmp(flag, "--finetune") == 0)
+            opts->finetune_steps = atoi(value);
+        else if (strcmp(flag, "--socket") == 0)
+            opts->server.socket_path = value;
+        else if (strcmp(flag, "--port") == 0)
+            opts->server.port = atoi(value);
+        else if (strcmp(flag, "--workers") == 0)
+            opts->server.num_workers = atoi(value);
+        else if (strcmp(flag, "--max-batch") == 0)
+            opts->server.max_batch = atoi(value);
+        else if (strcmp(flag, "--max-latency-us") == 0)
+            opts->server.max_latency_us = atoi(value);
+        else if (strcmp(flag, "--clients") == 0)
+            opts->clients = atoi(value);
+        else
         {
-            printf("- %p was incorrectly freed\n", (void *)track.bad_free_array[i]);
+            printf("Unknown option: %s\n", flag);
+            return false;
         }
     }
-    tracking_allocator_destroy(&track); // Use the global `track`
+    if (!net_arch_valid(opts->train.arch, opts->train.arch_len))
+        return false;
+    for (int i = 0; i < opts->sweep.num_dropout_rates; i++)
+    {
+        if (opts->sweep.dropout_rates[i] < 0 || opts->sweep.dropout_rates[i] >= 1)
+            return false;
+    }
+    // The sampler replaces the in-order walk of train(); distillation and the parallel trainers keep it
+    if (opts->train.importance_sampling &&
+        (opts->train.teacher_path || opts->parallel.num_procs > 1 || opts->parallel.num_threads > 1))
+        return false;
+    // The threaded trainer neither distills nor publishes live snapshots
+    if (opts->parallel.num_threads > 1 && (opts->train.teacher_path || opts->train.live_name))
+        return false;
+    // Only the single-process trainer updates the exit heads
+    if (opts->train.exit_heads &&
+        (opts->train.teacher_path || opts->parallel.num_procs > 1 || opts->parallel.num_threads > 1))
+        return false;
+    // Conv and pooling layers train in the single-process trainer, without live snapshots
+    if (!net_arch_is_dense(opts->train.arch, opts->train.arch_len) &&
+        (opts->train.live_name || opts->parallel.num_procs > 1 || opts->parallel.num_threads > 1 ||
+         opts->parallel.rank >= 0))
+        return false;
+    // Exit heads read every hidden activation, there is nothing to recompute
+    if (opts->train.checkpoint_stride < 0 || (opts->train.checkpoint_stride > 1 && opts->train.exit_heads))
+        return false;
+    if (opts->train.skip_loss < 0 || (opts->train.skip_loss > 0 && !opts->train.importance_sampling))
+        return false;
+    if (opts->tta_views < 1 || opts->tta_views > TTA_MAX_VIEWS)
+        return false;
+    return opts->train.batch_size > 0 && opts->index >= 0 && opts->index < TEST_DATA_LEN && opts->count > 0 &&
+           opts->iters > 0 && opts->train.temperature > 0 && opts->sparsity >= 0 && opts->sparsity < 1 &&
+           opts->server.port >= 0 && opts->server.port < 65536 && opts->server.num_workers > 0 &&
+           opts->server.max_batch > 0 && opts->server.max_latency_us >= 0 && opts->clients > 0 &&
+           opts->parallel.num_procs > 0 && opts->parallel.rank < opts->parallel.num_procs &&
+           opts->parallel.num_threads >= 0 && (opts->parallel.num_threads <= 1 || opts->parallel.num_procs == 1);
 }
 
-// Seed random number generator with current time in nanoseconds
-void seed_random()
+// Commands built on the dense kernels turn away networks with conv or pooling layers
+static bool require_dense(const Net *net, const char *command)
 {
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    srand((unsigned int)ts.tv_nsec); // Seeding with nanoseconds
+    if (net_is_dense(net))
+        return true;
+    printf("%s needs a network of dense layers only\n", command);
+    return false;
+}
+
+// Evaluate a saved network on the test set
+static int cmd_eval(CliOptions *opts)
+{
+    Net net = {};
+    if (!net_load(&net, opts->model_path))
+    {
+        printf("Failed to load network: %s\n", opts->model_path);
+        return 1;
+    }
+    tune_load_net(opts->train.tuning_path, &net);
+
+    MnistRecord *test_data = load_mnist_data(opts->data_path, TEST_DATA_LEN);
+    if (!test_data)
+    {
+        net_free(&net);
+        return 1;
+    }
+
+    float accuracy = calc_net_accuracy(test_data, &net);
+    printf("Accuracy: %.4f\n", accuracy);
+    if (net.num_exits > 0)
+    {
+        bench_early_exit(&net, test_data, TEST_DATA_LEN);
+    }
+
+    free_mnist_data(test_data);
+    net_free(&net);
+    return 0;
 }
 
-// Run the visualization loop
-void run_viz()
+// Print predictions and class probabilities for a range of test images
+static int cmd_predict(CliOptions *opts)
 {
-    // Viz Init
-    if (viz_init())
+    Net net = {};
+    if (!net_load(&net, opts->model_path))
     {
-        return; // Exit if initialization failed
+        printf("Failed to load network: %s\n", opts->model_path);
+        return 1;
     }
-    atexit(viz_deinit); // Ensure cleanup happens on exit
+    tune_load_net(opts->train.tuning_path, &net);
 
-    // Load test data
-    MnistRecord *test_data = load_mnist_data(MNIST_TEST_FILE_PATH, TEST_DATA_LEN);
+    MnistRecord *test_data = load_mnist_data(opts->data_path, TEST_DATA_LEN);
     if (!test_data)
     {
-        printf("Failed to read MNIST test data file\n");
-        return;
+        net_free(&net);
+        return 1;
+    }
+
+    for (int i = opts->index; i < opts->index + opts->count && i < TEST_DATA_LEN; i++)
+    {
+        float **activations = net_forward(&net, &test_data[i], NULL, false);
+        float *preds = activations[net.num_layers];
+        printf("%d: label %d, prediction %d, probs", i, test_data[i].label, get_prediction_index(preds));
+        for (int j = 0; j < MNIST_NUM_LABELS; j++)
+        {
+            printf(" %.4f", preds[j]);
+        }
+        printf("\n");
+        net_free_activations(&net, activations);
+    }
+
+    free_mnist_data(test_data);
+    net_free(&net);
+    return 0;
+}
+
+// Benchmark a saved network, or a freshly initialized NET_ARCH network
+static int cmd_bench(CliOptions *opts)
+{
+    Net net = {};
+    if (opts->model_path)
+    {
+        if (!net_load(&net, opts->model_path))
+        {
+            printf("Failed to load network: %s\n", opts->model_path);
+            return 1;
+        }
+    }
+    else
+    {
+        net_init_mem(&net, false);
+        net_init_values(&net);
+    }
+    if (!require_dense(&net, "bench"))
+    {
+        net_free(&net);
+        return 1;
+    }
+
+    run_bench(&net, opts->iters);
+    net_free(&net);
+    return 0;
+}
+
+// Prune a saved network to the target sparsity, optionally fine-tuning it
+static int cmd_prune(CliOptions *opts)
+{
+    Net net = {};
+    if (!net_load(&net, opts->model_path))
+    {
+        printf("Failed to load network: %s\n", opts->model_path);
+        return 1;
+    }
+    if (!require_dense(&net, "prune"))
+    {
+        net_free(&net);
+        return 1;
+    }
+
+    run_prune(&net, opts->sparsity, opts->finetune_steps, opts->data_path, opts->train.save_path);
+    net_free(&net);
+    return 0;
+}
+
+// Serve a saved network until interrupted
+static int cmd_serve(CliOptions *opts)
+{
+    Net net = {};
+    if (!net_load(&net, opts->model_path))
+    {
+        printf("Failed to load network: %s\n", opts->model_path);
+        return 1;
     }
+    if (!require_dense(&net, "serve"))
+    {
+        net_free(&net);
+        return 1;
+    }
+    tune_load_net(opts->train.tuning_path, &net);
 
-    int frame_idx = 0;
-    int img_idx = 0;
+    int status = run_server(&net, &opts->server);
+    net_free(&net);
+    return status;
+}
 
-    // Simulation loop
-    while (!is_viz_terminate())
+// Time the kernel choices for a saved network, or a freshly initialized --arch one, and store the
+// fastest in the tuning cache
+static int cmd_autotune(CliOptions *opts)
+{
+    Net net = {};
+    if (opts->model_path)
     {
-        frame_idx = (frame_idx + 1) % 15;
-        if (frame_idx == 0)
+        if (!net_load(&net, opts->model_path))
         {
-            img_idx = (img_idx + 1) % TEST_DATA_LEN;
+            printf("Failed to load network: %s\n", opts->model_path);
+            return 1;
         }
+    }
+    else
+    {
+        net_init_mem_arch(&net, opts->train.arch, opts->train.arch_len, false);
+        net_init_values(&net);
+    }
+    if (!require_dense(&net, "autotune"))
+    {
+        net_free(&net);
+        return 1;
+    }
 
-        viz_update(&test_data[img_idx]);
+    TuningEntry entry;
+    run_autotune(&net, &entry, opts->iters);
+    bool stored = tune_store(opts->train.tuning_path, &entry);
+    if (stored)
+    {
+        printf("Saved tuning to %s\n", opts->train.tuning_path);
+    }
+    net_free(&net);
+    return stored ? 0 : 1;
+}
 
-        // Simulating memory cleanup (free temporary allocations)
-        // free_all(context.temp_allocator);  // Assuming you handle this elsewhere
+// Evaluate every ensemble of the leading --models with up to --tta views on the test set
+static int cmd_ensemble(CliOptions *opts)
+{
+    Net models[ENSEMBLE_MAX_MODELS] = {};
+    int num_models = 0;
+    int status = 0;
+    const char *p = opts->model_paths ? opts->model_paths : opts->model_path;
+    while (p && num_models < ENSEMBLE_MAX_MODELS)
+    {
+        const char *end = strchr(p, ',');
+        char path[1024];
+        snprintf(path, sizeof(path), "%.*s", end ? (int)(end - p) : (int)strlen(p), p);
+        if (!net_load(&models[num_models], path))
+        {
+            printf("Failed to load network: %s\n", path);
+            status = 1;
+            break;
+        }
+        num_models++;
+        p = end ? end + 1 : NULL;
     }
 
-    free(test_data); // Free test data after the loop
+    MnistRecord *test_data = status == 0 ? load_mnist_data(opts->data_path, TEST_DATA_LEN) : NULL;
+    if (test_data)
+    {
+        int num_threads = opts->parallel.num_threads;
+        if (num_threads == 0)
+        {
+            NumaTopology topo;
+            numa_topology_read(&topo);
+            num_threads = topo.num_cpus;
+            numa_topology_free(&topo);
+        }
+        run_ensemble_eval(models, num_models, opts->tta_views, test_data, TEST_DATA_LEN, num_threads);
+        free_mnist_data(test_data);
+    }
+    else
+    {
+        status = 1;
+    }
+
+    for (int m = 0; m < num_models; m++)
+    {
+        net_free(&models[m]);
+    }
+    return status;
+}
+
+// Send the test set to a running server
+static int cmd_query(CliOptions *opts)
+{
+    MnistRecord *test_data = load_mnist_data(opts->data_path, TEST_DATA_LEN);
+    if (!test_data)
+        return 1;
+
+    run_server_query(&opts->server, test_data, TEST_DATA_LEN, opts->clients);
+    free_mnist_data(test_data);
+    return 0;
 }
 
 // Main function
-int main()
+int main(int argc, char **argv)
 {
-    // Memory tracking allocator setup
-    tracking_allocator_init(&track);
-    atexit(check_memory_allocations); // Register global memory check at program exit
+#ifdef NN_TRACK_ALLOC
+    atexit(mem_report_leaks); // Registered first so it runs after every other exit handler
+#endif
+    mem_scope_begin(MEM_TAG_CLI);
 
     // Seed the random number generator
     seed_random();
 
-    // Run the visualization (or training if desired)
-    run_viz();
+#ifdef NN_WITH_VIZ
+    const char *command = argc > 1 ? argv[1] : "viz";
+#else
+    const char *command = argc > 1 ? argv[1] : "";
+#endif
 
-    return 0;
-}
\ No newline at end of file
+    CliOptions opts = {
+        .model_path = NULL,
+        .model_paths = NULL,
+        .tta_views = TTA_MAX_VIEWS,
+        .data_path = MNIST_TEST_FILE_PATH,
+        .index = 0,
+        .count = 1,
+        .iters = 10000,
+        .sparsity = 0.9f,
+        .finetune_steps = 0,
+        .train = train_config_default(),
+        .server = server_config_default(),
+        .clients = SERVER_QUERY_CLIENTS,
+        .parallel = parallel_config_default(),
+    };
+    int num_opts = argc > 2 ? argc - 2 : 0;
+    if (!parse_options(num_opts, argv + 2, &opts))
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // bench and autotune default to a freshly initialized network, everything else to the saved one
+    if (!opts.model_path && strcmp(command, "bench") != 0 && strcmp(command, "autotune") != 0)
+    {
+        opts.model_path = NETWORK_LOAD_FILE_PATH;
+    }
+
+    if (strcmp(command, "publish") == 0)
+    {
+        return dataset_publish(opts.dataset_name ? opts.dataset_name : DATASET_SHARED_NAME) ? 0 : 1;
+    }
+    if (strcmp(command, "unpublish") == 0)
+    {
+        return dataset_unpublish(opts.dataset_name ? opts.dataset_name : DATASET_SHARED_NAME) ? 0 : 1;
+    }
+    // Every later load of the published files reads the shared pages instead
+    if (opts.dataset_name && !dataset_attach(opts.dataset_name))
+    {
+        return 1;
+    }
+
+    // The nn core's allocations are charged to the subsystem running the command
+    if (strcmp(command, "train") == 0)
+    {
+        mem_scope_begin(MEM_TAG_TRAIN);
+        if (opts.parallel.num_procs > 1 || opts.parallel.rank >= 0)
+        {
+            if (opts.server.port)
+            {
+                opts.parallel.port = opts.server.port;
+            }
+            return run_parallel_train(&opts.train, &opts.parallel);
+        }
+        // Unless given, the thread count autotune picked, where the threaded trainer supports the run
+        int num_threads = opts.parallel.num_threads;
+        if (num_threads == 0)
+        {
+            TuningEntry entry;
+            tune_entry_init(&entry, opts.train.arch, opts.train.arch_len);
+            bool tuned = !opts.train.teacher_path && !opts.train.live_name && !opts.train.importance_sampling &&
+                         !opts.train.exit_heads && tune_lookup(opts.train.tuning_path, &entry);
+            num_threads = tuned ? entry.train_threads : 1;
+        }
+        if (num_threads > 1)
+        {
+            return run_threaded_train(&opts.train, num_threads);
+        }
+        train(&opts.train);
+        return 0;
+    }
+    if (strcmp(command, "sweep") == 0)
+    {
+        if (!net_arch_is_dense(opts.train.arch, opts.train.arch_len))
+        {
+            printf("sweep needs dense architectures only\n");
+            return 1;
+        }
+        mem_scope_begin(MEM_TAG_TRAIN);
+        run_sweep(&opts.train, &opts.sweep);
+        return 0;
+    }
+    if (strcmp(command, "eval") == 0)
+    {
+        return cmd_eval(&opts);
+    }
+    if (strcmp(command, "predict") == 0)
+    {
+        return cmd_predict(&opts);
+    }
+    if (strcmp(command, "bench") == 0)
+    {
+        mem_scope_begin(MEM_TAG_BENCH);
+        return cmd_bench(&opts);
+    }
+    if (strcmp(command, "autotune") == 0)
+    {
+        mem_scope_begin(MEM_TAG_BENCH);
+        return cmd_autotune(&opts);
+    }
+    if (strcmp(command, "prune") == 0)
+    {
+        mem_scope_begin(MEM_TAG_PRUNE);
+        return cmd_prune(&opts);
+    }
+    if (strcmp(command, "serve") == 0)
+    {
+        mem_scope_begin(MEM_TAG_SERVER);
+        return cmd_serve(&opts);
+    }
+    if (strcmp(command, "ensemble") == 0)
+    {
+        mem_scope_begin(MEM_TAG_EVAL);
+        return cmd_ensemble(&opts);
+    }
+    if (strcmp(command, "query") == 0)
+    {
+        mem_scope_begin(MEM_TAG_SERVER);
+        return cmd_query(&opts);
+    }
+#ifdef NN_WITH_VIZ
+    if (strcmp(command, "viz") == 0)
+    {
+        mem_scope_begin(MEM_TAG_VIZ);
+        run_viz(opts.model_path, opts.train.live_name);
+        return 0;
+    }
+#endif
+
+    print_usage(argv[0]);
+    return strcmp(command, "help") == 0 || strcmp(command, "--help") == 0 ? 0 : 1;
+}
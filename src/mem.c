@@ -0,0 +1,293 @@
+#include "mem.h"
+
+#ifdef NN_TRACK_ALLOC
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define MEM_BLOCK_MAGIC 0x4d454d42u // "MEMB"
+#define MEM_BLOCK_FREED 0x46524545u // "FREE"
+// Leak report lists at most this many allocation sites
+#define MEM_MAX_LEAK_SITES 32
+
+// Header in front of every tracked allocation; live blocks form a list for the leak report
+typedef struct MemBlock
+{
+    struct MemBlock *prev;
+    struct MemBlock *next;
+    size_t size;
+    const char *file;
+    int line;
+    uint16_t tag;
+    uint32_t magic;
+} MemBlock;
+
+// Rounded up so the user pointer keeps malloc's alignment
+#define MEM_HEADER_SIZE ((sizeof(MemBlock) + 15) & ~(size_t)15)
+
+typedef struct
+{
+    size_t live_bytes;
+    size_t peak_bytes;
+    size_t num_allocs;
+    size_t num_frees;
+    size_t reported_allocs; // num_allocs at the last mem_report
+} MemStats;
+
+static const char *MEM_TAG_NAMES[MEM_TAG_COUNT] = {"nn", "train", "distill", "prune", "bench", "snapshot", "viz", "server", "parallel", "cli", "eval"};
+
+static pthread_mutex_t g_mem_lock = PTHREAD_MUTEX_INITIALIZER;
+static MemBlock *g_mem_blocks;
+static MemStats g_mem_stats[MEM_TAG_COUNT];
+static size_t g_mem_bad_frees;
+static double g_mem_last_report = -1;
+static _Thread_local MemTag g_mem_scope = MEM_TAG_NN;
+
+static double mem_time_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *mem_block_data(MemBlock *block)
+{
+    return (char *)block + MEM_HEADER_SIZE;
+}
+
+static MemBlock *mem_data_block(void *ptr)
+{
+    return (MemBlock *)((char *)ptr - MEM_HEADER_SIZE);
+}
+
+static void mem_track(MemBlock *block, size_t size, MemTag tag, const char *file, int line)
+{
+    block->size = size;
+    block->file = file;
+    block->line = line;
+    block->tag = (uint16_t)tag;
+    block->magic = MEM_BLOCK_MAGIC;
+
+    pthread_mutex_lock(&g_mem_lock);
+    if (g_mem_last_report < 0)
+    {
+        g_mem_last_report = mem_time_sec();
+    }
+    block->prev = NULL;
+    block->next = g_mem_blocks;
+    if (g_mem_blocks)
+    {
+        g_mem_blocks->prev = block;
+    }
+    g_mem_blocks = block;
+
+    MemStats *stats = &g_mem_stats[tag];
+    stats->live_bytes += size;
+    stats->num_allocs++;
+    if (stats->live_bytes > stats->peak_bytes)
+    {
+        stats->peak_bytes = stats->live_bytes;
+    }
+    pthread_mutex_unlock(&g_mem_lock);
+}
+
+// Unlink a block, false when ptr was not a live tracked allocation
+static bool mem_untrack(MemBlock *block)
+{
+    pthread_mutex_lock(&g_mem_lock);
+    if (block->magic != MEM_BLOCK_MAGIC)
+    {
+        g_mem_bad_frees++;
+        pthread_mutex_unlock(&g_mem_lock);
+        return false;
+    }
+    block->magic = MEM_BLOCK_FREED;
+
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        g_mem_blocks = block->next;
+    if (block->next)
+        block->next->prev = block->prev;
+
+    MemStats *stats = &g_mem_stats[block->tag];
+    stats->live_bytes -= block->size;
+    stats->num_frees++;
+    pthread_mutex_unlock(&g_mem_lock);
+    return true;
+}
+
+void *mem_malloc(size_t size, MemTag tag, const char *file, int line)
+{
+    MemBlock *block = (MemBlock *)malloc(MEM_HEADER_SIZE + size);
+    if (!block)
+        return NULL;
+
+    mem_track(block, size, tag, file, line);
+    return mem_block_data(block);
+}
+
+void *mem_calloc(size_t num, size_t size, MemTag tag, const char *file, int line)
+{
+    if (size && num > SIZE_MAX / size)
+        return NULL;
+
+    void *ptr = mem_malloc(num * size, tag, file, line);
+    if (ptr)
+    {
+        memset(ptr, 0, num * size);
+    }
+    return ptr;
+}
+
+void *mem_realloc(void *ptr, size_t size, MemTag tag, const char *file, int line)
+{
+    if (!ptr)
+        return mem_malloc(size, tag, file, line);
+
+    MemBlock *block = mem_data_block(ptr);
+    if (!mem_untrack(block))
+        return NULL;
+
+    MemBlock *resized = (MemBlock *)realloc(block, MEM_HEADER_SIZE + size);
+    if (!resized)
+    {
+        // The original block is still valid, keep tracking it
+        mem_track(block, block->size, (MemTag)block->tag, block->file, block->line);
+        return NULL;
+    }
+
+    mem_track(resized, size, tag, file, line);
+    return mem_block_data(resized);
+}
+
+void mem_free(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    MemBlock *block = mem_data_block(ptr);
+    if (mem_untrack(block))
+    {
+        free(block);
+    }
+}
+
+// Charge the nn core's allocations on this thread to tag until mem_scope_end
+MemTag mem_scope_begin(MemTag tag)
+{
+    MemTag prev = g_mem_scope;
+    g_mem_scope = tag;
+    return prev;
+}
+
+void mem_scope_end(MemTag prev)
+{
+    g_mem_scope = prev;
+}
+
+MemTag mem_scope_tag(void)
+{
+    return g_mem_scope;
+}
+
+// Print live and peak bytes per subsystem, and the allocation rate since the previous report
+void mem_report(void)
+{
+    pthread_mutex_lock(&g_mem_lock);
+    double now = mem_time_sec();
+    double elapsed = g_mem_last_report < 0 ? 0 : now - g_mem_last_report;
+    g_mem_last_report = now;
+
+    printf("%-10s %12s %12s %12s %12s\n", "memory", "live KB", "peak KB", "allocs", "allocs/s");
+    for (int i = 0; i < MEM_TAG_COUNT; i++)
+    {
+        MemStats *stats = &g_mem_stats[i];
+        if (stats->num_allocs == 0)
+            continue;
+
+        size_t new_allocs = stats->num_allocs - stats->reported_allocs;
+        stats->reported_allocs = stats->num_allocs;
+        printf("%-10s %12.1f %12.1f %12zu %12.0f\n", MEM_TAG_NAMES[i], stats->live_bytes / 1024.0,
+               stats->peak_bytes / 1024.0, stats->num_allocs, elapsed > 0 ? new_allocs / elapsed : 0.0);
+    }
+    pthread_mutex_unlock(&g_mem_lock);
+}
+
+typedef struct
+{
+    const char *file;
+    int line;
+    int tag;
+    size_t count;
+    size_t bytes;
+} LeakSite;
+
+static int compare_leak_sites(const void *a, const void *b)
+{
+    size_t ba = ((const LeakSite *)a)->bytes;
+    size_t bb = ((const LeakSite *)b)->bytes;
+    return (ba < bb) - (ba > bb);
+}
+
+// Print the allocations still live, grouped by allocation site; meant to run at exit
+void mem_report_leaks(void)
+{
+    LeakSite sites[MEM_MAX_LEAK_SITES * 4];
+    int num_sites = 0;
+    size_t total_count = 0;
+    size_t total_bytes = 0;
+    size_t other_count = 0;
+
+    pthread_mutex_lock(&g_mem_lock);
+    for (MemBlock *block = g_mem_blocks; block; block = block->next)
+    {
+        total_count++;
+        total_bytes += block->size;
+
+        int i = 0;
+        while (i < num_sites && !(sites[i].line == block->line && sites[i].tag == block->tag &&
+                                  strcmp(sites[i].file, block->file) == 0))
+        {
+            i++;
+        }
+        if (i == num_sites)
+        {
+            if (num_sites == (int)(sizeof(sites) / sizeof(sites[0])))
+            {
+                other_count++;
+                continue;
+            }
+            sites[num_sites++] = (LeakSite){block->file, block->line, block->tag, 0, 0};
+        }
+        sites[i].count++;
+        sites[i].bytes += block->size;
+    }
+    size_t bad_frees = g_mem_bad_frees;
+    pthread_mutex_unlock(&g_mem_lock);
+
+    if (total_count > 0)
+    {
+        qsort(sites, num_sites, sizeof(LeakSite), compare_leak_sites);
+        printf("=== %zu allocations (%zu bytes) not freed: ===\n", total_count, total_bytes);
+        for (int i = 0; i < num_sites && i < MEM_MAX_LEAK_SITES; i++)
+        {
+            printf("- %zu bytes in %zu allocations [%s] at %s:%d\n", sites[i].bytes, sites[i].count,
+                   MEM_TAG_NAMES[sites[i].tag], sites[i].file, sites[i].line);
+        }
+        if (other_count > 0)
+        {
+            printf("- %zu more allocations at other sites\n", other_count);
+        }
+    }
+    if (bad_frees > 0)
+    {
+        printf("=== %zu incorrect frees ===\n", bad_frees);
+    }
+}
+
+#endif
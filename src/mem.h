@@ -0,0 +1,57 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include <stddef.h>
+#include <stdlib.h>
+
+// Subsystem an allocation is accounted to
+typedef enum
+{
+    MEM_TAG_NN,
+    MEM_TAG_TRAIN,
+    MEM_TAG_DISTILL,
+    MEM_TAG_PRUNE,
+    MEM_TAG_BENCH,
+    MEM_TAG_SNAPSHOT,
+    MEM_TAG_VIZ,
+    MEM_TAG_SERVER,
+    MEM_TAG_PARALLEL,
+    MEM_TAG_CLI,
+    MEM_TAG_EVAL,
+    MEM_TAG_COUNT
+} MemTag;
+
+// Each source file defines MEM_TAG before using the MEM_* macros. Shared code (nn.c) uses
+// mem_scope_tag() so its buffers are charged to the subsystem that asked for them.
+#ifdef NN_TRACK_ALLOC
+
+void *mem_malloc(size_t size, MemTag tag, const char *file, int line);
+void *mem_calloc(size_t num, size_t size, MemTag tag, const char *file, int line);
+void *mem_realloc(void *ptr, size_t size, MemTag tag, const char *file, int line);
+void mem_free(void *ptr);
+MemTag mem_scope_begin(MemTag tag);
+void mem_scope_end(MemTag prev);
+MemTag mem_scope_tag(void);
+void mem_report(void);
+void mem_report_leaks(void);
+
+#define MEM_MALLOC(size) mem_malloc((size), MEM_TAG, __FILE__, __LINE__)
+#define MEM_CALLOC(num, size) mem_calloc((num), (size), MEM_TAG, __FILE__, __LINE__)
+#define MEM_REALLOC(ptr, size) mem_realloc((ptr), (size), MEM_TAG, __FILE__, __LINE__)
+#define MEM_FREE(ptr) mem_free(ptr)
+
+#else
+
+#define MEM_MALLOC(size) malloc(size)
+#define MEM_CALLOC(num, size) calloc((num), (size))
+#define MEM_REALLOC(ptr, size) realloc((ptr), (size))
+#define MEM_FREE(ptr) free(ptr)
+static inline MemTag mem_scope_begin(MemTag tag) { return tag; }
+static inline void mem_scope_end(MemTag prev) { (void)prev; }
+static inline MemTag mem_scope_tag(void) { return MEM_TAG_NN; }
+static inline void mem_report(void) {}
+static inline void mem_report_leaks(void) {}
+
+#endif
+
+#endif
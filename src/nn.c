@@ -4,7 +4,13 @@
 #include <string.h>
 #include <assert.h>
 #include "nn.h"
+#include "conv.h"
+#include "augment.h"
 #include "configs.h"
+#include "mem.h"
+
+// Shared core: buffers are charged to the calling subsystem
+#define MEM_TAG mem_scope_tag()
 
 // Helper functions for random values
 static float get_rand_bias()
@@ -31,12 +37,12 @@ static void relu(float *values, int len)
     }
 }
 
-// ReLU derivative (for backpropagation)
-static void relu_derivative(float *values, int len)
+// ReLU derivative (for backpropagation), applied to the errors of the given activations
+static void relu_derivative(float *errors, const float *values, int len)
 {
     for (int i = 0; i < len; i++)
     {
-        values[i] = values[i] > 0 ? 1 : 0;
+        errors[i] = values[i] > 0 ? errors[i] : 0;
     }
 }
 
@@ -67,231 +73,1636 @@ static void softmax(float *values, int len)
     }
 }
 
-// Initialize the network memory (weights and biases)
-void net_init_mem(Net *net, bool use_temp_allocator)
+// Type, geometry and weight shape of a layer from its arch entry, reading in_len activations of
+// in_channels channels; false for an entry no layer matches. Nothing is allocated yet.
+static bool layer_describe(Layer *layer, uint32_t code, int in_channels, int in_len)
 {
-    // Initialize the layers with sizes from NET_ARCH and add an output layer
-    // int arch[] = NET_ARCH;
-    int num_layers = sizeof(NET_ARCH) / sizeof(NET_ARCH[0]) + 1; // Output layer added
-    int img_size = MNIST_IMG_DATA_LEN;
+    memset(layer, 0, sizeof(*layer));
+    layer->activation = RELU;
+    layer->backprop_kernel = BACKPROP_KERNEL_ROWS;
+    layer->conv_kernel = CONV_KERNEL_IM2COL;
+    if (!(code & ARCH_SPATIAL))
+    {
+        layer->type = LAYER_DENSE;
+        layer->num_rows = (int)code;
+        layer->row_len = in_len;
+        return code > 0;
+    }
 
-    net->layers = (Layer *)malloc(num_layers * sizeof(Layer));
+    // Pooling keeps the ReLU: its inputs are never negative, so it only makes backward mask the
+    // error like at any hidden layer
+    layer->type = (LayerType)((code >> 28) & 7);
+    layer->conv.kernel = (int)((code >> 12) & 0xf);
+    layer->conv.stride = (int)((code >> 16) & 0xf);
+    layer->conv.padding = (int)((code >> 20) & 0xf);
+    if (layer->type == LAYER_CONV)
+    {
+        layer->num_rows = (int)(code & 0xfff);
+        layer->row_len = in_channels * layer->conv.kernel * layer->conv.kernel;
+        return layer->num_rows > 0;
+    }
+    return layer->type == LAYER_MAX_POOL || layer->type == LAYER_AVG_POOL;
+}
 
-    for (int i = 0; i < num_layers; i++)
+// Fill in the activation lengths and conv geometry of a layer reading a (channels, h, w) input,
+// which then becomes the layer's output shape. False if the layer does not fit its input.
+static bool layer_link(Layer *layer, int *channels, int *h, int *w)
+{
+    ConvShape *s = &layer->conv;
+    layer->num_inputs = *channels * *h * *w;
+    if (layer->type == LAYER_DENSE)
     {
-        int num_nodes = (i == num_layers - 1) ? MNIST_NUM_LABELS : NET_ARCH[i];
-        int num_inputs = (i == 0) ? img_size : NET_ARCH[i - 1];
+        layer->num_nodes = layer->num_rows;
+        *channels = layer->num_nodes;
+        *h = 1;
+        *w = 1;
+        return layer->num_rows > 0 && layer->row_len == layer->num_inputs;
+    }
 
-        // Initialize weights and biases
-        net->layers[i].w = (float **)malloc(num_nodes * sizeof(float *));
-        net->layers[i].b = (float *)malloc(num_nodes * sizeof(float));
+    s->in_channels = *channels;
+    s->in_h = *h;
+    s->in_w = *w;
+    if (layer->type == LAYER_CONV)
+    {
+        if (s->kernel <= 0 || s->stride <= 0 || s->padding < 0 || s->padding >= s->kernel ||
+            s->in_h + 2 * s->padding < s->kernel || s->in_w + 2 * s->padding < s->kernel)
+            return false;
+        s->out_channels = layer->num_rows;
+        s->out_h = (s->in_h + 2 * s->padding - s->kernel) / s->stride + 1;
+        s->out_w = (s->in_w + 2 * s->padding - s->kernel) / s->stride + 1;
+    }
+    else
+    {
+        if (s->kernel <= 0 || s->in_h < s->kernel || s->in_w < s->kernel)
+            return false;
+        s->stride = s->kernel;
+        s->padding = 0;
+        s->out_channels = s->in_channels;
+        s->out_h = s->in_h / s->kernel;
+        s->out_w = s->in_w / s->kernel;
+    }
+    layer->num_nodes = s->out_channels * s->out_h * s->out_w;
+    *channels = s->out_channels;
+    *h = s->out_h;
+    *w = s->out_w;
+    return layer->type == LAYER_CONV ? layer->num_rows > 0 && layer->row_len == s->in_channels * s->kernel * s->kernel
+                                     : layer->num_rows == 0;
+}
 
-        for (int j = 0; j < num_nodes; j++)
+// Allocate zeroed weight rows and biases for a described layer. Pooling layers have none, one
+// unused slot keeps their pointers valid.
+static void layer_alloc(Layer *layer)
+{
+    int num_slots = layer->num_rows > 0 ? layer->num_rows : 1;
+    layer->w = (float **)MEM_MALLOC(num_slots * sizeof(float *));
+    layer->b = (float *)MEM_CALLOC(num_slots, sizeof(float));
+    for (int j = 0; j < layer->num_rows; j++)
+    {
+        layer->w[j] = (float *)MEM_CALLOC(layer->row_len, sizeof(float));
+    }
+    layer->w_t = NULL;
+    layer->w_t_valid = false;
+}
+
+// Allocate a dense layer with zeroed weights and biases
+static void layer_init_mem(Layer *layer, int num_inputs, int num_nodes, Activation activation)
+{
+    layer_describe(layer, (uint32_t)num_nodes, num_inputs, num_inputs);
+    layer->activation = activation;
+    layer_alloc(layer);
+    int channels = num_inputs, h = 1, w = 1;
+    layer_link(layer, &channels, &h, &w);
+}
+
+// Initialize the network memory (weights and biases) using NET_ARCH
+void net_init_mem(Net *net, bool use_temp_allocator)
+{
+    int arch_len = sizeof(NET_ARCH) / sizeof(NET_ARCH[0]);
+    net_init_mem_arch(net, NET_ARCH, arch_len, use_temp_allocator);
+}
+
+// Initialize the network memory for the given hidden layers, checked with net_arch_valid
+void net_init_mem_arch(Net *net, const uint32_t *arch, int arch_len, bool use_temp_allocator)
+{
+    // Initialize the layers from arch and add an output layer
+    int num_layers = arch_len + 1; // Output layer added
+
+    net->num_layers = num_layers;
+    net->sparse_input_mode = SPARSE_INPUT_AUTO;
+    net->sparse_input_threshold = SPARSE_INPUT_DENSITY_THRESHOLD;
+    net->checkpoint_stride = 0;
+    net->layers = (Layer *)MEM_MALLOC(num_layers * sizeof(Layer));
+    net->exits = NULL;
+    net->num_exits = 0;
+
+    // The image is a single channel
+    int channels = 1, h = MNIST_IMG_SIZE, w = MNIST_IMG_SIZE;
+    for (int i = 0; i < num_layers; i++)
+    {
+        Layer *layer = &net->layers[i];
+        uint32_t code = (i == num_layers - 1) ? MNIST_NUM_LABELS : arch[i];
+        layer_describe(layer, code, channels, channels * h * w);
+        if (i == num_layers - 1)
         {
-            net->layers[i].w[j] = (float *)malloc(num_inputs * sizeof(float));
+            layer->activation = SOFTMAX;
         }
+        layer_alloc(layer);
+        layer_link(layer, &channels, &h, &w);
+    }
+}
 
-        net->layers[i].activation = (i == num_layers - 1) ? SOFTMAX : RELU;
-        net->layers[i].dropout_rate = 0;
+// Whether the hidden layers of arch build a network: known entries that fit their inputs
+bool net_arch_valid(const uint32_t *arch, int arch_len)
+{
+    if (arch_len <= 0 || arch_len > MAX_NET_ARCH_LEN)
+        return false;
+
+    int channels = 1, h = MNIST_IMG_SIZE, w = MNIST_IMG_SIZE;
+    for (int i = 0; i < arch_len; i++)
+    {
+        Layer layer;
+        if (!layer_describe(&layer, arch[i], channels, channels * h * w) || !layer_link(&layer, &channels, &h, &w))
+            return false;
     }
+    return true;
 }
 
-// Initialize the values of weights and biases using Xavier initialization
-void net_init_values(Net *net)
+bool net_arch_is_dense(const uint32_t *arch, int arch_len)
 {
-    // int arch[] = NET_ARCH;
-    int num_layers = sizeof(NET_ARCH) / sizeof(NET_ARCH[0]) + 1;
-    int img_size = MNIST_IMG_DATA_LEN;
+    for (int i = 0; i < arch_len; i++)
+    {
+        if (arch[i] & ARCH_SPATIAL)
+            return false;
+    }
+    return true;
+}
 
-    for (int i = 0; i < num_layers; i++)
+// Pruning, serving, the visualizer, sweeps, snapshots and the parallel trainers take dense networks only
+bool net_is_dense(const Net *net)
+{
+    for (int i = 0; i < net->num_layers; i++)
     {
-        int num_nodes = (i == num_layers - 1) ? MNIST_NUM_LABELS : NET_ARCH[i];
-        int num_inputs = (i == 0) ? img_size : NET_ARCH[i - 1];
+        if (net->layers[i].type != LAYER_DENSE)
+            return false;
+    }
+    return true;
+}
 
-        for (int j = 0; j < num_nodes; j++)
+// Arch entry that rebuilds a layer's shape
+uint32_t layer_arch(const Layer *layer)
+{
+    switch (layer->type)
+    {
+    case LAYER_CONV:
+        return ARCH_CONV(layer->num_rows, layer->conv.kernel, layer->conv.stride, layer->conv.padding);
+    case LAYER_MAX_POOL:
+    case LAYER_AVG_POOL:
+        return ARCH_POOL(layer->type, layer->conv.kernel);
+    default:
+        return (uint32_t)layer->num_nodes;
+    }
+}
+
+// Attach a zeroed early-exit head to every hidden layer: a softmax classifier over its outputs
+void net_add_exits(Net *net)
+{
+    net->num_exits = net->num_layers - 1;
+    net->exits = (Layer *)MEM_MALLOC((net->num_exits > 0 ? net->num_exits : 1) * sizeof(Layer));
+    for (int i = 0; i < net->num_exits; i++)
+    {
+        layer_init_mem(&net->exits[i], net->layers[i].num_nodes, MNIST_NUM_LABELS, SOFTMAX);
+    }
+}
+
+// Initialize zeroed network memory with the same shape as another network (e.g. for gradients)
+void net_init_mem_like(Net *net, Net *src, bool use_temp_allocator)
+{
+    uint32_t arch[src->num_layers];
+    for (int i = 0; i < src->num_layers - 1; i++)
+    {
+        arch[i] = layer_arch(&src->layers[i]);
+    }
+    net_init_mem_arch(net, arch, src->num_layers - 1, use_temp_allocator);
+    if (src->num_exits > 0)
+    {
+        net_add_exits(net);
+    }
+}
+
+// Copy the parameters of a layer with the same shape
+static void layer_copy_values(Layer *layer, const Layer *src)
+{
+    memcpy(layer->b, src->b, src->num_rows * sizeof(float));
+    for (int j = 0; j < src->num_rows; j++)
+    {
+        memcpy(layer->w[j], src->w[j], src->row_len * sizeof(float));
+    }
+    layer->activation = src->activation;
+    layer->dropout_rate = src->dropout_rate;
+    layer->backprop_kernel = src->backprop_kernel;
+    layer->conv_kernel = src->conv_kernel;
+}
+
+// Initialize net as a deep copy of src
+void net_copy(Net *net, Net *src)
+{
+    net_init_mem_like(net, src, false);
+    net->sparse_input_mode = src->sparse_input_mode;
+    net->sparse_input_threshold = src->sparse_input_threshold;
+    net->checkpoint_stride = src->checkpoint_stride;
+    for (int i = 0; i < src->num_layers; i++)
+    {
+        layer_copy_values(&net->layers[i], &src->layers[i]);
+    }
+    for (int i = 0; i < src->num_exits; i++)
+    {
+        layer_copy_values(&net->exits[i], &src->exits[i]);
+    }
+}
+
+static void layer_init_values(Layer *layer)
+{
+    // A filter's fan-out is its taps over every output channel
+    float fan_in = (float)layer->row_len;
+    float fan_out = layer->type == LAYER_CONV ? (float)(layer->num_rows * layer->conv.kernel * layer->conv.kernel)
+                                              : (float)layer->num_rows;
+    for (int j = 0; j < layer->num_rows; j++)
+    {
+        layer->b[j] = get_rand_bias();
+        for (int k = 0; k < layer->row_len; k++)
         {
-            net->layers[i].b[j] = get_rand_bias();
-            for (int k = 0; k < num_inputs; k++)
-            {
-                net->layers[i].w[j][k] = get_rand_weight((float)num_inputs, (float)num_nodes);
-            }
+            layer->w[j][k] = get_rand_weight(fan_in, fan_out);
         }
+    }
+}
 
+// Initialize the values of weights and biases using Xavier initialization
+void net_init_values(Net *net)
+{
+    for (int i = 0; i < net->num_layers; i++)
+    {
+        layer_init_values(&net->layers[i]);
         net->layers[i].dropout_rate = DROPOUT_RATE;
     }
+
+    // Exit heads keep their outputs intact, no dropout
+    for (int i = 0; i < net->num_exits; i++)
+    {
+        layer_init_values(&net->exits[i]);
+    }
+
+    net_weights_changed(net);
 }
 
-// Forward pass for a single layer
-static float *layer_forward(Layer *layer, float *input, int num_inputs, bool is_train)
+// Must be called after weights are modified so derived copies get rebuilt
+void net_weights_changed(Net *net)
 {
-    int num_outputs = sizeof(layer->b) / sizeof(layer->b[0]);
-    float *output = (float *)malloc(num_outputs * sizeof(float));
+    for (int i = 0; i < net->num_layers; i++)
+    {
+        net->layers[i].w_t_valid = false;
+    }
+    for (int i = 0; i < net->num_exits; i++)
+    {
+        net->exits[i].w_t_valid = false;
+    }
+}
 
-    for (int i = 0; i < num_outputs; i++)
+// Rebuild the column-major weight copy if it is stale. This writes the layer, so the forward and
+// backward passes may only rebuild it lazily while one thread uses the net.
+static void layer_refresh_transposed(Layer *layer)
+{
+    if (layer->w_t_valid || layer->type != LAYER_DENSE)
+        return;
+
+    if (!layer->w_t)
+    {
+        layer->w_t = (float *)MEM_MALLOC(layer->num_inputs * layer->num_nodes * sizeof(float));
+    }
+
+    for (int j = 0; j < layer->num_nodes; j++)
     {
-        output[i] = layer->b[i];
-        for (int j = 0; j < num_inputs; j++)
+        for (int k = 0; k < layer->num_inputs; k++)
         {
-            output[i] += layer->w[i][j] * input[j];
+            layer->w_t[k * layer->num_nodes + j] = layer->w[j][k];
         }
     }
+    layer->w_t_valid = true;
+}
 
-    // Apply activation
-    if (layer->activation == RELU)
+// Build every layer's column-major copy now, so threads that only read the net never race to build it
+void net_refresh_transposed(Net *net)
+{
+    for (int i = 0; i < net->num_layers; i++)
     {
-        relu(output, num_outputs);
+        layer_refresh_transposed(&net->layers[i]);
     }
-    else if (layer->activation == SOFTMAX)
+}
+
+// Whether no dense layer's column-major copy is stale, so threads can read the net concurrently
+bool net_transposed_ready(const Net *net)
+{
+    for (int i = 0; i < net->num_layers; i++)
     {
-        softmax(output, num_outputs);
+        if (net->layers[i].type == LAYER_DENSE && !net->layers[i].w_t_valid)
+            return false;
     }
+    return true;
+}
+
+// Error at the layer's inputs: prev_error[k] = sum_j error[j] * w[j][k]. The row kernel reads
+// each weight row once, contiguously, and skips the rows of nodes with zero error (inactive
+// ReLUs). It beats dot products over the transposed copy on every shape bench measures, since
+// those reductions stay scalar under strict floating point and pay for a transpose per update.
+void layer_backprop_error(Layer *layer, const float *error, float *prev_error, BackpropKernel kernel)
+{
+    int num_inputs = layer->num_inputs;
+    int num_nodes = layer->num_nodes;
 
-    // Dropout (during training)
-    if (is_train && layer->dropout_rate > 0)
+    switch (kernel)
     {
-        for (int i = 0; i < num_outputs; i++)
+    case BACKPROP_KERNEL_STRIDED:
+        for (int k = 0; k < num_inputs; k++)
         {
-            if ((float)rand() / RAND_MAX < layer->dropout_rate)
+            float sum = 0;
+            for (int j = 0; j < num_nodes; j++)
             {
-                output[i] = 0;
+                sum += error[j] * layer->w[j][k];
             }
-            else
+            prev_error[k] = sum;
+        }
+        break;
+
+    case BACKPROP_KERNEL_TRANSPOSED:
+        layer_refresh_transposed(layer);
+        for (int k = 0; k < num_inputs; k++)
+        {
+            const float *column = &layer->w_t[k * num_nodes];
+            float sum = 0;
+            for (int j = 0; j < num_nodes; j++)
             {
-                output[i] /= (1 - layer->dropout_rate);
+                sum += error[j] * column[j];
             }
+            prev_error[k] = sum;
         }
-    }
+        break;
 
-    return output;
+    default:
+        memset(prev_error, 0, num_inputs * sizeof(float));
+        for (int j = 0; j < num_nodes; j++)
+        {
+            float e = error[j];
+            if (e == 0)
+                continue;
+            const float *row = layer->w[j];
+            for (int k = 0; k < num_inputs; k++)
+            {
+                prev_error[k] += e * row[k];
+            }
+        }
+        break;
+    }
 }
 
-// Forward pass for the entire network
-float **net_forward(Net *net, MnistRecord *img, Net *contribs, bool is_train)
+// Collect the nonzero entries of values, returns their count
+int sparse_input_compress(const float *values, int len, SparseInput *out)
 {
-    int num_layers = sizeof(NET_ARCH) / sizeof(NET_ARCH[0]) + 1;
-    float **activations = (float **)malloc((num_layers + 1) * sizeof(float *));
+    int nnz = 0;
+    for (int i = 0; i < len; i++)
+    {
+        if (values[i] != 0)
+        {
+            out->idx[nnz] = (uint16_t)i;
+            out->val[nnz] = values[i];
+            nnz++;
+        }
+    }
+    out->len = nnz;
+    return nnz;
+}
 
-    // Input layer
-    activations[0] = img->pixels;
+// Decide whether a layer should take the sparse input path for this input
+static bool use_sparse_input(const Net *net, const SparseInput *sparse)
+{
+    if (net->sparse_input_mode == SPARSE_INPUT_ALWAYS)
+        return true;
+    return sparse->len <= net->layers[0].num_inputs * net->sparse_input_threshold;
+}
 
-    // Pass through each layer
-    for (int i = 0; i < num_layers; i++)
+// Apply a layer activation in place
+static void apply_activation(Activation activation, float *values, int len)
+{
+    if (activation == RELU)
     {
-        int num_inputs = (i == 0) ? MNIST_IMG_DATA_LEN : sizeof(net->layers[i - 1].b) / sizeof(float);
-        activations[i + 1] = layer_forward(&net->layers[i], activations[i], num_inputs, is_train);
+        relu(values, len);
     }
+    else if (activation == SOFTMAX)
+    {
+        softmax(values, len);
+    }
+}
 
-    return activations;
+// Uniform draw in [0, 1) for the training passes: from rng when the caller gives its own stream
+// (threads training at once), else from rand()
+static float train_uniform(AugmentRng *rng)
+{
+    return rng ? augment_rng_uniform(rng, 0, 1) : (float)rand() / RAND_MAX;
 }
 
-// Backpropagation and loss calculation
-float net_backward(Net *net, MnistRecord *img, Net *grad, Net *contribs, bool is_train)
+// Dropout (during training). keep, when set, records one bit per node for whether it was kept;
+// with replay the recorded bits are applied instead of drawing new ones.
+static void apply_dropout(Layer *layer, float *output, uint8_t *keep, bool replay, AugmentRng *rng)
 {
-    float **activations = net_forward(net, img, contribs, is_train);
+    if (layer->dropout_rate <= 0)
+        return;
 
-    int num_outputs = MNIST_NUM_LABELS;
-    float *output_error = (float *)malloc(num_outputs * sizeof(float));
-    for (int i = 0; i < num_outputs; i++)
+    for (int i = 0; i < layer->num_nodes; i++)
     {
-        output_error[i] = activations[num_outputs][i];
-        if (i == img->label)
+        bool dropped = replay ? !(keep[i >> 3] & (1 << (i & 7))) : train_uniform(rng) < layer->dropout_rate;
+        if (keep && !replay && !dropped)
         {
-            output_error[i] -= 1;
+            keep[i >> 3] |= (uint8_t)(1 << (i & 7));
         }
-    }
-
-    float loss = -logf(activations[num_outputs][img->label]);
-
-    // Backpropagate error through layers
-    for (int i = num_outputs - 1; i >= 0; i--)
-    {
-        Layer *layer = &net->layers[i];
-        Layer *grad_layer = &grad->layers[i];
-        float *prev_act = activations[i];
-
-        for (int j = 0; j < num_outputs; j++)
+        if (dropped)
         {
-            grad_layer->b[j] += output_error[j];
-            for (int k = 0; k < MNIST_IMG_DATA_LEN; k++)
-            {
-                grad_layer->w[j][k] += output_error[j] * prev_act[k];
-            }
+            output[i] = 0;
+        }
+        else
+        {
+            output[i] /= (1 - layer->dropout_rate);
         }
+    }
+}
 
-        if (i == 0)
-            continue;
+// Forward pass for a single layer, recording or replaying its dropout as in apply_dropout
+static float *layer_forward_dropout(Layer *layer, float *input, const SparseInput *sparse, bool is_train,
+                                    uint8_t *keep, bool replay, AugmentRng *rng)
+{
+    int num_inputs = layer->num_inputs;
+    int num_outputs = layer->num_nodes;
+    float *output = (float *)MEM_MALLOC(num_outputs * sizeof(float));
 
-        // Compute the error for the previous layer
-        float *prev_error = (float *)malloc(sizeof(prev_act) * sizeof(float));
-        for (int j = 0; j < sizeof(prev_act) / sizeof(float); j++)
+    if (layer->type == LAYER_CONV)
+    {
+        conv_forward(layer, input, output);
+    }
+    else if (layer->type != LAYER_DENSE)
+    {
+        pool_forward(layer, input, output);
+    }
+    else if (sparse)
+    {
+        // Accumulate only the weight columns of nonzero inputs
+        layer_refresh_transposed(layer);
+        memcpy(output, layer->b, num_outputs * sizeof(float));
+        for (int n = 0; n < sparse->len; n++)
         {
-            for (int k = 0; k < sizeof(output_error) / sizeof(float); k++)
+            const float *column = &layer->w_t[sparse->idx[n] * num_outputs];
+            float value = sparse->val[n];
+            for (int i = 0; i < num_outputs; i++)
             {
-                prev_error[j] += output_error[k] * layer->w[k][j];
+                output[i] += value * column[i];
             }
         }
-
-        if (net->layers[i - 1].activation == RELU)
+    }
+    else
+    {
+        for (int i = 0; i < num_outputs; i++)
         {
-            relu_derivative(prev_act, sizeof(prev_act) / sizeof(float));
-            for (int j = 0; j < sizeof(prev_error) / sizeof(float); j++)
+            output[i] = layer->b[i];
+            for (int j = 0; j < num_inputs; j++)
             {
-                prev_error[j] *= prev_act[j];
+                output[i] += layer->w[i][j] * input[j];
             }
         }
+    }
 
-        free(output_error);
-        output_error = prev_error;
+    apply_activation(layer->activation, output, num_outputs);
+    if (is_train)
+    {
+        apply_dropout(layer, output, keep, replay, rng);
     }
+    return output;
+}
 
-    return loss;
+// Forward pass for a single layer
+static float *layer_forward(Layer *layer, float *input, const SparseInput *sparse, bool is_train)
+{
+    return layer_forward_dropout(layer, input, sparse, is_train, NULL, false, NULL);
 }
 
-// Free network resources
-void net_free(Net *net)
+// What a checkpointed backward pass needs to recompute the activations it dropped
+typedef struct
+{
+    int stride;     // activations[i] is kept through the forward pass when i % stride == 0
+    uint8_t **keep; // Per layer dropout bits, NULL for layers without dropout
+} Checkpoints;
+
+// Checkpoints for the net's checkpoint_stride, NULL when every activation is kept
+static Checkpoints *checkpoints_create(const Net *net, bool is_train)
+{
+    if (net->checkpoint_stride <= 1)
+        return NULL;
+
+    Checkpoints *ckpt = (Checkpoints *)MEM_MALLOC(sizeof(Checkpoints));
+    ckpt->stride = net->checkpoint_stride;
+    ckpt->keep = (uint8_t **)MEM_MALLOC(net->num_layers * sizeof(uint8_t *));
+    for (int i = 0; i < net->num_layers; i++)
+    {
+        const Layer *layer = &net->layers[i];
+        bool has_dropout = is_train && layer->dropout_rate > 0;
+        ckpt->keep[i] = has_dropout ? (uint8_t *)MEM_CALLOC((layer->num_nodes + 7) / 8, 1) : NULL;
+    }
+    return ckpt;
+}
+
+static void checkpoints_free(const Net *net, Checkpoints *ckpt)
 {
-    if (!net)
+    if (!ckpt)
         return;
+    for (int i = 0; i < net->num_layers; i++)
+    {
+        MEM_FREE(ckpt->keep[i]);
+    }
+    MEM_FREE(ckpt->keep);
+    MEM_FREE(ckpt);
+}
 
-    for (int i = 0; i < sizeof(net->layers) / sizeof(Layer); i++)
+// Recompute activations[c + 1 .. i] from the nearest kept activation c below i, replaying the
+// dropout of the first pass so they come out bitwise the same
+static void recompute_activations(Net *net, float **activations, const SparseInput *sparse, bool is_sparse,
+                                  const Checkpoints *ckpt, int i)
+{
+    int c = i;
+    while (!activations[c])
     {
-        Layer *layer = &net->layers[i];
-        for (int j = 0; j < sizeof(layer->w) / sizeof(float *); j++)
+        c--;
+    }
+    for (int k = c; k < i; k++)
+    {
+        const SparseInput *layer_sparse = (k == 0 && is_sparse) ? sparse : NULL;
+        activations[k + 1] = layer_forward_dropout(&net->layers[k], activations[k], layer_sparse, ckpt->keep[k] != NULL,
+                                                   ckpt->keep[k], true, NULL);
+    }
+}
+
+// Activation floats one training example holds at the peak of its backward pass: all of them, or
+// with checkpoint_stride > 1 the output and checkpoints plus the worst of the forward pass and
+// of the stretches recomputed between two checkpoints
+int net_activation_floats(const Net *net)
+{
+    int num_layers = net->num_layers;
+    int stride = net->checkpoint_stride;
+    int total = 0;
+    for (int i = 0; i < num_layers; i++)
+    {
+        total += net->layers[i].num_nodes;
+    }
+    if (stride <= 1)
+        return total;
+
+    // Forward: the checkpoints so far, the layer's input unless it is one, and its output.
+    // activations[i] is the output of layers[i - 1]; activations[0] is the caller's image.
+    int peak = 0;
+    int kept = 0;
+    for (int i = 0; i < num_layers; i++)
+    {
+        int live = kept + net->layers[i].num_nodes + (i % stride != 0 ? net->layers[i - 1].num_nodes : 0);
+        peak = live > peak ? live : peak;
+        if ((i + 1) % stride == 0)
         {
-            free(layer->w[j]);
+            kept += net->layers[i].num_nodes;
         }
-        free(layer->w);
-        free(layer->b);
     }
-    free(net->layers);
+
+    // Backward: the output, the checkpoints up to c and the recomputed activations above c
+    for (int c = (num_layers - 1) / stride * stride; c >= 0; c -= stride)
+    {
+        int live = net->layers[num_layers - 1].num_nodes;
+        for (int j = stride; j <= c; j += stride)
+        {
+            live += net->layers[j - 1].num_nodes;
+        }
+        for (int j = c + 1; j < c + stride && j < num_layers; j++)
+        {
+            live += net->layers[j - 1].num_nodes;
+        }
+        peak = live > peak ? live : peak;
+    }
+    return peak;
 }
 
-// Save the network to a file
-bool net_save(Net *net)
+// Forward pass for the entire network, sparse receives the compressed input if the sparse path was taken.
+// With ckpt set only the checkpointed activations and the output are kept, the others are NULL.
+// Dropout draws from rng, or from rand() when it is NULL.
+static float **net_forward_impl(Net *net, MnistRecord *img, SparseInput *sparse, bool *is_sparse, bool is_train,
+                                Checkpoints *ckpt, AugmentRng *rng)
 {
-    FILE *file = fopen(NETWORK_SAVE_FILE_PATH, "wb");
-    if (!file)
+    int num_layers = net->num_layers;
+    float **activations = (float **)MEM_MALLOC((num_layers + 1) * sizeof(float *));
+
+    // Input layer
+    activations[0] = img->pixels;
+
+    // Most MNIST pixels are blank, so the wide first layer can skip them
+    *is_sparse = false;
+    if (net->sparse_input_mode != SPARSE_INPUT_NEVER && net->layers[0].type == LAYER_DENSE)
     {
-        return false;
+        sparse_input_compress(img->pixels, MNIST_IMG_DATA_LEN, sparse);
+        *is_sparse = use_sparse_input(net, sparse);
     }
 
-    fwrite(net, sizeof(Net), 1, file);
-    fclose(file);
+    // Pass through each layer
+    for (int i = 0; i < num_layers; i++)
+    {
+        const SparseInput *layer_sparse = (i == 0 && *is_sparse) ? sparse : NULL;
+        if (!ckpt)
+        {
+            activations[i + 1] =
+                layer_forward_dropout(&net->layers[i], activations[i], layer_sparse, is_train, NULL, false, rng);
+            continue;
+        }
+        activations[i + 1] = layer_forward_dropout(&net->layers[i], activations[i], layer_sparse, is_train,
+                                                   ckpt->keep[i], false, rng);
+        if (i > 0 && i % ckpt->stride != 0)
+        {
+            MEM_FREE(activations[i]);
+            activations[i] = NULL;
+        }
+    }
 
-    return true;
+    return activations;
 }
 
-// Load the network from a file
-bool net_load(Net *net)
+// Forward pass for the entire network
+float **net_forward(Net *net, MnistRecord *img, Net *contribs, bool is_train)
 {
-    FILE *file = fopen(NETWORK_LOAD_FILE_PATH, "rb");
-    if (!file)
+    SparseInput sparse;
+    bool is_sparse;
+    return net_forward_impl(net, img, &sparse, &is_sparse, is_train, NULL, NULL);
+}
+
+// Start incremental inference for an image, computing the first layer pre-activations in full
+void net_incremental_init(Net *net, IncrementalInput *inc, const float *pixels)
+{
+    Layer *layer = &net->layers[0];
+    if (!inc->pre_act)
     {
-        return false;
+        inc->pre_act = (float *)MEM_MALLOC(layer->num_nodes * sizeof(float));
     }
+    memcpy(inc->pixels, pixels, sizeof(inc->pixels));
 
-    fread(net, sizeof(Net), 1, file);
+    SparseInput sparse;
+    sparse_input_compress(inc->pixels, MNIST_IMG_DATA_LEN, &sparse);
+    layer_refresh_transposed(layer);
+    memcpy(inc->pre_act, layer->b, layer->num_nodes * sizeof(float));
+    for (int n = 0; n < sparse.len; n++)
+    {
+        const float *column = &layer->w_t[sparse.idx[n] * layer->num_nodes];
+        for (int j = 0; j < layer->num_nodes; j++)
+        {
+            inc->pre_act[j] += sparse.val[n] * column[j];
+        }
+    }
+    inc->num_updates = 0;
+}
+
+// Change some pixels, only their weight columns are applied to the first layer pre-activations
+void net_incremental_set_pixels(Net *net, IncrementalInput *inc, const int *idx, const float *values, int len)
+{
+    // Rounding errors accumulate with every delta, so periodically start over
+    inc->num_updates += len;
+    if (inc->num_updates > INCREMENTAL_REFRESH_INTERVAL)
+    {
+        for (int n = 0; n < len; n++)
+        {
+            inc->pixels[idx[n]] = values[n];
+        }
+        float pixels[MNIST_IMG_DATA_LEN];
+        memcpy(pixels, inc->pixels, sizeof(pixels));
+        net_incremental_init(net, inc, pixels);
+        return;
+    }
+
+    Layer *layer = &net->layers[0];
+    layer_refresh_transposed(layer);
+    for (int n = 0; n < len; n++)
+    {
+        float delta = values[n] - inc->pixels[idx[n]];
+        inc->pixels[idx[n]] = values[n];
+        if (delta == 0)
+            continue;
+
+        const float *column = &layer->w_t[idx[n] * layer->num_nodes];
+        for (int j = 0; j < layer->num_nodes; j++)
+        {
+            inc->pre_act[j] += delta * column[j];
+        }
+    }
+}
+
+// Forward pass from first layer pre-activations computed elsewhere (incrementally, or stacked
+// with other networks), same result layout as net_forward
+float **net_forward_pre_activations(Net *net, float *pixels, const float *pre_act, bool is_train)
+{
+    int num_layers = net->num_layers;
+    float **activations = (float **)MEM_MALLOC((num_layers + 1) * sizeof(float *));
+    activations[0] = pixels;
+
+    Layer *first = &net->layers[0];
+    activations[1] = (float *)MEM_MALLOC(first->num_nodes * sizeof(float));
+    memcpy(activations[1], pre_act, first->num_nodes * sizeof(float));
+    apply_activation(first->activation, activations[1], first->num_nodes);
+    if (is_train)
+    {
+        apply_dropout(first, activations[1], NULL, false, NULL);
+    }
+
+    for (int i = 1; i < num_layers; i++)
+    {
+        activations[i + 1] = layer_forward(&net->layers[i], activations[i], NULL, is_train);
+    }
+
+    return activations;
+}
+
+// Forward pass reusing the first layer pre-activations, same result layout as net_forward
+float **net_incremental_forward(Net *net, IncrementalInput *inc)
+{
+    return net_forward_pre_activations(net, inc->pixels, inc->pre_act, false);
+}
+
+void net_incremental_free(IncrementalInput *inc)
+{
+    MEM_FREE(inc->pre_act);
+    inc->pre_act = NULL;
+}
+
+// Pre-softmax outputs of a layer for the given input
+static void layer_logits(Layer *layer, const float *input, float *logits)
+{
+    for (int j = 0; j < layer->num_nodes; j++)
+    {
+        logits[j] = layer->b[j];
+        for (int k = 0; k < layer->num_inputs; k++)
+        {
+            logits[j] += layer->w[j][k] * input[k];
+        }
+    }
+}
+
+// Free the buffers returned by net_forward
+void net_free_activations(Net *net, float **activations)
+{
+    for (int i = 1; i <= net->num_layers; i++)
+    {
+        MEM_FREE(activations[i]);
+    }
+    MEM_FREE(activations);
+}
+
+// Output layer logits (before softmax) for an image
+void net_forward_logits(Net *net, MnistRecord *img, float *logits)
+{
+    float **activations = net_forward(net, img, NULL, false);
+    layer_logits(&net->layers[net->num_layers - 1], activations[net->num_layers - 1], logits);
+    net_free_activations(net, activations);
+}
+
+// Index of the largest value
+static int argmax(const float *values, int len)
+{
+    int max_idx = 0;
+    for (int i = 1; i < len; i++)
+    {
+        if (values[i] > values[max_idx])
+        {
+            max_idx = i;
+        }
+    }
+    return max_idx;
+}
+
+// Classify an image layer by layer, returning the prediction of the first exit head whose top
+// probability reaches threshold, or of the output layer. layers_run receives how many layers of
+// the network were computed; a threshold above 1 always runs them all.
+int net_predict_early_exit(Net *net, MnistRecord *img, float threshold, int *layers_run)
+{
+    SparseInput sparse;
+    bool is_sparse = false;
+    if (net->sparse_input_mode != SPARSE_INPUT_NEVER && net->layers[0].type == LAYER_DENSE)
+    {
+        sparse_input_compress(img->pixels, MNIST_IMG_DATA_LEN, &sparse);
+        is_sparse = use_sparse_input(net, &sparse);
+    }
+
+    float *input = img->pixels;
+    for (int i = 0; i < net->num_layers; i++)
+    {
+        float *output = layer_forward(&net->layers[i], input, (i == 0 && is_sparse) ? &sparse : NULL, false);
+        if (i > 0)
+        {
+            MEM_FREE(input);
+        }
+        input = output;
+
+        if (i < net->num_exits)
+        {
+            float *probs = layer_forward(&net->exits[i], output, NULL, false);
+            int prediction = argmax(probs, MNIST_NUM_LABELS);
+            bool confident = probs[prediction] >= threshold;
+            MEM_FREE(probs);
+            if (confident)
+            {
+                MEM_FREE(output);
+                *layers_run = i + 1;
+                return prediction;
+            }
+        }
+    }
+
+    int prediction = argmax(input, MNIST_NUM_LABELS);
+    MEM_FREE(input);
+    *layers_run = net->num_layers;
+    return prediction;
+}
+
+// Cross entropy gradient of one exit head, scaled by weight, accumulated into grad_head. Returns
+// the error the head sends back into the hidden layer output it reads (caller frees).
+static float *exit_backward(Layer *head, Layer *grad_head, const float *input, uint8_t label, float weight)
+{
+    float probs[MNIST_NUM_LABELS];
+    layer_logits(head, input, probs);
+    softmax(probs, MNIST_NUM_LABELS);
+
+    float error[MNIST_NUM_LABELS];
+    for (int j = 0; j < MNIST_NUM_LABELS; j++)
+    {
+        error[j] = (probs[j] - (j == label ? 1.0f : 0.0f)) * weight;
+        grad_head->b[j] += error[j];
+        for (int k = 0; k < head->num_inputs; k++)
+        {
+            grad_head->w[j][k] += error[j] * input[k];
+        }
+    }
+
+    float *input_error = (float *)MEM_MALLOC(head->num_inputs * sizeof(float));
+    layer_backprop_error(head, error, input_error, head->backprop_kernel);
+    return input_error;
+}
+
+// Propagate the output error back through all layers, accumulating into grad; takes ownership of output_error.
+// With first_error set the first layer's gradients are skipped and its error is copied there instead.
+// on_grad_ready, when set, is called as soon as each layer's gradients are accumulated.
+// exit_errors, when set, holds the error each exit head sends back into the output of layer i.
+// ckpt, when set, recomputes the activations the forward pass dropped and frees each one once used.
+static void backprop_error(Net *net, float **activations, const SparseInput *sparse, bool is_sparse, float *output_error, Net *grad,
+                           float *first_error, float **exit_errors, const Checkpoints *ckpt, GradReadyFn on_grad_ready,
+                           void *ctx)
+{
+    // Backpropagate error through layers
+    for (int i = net->num_layers - 1; i >= 0; i--)
+    {
+        Layer *layer = &net->layers[i];
+        Layer *grad_layer = &grad->layers[i];
+        if (!activations[i])
+        {
+            recompute_activations(net, activations, sparse, is_sparse, ckpt, i);
+        }
+        float *prev_act = activations[i];
+
+        if (i == 0 && first_error)
+        {
+            memcpy(first_error, output_error, layer->num_nodes * sizeof(float));
+            break;
+        }
+
+        if (layer->type == LAYER_CONV)
+        {
+            conv_backward_weights(layer, prev_act, output_error, grad_layer);
+        }
+        for (int j = 0; layer->type == LAYER_DENSE && j < layer->num_nodes; j++)
+        {
+            grad_layer->b[j] += output_error[j];
+            if (i == 0 && is_sparse)
+            {
+                // Zero inputs contribute nothing to the weight gradient
+                for (int n = 0; n < sparse->len; n++)
+                {
+                    grad_layer->w[j][sparse->idx[n]] += output_error[j] * sparse->val[n];
+                }
+                continue;
+            }
+            for (int k = 0; k < layer->num_inputs; k++)
+            {
+                grad_layer->w[j][k] += output_error[j] * prev_act[k];
+            }
+        }
+        if (on_grad_ready)
+        {
+            on_grad_ready(i, ctx);
+        }
+
+        if (i == 0)
+            continue;
+
+        // Compute the error for the previous layer
+        float *prev_error = (float *)MEM_MALLOC(layer->num_inputs * sizeof(float));
+        if (layer->type == LAYER_CONV)
+        {
+            conv_backward_input(layer, output_error, prev_error);
+        }
+        else if (layer->type != LAYER_DENSE)
+        {
+            pool_backward(layer, prev_act, output_error, prev_error);
+        }
+        else
+        {
+            layer_backprop_error(layer, output_error, prev_error, layer->backprop_kernel);
+        }
+        if (exit_errors)
+        {
+            for (int k = 0; k < layer->num_inputs; k++)
+            {
+                prev_error[k] += exit_errors[i - 1][k];
+            }
+        }
+
+        if (net->layers[i - 1].activation == RELU)
+        {
+            relu_derivative(prev_error, prev_act, layer->num_inputs);
+        }
+        if (ckpt)
+        {
+            MEM_FREE(activations[i]);
+            activations[i] = NULL;
+        }
+
+        MEM_FREE(output_error);
+        output_error = prev_error;
+    }
+
+    MEM_FREE(output_error);
+}
+
+// Backward pass with the output error scaled by weight. An example whose loss is below min_loss
+// only continues past the forward pass with probability loss / min_loss, at least
+// SKIP_MIN_KEEP, and is then weighted up by the inverse, so skipping keeps the expected gradient
+// (min_loss 0 never skips). The floor bounds that weight: dropout on the output leaves an error
+// of about its rate even on examples with no loss.
+static float net_backward_impl(Net *net, MnistRecord *img, Net *grad, bool is_train, float weight, float min_loss,
+                               bool *backward_ran, GradReadyFn on_grad_ready, void *ctx, AugmentRng *rng)
+{
+    // Exit heads read every hidden activation, so they keep them all
+    bool with_exits = net->num_exits > 0 && grad->num_exits == net->num_exits;
+    Checkpoints *ckpt = with_exits ? NULL : checkpoints_create(net, is_train);
+    SparseInput sparse;
+    bool is_sparse;
+    float **activations = net_forward_impl(net, img, &sparse, &is_sparse, is_train, ckpt, rng);
+    int num_layers = net->num_layers;
+    float loss = -logf(fmaxf(activations[num_layers][img->label], 1e-30f));
+    if (min_loss > 0 && loss < min_loss)
+    {
+        float keep = fmaxf(loss / min_loss, SKIP_MIN_KEEP);
+        if (train_uniform(rng) >= keep)
+        {
+            net_free_activations(net, activations);
+            checkpoints_free(net, ckpt);
+            if (backward_ran)
+            {
+                *backward_ran = false;
+            }
+            return loss;
+        }
+        weight /= keep;
+    }
+    if (backward_ran)
+    {
+        *backward_ran = true;
+    }
+
+    int num_outputs = net->layers[num_layers - 1].num_nodes;
+    float *output_error = (float *)MEM_MALLOC(num_outputs * sizeof(float));
+    for (int i = 0; i < num_outputs; i++)
+    {
+        output_error[i] = activations[num_layers][i];
+        if (i == img->label)
+        {
+            output_error[i] -= 1;
+        }
+        output_error[i] *= weight;
+    }
+
+    // Exit heads are trained jointly, their loss weighted by EXIT_LOSS_WEIGHT
+    float *exit_errors[num_layers];
+    for (int i = 0; with_exits && i < net->num_exits; i++)
+    {
+        exit_errors[i] = exit_backward(&net->exits[i], &grad->exits[i], activations[i + 1], img->label,
+                                       weight * EXIT_LOSS_WEIGHT);
+    }
+
+    backprop_error(net, activations, &sparse, is_sparse, output_error, grad, NULL, with_exits ? exit_errors : NULL, ckpt,
+                   on_grad_ready, ctx);
+    net_free_activations(net, activations);
+    checkpoints_free(net, ckpt);
+    for (int i = 0; with_exits && i < net->num_exits; i++)
+    {
+        MEM_FREE(exit_errors[i]);
+    }
+
+    return loss;
+}
+
+// Backpropagation and loss calculation, gradients are accumulated into grad
+float net_backward(Net *net, MnistRecord *img, Net *grad, Net *contribs, bool is_train)
+{
+    return net_backward_impl(net, img, grad, is_train, 1, 0, NULL, NULL, NULL, NULL);
+}
+
+// net_backward drawing dropout from the caller's rng instead of rand(), for threads training at once
+float net_backward_rng(Net *net, MnistRecord *img, Net *grad, bool is_train, AugmentRng *rng)
+{
+    return net_backward_impl(net, img, grad, is_train, 1, 0, NULL, NULL, NULL, rng);
+}
+
+// net_backward that reports each layer as soon as its gradients are final, output layer first, so
+// the caller can start reducing them while the earlier layers are still backpropagating
+float net_backward_notify(Net *net, MnistRecord *img, Net *grad, bool is_train, GradReadyFn on_grad_ready, void *ctx)
+{
+    return net_backward_impl(net, img, grad, is_train, 1, 0, NULL, on_grad_ready, ctx, NULL);
+}
+
+// net_backward with the gradients scaled by weight (importance sampling), randomly skipping the
+// backward pass of examples whose loss is below min_loss. Returns the unweighted loss either way.
+float net_backward_weighted(Net *net, MnistRecord *img, Net *grad, float weight, float min_loss, bool is_train,
+                            bool *backward_ran)
+{
+    return net_backward_impl(net, img, grad, is_train, weight, min_loss, backward_ran, NULL, NULL, NULL);
+}
+
+// Backpropagation from activations computed earlier (e.g. by net_incremental_forward)
+float net_backward_activations(Net *net, float **activations, uint8_t label, Net *grad)
+{
+    int num_layers = net->num_layers;
+    int num_outputs = net->layers[num_layers - 1].num_nodes;
+    float *output_error = (float *)MEM_MALLOC(num_outputs * sizeof(float));
+    for (int i = 0; i < num_outputs; i++)
+    {
+        output_error[i] = activations[num_layers][i] - (i == label ? 1.0f : 0.0f);
+    }
+
+    SparseInput sparse;
+    sparse_input_compress(activations[0], net->layers[0].num_inputs, &sparse);
+    backprop_error(net, activations, &sparse, true, output_error, grad, NULL, NULL, NULL, NULL, NULL);
+
+    return -logf(fmaxf(activations[num_layers][label], 1e-30f));
+}
+
+// Like net_backward_activations, but the first layer's gradients are left to the caller: the error
+// at its pre-activations is written to first_error instead
+float net_backward_hidden(Net *net, float **activations, uint8_t label, Net *grad, float *first_error)
+{
+    int num_layers = net->num_layers;
+    int num_outputs = net->layers[num_layers - 1].num_nodes;
+    float *output_error = (float *)MEM_MALLOC(num_outputs * sizeof(float));
+    for (int i = 0; i < num_outputs; i++)
+    {
+        output_error[i] = activations[num_layers][i] - (i == label ? 1.0f : 0.0f);
+    }
+
+    backprop_error(net, activations, NULL, false, output_error, grad, first_error, NULL, NULL, NULL, NULL);
+
+    return -logf(fmaxf(activations[num_layers][label], 1e-30f));
+}
+
+// Temperature-scaled softmax of logits
+static void softmax_temperature(const float *logits, float temperature, float *out, int len)
+{
+    for (int i = 0; i < len; i++)
+    {
+        out[i] = logits[i] / temperature;
+    }
+    softmax(out, len);
+}
+
+// Distillation backpropagation: alpha * T^2 * KL(teacher_T || student_T) + (1 - alpha) * cross entropy
+float net_backward_distill(Net *net, MnistRecord *img, const float *teacher_logits, float temperature, float alpha, Net *grad, bool is_train)
+{
+    Checkpoints *ckpt = checkpoints_create(net, is_train);
+    SparseInput sparse;
+    bool is_sparse;
+    float **activations = net_forward_impl(net, img, &sparse, &is_sparse, is_train, ckpt, NULL);
+    int num_layers = net->num_layers;
+    Layer *out_layer = &net->layers[num_layers - 1];
+    int num_outputs = out_layer->num_nodes;
+
+    float logits[num_outputs];
+    float student_soft[num_outputs];
+    float teacher_soft[num_outputs];
+    if (!activations[num_layers - 1])
+    {
+        recompute_activations(net, activations, &sparse, is_sparse, ckpt, num_layers - 1);
+    }
+    layer_logits(out_layer, activations[num_layers - 1], logits);
+    softmax_temperature(logits, temperature, student_soft, num_outputs);
+    softmax_temperature(teacher_logits, temperature, teacher_soft, num_outputs);
+
+    // d/dz of T^2 * KL(teacher_T || student_T) is T * (student_T - teacher_T)
+    float *output_error = (float *)MEM_MALLOC(num_outputs * sizeof(float));
+    float kl = 0;
+    for (int i = 0; i < num_outputs; i++)
+    {
+        float hard_error = activations[num_layers][i] - (i == img->label ? 1.0f : 0.0f);
+        float soft_error = temperature * (student_soft[i] - teacher_soft[i]);
+        output_error[i] = alpha * soft_error + (1 - alpha) * hard_error;
+
+        if (teacher_soft[i] > 0)
+        {
+            kl += teacher_soft[i] * (logf(teacher_soft[i]) - logf(fmaxf(student_soft[i], 1e-30f)));
+        }
+    }
+
+    float hard_loss = -logf(fmaxf(activations[num_layers][img->label], 1e-30f));
+    float loss = alpha * temperature * temperature * kl + (1 - alpha) * hard_loss;
+
+    backprop_error(net, activations, &sparse, is_sparse, output_error, grad, NULL, NULL, ckpt, NULL, NULL);
+    net_free_activations(net, activations);
+    checkpoints_free(net, ckpt);
+
+    return loss;
+}
+
+static void layer_free(Layer *layer)
+{
+    for (int j = 0; j < layer->num_rows; j++)
+    {
+        MEM_FREE(layer->w[j]);
+    }
+    MEM_FREE(layer->w);
+    MEM_FREE(layer->b);
+    MEM_FREE(layer->w_t);
+}
+
+// Free network resources
+void net_free(Net *net)
+{
+    if (!net || (!net->layers && !net->exits))
+        return;
+
+    for (int i = 0; i < net->num_layers; i++)
+    {
+        layer_free(&net->layers[i]);
+    }
+    for (int i = 0; i < net->num_exits; i++)
+    {
+        layer_free(&net->exits[i]);
+    }
+    MEM_FREE(net->layers);
+    MEM_FREE(net->exits);
+    net->layers = NULL;
+    net->num_layers = 0;
+    net->exits = NULL;
+    net->num_exits = 0;
+}
+
+static const char *LAYER_TYPE_NAMES[] = {"Dense", "Conv", "MaxPool", "AvgPool"};
+
+// Write one layer object, dense layers without a type so older readers still load them
+static void json_write_layer(FILE *file, const Layer *layer)
+{
+    fprintf(file, "{");
+    if (layer->type != LAYER_DENSE)
+    {
+        fprintf(file, "\"type\":\"%s\",\"kernel\":%d,\"stride\":%d,\"padding\":%d,", LAYER_TYPE_NAMES[layer->type],
+                layer->conv.kernel, layer->conv.stride, layer->conv.padding);
+    }
+    fprintf(file, "\"w\":[");
+    for (int j = 0; j < layer->num_rows; j++)
+    {
+        fprintf(file, "%s[", j > 0 ? "," : "");
+        for (int k = 0; k < layer->row_len; k++)
+        {
+            fprintf(file, "%s%.9g", k > 0 ? "," : "", layer->w[j][k]);
+        }
+        fprintf(file, "]");
+    }
+    fprintf(file, "],\"b\":[");
+    for (int j = 0; j < layer->num_rows; j++)
+    {
+        fprintf(file, "%s%.9g", j > 0 ? "," : "", layer->b[j]);
+    }
+    fprintf(file, "],\"activation\":\"%s\",\"dropout_rate\":%.9g}",
+            layer->activation == SOFTMAX ? "Softmax" : "Relu", layer->dropout_rate);
+}
+
+// Save the network to a JSON file, exit heads go in an "exits" array after the layers
+bool net_save(Net *net, const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (!file)
+    {
+        return false;
+    }
+
+    fprintf(file, "{\"layers\":[");
+    for (int i = 0; i < net->num_layers; i++)
+    {
+        fprintf(file, "%s", i > 0 ? "," : "");
+        json_write_layer(file, &net->layers[i]);
+    }
+    fprintf(file, "]");
+    if (net->num_exits > 0)
+    {
+        fprintf(file, ",\"exits\":[");
+        for (int i = 0; i < net->num_exits; i++)
+        {
+            fprintf(file, "%s", i > 0 ? "," : "");
+            json_write_layer(file, &net->exits[i]);
+        }
+        fprintf(file, "]");
+    }
+    fprintf(file, "}\n");
+
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+// Minimal JSON reader for the network file format written by net_save
+typedef struct
+{
+    const char *cur;
+    const char *end;
+    bool failed;
+} JsonReader;
+
+// Growable float list used while the layer dimensions are still unknown
+typedef struct
+{
+    float *data;
+    int len;
+    int cap;
+} FloatList;
+
+static void float_list_push(FloatList *list, float value)
+{
+    if (list->len == list->cap)
+    {
+        list->cap = list->cap ? list->cap * 2 : 64;
+        list->data = (float *)MEM_REALLOC(list->data, list->cap * sizeof(float));
+    }
+    list->data[list->len++] = value;
+}
+
+static void json_skip_ws(JsonReader *r)
+{
+    while (r->cur < r->end && (*r->cur == ' ' || *r->cur == '\n' || *r->cur == '\r' || *r->cur == '\t'))
+    {
+        r->cur++;
+    }
+}
+
+static char json_peek(JsonReader *r)
+{
+    json_skip_ws(r);
+    return r->cur < r->end ? *r->cur : '\0';
+}
+
+static bool json_expect(JsonReader *r, char c)
+{
+    if (json_peek(r) != c)
+    {
+        r->failed = true;
+        return false;
+    }
+    r->cur++;
+    return true;
+}
+
+// Reads a string into buf (truncated to buf_len - 1), escapes are kept verbatim
+static void json_read_string(JsonReader *r, char *buf, int buf_len)
+{
+    int len = 0;
+    if (!json_expect(r, '"'))
+        return;
+
+    while (r->cur < r->end && *r->cur != '"')
+    {
+        if (*r->cur == '\\' && r->cur + 1 < r->end)
+        {
+            r->cur++;
+        }
+        if (len < buf_len - 1)
+        {
+            buf[len++] = *r->cur;
+        }
+        r->cur++;
+    }
+    buf[len] = '\0';
+    json_expect(r, '"');
+}
+
+static float json_read_number(JsonReader *r)
+{
+    json_skip_ws(r);
+    char *num_end;
+    float value = strtof(r->cur, &num_end);
+    if (num_end == r->cur)
+    {
+        r->failed = true;
+    }
+    r->cur = num_end;
+    return value;
+}
+
+// Reads a flat array of numbers, returns the number of elements read
+static int json_read_float_array(JsonReader *r, FloatList *out)
+{
+    int count = 0;
+    if (!json_expect(r, '['))
+        return 0;
+
+    if (json_peek(r) == ']')
+    {
+        r->cur++;
+        return 0;
+    }
+
+    while (!r->failed)
+    {
+        float_list_push(out, json_read_number(r));
+        count++;
+        if (json_peek(r) != ',')
+            break;
+        r->cur++;
+    }
+
+    json_expect(r, ']');
+    return count;
+}
+
+// Skips over any JSON value (used for unknown keys)
+static void json_skip_value(JsonReader *r)
+{
+    char c = json_peek(r);
+    if (c == '"')
+    {
+        char tmp[1];
+        json_read_string(r, tmp, sizeof(tmp));
+    }
+    else if (c == '[' || c == '{')
+    {
+        int depth = 0;
+        bool in_string = false;
+        for (; r->cur < r->end; r->cur++)
+        {
+            char ch = *r->cur;
+            if (in_string)
+            {
+                if (ch == '\\')
+                    r->cur++;
+                else if (ch == '"')
+                    in_string = false;
+                continue;
+            }
+            if (ch == '"')
+                in_string = true;
+            else if (ch == '[' || ch == '{')
+                depth++;
+            else if ((ch == ']' || ch == '}') && --depth == 0)
+            {
+                r->cur++;
+                return;
+            }
+        }
+        r->failed = true;
+    }
+    else
+    {
+        while (r->cur < r->end && *r->cur != ',' && *r->cur != '}' && *r->cur != ']')
+        {
+            r->cur++;
+        }
+    }
+}
+
+// Reads one layer object into a freshly allocated Layer; net_load fills in its activation lengths
+static bool json_read_layer(JsonReader *r, Layer *layer)
+{
+    FloatList w = {};
+    FloatList b = {};
+    int num_rows = 0;
+    int row_len = -1;
+
+    memset(layer, 0, sizeof(*layer));
+    layer->type = LAYER_DENSE;
+    layer->activation = RELU;
+    layer->backprop_kernel = BACKPROP_KERNEL_ROWS;
+    layer->conv_kernel = CONV_KERNEL_IM2COL;
+    layer->conv.stride = 1;
+
+    json_expect(r, '{');
+    while (!r->failed && json_peek(r) != '}')
+    {
+        char key[32];
+        json_read_string(r, key, sizeof(key));
+        json_expect(r, ':');
+
+        if (strcmp(key, "w") == 0)
+        {
+            json_expect(r, '[');
+            while (!r->failed && json_peek(r) != ']')
+            {
+                int len = json_read_float_array(r, &w);
+                if (row_len >= 0 && len != row_len)
+                {
+                    r->failed = true;
+                }
+                row_len = len;
+                num_rows++;
+                if (json_peek(r) == ',')
+                    r->cur++;
+            }
+            json_expect(r, ']');
+        }
+        else if (strcmp(key, "b") == 0)
+        {
+            json_read_float_array(r, &b);
+        }
+        else if (strcmp(key, "type") == 0)
+        {
+            char name[16];
+            json_read_string(r, name, sizeof(name));
+            int type = 0;
+            while (type < 4 && strcmp(name, LAYER_TYPE_NAMES[type]) != 0)
+            {
+                type++;
+            }
+            r->failed |= type == 4;
+            layer->type = (LayerType)type;
+        }
+        else if (strcmp(key, "kernel") == 0)
+        {
+            layer->conv.kernel = (int)json_read_number(r);
+        }
+        else if (strcmp(key, "stride") == 0)
+        {
+            layer->conv.stride = (int)json_read_number(r);
+        }
+        else if (strcmp(key, "padding") == 0)
+        {
+            layer->conv.padding = (int)json_read_number(r);
+        }
+        else if (strcmp(key, "activation") == 0)
+        {
+            if (json_peek(r) == '"')
+            {
+                char name[16];
+                json_read_string(r, name, sizeof(name));
+                layer->activation = (name[0] == 'S' || name[0] == 's') ? SOFTMAX : RELU;
+            }
+            else
+            {
+                layer->activation = (Activation)(int)json_read_number(r);
+            }
+        }
+        else if (strcmp(key, "dropout_rate") == 0)
+        {
+            layer->dropout_rate = json_read_number(r);
+        }
+        else
+        {
+            json_skip_value(r);
+        }
+
+        if (json_peek(r) == ',')
+            r->cur++;
+    }
+    json_expect(r, '}');
+
+    // Pooling layers have no weights
+    bool has_weights = layer->type == LAYER_DENSE || layer->type == LAYER_CONV;
+    bool ok = !r->failed && b.len == num_rows && (has_weights ? num_rows > 0 && row_len > 0 : num_rows == 0);
+    if (ok)
+    {
+        layer->num_rows = num_rows;
+        layer->row_len = has_weights ? row_len : 0;
+        layer_alloc(layer);
+        if (num_rows > 0)
+        {
+            memcpy(layer->b, b.data, num_rows * sizeof(float));
+        }
+        for (int j = 0; j < num_rows; j++)
+        {
+            memcpy(layer->w[j], &w.data[j * row_len], row_len * sizeof(float));
+        }
+    }
+    MEM_FREE(b.data);
+    MEM_FREE(w.data);
+    return ok;
+}
+
+// Reads an array of layer objects, growing layers as needed; false on malformed input
+static bool json_read_layers(JsonReader *r, Layer **layers, int *num_layers)
+{
+    int cap = 0;
+    json_expect(r, '[');
+    while (!r->failed && json_peek(r) != ']')
+    {
+        if (*num_layers == cap)
+        {
+            cap = cap ? cap * 2 : 4;
+            *layers = (Layer *)MEM_REALLOC(*layers, cap * sizeof(Layer));
+        }
+        if (!json_read_layer(r, &(*layers)[*num_layers]))
+        {
+            r->failed = true;
+            break;
+        }
+        (*num_layers)++;
+        if (json_peek(r) == ',')
+            r->cur++;
+    }
+    json_expect(r, ']');
+    return !r->failed;
+}
+
+// Load the network from a JSON file, the architecture is taken from the file
+bool net_load(Net *net, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char *text = (char *)MEM_MALLOC(size > 0 ? size : 1);
+    size_t read_len = fread(text, 1, size > 0 ? size : 0, file);
     fclose(file);
 
+    JsonReader r = {text, text + read_len, false};
+    net->layers = NULL;
+    net->num_layers = 0;
+    net->exits = NULL;
+    net->num_exits = 0;
+    net->sparse_input_mode = SPARSE_INPUT_AUTO;
+    net->sparse_input_threshold = SPARSE_INPUT_DENSITY_THRESHOLD;
+    net->checkpoint_stride = 0;
+
+    json_expect(&r, '{');
+    while (!r.failed && json_peek(&r) != '}')
+    {
+        char key[32];
+        json_read_string(&r, key, sizeof(key));
+        json_expect(&r, ':');
+
+        if (strcmp(key, "layers") == 0 && net->num_layers == 0)
+        {
+            json_read_layers(&r, &net->layers, &net->num_layers);
+        }
+        else if (strcmp(key, "exits") == 0 && net->num_exits == 0)
+        {
+            json_read_layers(&r, &net->exits, &net->num_exits);
+        }
+        else
+        {
+            json_skip_value(&r);
+        }
+
+        if (json_peek(&r) == ',')
+            r.cur++;
+    }
+    MEM_FREE(text);
+
+    // Link the layer chain from the single channel image to a dense output layer
+    bool ok = !r.failed && net->num_layers > 0;
+    int channels = 1, h = MNIST_IMG_SIZE, w = MNIST_IMG_SIZE;
+    for (int i = 0; ok && i < net->num_layers; i++)
+    {
+        ok = layer_link(&net->layers[i], &channels, &h, &w);
+    }
+    ok = ok && net->layers[net->num_layers - 1].type == LAYER_DENSE &&
+         net->layers[net->num_layers - 1].num_nodes == MNIST_NUM_LABELS;
+
+    // Exit heads, when present, read every hidden layer
+    ok = ok && (net->num_exits == 0 || net->num_exits == net->num_layers - 1);
+    for (int i = 0; ok && i < net->num_exits; i++)
+    {
+        channels = net->layers[i].num_nodes;
+        h = 1;
+        w = 1;
+        ok = net->exits[i].type == LAYER_DENSE && layer_link(&net->exits[i], &channels, &h, &w) &&
+             net->exits[i].num_nodes == MNIST_NUM_LABELS;
+    }
+
+    if (!ok)
+    {
+        net_free(net);
+        return false;
+    }
+
     return true;
 }
@@ -11,31 +11,143 @@ typedef enum
     SOFTMAX
 } Activation;
 
+typedef enum
+{
+    SPARSE_INPUT_AUTO,
+    SPARSE_INPUT_NEVER,
+    SPARSE_INPUT_ALWAYS
+} SparseInputMode;
+
+// How backward computes the previous layer's error from a layer's weights
+typedef enum
+{
+    BACKPROP_KERNEL_ROWS,       // Add whole weight rows scaled by their error, skipping zero errors
+    BACKPROP_KERNEL_TRANSPOSED, // Dot products over the columns of the lazily refreshed w_t
+    BACKPROP_KERNEL_STRIDED     // Walk each weight column across the rows (reference)
+} BackpropKernel;
+
+typedef enum
+{
+    LAYER_DENSE,
+    LAYER_CONV,     // 2D convolution over channel-major (channel, y, x) activations
+    LAYER_MAX_POOL, // Pooling over non-overlapping kernel x kernel windows
+    LAYER_AVG_POOL
+} LayerType;
+
+// How conv layers compute forward and backward
+typedef enum
+{
+    CONV_KERNEL_IM2COL, // Unfold the input patches into a scratch matrix and multiply the filters with it
+    CONV_KERNEL_DIRECT  // Run each filter tap as one contiguous loop over stride phase planes of the input
+} ConvKernel;
+
+// Geometry of a conv or pooling layer; pooling has stride == kernel and no padding
 typedef struct
 {
-    float **w;
-    float *b;
+    int in_channels, in_h, in_w;
+    int out_channels, out_h, out_w;
+    int kernel, stride, padding;
+} ConvShape;
+
+// Hidden layer entries of an arch are dense layer sizes, or a conv or pooling layer packed by these
+#define ARCH_SPATIAL 0x80000000u
+#define ARCH_CONV(filters, kernel, stride, padding)                                                          \
+    (ARCH_SPATIAL | ((uint32_t)LAYER_CONV << 28) | ((uint32_t)(padding) << 20) | ((uint32_t)(stride) << 16) | \
+     ((uint32_t)(kernel) << 12) | (uint32_t)(filters))
+#define ARCH_POOL(type, size) (ARCH_SPATIAL | ((uint32_t)(type) << 28) | ((uint32_t)(size) << 12))
+
+typedef struct
+{
+    LayerType type;
+    float **w; // num_rows x row_len: one row per node (dense) or per filter (conv), none for pooling
+    float *b;  // num_rows
     Activation activation;
     float dropout_rate;
+    BackpropKernel backprop_kernel; // How backward computes this layer's input error
+    ConvKernel conv_kernel;
+    ConvShape conv; // Conv and pooling layers
+    int num_inputs; // Activation lengths
+    int num_nodes;
+    int num_rows;
+    int row_len;
+    float *w_t;     // Column-major copy of w (num_inputs x num_nodes), rebuilt lazily
+    bool w_t_valid; // Cleared by net_weights_changed
 } Layer;
 
 typedef struct
 {
     Layer *layers;
+    int num_layers;
+    SparseInputMode sparse_input_mode; // First layer: skip zero inputs when sparse enough
+    float sparse_input_threshold;      // Largest fraction of nonzero inputs the auto mode treats as sparse
+    Layer *exits;                      // Early-exit softmax head on the output of each hidden layer, or NULL
+    int num_exits;                     // num_layers - 1 with heads, else 0
+    int checkpoint_stride;             // Training keeps every n-th activation, recomputing the rest in backward; <= 1 keeps all
 } Net;
 
+// Nonzero entries of an input vector
+typedef struct
+{
+    uint16_t idx[MNIST_IMG_DATA_LEN];
+    float val[MNIST_IMG_DATA_LEN];
+    int len;
+} SparseInput;
+
 typedef struct
 {
     float pixels[MNIST_IMG_DATA_LEN];
     uint8_t label;
 } MnistRecord;
 
+// First layer pre-activations kept between calls so pixel edits only pay for the changed columns
+typedef struct
+{
+    float pixels[MNIST_IMG_DATA_LEN];
+    float *pre_act;
+    int num_updates; // Pixel deltas applied since the last full recompute
+} IncrementalInput;
+
+// Random state of one training thread, defined in augment.h
+typedef struct AugmentRng AugmentRng;
+
 void net_init_mem(Net *net, bool use_temp_allocator);
+void net_init_mem_arch(Net *net, const uint32_t *arch, int arch_len, bool use_temp_allocator);
+void net_init_mem_like(Net *net, Net *src, bool use_temp_allocator);
+bool net_arch_valid(const uint32_t *arch, int arch_len);
+bool net_arch_is_dense(const uint32_t *arch, int arch_len);
+bool net_is_dense(const Net *net);
+uint32_t layer_arch(const Layer *layer);
+void net_copy(Net *net, Net *src);
+void net_add_exits(Net *net);
 void net_init_values(Net *net);
 float **net_forward(Net *net, MnistRecord *img, Net *contribs, bool is_train);
+void net_free_activations(Net *net, float **activations);
+void net_forward_logits(Net *net, MnistRecord *img, float *logits);
+int net_predict_early_exit(Net *net, MnistRecord *img, float threshold, int *layers_run);
 float net_backward(Net *net, MnistRecord *img, Net *grad, Net *contribs, bool is_train);
+float net_backward_rng(Net *net, MnistRecord *img, Net *grad, bool is_train, AugmentRng *rng);
+// Called with a layer index once that layer's gradients are accumulated
+typedef void (*GradReadyFn)(int layer, void *ctx);
+float net_backward_notify(Net *net, MnistRecord *img, Net *grad, bool is_train, GradReadyFn on_grad_ready, void *ctx);
+float net_backward_weighted(Net *net, MnistRecord *img, Net *grad, float weight, float min_loss, bool is_train, bool *backward_ran);
+float net_backward_distill(Net *net, MnistRecord *img, const float *teacher_logits, float temperature, float alpha, Net *grad, bool is_train);
+int net_activation_floats(const Net *net);
+void net_weights_changed(Net *net);
+// Callers sharing a net between threads must call this before starting them, and again after
+// every net_weights_changed, or concurrent passes race to rebuild the stale copies
+void net_refresh_transposed(Net *net);
+bool net_transposed_ready(const Net *net);
+void layer_backprop_error(Layer *layer, const float *error, float *prev_error, BackpropKernel kernel);
+int sparse_input_compress(const float *values, int len, SparseInput *out);
+void net_incremental_init(Net *net, IncrementalInput *inc, const float *pixels);
+void net_incremental_set_pixels(Net *net, IncrementalInput *inc, const int *idx, const float *values, int len);
+float **net_incremental_forward(Net *net, IncrementalInput *inc);
+float **net_forward_pre_activations(Net *net, float *pixels, const float *pre_act, bool is_train);
+void net_incremental_free(IncrementalInput *inc);
+float net_backward_activations(Net *net, float **activations, uint8_t label, Net *grad);
+float net_backward_hidden(Net *net, float **activations, uint8_t label, Net *grad, float *first_error);
 void net_free(Net *net);
-bool net_save(Net *net);
-bool net_load(Net *net);
+bool net_save(Net *net, const char *path);
+bool net_load(Net *net, const char *path);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,197 @@
+#define _GNU_SOURCE // sched_setaffinity and the CPU_* macros
+#include "numa.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mem.h"
+
+#if defined(__linux__)
+#include <errno.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#define NUMA_UNSUPPORTED
+#endif
+
+#define MEM_TAG MEM_TAG_PARALLEL
+
+// set_mempolicy modes, from linux/mempolicy.h
+#define NUMA_MPOL_DEFAULT 0
+#define NUMA_MPOL_INTERLEAVE 3
+
+#ifndef NUMA_UNSUPPORTED
+
+// Parse a cpulist such as "0-3,8-11" into cpus, returns the count (at most max_cpus)
+static int parse_cpulist(const char *list, int *cpus, int max_cpus)
+{
+    int count = 0;
+    const char *p = list;
+    while (*p >= '0' && *p <= '9')
+    {
+        char *end;
+        long lo = strtol(p, &end, 10);
+        long hi = lo;
+        if (*end == '-')
+        {
+            hi = strtol(end + 1, &end, 10);
+        }
+        for (long cpu = lo; cpu <= hi && count < max_cpus; cpu++)
+        {
+            cpus[count++] = (int)cpu;
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+// Nodes without CPUs (memory only) are left out; false when the topology had to be guessed
+bool numa_topology_read(NumaTopology *topo)
+{
+    memset(topo, 0, sizeof(*topo));
+    int max_cpus = (int)sysconf(_SC_NPROCESSORS_CONF);
+    if (max_cpus < 1)
+    {
+        max_cpus = 1;
+    }
+    topo->cpus = (int *)MEM_MALLOC(max_cpus * sizeof(int));
+
+    for (int node = 0; node < NUMA_MAX_NODES && topo->num_nodes < NUMA_MAX_NODES; node++)
+    {
+        char path[96];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *file = fopen(path, "r");
+        if (!file)
+            continue; // Node numbers can have gaps
+        char list[4096];
+        bool read = fgets(list, sizeof(list), file) != NULL;
+        fclose(file);
+
+        int count = read ? parse_cpulist(list, &topo->cpus[topo->num_cpus], max_cpus - topo->num_cpus) : 0;
+        if (count == 0)
+            continue;
+        topo->node_ids[topo->num_nodes] = node;
+        topo->node_start[topo->num_nodes] = topo->num_cpus;
+        topo->num_cpus += count;
+        topo->num_nodes++;
+    }
+    topo->node_start[topo->num_nodes] = topo->num_cpus;
+    if (topo->num_nodes > 0)
+        return true;
+
+    // No NUMA information: one node with every online CPU
+    int online = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    topo->num_cpus = online > 0 && online <= max_cpus ? online : 1;
+    for (int i = 0; i < topo->num_cpus; i++)
+    {
+        topo->cpus[i] = i;
+    }
+    topo->num_nodes = 1;
+    topo->node_ids[0] = 0;
+    topo->node_start[0] = 0;
+    topo->node_start[1] = topo->num_cpus;
+    return false;
+}
+
+void numa_topology_free(NumaTopology *topo)
+{
+    MEM_FREE(topo->cpus);
+    memset(topo, 0, sizeof(*topo));
+}
+
+// Workers are spread over the nodes in consecutive blocks, so neighbours share a node
+int numa_worker_node(const NumaTopology *topo, int worker, int num_workers)
+{
+    return (int)((long long)worker * topo->num_nodes / num_workers);
+}
+
+// A CPU of the worker's node, cycling through the node's CPUs when there are more workers
+int numa_worker_cpu(const NumaTopology *topo, int worker, int num_workers)
+{
+    int node = numa_worker_node(topo, worker, num_workers);
+    int first_worker = (int)(((long long)node * num_workers + topo->num_nodes - 1) / topo->num_nodes);
+    int node_cpus = topo->node_start[node + 1] - topo->node_start[node];
+    return topo->cpus[topo->node_start[node] + (worker - first_worker) % node_cpus];
+}
+
+// Pin the calling thread
+bool numa_pin_cpu(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+// Let the calling thread run on any CPU of node
+bool numa_pin_node(const NumaTopology *topo, int node)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = topo->node_start[node]; i < topo->node_start[node + 1]; i++)
+    {
+        CPU_SET(topo->cpus[i], &set);
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+// Spread the pages the calling thread touches from now on over every node, or go back to
+// allocating on the local node. False without kernel NUMA support.
+bool numa_interleave(const NumaTopology *topo, bool enable)
+{
+    unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long)) + 1] = {0};
+    for (int n = 0; n < topo->num_nodes; n++)
+    {
+        int id = topo->node_ids[n];
+        mask[id / (8 * sizeof(unsigned long))] |= 1ul << (id % (8 * sizeof(unsigned long)));
+    }
+    long status = enable ? syscall(SYS_set_mempolicy, NUMA_MPOL_INTERLEAVE, mask, NUMA_MAX_NODES + 1)
+                         : syscall(SYS_set_mempolicy, NUMA_MPOL_DEFAULT, NULL, 0);
+    return status == 0;
+}
+
+#else
+
+bool numa_topology_read(NumaTopology *topo)
+{
+    memset(topo, 0, sizeof(*topo));
+    topo->cpus = (int *)MEM_MALLOC(sizeof(int));
+    topo->cpus[0] = 0;
+    topo->num_cpus = 1;
+    topo->num_nodes = 1;
+    topo->node_start[1] = 1;
+    return false;
+}
+
+void numa_topology_free(NumaTopology *topo)
+{
+    MEM_FREE(topo->cpus);
+    memset(topo, 0, sizeof(*topo));
+}
+
+int numa_worker_node(const NumaTopology *topo, int worker, int num_workers)
+{
+    return 0;
+}
+
+int numa_worker_cpu(const NumaTopology *topo, int worker, int num_workers)
+{
+    return 0;
+}
+
+bool numa_pin_cpu(int cpu)
+{
+    return false;
+}
+
+bool numa_pin_node(const NumaTopology *topo, int node)
+{
+    return false;
+}
+
+bool numa_interleave(const NumaTopology *topo, bool enable)
+{
+    return false;
+}
+
+#endif
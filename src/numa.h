@@ -0,0 +1,28 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdbool.h>
+
+#define NUMA_MAX_NODES 64
+
+// CPUs of each NUMA node that has any, read from /sys/devices/system/node. Without NUMA
+// support every online CPU is reported as node 0.
+typedef struct
+{
+    int num_nodes;
+    int node_ids[NUMA_MAX_NODES];        // Kernel node number of each entry
+    int node_start[NUMA_MAX_NODES + 1]; // cpus[node_start[n]] .. cpus[node_start[n + 1] - 1] are on node n
+    int *cpus;
+    int num_cpus;
+} NumaTopology;
+
+bool numa_topology_read(NumaTopology *topo);
+void numa_topology_free(NumaTopology *topo);
+
+int numa_worker_node(const NumaTopology *topo, int worker, int num_workers);
+int numa_worker_cpu(const NumaTopology *topo, int worker, int num_workers);
+bool numa_pin_cpu(int cpu);
+bool numa_pin_node(const NumaTopology *topo, int node);
+bool numa_interleave(const NumaTopology *topo, bool enable);
+
+#endif
@@ -0,0 +1,1282 @@
+#include "parallel.h"
+#include "nn.h"
+#include "train.h"
+#include "snapshot.h"
+#include "numa.h"
+#include "tune.h"
+#include "bench.h"
+#include "configs.h"
+#include "augment.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include "mem.h"
+
+#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+#define PARALLEL_UNSUPPORTED
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#define MEM_TAG MEM_TAG_PARALLEL
+
+// Busy-wait this many times on a mailbox before yielding the CPU to other ranks
+#define SHM_SPINS_BEFORE_YIELD 256
+#define SHM_ALIGN 64
+
+ParallelConfig parallel_config_default()
+{
+    return (ParallelConfig){
+        .num_procs = 1,
+        .num_threads = 0,
+        .rank = -1,
+        .transport = ALLREDUCE_SHM,
+        .peers = NULL,
+        .port = PARALLEL_BASE_PORT,
+        .pin_numa = false,
+    };
+}
+
+#ifndef PARALLEL_UNSUPPORTED
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Mapping layout: this header, then one mailbox per rank. A mailbox is a cache line holding its
+// flag, followed by room for one chunk.
+struct ShmRing
+{
+    int num_ranks;
+    int chunk_len;        // Floats a mailbox holds
+    size_t mailbox_size;  // Bytes from one mailbox to the next
+    size_t size;          // Bytes of the whole mapping
+    _Atomic bool aborted; // Set by the launcher when a rank dies, so the others stop waiting
+};
+
+typedef struct
+{
+    _Atomic uint32_t full; // Set by the previous rank once its chunk is in, cleared by the owner once read
+} Mailbox;
+
+static size_t shm_align(size_t size)
+{
+    return (size + SHM_ALIGN - 1) / SHM_ALIGN * SHM_ALIGN;
+}
+
+static Mailbox *shm_mailbox(ShmRing *ring, int rank)
+{
+    return (Mailbox *)((char *)ring + shm_align(sizeof(ShmRing)) + rank * ring->mailbox_size);
+}
+
+static float *mailbox_data(Mailbox *mailbox)
+{
+    return (float *)((char *)mailbox + SHM_ALIGN);
+}
+
+// Mailboxes big enough to all-reduce max_len floats over num_ranks ranks
+ShmRing *shm_ring_create(int num_ranks, int max_len)
+{
+    int chunk_len = (max_len + num_ranks - 1) / num_ranks;
+    size_t mailbox_size = SHM_ALIGN + shm_align(chunk_len * sizeof(float));
+    size_t size = shm_align(sizeof(ShmRing)) + num_ranks * mailbox_size;
+
+    // Anonymous shared pages stay shared with every process forked afterwards; mmap zeroes them
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        perror("mmap");
+        return NULL;
+    }
+
+    ShmRing *ring = (ShmRing *)mem;
+    ring->num_ranks = num_ranks;
+    ring->chunk_len = chunk_len;
+    ring->mailbox_size = mailbox_size;
+    ring->size = size;
+    return ring;
+}
+
+void shm_ring_abort(ShmRing *ring)
+{
+    atomic_store(&ring->aborted, true);
+}
+
+void shm_ring_destroy(ShmRing *ring)
+{
+    if (ring)
+    {
+        munmap(ring, ring->size);
+    }
+}
+
+// Wait for a mailbox flag to become want, false if the ring was aborted first
+static bool shm_wait(ShmRing *ring, Mailbox *mailbox, uint32_t want)
+{
+    for (int spins = 0; atomic_load_explicit(&mailbox->full, memory_order_acquire) != want; spins++)
+    {
+        if (atomic_load_explicit(&ring->aborted, memory_order_relaxed))
+            return false;
+        if (spins >= SHM_SPINS_BEFORE_YIELD)
+        {
+            sched_yield();
+        }
+    }
+    return true;
+}
+
+// Hand a chunk to the next rank's mailbox, then take the previous rank's chunk out of our own,
+// adding it to recv when accumulating
+static bool shm_sendrecv(Comm *comm, const float *send, int send_len, float *recv, int recv_len, bool accumulate)
+{
+    ShmRing *ring = comm->shm;
+    Mailbox *next = shm_mailbox(ring, (comm->rank + 1) % comm->num_ranks);
+    Mailbox *own = shm_mailbox(ring, comm->rank);
+
+    if (!shm_wait(ring, next, 0))
+        return false;
+    memcpy(mailbox_data(next), send, send_len * sizeof(float));
+    atomic_store_explicit(&next->full, 1, memory_order_release);
+
+    if (!shm_wait(ring, own, 1))
+        return false;
+    const float *data = mailbox_data(own);
+    if (accumulate)
+    {
+        for (int i = 0; i < recv_len; i++)
+        {
+            recv[i] += data[i];
+        }
+    }
+    else
+    {
+        memcpy(recv, data, recv_len * sizeof(float));
+    }
+    atomic_store_explicit(&own->full, 0, memory_order_release);
+    return true;
+}
+
+// Send and receive at once, so ranks that all send first cannot deadlock on full socket buffers
+static bool tcp_sendrecv(Comm *comm, const float *send_buf, int send_len, float *recv_buf, int recv_len)
+{
+    const char *out = (const char *)send_buf;
+    char *in = (char *)recv_buf;
+    size_t out_left = send_len * sizeof(float);
+    size_t in_left = recv_len * sizeof(float);
+
+    while (out_left > 0 || in_left > 0)
+    {
+        struct pollfd fds[2] = {
+            {.fd = comm->send_fd, .events = out_left > 0 ? POLLOUT : 0},
+            {.fd = comm->recv_fd, .events = in_left > 0 ? POLLIN : 0},
+        };
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        if (out_left > 0 && fds[0].revents)
+        {
+            ssize_t n = send(comm->send_fd, out, out_left, MSG_NOSIGNAL);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                continue;
+            if (n <= 0)
+                return false;
+            out += n;
+            out_left -= (size_t)n;
+        }
+        if (in_left > 0 && fds[1].revents)
+        {
+            ssize_t n = recv(comm->recv_fd, in, in_left, 0);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                continue;
+            if (n <= 0)
+                return false; // The previous rank went away
+            in += n;
+            in_left -= (size_t)n;
+        }
+    }
+    return true;
+}
+
+static bool comm_sendrecv(Comm *comm, const float *send, int send_len, float *recv, int recv_len, bool accumulate)
+{
+    if (comm->shm)
+        return shm_sendrecv(comm, send, send_len, recv, recv_len, accumulate);
+    if (!accumulate)
+        return tcp_sendrecv(comm, send, send_len, recv, recv_len);
+
+    if (comm->scratch_len < recv_len)
+    {
+        comm->scratch = (float *)MEM_REALLOC(comm->scratch, recv_len * sizeof(float));
+        comm->scratch_len = recv_len;
+    }
+    if (!tcp_sendrecv(comm, send, send_len, comm->scratch, recv_len))
+        return false;
+    for (int i = 0; i < recv_len; i++)
+    {
+        recv[i] += comm->scratch[i];
+    }
+    return true;
+}
+
+bool comm_init_shm(Comm *comm, ShmRing *ring, int rank)
+{
+    memset(comm, 0, sizeof(*comm));
+    comm->rank = rank;
+    comm->num_ranks = ring->num_ranks;
+    comm->shm = ring;
+    comm->send_fd = -1;
+    comm->recv_fd = -1;
+    return rank >= 0 && rank < ring->num_ranks;
+}
+
+// Address of rank in the comma separated peers list, loopback without one
+static void peer_host(const char *peers, int rank, char *host, size_t host_len)
+{
+    snprintf(host, host_len, "127.0.0.1");
+    const char *p = peers;
+    for (int i = 0; i < rank && p; i++)
+    {
+        p = strchr(p, ',');
+        p = p ? p + 1 : NULL;
+    }
+    if (!p)
+        return;
+
+    size_t len = strcspn(p, ",");
+    if (len >= host_len)
+    {
+        len = host_len - 1;
+    }
+    memcpy(host, p, len);
+    host[len] = '\0';
+}
+
+static int tcp_listen(const char *peers, int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    // Ranks spread over hosts accept from anywhere, a single host keeps the ring on loopback
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(peers ? INADDR_ANY : INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 1) != 0)
+    {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Connect to host:port, retrying until deadline since the other rank may not be listening yet
+static int tcp_connect(const char *host, int port, double deadline)
+{
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res;
+    if (getaddrinfo(host, service, &hints, &res) != 0)
+    {
+        printf("Unknown host: %s\n", host);
+        return -1;
+    }
+
+    int fd = -1;
+    while (get_time_sec() < deadline)
+    {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) == 0)
+            break;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        fd = -1;
+        usleep(10000);
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int tcp_accept(int listen_fd, double deadline)
+{
+    int timeout_ms = (int)((deadline - get_time_sec()) * 1000);
+    struct pollfd pfd = {.fd = listen_fd, .events = POLLIN};
+    if (poll(&pfd, 1, timeout_ms > 0 ? timeout_ms : 0) <= 0)
+        return -1;
+    return accept(listen_fd, NULL, NULL);
+}
+
+// Listen on port + rank, connect to the next rank and accept the previous one
+bool comm_init_tcp(Comm *comm, int rank, int num_ranks, const char *peers, int port)
+{
+    memset(comm, 0, sizeof(*comm));
+    comm->rank = rank;
+    comm->num_ranks = num_ranks;
+    comm->send_fd = -1;
+    comm->recv_fd = -1;
+    if (num_ranks == 1)
+        return true;
+
+    int listen_fd = tcp_listen(peers, port + rank);
+    if (listen_fd < 0)
+        return false;
+
+    int next = (rank + 1) % num_ranks;
+    char host[256];
+    peer_host(peers, next, host, sizeof(host));
+    double deadline = get_time_sec() + PARALLEL_CONNECT_TIMEOUT_MS / 1000.0;
+    comm->send_fd = tcp_connect(host, port + next, deadline);
+    if (comm->send_fd >= 0)
+    {
+        comm->recv_fd = tcp_accept(listen_fd, deadline);
+    }
+    close(listen_fd);
+    if (comm->send_fd < 0 || comm->recv_fd < 0)
+    {
+        printf("Rank %d: ring neighbours did not connect\n", rank);
+        comm_close(comm);
+        return false;
+    }
+
+    int one = 1;
+    setsockopt(comm->send_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(comm->send_fd, F_SETFL, fcntl(comm->send_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(comm->recv_fd, F_SETFL, fcntl(comm->recv_fd, F_GETFL) | O_NONBLOCK);
+    return true;
+}
+
+static int chunk_start(int len, int num_chunks, int chunk)
+{
+    return (int)((long long)len * chunk / num_chunks);
+}
+
+// Sum data over every rank in place. Ring all-reduce: a reduce-scatter leaves each rank with the
+// total of one chunk, an all-gather passes the totals around. Each rank sends 2 (n - 1) / n of the
+// data whatever the ring size, and every rank ends with bit-identical sums.
+bool comm_allreduce(Comm *comm, float *data, int len)
+{
+    int n = comm->num_ranks;
+    int r = comm->rank;
+    if (n == 1)
+        return true;
+    if (comm->shm && (len + n - 1) / n > comm->shm->chunk_len)
+    {
+        printf("All-reduce of %d floats does not fit the shared mailboxes\n", len);
+        return false;
+    }
+
+    for (int s = 0; s < n - 1; s++)
+    {
+        int send_chunk = (r - s + n) % n;
+        int recv_chunk = (r - s - 1 + n) % n;
+        int send_start = chunk_start(len, n, send_chunk);
+        int recv_start = chunk_start(len, n, recv_chunk);
+        if (!comm_sendrecv(comm, &data[send_start], chunk_start(len, n, send_chunk + 1) - send_start, &data[recv_start],
+                           chunk_start(len, n, recv_chunk + 1) - recv_start, true))
+            return false;
+    }
+
+    // Rank r now holds the total of chunk r + 1
+    for (int s = 0; s < n - 1; s++)
+    {
+        int send_chunk = (r + 1 - s + n) % n;
+        int recv_chunk = (r - s + n) % n;
+        int send_start = chunk_start(len, n, send_chunk);
+        int recv_start = chunk_start(len, n, recv_chunk);
+        if (!comm_sendrecv(comm, &data[send_start], chunk_start(len, n, send_chunk + 1) - send_start, &data[recv_start],
+                           chunk_start(len, n, recv_chunk + 1) - recv_start, false))
+            return false;
+    }
+    return true;
+}
+
+void comm_close(Comm *comm)
+{
+    if (comm->send_fd >= 0)
+    {
+        close(comm->send_fd);
+    }
+    if (comm->recv_fd >= 0)
+    {
+        close(comm->recv_fd);
+    }
+    MEM_FREE(comm->scratch);
+    memset(comm, 0, sizeof(*comm));
+    comm->send_fd = -1;
+    comm->recv_fd = -1;
+}
+
+// Gradient buckets, one per layer. The last backward pass of a step hands each layer over as soon
+// as it is final, output layer first, and a communication thread reduces it while backward goes on.
+typedef struct
+{
+    Comm *comm;
+    Net *grad;
+    float **buckets; // Biases, then the weight rows
+    int *bucket_lens;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int num_ready; // Buckets handed over this step
+    int num_done;  // Buckets reduced this step
+    bool failed;
+    bool quit;
+    pthread_t thread;
+} GradSync;
+
+// GradReadyFn for the last sample of a step
+static void grad_sync_layer_ready(int layer, void *ctx)
+{
+    GradSync *sync = (GradSync *)ctx;
+    Layer *grad_layer = &sync->grad->layers[layer];
+    float *bucket = sync->buckets[layer];
+    memcpy(bucket, grad_layer->b, grad_layer->num_nodes * sizeof(float));
+    bucket += grad_layer->num_nodes;
+    for (int j = 0; j < grad_layer->num_nodes; j++)
+    {
+        memcpy(bucket, grad_layer->w[j], grad_layer->num_inputs * sizeof(float));
+        bucket += grad_layer->num_inputs;
+    }
+
+    pthread_mutex_lock(&sync->lock);
+    sync->num_ready++;
+    pthread_cond_broadcast(&sync->cond);
+    pthread_mutex_unlock(&sync->lock);
+}
+
+static void *grad_sync_main(void *arg)
+{
+    GradSync *sync = (GradSync *)arg;
+    int num_layers = sync->grad->num_layers;
+    while (true)
+    {
+        pthread_mutex_lock(&sync->lock);
+        while (!sync->quit && sync->num_done == sync->num_ready)
+        {
+            pthread_cond_wait(&sync->cond, &sync->lock);
+        }
+        if (sync->quit)
+        {
+            pthread_mutex_unlock(&sync->lock);
+            return NULL;
+        }
+        int layer = num_layers - 1 - sync->num_done;
+        pthread_mutex_unlock(&sync->lock);
+
+        bool ok = comm_allreduce(sync->comm, sync->buckets[layer], sync->bucket_lens[layer]);
+
+        pthread_mutex_lock(&sync->lock);
+        sync->failed |= !ok;
+        sync->num_done++;
+        pthread_cond_broadcast(&sync->cond);
+        pthread_mutex_unlock(&sync->lock);
+    }
+}
+
+static void grad_sync_init(GradSync *sync, Comm *comm, Net *grad)
+{
+    memset(sync, 0, sizeof(*sync));
+    sync->comm = comm;
+    sync->grad = grad;
+    sync->buckets = (float **)MEM_MALLOC(grad->num_layers * sizeof(float *));
+    sync->bucket_lens = (int *)MEM_MALLOC(grad->num_layers * sizeof(int));
+    for (int i = 0; i < grad->num_layers; i++)
+    {
+        sync->bucket_lens[i] = grad->layers[i].num_nodes * (grad->layers[i].num_inputs + 1);
+        sync->buckets[i] = (float *)MEM_MALLOC(sync->bucket_lens[i] * sizeof(float));
+    }
+    pthread_mutex_init(&sync->lock, NULL);
+    pthread_cond_init(&sync->cond, NULL);
+    pthread_create(&sync->thread, NULL, grad_sync_main, sync);
+}
+
+// Wait for every bucket of the step and copy the sums back into grad
+static bool grad_sync_wait(GradSync *sync)
+{
+    Net *grad = sync->grad;
+    pthread_mutex_lock(&sync->lock);
+    while (sync->num_done < grad->num_layers)
+    {
+        pthread_cond_wait(&sync->cond, &sync->lock);
+    }
+    sync->num_ready = 0;
+    sync->num_done = 0;
+    bool ok = !sync->failed;
+    pthread_mutex_unlock(&sync->lock);
+
+    for (int i = 0; i < grad->num_layers; i++)
+    {
+        Layer *grad_layer = &grad->layers[i];
+        const float *bucket = sync->buckets[i];
+        memcpy(grad_layer->b, bucket, grad_layer->num_nodes * sizeof(float));
+        bucket += grad_layer->num_nodes;
+        for (int j = 0; j < grad_layer->num_nodes; j++)
+        {
+            memcpy(grad_layer->w[j], bucket, grad_layer->num_inputs * sizeof(float));
+            bucket += grad_layer->num_inputs;
+        }
+    }
+    return ok;
+}
+
+static void grad_sync_free(GradSync *sync)
+{
+    pthread_mutex_lock(&sync->lock);
+    sync->quit = true;
+    pthread_cond_broadcast(&sync->cond);
+    pthread_mutex_unlock(&sync->lock);
+    pthread_join(sync->thread, NULL);
+
+    for (int i = 0; i < sync->grad->num_layers; i++)
+    {
+        MEM_FREE(sync->buckets[i]);
+    }
+    MEM_FREE(sync->buckets);
+    MEM_FREE(sync->bucket_lens);
+    pthread_mutex_destroy(&sync->lock);
+    pthread_cond_destroy(&sync->cond);
+}
+
+static void grad_zero(Net *grad)
+{
+    for (int i = 0; i < grad->num_layers; i++)
+    {
+        Layer *layer = &grad->layers[i];
+        memset(layer->b, 0, layer->num_nodes * sizeof(float));
+        for (int j = 0; j < layer->num_nodes; j++)
+        {
+            memset(layer->w[j], 0, layer->num_inputs * sizeof(float));
+        }
+    }
+}
+
+// One rank's training loop. Every rank walks the same global batches and trains on its contiguous
+// share of each; after the all-reduce all ranks apply identical sums, so the weights never diverge.
+static int parallel_worker(TrainConfig *cfg, Comm *comm, Net *net, MnistRecord *train_data, int data_len, MnistRecord *test_data)
+{
+    int rank = comm->rank;
+    int num_procs = comm->num_ranks;
+    // Ranks inherit one random state, give each its own dropout masks
+    srand((unsigned int)rand() + rank);
+
+    // Allocated after pinning, so the gradients live on this rank's node
+    Net grad = {};
+    net_init_mem_like(&grad, net, false);
+    GradSync sync;
+    grad_sync_init(&sync, comm, &grad);
+
+    SnapshotChannel live = {};
+    TrainMetrics metrics = {};
+    if (rank == 0 && cfg->live_name && snapshot_publisher_open(&live, cfg->live_name, net))
+    {
+        printf("Publishing live snapshots to %s\n", cfg->live_name);
+    }
+
+    int status = 0;
+    int batch_start = 0;
+    long long num_imgs = 0;
+    double eval_sec = 0;
+    double start = get_time_sec();
+    for (int step = 0; step < cfg->num_steps; step++)
+    {
+        MnistRecord *batch = &train_data[batch_start];
+        int batch_size = cfg->batch_size;
+        if (batch_start + batch_size > data_len)
+        {
+            batch_size = data_len - batch_start;
+        }
+        batch_start = (batch_start + batch_size) % data_len;
+
+        int lo = batch_size * rank / num_procs;
+        int hi = batch_size * (rank + 1) / num_procs;
+        grad_zero(&grad);
+        float loss = 0;
+        for (int i = lo; i < hi - 1; i++)
+        {
+            loss += net_backward(net, &batch[i], &grad, NULL, true);
+        }
+        if (hi > lo)
+        {
+            loss += net_backward_notify(net, &batch[hi - 1], &grad, true, grad_sync_layer_ready, &sync);
+        }
+        else
+        {
+            // An empty share still takes part in every reduction
+            for (int i = grad.num_layers - 1; i >= 0; i--)
+            {
+                grad_sync_layer_ready(i, &sync);
+            }
+        }
+
+        if (!grad_sync_wait(&sync))
+        {
+            status = 1;
+            break;
+        }
+        train_apply_gradients(net, &grad, batch_size, cfg->learning_rate);
+        num_imgs += batch_size;
+
+        // Every 250 steps, every rank reduces the loss and rank 0 prints it with the accuracy
+        if (step % 250 == 0)
+        {
+            double eval_start = get_time_sec();
+            if (!comm_allreduce(comm, &loss, 1))
+            {
+                status = 1;
+                break;
+            }
+            if (rank == 0)
+            {
+                float accuracy = calc_net_accuracy(test_data, net);
+                printf("Step: %d, Accuracy: %.4f, Loss: %.4f, Learning Rate: %.4f\n", step, accuracy, loss / batch_size,
+                       cfg->learning_rate);
+                metrics.accuracy = accuracy;
+                mem_report();
+            }
+            eval_sec += get_time_sec() - eval_start;
+        }
+
+        if (live.mem && step % LIVE_SNAPSHOT_INTERVAL == 0)
+        {
+            metrics.step = step;
+            metrics.loss = loss / batch_size;
+            metrics.learning_rate = cfg->learning_rate;
+            snapshot_publish(&live, net, &metrics);
+        }
+
+        if (rank == 0 && step % 2500 == 0 && !net_save(net, cfg->save_path))
+        {
+            printf("Failed to save network\n");
+        }
+    }
+    // Throughput counts training only, not the accuracy checks
+    double elapsed = get_time_sec() - start - eval_sec;
+
+    if (rank == 0 && status == 0)
+    {
+        if (!net_save(net, cfg->save_path))
+        {
+            printf("Failed to save network\n");
+        }
+        printf("Trained %d steps on %d ranks in %.2f s (%.0f imgs/s)\n", cfg->num_steps, num_procs, elapsed,
+               elapsed > 0 ? num_imgs / elapsed : 0.0);
+    }
+
+    snapshot_close(&live);
+    grad_sync_free(&sync);
+    net_free(&grad);
+    return status;
+}
+
+// Pin, join the ring and train as rank
+static int parallel_rank(TrainConfig *cfg, const ParallelConfig *pcfg, int rank, ShmRing *ring, Net *net, MnistRecord *train_data,
+                         int data_len, MnistRecord *test_data)
+{
+    if (pcfg->pin_numa)
+    {
+        NumaTopology topo;
+        numa_topology_read(&topo);
+        int node = rank % topo.num_nodes;
+        if (numa_pin_node(&topo, node))
+        {
+            printf("Rank %d pinned to NUMA node %d\n", rank, topo.node_ids[node]);
+        }
+        else
+        {
+            printf("Rank %d: could not pin to NUMA node %d\n", rank, topo.node_ids[node]);
+        }
+        numa_topology_free(&topo);
+    }
+
+    Comm comm;
+    bool joined = ring ? comm_init_shm(&comm, ring, rank) : comm_init_tcp(&comm, rank, pcfg->num_procs, pcfg->peers, pcfg->port);
+    if (!joined)
+        return 1;
+
+    int status = parallel_worker(cfg, &comm, net, train_data, data_len, test_data);
+    comm_close(&comm);
+    return status;
+}
+
+// Data-parallel training. The data is loaded, augmented and the network initialized once, then
+// every rank is forked from here and inherits them; with --rank only that rank runs, and every
+// host must use the same seed to start from the same weights and data.
+int run_parallel_train(TrainConfig *cfg, const ParallelConfig *pcfg)
+{
+    if (pcfg->rank >= 0 && (pcfg->transport != ALLREDUCE_TCP || !cfg->seed))
+    {
+        printf("--rank needs --allreduce tcp and a --seed shared by every rank\n");
+        return 1;
+    }
+    if (cfg->teacher_path)
+    {
+        printf("Distillation is not supported with --procs\n");
+        return 1;
+    }
+    srand(cfg->seed ? cfg->seed : (unsigned int)time(NULL));
+
+    printf("Loading Training data ...\n");
+    MnistRecord *train_data = load_mnist_data(MNIST_TRAIN_FILE_PATH, TRAIN_DATA_LEN);
+    if (!train_data)
+        return 1;
+
+    printf("Loading Testing data ...\n");
+    MnistRecord *test_data = load_mnist_data(MNIST_TEST_FILE_PATH, TEST_DATA_LEN);
+    if (!test_data)
+    {
+        free_mnist_data(train_data);
+        return 1;
+    }
+
+    int data_len;
+    train_data = augment_training_data(train_data, cfg->augmentation_count, &data_len);
+
+    Net net = {};
+    net_init_mem_arch(&net, cfg->arch, cfg->arch_len, false);
+    net_init_values(&net);
+    tune_load_net(cfg->tuning_path, &net);
+    train_set_checkpointing(&net, cfg->checkpoint_stride);
+
+    int status = 0;
+    if (pcfg->rank >= 0)
+    {
+        status = parallel_rank(cfg, pcfg, pcfg->rank, NULL, &net, train_data, data_len, test_data);
+    }
+    else
+    {
+        // The shared mailboxes hold a chunk of the largest layer
+        ShmRing *ring = NULL;
+        if (pcfg->transport == ALLREDUCE_SHM)
+        {
+            int max_len = 1;
+            for (int i = 0; i < net.num_layers; i++)
+            {
+                int len = net.layers[i].num_nodes * (net.layers[i].num_inputs + 1);
+                max_len = len > max_len ? len : max_len;
+            }
+            ring = shm_ring_create(pcfg->num_procs, max_len);
+            if (!ring)
+            {
+                status = 1;
+            }
+        }
+
+        printf("Training on %d ranks, %s all-reduce\n", pcfg->num_procs,
+               pcfg->transport == ALLREDUCE_SHM ? "shared memory" : "TCP");
+        fflush(stdout); // Or the forked ranks would flush the parent's buffered output again
+
+        int num_launched = 0;
+        for (int rank = 0; rank < pcfg->num_procs && status == 0; rank++)
+        {
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                int rank_status = parallel_rank(cfg, pcfg, rank, ring, &net, train_data, data_len, test_data);
+                net_free(&net);
+                free_mnist_data(train_data);
+                free_mnist_data(test_data);
+                exit(rank_status);
+            }
+            if (pid < 0)
+            {
+                perror("fork");
+                status = 1;
+                break;
+            }
+            num_launched++;
+        }
+        if (status != 0 && ring)
+        {
+            shm_ring_abort(ring);
+        }
+
+        // A failed rank aborts the ring, shared memory ranks then stop waiting on it; TCP ranks see
+        // their neighbour's sockets close
+        for (int i = 0; i < num_launched; i++)
+        {
+            int wstatus;
+            if (wait(&wstatus) < 0)
+                break;
+            if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+            {
+                if (status == 0)
+                {
+                    printf("A rank failed, stopping the others\n");
+                }
+                status = 1;
+                if (ring)
+                {
+                    shm_ring_abort(ring);
+                }
+            }
+        }
+        shm_ring_destroy(ring);
+    }
+
+    net_free(&net);
+    free_mnist_data(train_data);
+    free_mnist_data(test_data);
+    return status;
+}
+
+// Threaded training: workers pinned across the NUMA nodes, each training on its own copy of a
+// shard of the data, reading one weight replica per node. A step is three phases between
+// barriers: every worker accumulates its gradients; every worker sums one slice of the rows
+// over all workers and updates the master weights; the other nodes' replicas copy the new rows.
+typedef struct
+{
+    int layer;
+    int row;
+} RowRef;
+
+typedef struct ThreadedTrainer ThreadedTrainer;
+
+typedef struct
+{
+    ThreadedTrainer *trainer;
+    int index;
+    int node;
+    int row_begin, row_end;           // Rows this worker updates
+    int node_row_begin, node_row_end; // Rows this worker copies into its node's replica
+    Net grad;
+    MnistRecord *shard;
+    int shard_len;
+    float *row_sum;
+    float loss;
+    AugmentRng rng; // Dropout stream of this worker, so workers neither share rand() nor race for it
+    pthread_t thread;
+} TrainWorker;
+
+struct ThreadedTrainer
+{
+    const TrainConfig *cfg;
+    MemPlacement placement;
+    NumaTopology topo;
+    Net *master;                   // The caller's net, and the replica of worker 0's node
+    Net *replicas[NUMA_MAX_NODES]; // NULL for nodes without workers
+    bool has_replicas;
+    const MnistRecord *data;
+    int data_len;
+    MnistRecord *test_data; // Worker 0 reports accuracy on it when set
+    TrainWorker *workers;
+    int num_workers;
+    int per_worker; // Samples per worker per step
+    RowRef *rows;
+    long long *row_offsets; // Parameters before each row, num_rows + 1 entries
+    int num_rows;
+    pthread_barrier_t barrier;
+    double train_start;
+    double eval_sec;
+};
+
+// Rows [begin, end) of part out of num_parts, balanced by parameter count
+static void split_rows(const ThreadedTrainer *t, int part, int num_parts, int *begin, int *end)
+{
+    long long total = t->row_offsets[t->num_rows];
+    long long lo = total * part / num_parts;
+    long long hi = total * (part + 1) / num_parts;
+    *begin = 0;
+    while (*begin < t->num_rows && t->row_offsets[*begin] < lo)
+    {
+        (*begin)++;
+    }
+    *end = *begin;
+    while (*end < t->num_rows && t->row_offsets[*end] < hi)
+    {
+        (*end)++;
+    }
+}
+
+// Allocate and fill a worker's gradients and data shard. Pages land on the node of the thread
+// that first writes them, so the worker does this itself for local placement.
+static void train_worker_place(TrainWorker *worker)
+{
+    ThreadedTrainer *t = worker->trainer;
+    net_init_mem_like(&worker->grad, t->master, false);
+    grad_zero(&worker->grad); // calloc can return untouched pages, write them from here
+
+    int lo = (int)((long long)t->data_len * worker->index / t->num_workers);
+    int hi = (int)((long long)t->data_len * (worker->index + 1) / t->num_workers);
+    worker->shard_len = hi - lo;
+    worker->shard = (MnistRecord *)MEM_MALLOC(worker->shard_len * sizeof(MnistRecord));
+    memcpy(worker->shard, &t->data[lo], worker->shard_len * sizeof(MnistRecord));
+    worker->row_sum = (float *)MEM_MALLOC(MNIST_IMG_DATA_LEN * sizeof(float));
+}
+
+// Sum this worker's rows over every worker's gradients and apply them to the master, keeping
+// its transposed copy current so readers never rebuild it
+static void train_worker_update(TrainWorker *worker)
+{
+    ThreadedTrainer *t = worker->trainer;
+    float scale = t->cfg->learning_rate / (t->per_worker * t->num_workers);
+    for (int r = worker->row_begin; r < worker->row_end; r++)
+    {
+        int l = t->rows[r].layer;
+        int j = t->rows[r].row;
+        Layer *layer = &t->master->layers[l];
+        float *sum = worker->row_sum;
+        float bias = 0;
+        memset(sum, 0, layer->num_inputs * sizeof(float));
+        for (int w = 0; w < t->num_workers; w++)
+        {
+            const Layer *grad_layer = &t->workers[w].grad.layers[l];
+            const float *grad_row = grad_layer->w[j];
+            bias += grad_layer->b[j];
+            for (int k = 0; k < layer->num_inputs; k++)
+            {
+                sum[k] += grad_row[k];
+            }
+        }
+
+        layer->b[j] -= scale * bias;
+        float *row = layer->w[j];
+        for (int k = 0; k < layer->num_inputs; k++)
+        {
+            row[k] -= scale * sum[k];
+            layer->w_t[k * layer->num_nodes + j] = row[k];
+        }
+    }
+}
+
+// Copy this worker's share of the updated rows into its node's replica
+static void train_worker_refresh_replica(TrainWorker *worker, Net *replica)
+{
+    ThreadedTrainer *t = worker->trainer;
+    for (int r = worker->node_row_begin; r < worker->node_row_end; r++)
+    {
+        int l = t->rows[r].layer;
+        int j = t->rows[r].row;
+        const Layer *src = &t->master->layers[l];
+        Layer *dst = &replica->layers[l];
+        dst->b[j] = src->b[j];
+        memcpy(dst->w[j], src->w[j], src->num_inputs * sizeof(float));
+        for (int k = 0; k < src->num_inputs; k++)
+        {
+            dst->w_t[k * src->num_nodes + j] = src->w[j][k];
+        }
+    }
+}
+
+static void *train_worker_main(void *arg)
+{
+    TrainWorker *worker = (TrainWorker *)arg;
+    ThreadedTrainer *t = worker->trainer;
+    const TrainConfig *cfg = t->cfg;
+    mem_scope_begin(MEM_TAG_TRAIN);
+    numa_pin_cpu(numa_worker_cpu(&t->topo, worker->index, t->num_workers));
+
+    if (t->placement == PLACEMENT_LOCAL)
+    {
+        train_worker_place(worker);
+        // The first worker of each other node builds its replica
+        bool first_on_node = worker->index == 0 || t->workers[worker->index - 1].node != worker->node;
+        if (first_on_node && worker->node != t->workers[0].node)
+        {
+            Net *replica = (Net *)MEM_CALLOC(1, sizeof(Net));
+            net_copy(replica, t->master);
+            net_refresh_transposed(replica);
+            t->replicas[worker->node] = replica;
+        }
+    }
+    pthread_barrier_wait(&t->barrier);
+    if (worker->index == 0)
+    {
+        t->train_start = get_time_sec();
+    }
+
+    Net *weights = t->replicas[worker->node];
+    assert(net_transposed_ready(weights));
+    int shard_pos = 0;
+    for (int step = 0; step < cfg->num_steps; step++)
+    {
+        grad_zero(&worker->grad);
+        float loss = 0;
+        for (int i = 0; i < t->per_worker; i++)
+        {
+            loss += net_backward_rng(weights, &worker->shard[shard_pos], &worker->grad, true, &worker->rng);
+            shard_pos = (shard_pos + 1) % worker->shard_len;
+        }
+        worker->loss = loss;
+        pthread_barrier_wait(&t->barrier);
+
+        train_worker_update(worker);
+        float step_loss = 0;
+        if (worker->index == 0 && t->test_data && step % 250 == 0)
+        {
+            for (int w = 0; w < t->num_workers; w++)
+            {
+                step_loss += t->workers[w].loss;
+            }
+        }
+        pthread_barrier_wait(&t->barrier);
+
+        if (weights != t->master)
+        {
+            train_worker_refresh_replica(worker, weights);
+        }
+
+        // Every 250 steps, print accuracy; the master is not written until every worker is past
+        // the next gradient phase
+        if (worker->index == 0 && t->test_data && step % 250 == 0)
+        {
+            double eval_start = get_time_sec();
+            float accuracy = calc_net_accuracy(t->test_data, t->master);
+            printf("Step: %d, Accuracy: %.4f, Loss: %.4f, Learning Rate: %.4f\n", step, accuracy,
+                   step_loss / (t->per_worker * t->num_workers), cfg->learning_rate);
+            if (step % 2500 == 0 && cfg->save_path && !net_save(t->master, cfg->save_path))
+            {
+                printf("Failed to save network\n");
+            }
+            t->eval_sec += get_time_sec() - eval_start;
+        }
+        if (t->has_replicas)
+        {
+            pthread_barrier_wait(&t->barrier);
+        }
+    }
+    return NULL;
+}
+
+// Train net for cfg->num_steps steps of cfg->batch_size samples split over num_threads pinned
+// threads. Returns the seconds spent training, without setup and evaluation.
+double threaded_train(Net *net, const MnistRecord *data, int data_len, MnistRecord *test_data, const TrainConfig *cfg,
+                      int num_threads, MemPlacement placement)
+{
+    ThreadedTrainer t = {0};
+    t.cfg = cfg;
+    t.placement = placement;
+    t.master = net;
+    t.data = data;
+    t.data_len = data_len;
+    t.test_data = test_data;
+    t.num_workers = num_threads < data_len ? num_threads : data_len;
+    t.per_worker = cfg->batch_size / t.num_workers > 0 ? cfg->batch_size / t.num_workers : 1;
+    numa_topology_read(&t.topo);
+    net_refresh_transposed(net);
+
+    for (int i = 0; i < net->num_layers; i++)
+    {
+        t.num_rows += net->layers[i].num_nodes;
+    }
+    t.rows = (RowRef *)MEM_MALLOC(t.num_rows * sizeof(RowRef));
+    t.row_offsets = (long long *)MEM_MALLOC((t.num_rows + 1) * sizeof(long long));
+    t.row_offsets[0] = 0;
+    for (int i = 0, r = 0; i < net->num_layers; i++)
+    {
+        for (int j = 0; j < net->layers[i].num_nodes; j++, r++)
+        {
+            t.rows[r] = (RowRef){i, j};
+            t.row_offsets[r + 1] = t.row_offsets[r] + net->layers[i].num_inputs + 1;
+        }
+    }
+
+    // Drawn from rand(), which the caller seeded, so the same --seed replays the same dropout
+    uint64_t dropout_seed = (uint64_t)rand();
+    t.workers = (TrainWorker *)MEM_CALLOC(t.num_workers, sizeof(TrainWorker));
+    for (int w = 0; w < t.num_workers; w++)
+    {
+        TrainWorker *worker = &t.workers[w];
+        worker->trainer = &t;
+        worker->index = w;
+        augment_rng_seed(&worker->rng, dropout_seed + w);
+        worker->node = placement == PLACEMENT_LOCAL ? numa_worker_node(&t.topo, w, t.num_workers) : 0;
+        split_rows(&t, w, t.num_workers, &worker->row_begin, &worker->row_end);
+    }
+    // Each node's workers split its replica refresh between them
+    for (int w = 0; w < t.num_workers; w++)
+    {
+        int node = t.workers[w].node;
+        int first = w;
+        while (first > 0 && t.workers[first - 1].node == node)
+        {
+            first--;
+        }
+        int last = w;
+        while (last + 1 < t.num_workers && t.workers[last + 1].node == node)
+        {
+            last++;
+        }
+        split_rows(&t, w - first, last - first + 1, &t.workers[w].node_row_begin, &t.workers[w].node_row_end);
+    }
+    t.replicas[t.workers[0].node] = net;
+    t.has_replicas = t.workers[t.num_workers - 1].node != t.workers[0].node;
+
+    if (placement == PLACEMENT_INTERLEAVED)
+    {
+        // Everything is placed from this thread, its pages spread over all nodes
+        bool interleaved = numa_interleave(&t.topo, true);
+        for (int w = 0; w < t.num_workers; w++)
+        {
+            train_worker_place(&t.workers[w]);
+        }
+        if (interleaved)
+        {
+            numa_interleave(&t.topo, false);
+        }
+    }
+
+    pthread_barrier_init(&t.barrier, NULL, t.num_workers);
+    for (int w = 0; w < t.num_workers; w++)
+    {
+        pthread_create(&t.workers[w].thread, NULL, train_worker_main, &t.workers[w]);
+    }
+    for (int w = 0; w < t.num_workers; w++)
+    {
+        pthread_join(t.workers[w].thread, NULL);
+    }
+    double elapsed = get_time_sec() - t.train_start - t.eval_sec;
+    pthread_barrier_destroy(&t.barrier);
+
+    for (int n = 0; n < NUMA_MAX_NODES; n++)
+    {
+        if (t.replicas[n] && t.replicas[n] != net)
+        {
+            net_free(t.replicas[n]);
+            MEM_FREE(t.replicas[n]);
+        }
+    }
+    for (int w = 0; w < t.num_workers; w++)
+    {
+        net_free(&t.workers[w].grad);
+        MEM_FREE(t.workers[w].shard);
+        MEM_FREE(t.workers[w].row_sum);
+    }
+    MEM_FREE(t.workers);
+    MEM_FREE(t.rows);
+    MEM_FREE(t.row_offsets);
+    numa_topology_free(&t.topo);
+    return elapsed;
+}
+
+// Train on num_threads threads of this process with NUMA-local placement
+int run_threaded_train(TrainConfig *cfg, int num_threads)
+{
+    srand(cfg->seed ? cfg->seed : (unsigned int)time(NULL));
+
+    printf("Loading Training data ...\n");
+    MnistRecord *train_data = load_mnist_data(MNIST_TRAIN_FILE_PATH, TRAIN_DATA_LEN);
+    if (!train_data)
+        return 1;
+
+    printf("Loading Testing data ...\n");
+    MnistRecord *test_data = load_mnist_data(MNIST_TEST_FILE_PATH, TEST_DATA_LEN);
+    if (!test_data)
+    {
+        free_mnist_data(train_data);
+        return 1;
+    }
+
+    int data_len;
+    train_data = augment_training_data(train_data, cfg->augmentation_count, &data_len);
+
+    Net net = {};
+    net_init_mem_arch(&net, cfg->arch, cfg->arch_len, false);
+    net_init_values(&net);
+    tune_load_net(cfg->tuning_path, &net);
+    train_set_checkpointing(&net, cfg->checkpoint_stride);
+
+    NumaTopology topo;
+    bool from_sys = numa_topology_read(&topo);
+    printf("Training on %d threads over %d NUMA node(s)%s\n", num_threads, topo.num_nodes,
+           from_sys ? "" : " (no NUMA topology in /sys)");
+    numa_topology_free(&topo);
+
+    double elapsed = threaded_train(&net, train_data, data_len, test_data, cfg, num_threads, PLACEMENT_LOCAL);
+    int per_thread = cfg->batch_size / num_threads > 0 ? cfg->batch_size / num_threads : 1;
+    double num_imgs = (double)cfg->num_steps * per_thread * num_threads;
+    printf("Trained %d steps on %d threads in %.2f s (%.0f imgs/s)\n", cfg->num_steps, num_threads, elapsed,
+           elapsed > 0 ? num_imgs / elapsed : 0.0);
+
+    int status = 0;
+    if (!net_save(&net, cfg->save_path))
+    {
+        printf("Failed to save network\n");
+        status = 1;
+    }
+    net_free(&net);
+    free_mnist_data(train_data);
+    free_mnist_data(test_data);
+    return status;
+}
+
+#else
+
+ShmRing *shm_ring_create(int num_ranks, int max_len)
+{
+    return NULL;
+}
+
+void shm_ring_abort(ShmRing *ring)
+{
+}
+
+void shm_ring_destroy(ShmRing *ring)
+{
+}
+
+bool comm_init_shm(Comm *comm, ShmRing *ring, int rank)
+{
+    return false;
+}
+
+bool comm_init_tcp(Comm *comm, int rank, int num_ranks, const char *peers, int port)
+{
+    return false;
+}
+
+bool comm_allreduce(Comm *comm, float *data, int len)
+{
+    return false;
+}
+
+void comm_close(Comm *comm)
+{
+}
+
+int run_parallel_train(TrainConfig *cfg, const ParallelConfig *pcfg)
+{
+    printf("Multi-process training is not supported on this platform\n");
+    return 1;
+}
+
+double threaded_train(Net *net, const MnistRecord *data, int data_len, MnistRecord *test_data, const TrainConfig *cfg,
+                      int num_threads, MemPlacement placement)
+{
+    return 0;
+}
+
+int run_threaded_train(TrainConfig *cfg, int num_threads)
+{
+    printf("Threaded training is not supported on this platform\n");
+    return 1;
+}
+
+#endif
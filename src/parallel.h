@@ -0,0 +1,64 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stdbool.h>
+#include "nn.h"
+#include "train.h"
+
+typedef enum
+{
+    ALLREDUCE_SHM, // Ranks forked on one host exchange chunks through shared memory
+    ALLREDUCE_TCP, // Ranks exchange chunks over sockets, also across hosts
+} AllReduceTransport;
+
+// Where threaded training puts each thread's gradients, data shard and weights
+typedef enum
+{
+    PLACEMENT_LOCAL,       // On the thread's NUMA node, with a weight replica per node
+    PLACEMENT_INTERLEAVED, // Spread over all nodes, every thread reading one set of weights
+} MemPlacement;
+
+typedef struct
+{
+    int num_procs;
+    int num_threads; // Worker threads of one process, pinned across the NUMA nodes; 0 uses the autotuned count
+    int rank; // -1 forks every rank on this host, otherwise runs only this rank (TCP)
+    AllReduceTransport transport;
+    const char *peers; // TCP: comma separated address of every rank, NULL for all on 127.0.0.1
+    int port;          // TCP: rank r listens on port + r
+    bool pin_numa;     // Pin rank r to the CPUs of NUMA node r % num_nodes
+} ParallelConfig;
+
+// Mailboxes of a single-host ring, mapped before forking so every rank inherits them
+typedef struct ShmRing ShmRing;
+
+// One rank's end of the ring: it sends to rank + 1 and receives from rank - 1
+typedef struct
+{
+    int rank;
+    int num_ranks;
+    ShmRing *shm;
+    int send_fd; // TCP
+    int recv_fd; // TCP
+    float *scratch;
+    int scratch_len;
+} Comm;
+
+ParallelConfig parallel_config_default();
+
+ShmRing *shm_ring_create(int num_ranks, int max_len);
+void shm_ring_abort(ShmRing *ring);
+void shm_ring_destroy(ShmRing *ring);
+
+bool comm_init_shm(Comm *comm, ShmRing *ring, int rank);
+bool comm_init_tcp(Comm *comm, int rank, int num_ranks, const char *peers, int port);
+bool comm_allreduce(Comm *comm, float *data, int len);
+void comm_close(Comm *comm);
+
+int run_parallel_train(TrainConfig *cfg, const ParallelConfig *pcfg);
+
+double threaded_train(Net *net, const MnistRecord *data, int data_len, MnistRecord *test_data, const TrainConfig *cfg,
+                      int num_threads, MemPlacement placement);
+int run_threaded_train(TrainConfig *cfg, int num_threads);
+
+#endif
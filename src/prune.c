@@ -0,0 +1,621 @@
+#include "prune.h"
+#include "nn.h"
+#include "train.h"
+#include "bench.h"
+#include "configs.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mem.h"
+
+#define MEM_TAG MEM_TAG_PRUNE
+
+static int compare_floats(const void *a, const void *b)
+{
+    float fa = *(const float *)a;
+    float fb = *(const float *)b;
+    return (fa > fb) - (fa < fb);
+}
+
+// Zero the smallest-magnitude weights of a layer, returns the achieved sparsity
+float layer_prune_magnitude(Layer *layer, float sparsity)
+{
+    int count = layer->num_nodes * layer->num_inputs;
+    int num_prune = (int)(sparsity * count);
+    if (num_prune <= 0)
+        return 1.0f - (float)layer_count_nonzero(layer) / count;
+
+    float *magnitudes = (float *)MEM_MALLOC(count * sizeof(float));
+    for (int j = 0; j < layer->num_nodes; j++)
+    {
+        for (int k = 0; k < layer->num_inputs; k++)
+        {
+            magnitudes[j * layer->num_inputs + k] = fabsf(layer->w[j][k]);
+        }
+    }
+    qsort(magnitudes, count, sizeof(float), compare_floats);
+    float threshold = magnitudes[num_prune - 1];
+    MEM_FREE(magnitudes);
+
+    // Weights below the threshold always go, ties only until the target is hit
+    int num_at_threshold = 0;
+    for (int j = 0; j < layer->num_nodes; j++)
+    {
+        for (int k = 0; k < layer->num_inputs; k++)
+        {
+            num_at_threshold += fabsf(layer->w[j][k]) < threshold;
+        }
+    }
+    int ties_left = num_prune - num_at_threshold;
+
+    for (int j = 0; j < layer->num_nodes; j++)
+    {
+        for (int k = 0; k < layer->num_inputs; k++)
+        {
+            float magnitude = fabsf(layer->w[j][k]);
+            if (magnitude < threshold || (magnitude == threshold && ties_left-- > 0))
+            {
+                layer->w[j][k] = 0;
+            }
+        }
+    }
+
+    return 1.0f - (float)layer_count_nonzero(layer) / count;
+}
+
+// Zero whole BSR blocks with the smallest L2 norm so the block-sparse kernel can skip them
+float layer_prune_block_magnitude(Layer *layer, float sparsity)
+{
+    int num_block_rows = (layer->num_nodes + BSR_BLOCK_ROWS - 1) / BSR_BLOCK_ROWS;
+    int num_block_cols = (layer->num_inputs + BSR_BLOCK_COLS - 1) / BSR_BLOCK_COLS;
+    int num_blocks = num_block_rows * num_block_cols;
+    int num_prune = (int)(sparsity * num_blocks);
+
+    float *norms = (float *)MEM_CALLOC(num_blocks, sizeof(float));
+    for (int j = 0; j < layer->num_nodes; j++)
+    {
+        for (int k = 0; k < layer->num_inputs; k++)
+        {
+            norms[(j / BSR_BLOCK_ROWS) * num_block_cols + k / BSR_BLOCK_COLS] += layer->w[j][k] * layer->w[j][k];
+        }
+    }
+
+    float *sorted = (float *)MEM_MALLOC(num_blocks * sizeof(float));
+    memcpy(sorted, norms, num_blocks * sizeof(float));
+    qsort(sorted, num_blocks, sizeof(float), compare_floats);
+    float threshold = num_prune > 0 ? sorted[num_prune - 1] : -1.0f;
+    MEM_FREE(sorted);
+
+    int ties_left = num_prune;
+    for (int b = 0; b < num_blocks; b++)
+    {
+        ties_left -= norms[b] < threshold;
+    }
+    for (int b = 0; b < num_blocks; b++)
+    {
+        bool prune = norms[b] < threshold || (norms[b] == threshold && ties_left-- > 0);
+        norms[b] = prune ? 0.0f : 1.0f;
+    }
+
+    for (int j = 0; j < layer->num_nodes; j++)
+    {
+        for (int k = 0; k < layer->num_inputs; k++)
+        {
+            if (norms[(j / BSR_BLOCK_ROWS) * num_block_cols + k / BSR_BLOCK_COLS] == 0.0f)
+                layer->w[j][k] = 0;
+        }
+    }
+    MEM_FREE(norms);
+
+    int count = layer->num_nodes * layer->num_inputs;
+    return 1.0f - (float)layer_count_nonzero(layer) / count;
+}
+
+// Prune every layer to the same sparsity, returns the overall achieved sparsity
+float net_prune_magnitude(Net *net, float sparsity, bool by_block)
+{
+    int total = 0;
+    int nonzero = 0;
+    for (int i = 0; i < net->num_layers; i++)
+    {
+        if (by_block)
+            layer_prune_block_magnitude(&net->layers[i], sparsity);
+        else
+            layer_prune_magnitude(&net->layers[i], sparsity);
+        total += net->layers[i].num_nodes * net->layers[i].num_inputs;
+        nonzero += layer_count_nonzero(&net->layers[i]);
+    }
+    net_weights_changed(net);
+    return 1.0f - (float)nonzero / total;
+}
+
+int layer_count_nonzero(Layer *layer)
+{
+    int nonzero = 0;
+    for (int j = 0; j < layer->num_nodes; j++)
+    {
+        for (int k = 0; k < layer->num_inputs; k++)
+        {
+            nonzero += layer->w[j][k] != 0;
+        }
+    }
+    return nonzero;
+}
+
+void csr_from_layer(CsrMatrix *csr, Layer *layer)
+{
+    int nonzero = layer_count_nonzero(layer);
+    csr->num_rows = layer->num_nodes;
+    csr->num_cols = layer->num_inputs;
+    csr->row_ptr = (int *)MEM_MALLOC((layer->num_nodes + 1) * sizeof(int));
+    csr->col_idx = (int *)MEM_MALLOC((nonzero > 0 ? nonzero : 1) * sizeof(int));
+    csr->values = (float *)MEM_MALLOC((nonzero > 0 ? nonzero : 1) * sizeof(float));
+
+    int pos = 0;
+    for (int j = 0; j < layer->num_nodes; j++)
+    {
+        csr->row_ptr[j] = pos;
+        for (int k = 0; k < layer->num_inputs; k++)
+        {
+            if (layer->w[j][k] != 0)
+            {
+                csr->col_idx[pos] = k;
+                csr->values[pos] = layer->w[j][k];
+                pos++;
+            }
+        }
+    }
+    csr->row_ptr[layer->num_nodes] = pos;
+}
+
+void csr_free(CsrMatrix *csr)
+{
+    MEM_FREE(csr->row_ptr);
+    MEM_FREE(csr->col_idx);
+    MEM_FREE(csr->values);
+    memset(csr, 0, sizeof(*csr));
+}
+
+// y[s] = W * x[s] + bias for n row-major samples
+void csr_gemm(const CsrMatrix *csr, const float *bias, const float *x, int n, float *y)
+{
+    for (int r = 0; r < csr->num_rows; r++)
+    {
+        int start = csr->row_ptr[r];
+        int end = csr->row_ptr[r + 1];
+        for (int s = 0; s < n; s++)
+        {
+            const float *xs = &x[s * csr->num_cols];
+            float acc = bias[r];
+            for (int p = start; p < end; p++)
+            {
+                acc += csr->values[p] * xs[csr->col_idx[p]];
+            }
+            y[s * csr->num_rows + r] = acc;
+        }
+    }
+}
+
+void bsr_from_layer(BsrMatrix *bsr, Layer *layer)
+{
+    int num_block_rows = (layer->num_nodes + BSR_BLOCK_ROWS - 1) / BSR_BLOCK_ROWS;
+    int num_block_cols = (layer->num_inputs + BSR_BLOCK_COLS - 1) / BSR_BLOCK_COLS;
+    int block_size = BSR_BLOCK_ROWS * BSR_BLOCK_COLS;
+
+    bsr->num_rows = layer->num_nodes;
+    bsr->num_cols = layer->num_inputs;
+    bsr->num_block_rows = num_block_rows;
+    bsr->block_row_ptr = (int *)MEM_MALLOC((num_block_rows + 1) * sizeof(int));
+    bsr->block_col_idx = (int *)MEM_MALLOC(num_block_rows * num_block_cols * sizeof(int));
+    bsr->values = (float *)MEM_CALLOC(num_block_rows * num_block_cols * block_size, sizeof(float));
+
+    int num_blocks = 0;
+    for (int br = 0; br < num_block_rows; br++)
+    {
+        bsr->block_row_ptr[br] = num_blocks;
+        for (int bc = 0; bc < num_block_cols; bc++)
+        {
+            // Keep the block if any of its weights survived pruning
+            bool has_nonzero = false;
+            float *block = &bsr->values[num_blocks * block_size];
+            for (int r = 0; r < BSR_BLOCK_ROWS; r++)
+            {
+                int j = br * BSR_BLOCK_ROWS + r;
+                for (int c = 0; c < BSR_BLOCK_COLS; c++)
+                {
+                    int k = bc * BSR_BLOCK_COLS + c;
+                    if (j < layer->num_nodes && k < layer->num_inputs && layer->w[j][k] != 0)
+                    {
+                        block[r * BSR_BLOCK_COLS + c] = layer->w[j][k];
+                        has_nonzero = true;
+                    }
+                }
+            }
+            if (has_nonzero)
+            {
+                bsr->block_col_idx[num_blocks++] = bc * BSR_BLOCK_COLS;
+            }
+        }
+    }
+    bsr->block_row_ptr[num_block_rows] = num_blocks;
+}
+
+void bsr_free(BsrMatrix *bsr)
+{
+    MEM_FREE(bsr->block_row_ptr);
+    MEM_FREE(bsr->block_col_idx);
+    MEM_FREE(bsr->values);
+    memset(bsr, 0, sizeof(*bsr));
+}
+
+// y[s] = W * x[s] + bias for n row-major samples
+void bsr_gemm(const BsrMatrix *bsr, const float *bias, const float *x, int n, float *y)
+{
+    for (int br = 0; br < bsr->num_block_rows; br++)
+    {
+        int row0 = br * BSR_BLOCK_ROWS;
+        int num_valid_rows = bsr->num_rows - row0 < BSR_BLOCK_ROWS ? bsr->num_rows - row0 : BSR_BLOCK_ROWS;
+
+        for (int s = 0; s < n; s++)
+        {
+            const float *xs = &x[s * bsr->num_cols];
+            float acc[BSR_BLOCK_ROWS] = {0};
+
+            for (int p = bsr->block_row_ptr[br]; p < bsr->block_row_ptr[br + 1]; p++)
+            {
+                const float *block = &bsr->values[p * BSR_BLOCK_ROWS * BSR_BLOCK_COLS];
+                int col0 = bsr->block_col_idx[p];
+                if (col0 + BSR_BLOCK_COLS <= bsr->num_cols)
+                {
+                    for (int r = 0; r < BSR_BLOCK_ROWS; r++)
+                    {
+                        for (int c = 0; c < BSR_BLOCK_COLS; c++)
+                        {
+                            acc[r] += block[r * BSR_BLOCK_COLS + c] * xs[col0 + c];
+                        }
+                    }
+                }
+                else
+                {
+                    // Partial block at the right edge
+                    for (int r = 0; r < BSR_BLOCK_ROWS; r++)
+                    {
+                        for (int c = 0; col0 + c < bsr->num_cols; c++)
+                        {
+                            acc[r] += block[r * BSR_BLOCK_COLS + c] * xs[col0 + c];
+                        }
+                    }
+                }
+            }
+
+            for (int r = 0; r < num_valid_rows; r++)
+            {
+                y[s * bsr->num_rows + row0 + r] = acc[r] + bias[row0 + r];
+            }
+        }
+    }
+}
+
+// Build an inference network from net; net must outlive pnet
+void pruned_net_init(PrunedNet *pnet, Net *net, SparseFormat format)
+{
+    pnet->num_layers = net->num_layers;
+    pnet->layers = (PrunedLayer *)MEM_CALLOC(net->num_layers, sizeof(PrunedLayer));
+    pnet->max_width = MNIST_IMG_DATA_LEN;
+
+    for (int i = 0; i < net->num_layers; i++)
+    {
+        PrunedLayer *pl = &pnet->layers[i];
+        pl->format = format;
+        pl->dense = &net->layers[i];
+        if (format == SPARSE_FORMAT_CSR)
+        {
+            csr_from_layer(&pl->csr, &net->layers[i]);
+        }
+        else if (format == SPARSE_FORMAT_BSR)
+        {
+            bsr_from_layer(&pl->bsr, &net->layers[i]);
+        }
+        if (net->layers[i].num_nodes > pnet->max_width)
+        {
+            pnet->max_width = net->layers[i].num_nodes;
+        }
+    }
+}
+
+void pruned_net_free(PrunedNet *pnet)
+{
+    for (int i = 0; i < pnet->num_layers; i++)
+    {
+        csr_free(&pnet->layers[i].csr);
+        bsr_free(&pnet->layers[i].bsr);
+    }
+    MEM_FREE(pnet->layers);
+    pnet->layers = NULL;
+    pnet->num_layers = 0;
+}
+
+// Dense kernel with the same layout as the sparse ones. Four samples share each pass over
+// a weight row, so batched callers stream the weights a quarter as often.
+static void dense_gemm(Layer *layer, const float *x, int n, float *y)
+{
+    int num_inputs = layer->num_inputs;
+    int s = 0;
+    for (; s + 4 <= n; s += 4)
+    {
+        const float *x0 = &x[s * num_inputs];
+        const float *x1 = x0 + num_inputs;
+        const float *x2 = x1 + num_inputs;
+        const float *x3 = x2 + num_inputs;
+        for (int j = 0; j < layer->num_nodes; j++)
+        {
+            const float *w = layer->w[j];
+            float acc0 = layer->b[j], acc1 = layer->b[j], acc2 = layer->b[j], acc3 = layer->b[j];
+            for (int k = 0; k < num_inputs; k++)
+            {
+                acc0 += w[k] * x0[k];
+                acc1 += w[k] * x1[k];
+                acc2 += w[k] * x2[k];
+                acc3 += w[k] * x3[k];
+            }
+            y[s * layer->num_nodes + j] = acc0;
+            y[(s + 1) * layer->num_nodes + j] = acc1;
+            y[(s + 2) * layer->num_nodes + j] = acc2;
+            y[(s + 3) * layer->num_nodes + j] = acc3;
+        }
+    }
+    for (; s < n; s++)
+    {
+        const float *xs = &x[s * num_inputs];
+        for (int j = 0; j < layer->num_nodes; j++)
+        {
+            float acc = layer->b[j];
+            for (int k = 0; k < num_inputs; k++)
+            {
+                acc += layer->w[j][k] * xs[k];
+            }
+            y[s * layer->num_nodes + j] = acc;
+        }
+    }
+}
+
+// Forward n row-major input images, writes n x MNIST_NUM_LABELS probabilities
+void pruned_net_forward(PrunedNet *pnet, const float *inputs, int n, float *probs)
+{
+    float *scratch = (float *)MEM_MALLOC(2 * n * pnet->max_width * sizeof(float));
+    pruned_net_forward_scratch(pnet, inputs, n, probs, scratch);
+    MEM_FREE(scratch);
+}
+
+// pruned_net_forward with the caller's scratch of at least 2 * n * max_width floats, so a caller
+// running many batches reuses one buffer
+void pruned_net_forward_scratch(PrunedNet *pnet, const float *inputs, int n, float *probs, float *scratch)
+{
+    float *buf_a = scratch;
+    float *buf_b = &scratch[n * pnet->max_width];
+    const float *input = inputs;
+    float *output = buf_a;
+
+    for (int i = 0; i < pnet->num_layers; i++)
+    {
+        PrunedLayer *pl = &pnet->layers[i];
+        Layer *layer = pl->dense;
+        if (i == pnet->num_layers - 1)
+        {
+            output = probs;
+        }
+
+        if (pl->format == SPARSE_FORMAT_CSR)
+            csr_gemm(&pl->csr, layer->b, input, n, output);
+        else if (pl->format == SPARSE_FORMAT_BSR)
+            bsr_gemm(&pl->bsr, layer->b, input, n, output);
+        else
+            dense_gemm(layer, input, n, output);
+
+        for (int s = 0; s < n; s++)
+        {
+            float *values = &output[s * layer->num_nodes];
+            if (layer->activation == RELU)
+            {
+                for (int j = 0; j < layer->num_nodes; j++)
+                {
+                    values[j] = fmaxf(0, values[j]);
+                }
+            }
+            else
+            {
+                float max_val = values[0];
+                for (int j = 1; j < layer->num_nodes; j++)
+                {
+                    max_val = fmaxf(max_val, values[j]);
+                }
+                float sum = 0;
+                for (int j = 0; j < layer->num_nodes; j++)
+                {
+                    values[j] = expf(values[j] - max_val);
+                    sum += values[j];
+                }
+                for (int j = 0; j < layer->num_nodes; j++)
+                {
+                    values[j] /= sum;
+                }
+            }
+        }
+
+        input = output;
+        output = output == buf_a ? buf_b : buf_a;
+    }
+}
+
+// Accuracy of a pruned network, or -1 without labelled data
+static float pruned_net_accuracy(PrunedNet *pnet, MnistRecord *data, int len)
+{
+    if (!data)
+        return -1;
+
+    int correct = 0;
+    float probs[MNIST_NUM_LABELS];
+    float *scratch = (float *)MEM_MALLOC(2 * pnet->max_width * sizeof(float));
+    for (int i = 0; i < len; i++)
+    {
+        pruned_net_forward_scratch(pnet, data[i].pixels, 1, probs, scratch);
+        correct += get_prediction_index(probs) == data[i].label;
+    }
+    MEM_FREE(scratch);
+    return (float)correct / len;
+}
+
+// Average single-image latency in microseconds, without the allocation of the activations
+static double pruned_net_latency_us(PrunedNet *pnet, MnistRecord *data, int len)
+{
+    float probs[MNIST_NUM_LABELS];
+    float *scratch = (float *)MEM_MALLOC(2 * pnet->max_width * sizeof(float));
+    double start = get_time_sec();
+    for (int i = 0; i < len; i++)
+    {
+        pruned_net_forward_scratch(pnet, data[i].pixels, 1, probs, scratch);
+    }
+    double latency_us = (get_time_sec() - start) * 1e6 / len;
+    MEM_FREE(scratch);
+    return latency_us;
+}
+
+// Zero the weights that were pruned again after a fine-tuning step
+static void apply_prune_mask(Net *net, uint8_t **masks)
+{
+    for (int i = 0; i < net->num_layers; i++)
+    {
+        Layer *layer = &net->layers[i];
+        for (int j = 0; j < layer->num_nodes; j++)
+        {
+            for (int k = 0; k < layer->num_inputs; k++)
+            {
+                if (!masks[i][j * layer->num_inputs + k])
+                    layer->w[j][k] = 0;
+            }
+        }
+    }
+    net_weights_changed(net);
+}
+
+static void finetune_pruned(Net *net, int steps)
+{
+    MnistRecord *train_data = load_mnist_data(MNIST_TRAIN_FILE_PATH, TRAIN_DATA_LEN);
+    if (!train_data)
+    {
+        printf("Skipping fine-tuning, no training data\n");
+        return;
+    }
+
+    uint8_t **masks = (uint8_t **)MEM_MALLOC(net->num_layers * sizeof(uint8_t *));
+    for (int i = 0; i < net->num_layers; i++)
+    {
+        Layer *layer = &net->layers[i];
+        masks[i] = (uint8_t *)MEM_MALLOC(layer->num_nodes * layer->num_inputs);
+        for (int j = 0; j < layer->num_nodes; j++)
+        {
+            for (int k = 0; k < layer->num_inputs; k++)
+            {
+                masks[i][j * layer->num_inputs + k] = layer->w[j][k] != 0;
+            }
+        }
+    }
+
+    // A lower learning rate keeps the surviving weights close to the trained ones
+    int batch_start = 0;
+    for (int step = 0; step < steps; step++)
+    {
+        float loss = train_step(net, &train_data[batch_start], BATCH_SIZE, LEARNING_RATE * 0.2f);
+        apply_prune_mask(net, masks);
+        batch_start = (batch_start + BATCH_SIZE) % (TRAIN_DATA_LEN - BATCH_SIZE);
+        if (step % 250 == 0)
+        {
+            printf("Fine-tune step: %d, Loss: %.4f\n", step, loss);
+        }
+    }
+
+    for (int i = 0; i < net->num_layers; i++)
+    {
+        MEM_FREE(masks[i]);
+    }
+    MEM_FREE(masks);
+    free_mnist_data(train_data);
+}
+
+// Report accuracy and speed versus sparsity, then prune net to the target (unstructured) and save it
+void run_prune(Net *net, float sparsity, int finetune_steps, const char *test_path, const char *out_path)
+{
+    const float levels[] = {0.0f, 0.5f, 0.7f, 0.8f, 0.9f, 0.95f};
+    const int num_levels = sizeof(levels) / sizeof(levels[0]);
+
+    MnistRecord *test_data = load_mnist_data(test_path, TEST_DATA_LEN);
+    int timing_len = 2000;
+    MnistRecord *timing_data = test_data;
+    if (!test_data)
+    {
+        // Timings still work on blank images, accuracy is reported as n/a
+        timing_data = (MnistRecord *)MEM_CALLOC(timing_len, sizeof(MnistRecord));
+    }
+
+    PrunedNet dense = {};
+    pruned_net_init(&dense, net, SPARSE_FORMAT_DENSE);
+    double dense_us = pruned_net_latency_us(&dense, timing_data, timing_len);
+    pruned_net_free(&dense);
+
+    // Unstructured pruning runs on CSR, block pruning on the 4x8 block-sparse format
+    printf("Dense latency: %.2f us/img\n", dense_us);
+    printf("%-9s %-6s %-9s %-10s %-8s\n", "sparsity", "format", "accuracy", "us/img", "speedup");
+    for (int l = 0; l < num_levels; l++)
+    {
+        if (levels[l] > sparsity)
+            break;
+
+        for (int by_block = 0; by_block <= 1; by_block++)
+        {
+            Net pruned = {};
+            net_copy(&pruned, net);
+            float achieved = net_prune_magnitude(&pruned, levels[l], by_block);
+
+            PrunedNet pnet = {};
+            pruned_net_init(&pnet, &pruned, by_block ? SPARSE_FORMAT_BSR : SPARSE_FORMAT_CSR);
+            float accuracy = pruned_net_accuracy(&pnet, test_data, TEST_DATA_LEN);
+            double us = pruned_net_latency_us(&pnet, timing_data, timing_len);
+
+            char accuracy_str[16] = "n/a";
+            if (accuracy >= 0)
+            {
+                snprintf(accuracy_str, sizeof(accuracy_str), "%.4f", accuracy);
+            }
+            printf("%-9.3f %-6s %-9s %-10.2f %-8.2f\n", achieved, by_block ? "bsr" : "csr", accuracy_str, us, dense_us / us);
+
+            pruned_net_free(&pnet);
+            net_free(&pruned);
+        }
+    }
+
+    float achieved = net_prune_magnitude(net, sparsity, false);
+    if (finetune_steps > 0)
+    {
+        finetune_pruned(net, finetune_steps);
+    }
+
+    PrunedNet csr = {};
+    pruned_net_init(&csr, net, SPARSE_FORMAT_CSR);
+    printf("Final sparsity: %.3f", achieved);
+    if (test_data)
+    {
+        printf(", accuracy: %.4f", pruned_net_accuracy(&csr, test_data, TEST_DATA_LEN));
+    }
+    printf("\n");
+    pruned_net_free(&csr);
+
+    // Pruned weights are written as 0, which also shrinks the JSON file
+    if (!net_save(net, out_path))
+    {
+        printf("Failed to save network: %s\n", out_path);
+    }
+
+    MEM_FREE(timing_data != test_data ? timing_data : NULL);
+    free_mnist_data(test_data);
+}
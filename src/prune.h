@@ -0,0 +1,73 @@
+#ifndef PRUNE_H
+#define PRUNE_H
+
+#include <stdint.h>
+#include "nn.h"
+
+// Block shape of the block-sparse format (output rows x input columns)
+#define BSR_BLOCK_ROWS 4
+#define BSR_BLOCK_COLS 8
+
+typedef enum
+{
+    SPARSE_FORMAT_DENSE,
+    SPARSE_FORMAT_CSR,
+    SPARSE_FORMAT_BSR
+} SparseFormat;
+
+// Compressed sparse row weights, one row per output node
+typedef struct
+{
+    int num_rows, num_cols;
+    int *row_ptr; // num_rows + 1 entries
+    int *col_idx;
+    float *values;
+} CsrMatrix;
+
+// Block sparse row weights with dense BSR_BLOCK_ROWS x BSR_BLOCK_COLS blocks
+typedef struct
+{
+    int num_rows, num_cols;
+    int num_block_rows;
+    int *block_row_ptr; // num_block_rows + 1 entries
+    int *block_col_idx; // First input column of each block
+    float *values;      // Row-major blocks, zero padded at the edges
+} BsrMatrix;
+
+typedef struct
+{
+    SparseFormat format;
+    CsrMatrix csr;
+    BsrMatrix bsr;
+    Layer *dense; // Source layer, used for the dense format and biases
+} PrunedLayer;
+
+// Inference-only network with per-layer sparse weights
+typedef struct
+{
+    PrunedLayer *layers;
+    int num_layers;
+    int max_width;
+} PrunedNet;
+
+float layer_prune_magnitude(Layer *layer, float sparsity);
+float layer_prune_block_magnitude(Layer *layer, float sparsity);
+float net_prune_magnitude(Net *net, float sparsity, bool by_block);
+int layer_count_nonzero(Layer *layer);
+
+void csr_from_layer(CsrMatrix *csr, Layer *layer);
+void csr_free(CsrMatrix *csr);
+void csr_gemm(const CsrMatrix *csr, const float *bias, const float *x, int n, float *y);
+
+void bsr_from_layer(BsrMatrix *bsr, Layer *layer);
+void bsr_free(BsrMatrix *bsr);
+void bsr_gemm(const BsrMatrix *bsr, const float *bias, const float *x, int n, float *y);
+
+void pruned_net_init(PrunedNet *pnet, Net *net, SparseFormat format);
+void pruned_net_free(PrunedNet *pnet);
+void pruned_net_forward(PrunedNet *pnet, const float *inputs, int n, float *probs);
+void pruned_net_forward_scratch(PrunedNet *pnet, const float *inputs, int n, float *probs, float *scratch);
+
+void run_prune(Net *net, float sparsity, int finetune_steps, const char *test_path, const char *out_path);
+
+#endif
@@ -0,0 +1,115 @@
+#include "sampler.h"
+#include "configs.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mem.h"
+
+#define MEM_TAG MEM_TAG_TRAIN
+
+// Uniform in [0, 1)
+static double rand_unit()
+{
+    return (double)rand() / ((double)RAND_MAX + 1);
+}
+
+// Sum loss into the tree from scratch, clearing the rounding drift of incremental updates
+static void loss_sampler_rebuild(LossSampler *sampler)
+{
+    memset(sampler->tree, 0, (sampler->len + 1) * sizeof(double));
+    sampler->total = 0;
+    for (int i = 1; i <= sampler->len; i++)
+    {
+        sampler->tree[i] += sampler->loss[i - 1];
+        sampler->total += sampler->loss[i - 1];
+        int parent = i + (i & -i);
+        if (parent <= sampler->len)
+        {
+            sampler->tree[parent] += sampler->tree[i];
+        }
+    }
+    sampler->num_updates = 0;
+}
+
+// Every example starts at the loss of an untrained network, so the first draws are uniform
+void loss_sampler_init(LossSampler *sampler, int len, float uniform_mix)
+{
+    sampler->len = len;
+    sampler->uniform_mix = uniform_mix;
+    sampler->loss = (float *)MEM_MALLOC(len * sizeof(float));
+    sampler->tree = (double *)MEM_MALLOC((len + 1) * sizeof(double));
+    for (int i = 0; i < len; i++)
+    {
+        sampler->loss[i] = logf(MNIST_NUM_LABELS);
+    }
+    sampler->top_bit = 1;
+    while (sampler->top_bit * 2 <= len)
+    {
+        sampler->top_bit *= 2;
+    }
+    loss_sampler_rebuild(sampler);
+}
+
+void loss_sampler_free(LossSampler *sampler)
+{
+    MEM_FREE(sampler->loss);
+    MEM_FREE(sampler->tree);
+    memset(sampler, 0, sizeof(*sampler));
+}
+
+// Index of the example whose loss interval contains target, descending the tree in O(log n)
+static int loss_sampler_find(const LossSampler *sampler, double target)
+{
+    int pos = 0;
+    for (int bit = sampler->top_bit; bit > 0; bit >>= 1)
+    {
+        if (pos + bit <= sampler->len && sampler->tree[pos + bit] <= target)
+        {
+            pos += bit;
+            target -= sampler->tree[pos];
+        }
+    }
+    return pos < sampler->len ? pos : sampler->len - 1;
+}
+
+// Draw an example index, weight receives its importance weight 1 / (len * p)
+int loss_sampler_draw(LossSampler *sampler, float *weight)
+{
+    int index;
+    double share = 0; // Of the loss-proportional draws
+    if (sampler->total > 0)
+    {
+        index = rand_unit() < sampler->uniform_mix ? (int)(rand_unit() * sampler->len)
+                                                   : loss_sampler_find(sampler, rand_unit() * sampler->total);
+        share = sampler->loss[index] / sampler->total;
+    }
+    else
+    {
+        index = (int)(rand_unit() * sampler->len);
+        share = 1.0 / sampler->len;
+    }
+
+    double p = sampler->uniform_mix / sampler->len + (1 - sampler->uniform_mix) * share;
+    *weight = (float)(1 / (sampler->len * p));
+    return index;
+}
+
+// Record the loss just seen for an example
+void loss_sampler_update(LossSampler *sampler, int index, float loss)
+{
+    // Dropout on the output can push the loss slightly below zero
+    loss = fminf(fmaxf(loss, 0), SAMPLER_MAX_LOSS);
+    double delta = (double)loss - sampler->loss[index];
+    sampler->loss[index] = loss;
+    if (++sampler->num_updates >= sampler->len)
+    {
+        loss_sampler_rebuild(sampler);
+        return;
+    }
+
+    sampler->total += delta;
+    for (int i = index + 1; i <= sampler->len; i += i & -i)
+    {
+        sampler->tree[i] += delta;
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "nn.h"
+
+// Draws training examples with probability proportional to the loss last seen for them, mixed
+// with a uniform share so no example starves. Every draw comes with the weight 1 / (N p) that
+// keeps the weighted batch gradient an unbiased estimate of the full one.
+typedef struct
+{
+    int len;
+    float uniform_mix; // Share of draws made uniformly
+    float *loss;       // Last loss seen for each example
+    double *tree;      // Fenwick tree of loss sums, 1-based
+    double total;
+    int top_bit;     // Largest power of two <= len, where the tree descent starts
+    int num_updates; // Since the tree was last rebuilt from loss
+} LossSampler;
+
+void loss_sampler_init(LossSampler *sampler, int len, float uniform_mix);
+void loss_sampler_free(LossSampler *sampler);
+int loss_sampler_draw(LossSampler *sampler, float *weight);
+void loss_sampler_update(LossSampler *sampler, int index, float loss);
+
+#endif
@@ -0,0 +1,634 @@
+#include "scene.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <raylib.h>
+#include "configs.h"
+#include "nn.h"
+#include "viz.h"
+#include "mem.h"
+
+#define MEM_TAG MEM_TAG_VIZ
+
+#define NODE_SPACING 1.5f
+#define LAYER_GAP 12.0f
+#define CLOUD_CUBE_SIZE 0.2f
+#define LINE_THICKNESS 0.05f
+#define COLOR_POSITIVE ORANGE
+#define COLOR_NEGATIVE ((Color){80, 140, 255, 255})
+// Clip distances used by raylib for perspective cameras
+#define CULL_NEAR 0.01f
+#define CULL_FAR 1000.0f
+
+// Instancing shaders: the last row of each instance transform carries its RGBA color
+#if defined(__EMSCRIPTEN__)
+static const char *INSTANCE_VS =
+    "#version 100\n"
+    "attribute vec3 vertexPosition;\n"
+    "attribute mat4 instanceTransform;\n"
+    "uniform mat4 mvp;\n"
+    "varying vec4 fragColor;\n"
+    "void main()\n"
+    "{\n"
+    "    mat4 model = instanceTransform;\n"
+    "    fragColor = vec4(model[0][3], model[1][3], model[2][3], model[3][3]);\n"
+    "    model[0][3] = 0.0; model[1][3] = 0.0; model[2][3] = 0.0; model[3][3] = 1.0;\n"
+    "    gl_Position = mvp * model * vec4(vertexPosition, 1.0);\n"
+    "}\n";
+static const char *INSTANCE_FS =
+    "#version 100\n"
+    "precision mediump float;\n"
+    "varying vec4 fragColor;\n"
+    "void main() { gl_FragColor = fragColor; }\n";
+#else
+static const char *INSTANCE_VS =
+    "#version 330\n"
+    "in vec3 vertexPosition;\n"
+    "in mat4 instanceTransform;\n"
+    "uniform mat4 mvp;\n"
+    "out vec4 fragColor;\n"
+    "void main()\n"
+    "{\n"
+    "    mat4 model = instanceTransform;\n"
+    "    fragColor = vec4(model[0][3], model[1][3], model[2][3], model[3][3]);\n"
+    "    model[0][3] = 0.0; model[1][3] = 0.0; model[2][3] = 0.0; model[3][3] = 1.0;\n"
+    "    gl_Position = mvp * model * vec4(vertexPosition, 1.0);\n"
+    "}\n";
+static const char *INSTANCE_FS =
+    "#version 330\n"
+    "in vec4 fragColor;\n"
+    "out vec4 finalColor;\n"
+    "void main() { finalColor = fragColor; }\n";
+#endif
+
+// Axis-aligned box transform with the color packed into the last row
+static Matrix box_instance(Vector3 pos, float size, Color color)
+{
+    Matrix m = {0};
+    m.m0 = size;
+    m.m5 = size;
+    m.m10 = size;
+    m.m12 = pos.x;
+    m.m13 = pos.y;
+    m.m14 = pos.z;
+    m.m3 = color.r / 255.0f;
+    m.m7 = color.g / 255.0f;
+    m.m11 = color.b / 255.0f;
+    m.m15 = color.a / 255.0f;
+    return m;
+}
+
+// Thin box stretched from start to end, used for connection lines
+static Matrix line_instance(Vector3 start, Vector3 end, Color color)
+{
+    Vector3 d = {end.x - start.x, end.y - start.y, end.z - start.z};
+    float len = sqrtf(d.x * d.x + d.y * d.y + d.z * d.z);
+    Vector3 z = {d.x / len, d.y / len, d.z / len};
+
+    // Any vector not parallel to z completes the basis
+    Vector3 up = fabsf(z.y) < 0.99f ? (Vector3){0, 1, 0} : (Vector3){1, 0, 0};
+    Vector3 x = {up.y * z.z - up.z * z.y, up.z * z.x - up.x * z.z, up.x * z.y - up.y * z.x};
+    float x_len = sqrtf(x.x * x.x + x.y * x.y + x.z * x.z);
+    x = (Vector3){x.x / x_len, x.y / x_len, x.z / x_len};
+    Vector3 y = {z.y * x.z - z.z * x.y, z.z * x.x - z.x * x.z, z.x * x.y - z.y * x.x};
+
+    Matrix m = {0};
+    m.m0 = x.x * LINE_THICKNESS;
+    m.m1 = x.y * LINE_THICKNESS;
+    m.m2 = x.z * LINE_THICKNESS;
+    m.m4 = y.x * LINE_THICKNESS;
+    m.m5 = y.y * LINE_THICKNESS;
+    m.m6 = y.z * LINE_THICKNESS;
+    m.m8 = z.x * len;
+    m.m9 = z.y * len;
+    m.m10 = z.z * len;
+    m.m12 = (start.x + end.x) / 2;
+    m.m13 = (start.y + end.y) / 2;
+    m.m14 = (start.z + end.z) / 2;
+    m.m3 = color.r / 255.0f;
+    m.m7 = color.g / 255.0f;
+    m.m11 = color.b / 255.0f;
+    m.m15 = color.a / 255.0f;
+    return m;
+}
+
+static Color lerp_color(Color a, Color b, float t)
+{
+    t = fminf(fmaxf(t, 0), 1);
+    return (Color){
+        (unsigned char)(a.r + (b.r - a.r) * t),
+        (unsigned char)(a.g + (b.g - a.g) * t),
+        (unsigned char)(a.b + (b.b - a.b) * t),
+        (unsigned char)(a.a + (b.a - a.a) * t),
+    };
+}
+
+static float max_abs(const float *values, int len)
+{
+    float result = 0;
+    for (int i = 0; i < len; i++)
+    {
+        result = fmaxf(result, fabsf(values[i]));
+    }
+    return result;
+}
+
+// Weight or contribution with its position in the layer (node * num_inputs + input)
+typedef struct
+{
+    float magnitude;
+    float value;
+    int index;
+} Ranked;
+
+static int compare_ranked_desc(const void *a, const void *b)
+{
+    float ma = ((const Ranked *)a)->magnitude;
+    float mb = ((const Ranked *)b)->magnitude;
+    return (ma < mb) - (ma > mb);
+}
+
+// Keep the cap largest items seen so far in a min-heap
+static void heap_push_top(Ranked *heap, int *len, int cap, Ranked item)
+{
+    int i;
+    if (*len < cap)
+    {
+        i = (*len)++;
+        while (i > 0 && heap[(i - 1) / 2].magnitude > item.magnitude)
+        {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = item;
+        return;
+    }
+    if (item.magnitude <= heap[0].magnitude)
+        return;
+
+    i = 0;
+    while (true)
+    {
+        int child = 2 * i + 1;
+        if (child >= *len)
+            break;
+        if (child + 1 < *len && heap[child + 1].magnitude < heap[child].magnitude)
+            child++;
+        if (heap[child].magnitude >= item.magnitude)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = item;
+}
+
+// Number of leading entries of a descending array that are >= threshold
+static int count_at_least(const float *sorted, int len, float threshold)
+{
+    int lo = 0;
+    int hi = len;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (sorted[mid] >= threshold)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static BoundingBox bounds_of_points(const Vector3 *points, int len, float margin)
+{
+    BoundingBox box = {points[0], points[0]};
+    for (int i = 1; i < len; i++)
+    {
+        box.min = (Vector3){fminf(box.min.x, points[i].x), fminf(box.min.y, points[i].y), fminf(box.min.z, points[i].z)};
+        box.max = (Vector3){fmaxf(box.max.x, points[i].x), fmaxf(box.max.y, points[i].y), fmaxf(box.max.z, points[i].z)};
+    }
+    box.min = (Vector3){box.min.x - margin, box.min.y - margin, box.min.z - margin};
+    box.max = (Vector3){box.max.x + margin, box.max.y + margin, box.max.z + margin};
+    return box;
+}
+
+static BoundingBox bounds_union(BoundingBox a, BoundingBox b)
+{
+    return (BoundingBox){
+        {fminf(a.min.x, b.min.x), fminf(a.min.y, b.min.y), fminf(a.min.z, b.min.z)},
+        {fmaxf(a.max.x, b.max.x), fmaxf(a.max.y, b.max.y), fmaxf(a.max.z, b.max.z)},
+    };
+}
+
+// Build the GPU resources and static layout for a model
+void scene_init(Scene *scene, Net *net)
+{
+    memset(scene, 0, sizeof(*scene));
+
+    scene->cube = GenMeshCube(1.0f, 1.0f, 1.0f);
+    scene->material = LoadMaterialDefault();
+    Shader shader = LoadShaderFromMemory(INSTANCE_VS, INSTANCE_FS);
+    shader.locs[SHADER_LOC_MATRIX_MVP] = GetShaderLocation(shader, "mvp");
+    shader.locs[SHADER_LOC_MATRIX_MODEL] = GetShaderLocationAttrib(shader, "instanceTransform");
+    scene->material.shader = shader;
+
+    Layer *first = &net->layers[0];
+    scene->num_layers = net->num_layers + 1;
+    scene->num_cloud_slabs = first->num_nodes;
+    scene->cloud_slab_len = first->num_inputs;
+    scene->num_slabs = scene->num_layers + net->num_layers + scene->num_cloud_slabs;
+    scene->slab_bounds = (BoundingBox *)MEM_CALLOC(scene->num_slabs, sizeof(BoundingBox));
+    scene->slab_dist = (float *)MEM_CALLOC(scene->num_slabs, sizeof(float));
+    scene->slab_visible = (bool *)MEM_CALLOC(scene->num_slabs, sizeof(bool));
+    scene->draw_order = (int *)MEM_MALLOC(scene->num_slabs * sizeof(int));
+    for (int i = 0; i < scene->num_slabs; i++)
+    {
+        scene->draw_order[i] = i;
+    }
+
+    // Layer grids, the input image first
+    scene->layers = (LayerViz *)MEM_CALLOC(scene->num_layers, sizeof(LayerViz));
+    scene->node_pos = (Vector3 **)MEM_CALLOC(scene->num_layers, sizeof(Vector3 *));
+    scene->layer_sizes = (int *)MEM_CALLOC(scene->num_layers, sizeof(int));
+    BoundingBox *node_bounds = scene->slab_bounds;
+    for (int l = 0; l < scene->num_layers; l++)
+    {
+        LayerViz *lv = &scene->layers[l];
+        int num_nodes = l == 0 ? MNIST_IMG_DATA_LEN : net->layers[l - 1].num_nodes;
+        lv->index = l;
+        lv->columns = l == 0 ? MNIST_IMG_SIZE : (int)ceilf(sqrtf((float)num_nodes));
+        lv->rows = (num_nodes + lv->columns - 1) / lv->columns;
+        lv->depth = 1;
+        lv->z_offset = (l - (scene->num_layers - 1) / 2.0f) * LAYER_GAP;
+        lv->grid_color = l == 0 ? (Color){200, 200, 200, 60} : (Color){120, 160, 255, 90};
+
+        float spacing = l == 0 ? 1.0f : NODE_SPACING;
+        scene->node_pos[l] = (Vector3 *)MEM_MALLOC(num_nodes * sizeof(Vector3));
+        for (int n = 0; n < num_nodes; n++)
+        {
+            int r = n / lv->columns;
+            int c = n % lv->columns;
+            scene->node_pos[l][n] = (Vector3){
+                (c - (lv->columns - 1) / 2.0f) * spacing,
+                ((lv->rows - 1) / 2.0f - r) * spacing,
+                lv->z_offset,
+            };
+        }
+        node_bounds[l] = bounds_of_points(scene->node_pos[l], num_nodes, spacing);
+        scene->layer_sizes[l] = num_nodes;
+        scene->num_nodes += num_nodes;
+    }
+
+    // Connections span the gap between consecutive layers
+    BoundingBox *line_bounds = &node_bounds[scene->num_layers];
+    for (int l = 0; l < net->num_layers; l++)
+    {
+        line_bounds[l] = bounds_union(node_bounds[l], node_bounds[l + 1]);
+    }
+
+    // Weight cloud: each first layer weight sits above its pixel, one slab per node
+    BoundingBox *cloud_bounds = &line_bounds[net->num_layers];
+    for (int j = 0; j < scene->num_cloud_slabs; j++)
+    {
+        cloud_bounds[j] = node_bounds[0];
+        cloud_bounds[j].min.z = cloud_bounds[j].max.z = scene->layers[0].z_offset + LAYER_GAP * (j + 1) / (scene->num_cloud_slabs + 1);
+    }
+}
+
+void scene_free(Scene *scene)
+{
+    for (int l = 0; l < scene->num_layers; l++)
+    {
+        MEM_FREE(scene->node_pos[l]);
+    }
+    MEM_FREE(scene->node_pos);
+    MEM_FREE(scene->layer_sizes);
+    MEM_FREE(scene->layers);
+    MEM_FREE(scene->slab_bounds);
+    MEM_FREE(scene->slab_dist);
+    MEM_FREE(scene->slab_visible);
+    MEM_FREE(scene->draw_order);
+    UnloadMaterial(scene->material); // Also unloads the instancing shader
+    UnloadMesh(scene->cube);
+    memset(scene, 0, sizeof(*scene));
+}
+
+// Allocate the instance buffers of one frame, CPU only so any thread may fill it
+void scene_frame_init(Scene *scene, SceneFrame *frame)
+{
+    memset(frame, 0, sizeof(*frame));
+    int num_line_slabs = scene->num_layers - 1;
+    int num_cloud = scene->num_cloud_slabs * scene->cloud_slab_len;
+
+    frame->node_instances = (Matrix *)MEM_MALLOC(scene->num_nodes * sizeof(Matrix));
+    frame->line_instances = (Matrix *)MEM_MALLOC(num_line_slabs * CONNECTION_LINES_THRESHOLD * sizeof(Matrix));
+    frame->line_magnitudes = (float *)MEM_MALLOC(num_line_slabs * CONNECTION_LINES_THRESHOLD * sizeof(float));
+    frame->cloud_instances = (Matrix *)MEM_MALLOC(num_cloud * sizeof(Matrix));
+    frame->cloud_magnitudes = (float *)MEM_MALLOC(num_cloud * sizeof(float));
+
+    frame->slabs = (SceneSlab *)MEM_CALLOC(scene->num_slabs, sizeof(SceneSlab));
+    frame->node_slabs = frame->slabs;
+    frame->line_slabs = frame->node_slabs + scene->num_layers;
+    frame->cloud_slabs = frame->line_slabs + num_line_slabs;
+
+    int node_offset = 0;
+    for (int l = 0; l < scene->num_layers; l++)
+    {
+        SceneSlab *slab = &frame->node_slabs[l];
+        slab->instances = &frame->node_instances[node_offset];
+        slab->len = scene->layer_sizes[l];
+        node_offset += slab->len;
+    }
+
+    for (int l = 0; l < num_line_slabs; l++)
+    {
+        SceneSlab *slab = &frame->line_slabs[l];
+        slab->instances = &frame->line_instances[l * CONNECTION_LINES_THRESHOLD];
+        slab->magnitudes = &frame->line_magnitudes[l * CONNECTION_LINES_THRESHOLD];
+    }
+    for (int j = 0; j < scene->num_cloud_slabs; j++)
+    {
+        SceneSlab *slab = &frame->cloud_slabs[j];
+        slab->instances = &frame->cloud_instances[j * scene->cloud_slab_len];
+        slab->magnitudes = &frame->cloud_magnitudes[j * scene->cloud_slab_len];
+        slab->len = scene->cloud_slab_len;
+    }
+
+    frame->last_generation = -1;
+    frame->last_weights_version = -1;
+}
+
+void scene_frame_free(SceneFrame *frame)
+{
+    MEM_FREE(frame->node_instances);
+    MEM_FREE(frame->line_instances);
+    MEM_FREE(frame->line_magnitudes);
+    MEM_FREE(frame->cloud_instances);
+    MEM_FREE(frame->cloud_magnitudes);
+    MEM_FREE(frame->slabs);
+    memset(frame, 0, sizeof(*frame));
+}
+
+// Sort each node's first layer weights by magnitude, so the weight cloud threshold only picks a prefix
+static void update_weight_cloud(Scene *scene, SceneFrame *frame, Net *net)
+{
+    Layer *first = &net->layers[0];
+    Ranked *ranked = (Ranked *)MEM_MALLOC(first->num_inputs * sizeof(Ranked));
+
+    frame->cloud_max_magnitude = 0;
+    for (int j = 0; j < first->num_nodes; j++)
+    {
+        frame->cloud_max_magnitude = fmaxf(frame->cloud_max_magnitude, max_abs(first->w[j], first->num_inputs));
+    }
+
+    BoundingBox *cloud_bounds = &scene->slab_bounds[scene->num_slabs - scene->num_cloud_slabs];
+    for (int j = 0; j < first->num_nodes; j++)
+    {
+        SceneSlab *slab = &frame->cloud_slabs[j];
+        for (int k = 0; k < first->num_inputs; k++)
+        {
+            ranked[k] = (Ranked){fabsf(first->w[j][k]), first->w[j][k], k};
+        }
+        qsort(ranked, first->num_inputs, sizeof(Ranked), compare_ranked_desc);
+
+        for (int i = 0; i < first->num_inputs; i++)
+        {
+            Vector3 pixel = scene->node_pos[0][ranked[i].index];
+            Color color = ranked[i].value > 0 ? COLOR_POSITIVE : COLOR_NEGATIVE;
+            if (frame->cloud_max_magnitude > 0)
+            {
+                color.a = (unsigned char)(ranked[i].magnitude / frame->cloud_max_magnitude * 255);
+            }
+            slab->magnitudes[i] = ranked[i].magnitude;
+            slab->instances[i] = box_instance((Vector3){pixel.x, pixel.y, cloud_bounds[j].min.z}, CLOUD_CUBE_SIZE, color);
+        }
+    }
+
+    MEM_FREE(ranked);
+}
+
+// Keep the strongest contributions of a layer, sorted so the threshold only picks a prefix
+static void update_layer_connections(Scene *scene, SceneFrame *frame, Layer *contribs, int l)
+{
+    SceneSlab *slab = &frame->line_slabs[l];
+    Ranked heap[CONNECTION_LINES_THRESHOLD];
+    int len = 0;
+
+    float max_val = 0;
+    for (int j = 0; j < contribs->num_nodes; j++)
+    {
+        max_val = fmaxf(max_val, max_abs(contribs->w[j], contribs->num_inputs));
+    }
+
+    for (int j = 0; max_val > 0 && j < contribs->num_nodes; j++)
+    {
+        for (int k = 0; k < contribs->num_inputs; k++)
+        {
+            float value = contribs->w[j][k] / max_val;
+            if (value != 0)
+            {
+                heap_push_top(heap, &len, CONNECTION_LINES_THRESHOLD, (Ranked){fabsf(value), value, j * contribs->num_inputs + k});
+            }
+        }
+    }
+    qsort(heap, len, sizeof(Ranked), compare_ranked_desc);
+
+    for (int i = 0; i < len; i++)
+    {
+        int j = heap[i].index / contribs->num_inputs;
+        int k = heap[i].index % contribs->num_inputs;
+        Color color = heap[i].value > 0 ? COLOR_POSITIVE : COLOR_NEGATIVE;
+        color.a = (unsigned char)(heap[i].magnitude * 255);
+        slab->magnitudes[i] = heap[i].magnitude;
+        slab->instances[i] = line_instance(scene->node_pos[l][k], scene->node_pos[l + 1][j], color);
+    }
+    slab->len = len;
+}
+
+// Node cubes colored by activation
+static void update_node_colors(Scene *scene, SceneFrame *frame, VizCache *cache, Flags *flags, Thresholds *thresholds)
+{
+    float activation_threshold = map_threshold_value(thresholds->activations, 0, 1);
+    for (int l = 0; l < scene->num_layers; l++)
+    {
+        SceneSlab *slab = &frame->node_slabs[l];
+        float *values = cache->activations[l];
+        float max_val = max_abs(values, slab->len);
+        float size = l == 0 ? 0.9f : 1.2f;
+
+        for (int n = 0; n < slab->len; n++)
+        {
+            float value = max_val > 0 ? values[n] / max_val : 0;
+            Color color = scene->layers[l].grid_color;
+            if (flags->draw_node_activations && value >= activation_threshold)
+            {
+                color = lerp_color(color, ORANGE, value);
+            }
+            if (l == scene->num_layers - 1 && n == cache->prediction_idx)
+            {
+                color = GREEN;
+            }
+            slab->instances[n] = box_instance(scene->node_pos[l][n], size, color);
+        }
+    }
+}
+
+// Bring a frame's instance data up to date with the cache. Each frame tracks what it was built
+// from, so a frame that missed several updates still catches up; threshold changes only move
+// the drawn prefix of each sorted slab.
+void scene_update(Scene *scene, SceneFrame *frame, Net *net, VizCache *cache, Flags *flags, Thresholds *thresholds)
+{
+    bool is_new_input = frame->last_generation != cache->generation;
+
+    if (frame->last_weights_version != cache->weights_version)
+    {
+        update_weight_cloud(scene, frame, net);
+        frame->last_weights_version = cache->weights_version;
+    }
+
+    if (flags->draw_connections && (is_new_input || !frame->last_flags.draw_connections))
+    {
+        for (int l = 0; l < net->num_layers; l++)
+        {
+            update_layer_connections(scene, frame, &cache->contribs.layers[l], l);
+        }
+    }
+
+    if (flags->draw_cubes &&
+        (is_new_input || !frame->last_flags.draw_cubes ||
+         flags->draw_node_activations != frame->last_flags.draw_node_activations ||
+         thresholds->activations != frame->last_thresholds.activations))
+    {
+        update_node_colors(scene, frame, cache, flags, thresholds);
+    }
+
+    frame->last_generation = cache->generation;
+    frame->last_flags = *flags;
+    frame->last_thresholds = *thresholds;
+
+    float connection_threshold = map_threshold_value(thresholds->connections, 0, 1);
+    float cloud_threshold = map_threshold_value(thresholds->weight_cloud, 0, frame->cloud_max_magnitude);
+    for (int l = 0; l < scene->num_layers; l++)
+    {
+        frame->node_slabs[l].count = flags->draw_cubes ? frame->node_slabs[l].len : 0;
+    }
+    for (int l = 0; l < net->num_layers; l++)
+    {
+        SceneSlab *slab = &frame->line_slabs[l];
+        slab->count = flags->draw_connections ? count_at_least(slab->magnitudes, slab->len, connection_threshold) : 0;
+    }
+    for (int j = 0; j < scene->num_cloud_slabs; j++)
+    {
+        SceneSlab *slab = &frame->cloud_slabs[j];
+        slab->count = flags->draw_weight_cloud ? count_at_least(slab->magnitudes, slab->len, cloud_threshold) : 0;
+    }
+}
+
+// Inward facing frustum planes (normal, offset) of a perspective camera, false when the view is degenerate
+static bool camera_frustum(Camera3D *camera, Vector4 planes[6])
+{
+    Vector3 eye = camera->position;
+    Vector3 f = {camera->target.x - eye.x, camera->target.y - eye.y, camera->target.z - eye.z};
+    float f_len = sqrtf(f.x * f.x + f.y * f.y + f.z * f.z);
+    if (f_len == 0)
+        return false;
+    f = (Vector3){f.x / f_len, f.y / f_len, f.z / f_len};
+
+    Vector3 up = camera->up;
+    Vector3 r = {f.y * up.z - f.z * up.y, f.z * up.x - f.x * up.z, f.x * up.y - f.y * up.x};
+    float r_len = sqrtf(r.x * r.x + r.y * r.y + r.z * r.z);
+    if (r_len < 1e-6f)
+        return false; // Looking along the up vector
+    r = (Vector3){r.x / r_len, r.y / r_len, r.z / r_len};
+    Vector3 u = {r.y * f.z - r.z * f.y, r.z * f.x - r.x * f.z, r.x * f.y - r.y * f.x};
+
+    float tan_y = tanf(camera->fovy * DEG2RAD / 2);
+    float tan_x = tan_y * GetRenderWidth() / fmaxf(GetRenderHeight(), 1);
+
+    Vector3 normals[6] = {
+        f,
+        {-f.x, -f.y, -f.z},
+        {f.x * tan_x + r.x, f.y * tan_x + r.y, f.z * tan_x + r.z},
+        {f.x * tan_x - r.x, f.y * tan_x - r.y, f.z * tan_x - r.z},
+        {f.x * tan_y + u.x, f.y * tan_y + u.y, f.z * tan_y + u.z},
+        {f.x * tan_y - u.x, f.y * tan_y - u.y, f.z * tan_y - u.z},
+    };
+    for (int i = 0; i < 6; i++)
+    {
+        Vector3 n = normals[i];
+        planes[i] = (Vector4){n.x, n.y, n.z, -(n.x * eye.x + n.y * eye.y + n.z * eye.z)};
+    }
+    planes[0].w -= CULL_NEAR;
+    planes[1].w += CULL_FAR;
+    return true;
+}
+
+static bool is_box_in_frustum(BoundingBox box, Vector4 planes[6])
+{
+    for (int i = 0; i < 6; i++)
+    {
+        Vector4 p = planes[i];
+        // Corner furthest along the plane normal
+        float x = p.x > 0 ? box.max.x : box.min.x;
+        float y = p.y > 0 ? box.max.y : box.min.y;
+        float z = p.z > 0 ? box.max.z : box.min.z;
+        if (p.x * x + p.y * y + p.z * z + p.w < 0)
+            return false;
+    }
+    return true;
+}
+
+// Draw the visible slabs back to front, call between BeginMode3D and EndMode3D
+void scene_draw(Scene *scene, SceneFrame *frame, Flags *flags, Camera3D *camera)
+{
+    Vector4 planes[6];
+    bool can_cull = camera_frustum(camera, planes);
+
+    for (int i = 0; i < scene->num_slabs; i++)
+    {
+        BoundingBox bounds = scene->slab_bounds[i];
+        Vector3 center = {
+            (bounds.min.x + bounds.max.x) / 2,
+            (bounds.min.y + bounds.max.y) / 2,
+            (bounds.min.z + bounds.max.z) / 2,
+        };
+        scene->slab_dist[i] = calc_vec3_dist_squared(center, camera->position);
+        scene->slab_visible[i] = !can_cull || is_box_in_frustum(bounds, planes);
+    }
+
+    // The camera moves little between frames, so insertion sort on last frame's order is near linear
+    for (int i = 1; i < scene->num_slabs; i++)
+    {
+        int idx = scene->draw_order[i];
+        float dist = scene->slab_dist[idx];
+        int j = i - 1;
+        while (j >= 0 && scene->slab_dist[scene->draw_order[j]] < dist)
+        {
+            scene->draw_order[j + 1] = scene->draw_order[j];
+            j--;
+        }
+        scene->draw_order[j + 1] = idx;
+    }
+
+    for (int i = 0; i < scene->num_slabs; i++)
+    {
+        int idx = scene->draw_order[i];
+        SceneSlab *slab = &frame->slabs[idx];
+        if (scene->slab_visible[idx] && slab->count > 0)
+        {
+            DrawMeshInstanced(scene->cube, scene->material, slab->instances, slab->count);
+        }
+    }
+
+    // One wireframe box per visible layer
+    for (int l = 0; flags->draw_cube_lines && l < scene->num_layers; l++)
+    {
+        LayerViz *lv = &scene->layers[l];
+        if (!scene->slab_visible[l])
+            continue;
+
+        float spacing = l == 0 ? 1.0f : NODE_SPACING;
+        Vector3 size = {lv->columns * spacing, lv->rows * spacing, 1.5f};
+        DrawCubeWiresV((Vector3){0, 0, lv->z_offset}, size, lv->grid_color);
+    }
+}
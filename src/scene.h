@@ -0,0 +1,70 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <stdbool.h>
+#include <raylib.h>
+#include "nn.h"
+#include "viz.h"
+
+// Group of instances at roughly the same depth, culled and depth ordered as a whole
+typedef struct
+{
+    Matrix *instances;
+    float *magnitudes; // Sorted descending, one per instance (NULL: not threshold filtered)
+    int len;
+    int count; // Instances drawn, the prefix of len passing the threshold
+} SceneSlab;
+
+// GPU resources and static layout, built once per model and owned by the render thread.
+// Slabs are the node grid of each layer, then the connections between consecutive layers,
+// then the weight cloud of each first layer node.
+typedef struct
+{
+    Mesh cube;
+    Material material;
+
+    LayerViz *layers; // Input grid first, then one per network layer
+    int num_layers;
+    Vector3 **node_pos;
+    int *layer_sizes; // Nodes per layer, the input grid first
+    int num_nodes;
+
+    int num_slabs;
+    int num_cloud_slabs;
+    int cloud_slab_len;
+    BoundingBox *slab_bounds;
+    float *slab_dist; // Squared distance to the camera, refreshed per draw
+    bool *slab_visible;
+    int *draw_order; // Back to front, kept from the previous frame
+} Scene;
+
+// Per-frame instance data, written by whoever computes the frame and then only read by the renderer
+typedef struct
+{
+    Matrix *node_instances;
+    Matrix *line_instances;
+    float *line_magnitudes;
+    Matrix *cloud_instances;
+    float *cloud_magnitudes;
+    float cloud_max_magnitude;
+
+    SceneSlab *slabs; // Same order as the scene's slab bounds
+    SceneSlab *node_slabs;
+    SceneSlab *line_slabs;
+    SceneSlab *cloud_slabs;
+
+    // Inputs of the last instance update, to skip unchanged work
+    int last_generation;
+    int last_weights_version;
+    Flags last_flags;
+    Thresholds last_thresholds;
+} SceneFrame;
+
+void scene_init(Scene *scene, Net *net);
+void scene_free(Scene *scene);
+void scene_frame_init(Scene *scene, SceneFrame *frame);
+void scene_frame_free(SceneFrame *frame);
+void scene_update(Scene *scene, SceneFrame *frame, Net *net, VizCache *cache, Flags *flags, Thresholds *thresholds);
+void scene_draw(Scene *scene, SceneFrame *frame, Flags *flags, Camera3D *camera);
+
+#endif
@@ -0,0 +1,697 @@
+#include "server.h"
+#include "nn.h"
+#include "prune.h"
+#include "bench.h"
+#include "train.h"
+#include "configs.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mem.h"
+
+#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+#define SERVER_UNSUPPORTED
+#else
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#define MEM_TAG MEM_TAG_SERVER
+
+// The accept loop checks for shutdown this often
+#define SERVER_POLL_MS 100
+
+ServerConfig server_config_default()
+{
+    return (ServerConfig){
+        .socket_path = SERVER_SOCKET_PATH,
+        .port = 0,
+        .num_workers = SERVER_NUM_WORKERS,
+        .max_batch = SERVER_MAX_BATCH,
+        .max_latency_us = SERVER_MAX_LATENCY_US,
+    };
+}
+
+#ifndef SERVER_UNSUPPORTED
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// A connection's pending request, queued for the batcher and answered in place
+typedef struct Request
+{
+    float pixels[MNIST_IMG_DATA_LEN];
+    float probs[MNIST_NUM_LABELS];
+    double enqueue_time;
+    struct timespec deadline; // CLOCK_REALTIME, latest start of the batch holding this request
+    bool done;
+    pthread_cond_t done_cond;
+    struct Request *next;
+} Request;
+
+typedef struct Connection
+{
+    struct Server *server;
+    int fd;
+    Request request;
+    struct Connection *prev;
+    struct Connection *next;
+} Connection;
+
+struct Server
+{
+    ServerConfig config;
+    PrunedNet pnet; // Dense batched kernels over the caller's net
+    int listen_fd;
+    atomic_bool accepting;
+    pthread_t accept_thread;
+    pthread_t *workers;
+
+    // Everything below is guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t ready_cond; // Requests queued and no worker is collecting a batch
+    pthread_cond_t full_cond;  // The batch being collected is full
+    pthread_cond_t idle_cond;  // A connection closed
+    Request *head;
+    Request *tail;
+    int queue_len;
+    bool collecting; // One worker at a time holds a batch open, the others compute
+    bool quit;
+    Connection *connections;
+    int num_connections;
+    ServerStats stats;
+};
+
+static bool read_full(int fd, void *buf, size_t len)
+{
+    char *p = (char *)buf;
+    while (len > 0)
+    {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    while (len > 0)
+    {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+// Fill in a Unix or loopback TCP address for config, returns its length or 0 when invalid
+static socklen_t server_address(const ServerConfig *config, struct sockaddr_storage *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    if (config->port > 0)
+    {
+        struct sockaddr_in *in = (struct sockaddr_in *)addr;
+        in->sin_family = AF_INET;
+        in->sin_port = htons((uint16_t)config->port);
+        in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        return sizeof(*in);
+    }
+
+    struct sockaddr_un *un = (struct sockaddr_un *)addr;
+    if (strlen(config->socket_path) >= sizeof(un->sun_path))
+    {
+        printf("Socket path too long: %s\n", config->socket_path);
+        return 0;
+    }
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, config->socket_path);
+    return sizeof(*un);
+}
+
+static void set_nodelay(int fd, const ServerConfig *config)
+{
+    if (config->port > 0)
+    {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+}
+
+static int listen_socket(const ServerConfig *config)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len = server_address(config, &addr);
+    if (addr_len == 0)
+        return -1;
+
+    int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    if (config->port > 0)
+    {
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    else
+    {
+        unlink(config->socket_path); // Left behind by a server that did not shut down cleanly
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, addr_len) != 0 || listen(fd, SOMAXCONN) != 0)
+    {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void timespec_add_us(struct timespec *ts, long us)
+{
+    ts->tv_sec += us / 1000000;
+    ts->tv_nsec += (us % 1000000) * 1000;
+    if (ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+// Queue a request and wait until a worker has filled in its probabilities
+static void submit_request(Server *server, Request *request)
+{
+    request->done = false;
+    request->next = NULL;
+    request->enqueue_time = get_time_sec();
+    clock_gettime(CLOCK_REALTIME, &request->deadline);
+    timespec_add_us(&request->deadline, server->config.max_latency_us);
+
+    pthread_mutex_lock(&server->lock);
+    if (server->tail)
+        server->tail->next = request;
+    else
+        server->head = request;
+    server->tail = request;
+    server->queue_len++;
+
+    if (!server->collecting)
+        pthread_cond_signal(&server->ready_cond);
+    else if (server->queue_len >= server->config.max_batch)
+        pthread_cond_signal(&server->full_cond);
+
+    while (!request->done)
+    {
+        pthread_cond_wait(&request->done_cond, &server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+}
+
+// Wait for a request, then hold the batch open until it is full or the oldest request's
+// latency budget runs out. Returns 0 once the server quits.
+static int next_batch(Server *server, Request **batch)
+{
+    int max_batch = server->config.max_batch;
+
+    pthread_mutex_lock(&server->lock);
+    while (!server->quit && (server->queue_len == 0 || server->collecting))
+    {
+        pthread_cond_wait(&server->ready_cond, &server->lock);
+    }
+    if (server->quit)
+    {
+        pthread_mutex_unlock(&server->lock);
+        return 0;
+    }
+
+    server->collecting = true;
+    while (server->queue_len < max_batch)
+    {
+        if (pthread_cond_timedwait(&server->full_cond, &server->lock, &server->head->deadline) == ETIMEDOUT)
+            break;
+    }
+
+    int n = 0;
+    double now = get_time_sec();
+    while (n < max_batch && server->head)
+    {
+        Request *request = server->head;
+        server->head = request->next;
+        server->stats.queue_sec += now - request->enqueue_time;
+        batch[n++] = request;
+    }
+    if (!server->head)
+    {
+        server->tail = NULL;
+    }
+    server->queue_len -= n;
+    server->stats.num_requests += n;
+    server->stats.num_batches++;
+
+    // Hand any overflow to the next idle worker
+    server->collecting = false;
+    if (server->queue_len > 0)
+    {
+        pthread_cond_signal(&server->ready_cond);
+    }
+    pthread_mutex_unlock(&server->lock);
+    return n;
+}
+
+static void *worker_main(void *arg)
+{
+    Server *server = (Server *)arg;
+    int max_batch = server->config.max_batch;
+    Request **batch = (Request **)MEM_MALLOC(max_batch * sizeof(Request *));
+    float *inputs = (float *)MEM_MALLOC(max_batch * MNIST_IMG_DATA_LEN * sizeof(float));
+    float *probs = (float *)MEM_MALLOC(max_batch * MNIST_NUM_LABELS * sizeof(float));
+    float *scratch = (float *)MEM_MALLOC(2 * max_batch * server->pnet.max_width * sizeof(float));
+
+    int n;
+    while ((n = next_batch(server, batch)) > 0)
+    {
+        for (int s = 0; s < n; s++)
+        {
+            memcpy(&inputs[s * MNIST_IMG_DATA_LEN], batch[s]->pixels, sizeof(batch[s]->pixels));
+        }
+        pruned_net_forward_scratch(&server->pnet, inputs, n, probs, scratch);
+
+        pthread_mutex_lock(&server->lock);
+        for (int s = 0; s < n; s++)
+        {
+            memcpy(batch[s]->probs, &probs[s * MNIST_NUM_LABELS], sizeof(batch[s]->probs));
+            batch[s]->done = true;
+            pthread_cond_signal(&batch[s]->done_cond);
+        }
+        pthread_mutex_unlock(&server->lock);
+    }
+
+    MEM_FREE(batch);
+    MEM_FREE(inputs);
+    MEM_FREE(probs);
+    MEM_FREE(scratch);
+    return NULL;
+}
+
+static void *connection_main(void *arg)
+{
+    Connection *conn = (Connection *)arg;
+    Server *server = conn->server;
+    uint8_t pixels[MNIST_IMG_DATA_LEN];
+
+    while (read_full(conn->fd, pixels, sizeof(pixels)))
+    {
+        for (int i = 0; i < MNIST_IMG_DATA_LEN; i++)
+        {
+            conn->request.pixels[i] = pixels[i] / 255.0f;
+        }
+        submit_request(server, &conn->request);
+        if (!write_full(conn->fd, conn->request.probs, sizeof(conn->request.probs)))
+            break;
+    }
+
+    pthread_mutex_lock(&server->lock);
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        server->connections = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    server->num_connections--;
+    pthread_cond_signal(&server->idle_cond);
+    pthread_mutex_unlock(&server->lock);
+
+    close(conn->fd);
+    pthread_cond_destroy(&conn->request.done_cond);
+    MEM_FREE(conn);
+    return NULL;
+}
+
+// Accept connections until server_stop, each one is read on its own thread
+static void *accept_main(void *arg)
+{
+    Server *server = (Server *)arg;
+    struct pollfd pfd = {.fd = server->listen_fd, .events = POLLIN};
+
+    while (atomic_load(&server->accepting))
+    {
+        if (poll(&pfd, 1, SERVER_POLL_MS) <= 0)
+            continue;
+
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        set_nodelay(fd, &server->config);
+
+        Connection *conn = (Connection *)MEM_CALLOC(1, sizeof(Connection));
+        conn->server = server;
+        conn->fd = fd;
+        pthread_cond_init(&conn->request.done_cond, NULL);
+
+        pthread_mutex_lock(&server->lock);
+        conn->next = server->connections;
+        if (server->connections)
+        {
+            server->connections->prev = conn;
+        }
+        server->connections = conn;
+        server->num_connections++;
+        pthread_mutex_unlock(&server->lock);
+
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, connection_main, conn) != 0)
+        {
+            // Unlinks and frees the connection like a closed one
+            shutdown(fd, SHUT_RDWR);
+            connection_main(conn);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    return NULL;
+}
+
+// Serve net (which must outlive the server) on config's socket; returns NULL on failure
+Server *server_start(Net *net, const ServerConfig *config)
+{
+    if (config->num_workers < 1 || config->max_batch < 1 || config->max_latency_us < 0)
+    {
+        printf("Invalid server config\n");
+        return NULL;
+    }
+
+    int listen_fd = listen_socket(config);
+    if (listen_fd < 0)
+        return NULL;
+
+    Server *server = (Server *)MEM_CALLOC(1, sizeof(Server));
+    server->config = *config;
+    server->listen_fd = listen_fd;
+    pruned_net_init(&server->pnet, net, SPARSE_FORMAT_DENSE);
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->ready_cond, NULL);
+    pthread_cond_init(&server->full_cond, NULL);
+    pthread_cond_init(&server->idle_cond, NULL);
+
+    server->workers = (pthread_t *)MEM_MALLOC(config->num_workers * sizeof(pthread_t));
+    for (int i = 0; i < config->num_workers; i++)
+    {
+        pthread_create(&server->workers[i], NULL, worker_main, server);
+    }
+    atomic_store(&server->accepting, true);
+    pthread_create(&server->accept_thread, NULL, accept_main, server);
+    return server;
+}
+
+void server_get_stats(Server *server, ServerStats *stats)
+{
+    pthread_mutex_lock(&server->lock);
+    *stats = server->stats;
+    pthread_mutex_unlock(&server->lock);
+}
+
+// Stop accepting, let open connections finish their current request, then join the workers
+void server_stop(Server *server)
+{
+    atomic_store(&server->accepting, false);
+    pthread_join(server->accept_thread, NULL);
+    close(server->listen_fd);
+    if (server->config.port == 0)
+    {
+        unlink(server->config.socket_path);
+    }
+
+    pthread_mutex_lock(&server->lock);
+    for (Connection *conn = server->connections; conn; conn = conn->next)
+    {
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    while (server->num_connections > 0)
+    {
+        pthread_cond_wait(&server->idle_cond, &server->lock);
+    }
+    server->quit = true;
+    pthread_cond_broadcast(&server->ready_cond);
+    pthread_mutex_unlock(&server->lock);
+
+    for (int i = 0; i < server->config.num_workers; i++)
+    {
+        pthread_join(server->workers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&server->lock);
+    pthread_cond_destroy(&server->ready_cond);
+    pthread_cond_destroy(&server->full_cond);
+    pthread_cond_destroy(&server->idle_cond);
+    pruned_net_free(&server->pnet);
+    MEM_FREE(server->workers);
+    MEM_FREE(server);
+}
+
+static volatile sig_atomic_t g_server_interrupted = 0;
+
+static void handle_interrupt(int sig)
+{
+    (void)sig;
+    g_server_interrupted = 1;
+}
+
+// Serve until SIGINT or SIGTERM, then print batching stats
+int run_server(Net *net, const ServerConfig *config)
+{
+    Server *server = server_start(net, config);
+    if (!server)
+        return 1;
+
+    struct sigaction action = {0};
+    action.sa_handler = handle_interrupt;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (config->port > 0)
+        printf("Serving on 127.0.0.1:%d", config->port);
+    else
+        printf("Serving on %s", config->socket_path);
+    printf(" (%d workers, batches of up to %d, %d us latency budget)\n", config->num_workers, config->max_batch,
+           config->max_latency_us);
+
+    struct timespec tick = {0, SERVER_POLL_MS * 1000000L};
+    while (!g_server_interrupted)
+    {
+        nanosleep(&tick, NULL);
+    }
+
+    ServerStats stats;
+    server_get_stats(server, &stats);
+    server_stop(server);
+
+    printf("Served %llu requests in %llu batches (%.2f per batch), mean queue wait %.1f us\n",
+           (unsigned long long)stats.num_requests, (unsigned long long)stats.num_batches,
+           stats.num_batches ? (double)stats.num_requests / stats.num_batches : 0.0,
+           stats.num_requests ? stats.queue_sec / stats.num_requests * 1e6 : 0.0);
+    return 0;
+}
+
+// Connect to a running server, returns the socket or -1
+int server_connect(const ServerConfig *config)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len = server_address(config, &addr);
+    if (addr_len == 0)
+        return -1;
+
+    int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, addr_len) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    set_nodelay(fd, config);
+    return fd;
+}
+
+// Send one image and wait for its probabilities
+bool server_classify(int fd, const uint8_t *pixels, float *probs)
+{
+    return write_full(fd, pixels, MNIST_IMG_DATA_LEN) && read_full(fd, probs, MNIST_NUM_LABELS * sizeof(float));
+}
+
+void server_disconnect(int fd)
+{
+    close(fd);
+}
+
+typedef struct
+{
+    const ServerConfig *config;
+    MnistRecord *data;
+    int len;
+    int client;
+    int num_clients;
+    double *latencies; // Per image, shared by all clients
+    int num_correct;
+    bool failed;
+} QueryClient;
+
+// Send every num_clients-th image over one connection, one request in flight at a time
+static void *query_client_main(void *arg)
+{
+    QueryClient *qc = (QueryClient *)arg;
+    int fd = server_connect(qc->config);
+    if (fd < 0)
+    {
+        qc->failed = true;
+        return NULL;
+    }
+
+    uint8_t pixels[MNIST_IMG_DATA_LEN];
+    float probs[MNIST_NUM_LABELS];
+    for (int i = qc->client; i < qc->len; i += qc->num_clients)
+    {
+        for (int p = 0; p < MNIST_IMG_DATA_LEN; p++)
+        {
+            pixels[p] = (uint8_t)lroundf(fminf(fmaxf(qc->data[i].pixels[p], 0), 1) * 255);
+        }
+
+        double start = get_time_sec();
+        if (!server_classify(fd, pixels, probs))
+        {
+            qc->failed = true;
+            break;
+        }
+        qc->latencies[i] = get_time_sec() - start;
+        qc->num_correct += get_prediction_index(probs) == qc->data[i].label;
+    }
+    server_disconnect(fd);
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+// Classify data through a running server from num_clients concurrent connections and
+// report accuracy, throughput and latency percentiles
+void run_server_query(const ServerConfig *config, MnistRecord *data, int len, int num_clients)
+{
+    // The latency percentiles index the sorted requests
+    if (len <= 0 || num_clients <= 0)
+    {
+        printf("Nothing to query: %d requests from %d clients\n", len, num_clients);
+        return;
+    }
+
+    QueryClient *clients = (QueryClient *)MEM_CALLOC(num_clients, sizeof(QueryClient));
+    pthread_t *threads = (pthread_t *)MEM_MALLOC(num_clients * sizeof(pthread_t));
+    double *latencies = (double *)MEM_CALLOC(len, sizeof(double));
+
+    double start = get_time_sec();
+    for (int c = 0; c < num_clients; c++)
+    {
+        clients[c] = (QueryClient){config, data, len, c, num_clients, latencies, 0, false};
+        pthread_create(&threads[c], NULL, query_client_main, &clients[c]);
+    }
+    int num_correct = 0;
+    bool failed = false;
+    for (int c = 0; c < num_clients; c++)
+    {
+        pthread_join(threads[c], NULL);
+        num_correct += clients[c].num_correct;
+        failed |= clients[c].failed;
+    }
+    double elapsed = get_time_sec() - start;
+
+    if (failed)
+    {
+        printf("Lost the connection to the server\n");
+    }
+    else
+    {
+        qsort(latencies, len, sizeof(double), compare_doubles);
+        printf("%d requests from %d clients in %.3f s: %.0f req/s\n", len, num_clients, elapsed, len / elapsed);
+        printf("Latency p50 %.1f us, p99 %.1f us, max %.1f us\n", latencies[len / 2] * 1e6,
+               latencies[(int)(len * 0.99)] * 1e6, latencies[len - 1] * 1e6);
+        printf("Accuracy: %.4f\n", (float)num_correct / len);
+    }
+
+    MEM_FREE(clients);
+    MEM_FREE(threads);
+    MEM_FREE(latencies);
+}
+
+#else
+
+Server *server_start(Net *net, const ServerConfig *config)
+{
+    printf("The inference server needs POSIX sockets and threads\n");
+    return NULL;
+}
+
+void server_get_stats(Server *server, ServerStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+void server_stop(Server *server)
+{
+}
+
+int run_server(Net *net, const ServerConfig *config)
+{
+    server_start(net, config);
+    return 1;
+}
+
+int server_connect(const ServerConfig *config)
+{
+    return -1;
+}
+
+bool server_classify(int fd, const uint8_t *pixels, float *probs)
+{
+    return false;
+}
+
+void server_disconnect(int fd)
+{
+}
+
+void run_server_query(const ServerConfig *config, MnistRecord *data, int len, int num_clients)
+{
+    server_start(NULL, config);
+}
+
+#endif
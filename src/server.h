@@ -0,0 +1,43 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "nn.h"
+
+// Wire protocol, one request at a time per connection:
+//   request:  MNIST_IMG_DATA_LEN uint8 pixels, row-major, 0-255
+//   response: MNIST_NUM_LABELS float32 class probabilities in host byte order
+// Clients that want requests in flight concurrently open several connections.
+
+typedef struct
+{
+    const char *socket_path; // Unix domain socket, used when port is 0
+    int port;                // TCP port on 127.0.0.1
+    int num_workers;
+    int max_batch;
+    int max_latency_us; // How long the first request of a batch may wait for more to arrive
+} ServerConfig;
+
+// Requests served since the server started
+typedef struct
+{
+    uint64_t num_requests;
+    uint64_t num_batches;
+    double queue_sec; // Summed time requests spent waiting for their batch to start
+} ServerStats;
+
+typedef struct Server Server;
+
+ServerConfig server_config_default();
+Server *server_start(Net *net, const ServerConfig *config);
+void server_get_stats(Server *server, ServerStats *stats);
+void server_stop(Server *server);
+int run_server(Net *net, const ServerConfig *config);
+
+int server_connect(const ServerConfig *config);
+bool server_classify(int fd, const uint8_t *pixels, float *probs);
+void server_disconnect(int fd);
+void run_server_query(const ServerConfig *config, MnistRecord *data, int len, int num_clients);
+
+#endif
@@ -0,0 +1,292 @@
+#include "snapshot.h"
+#include "nn.h"
+#include "configs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mem.h"
+
+#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+#define SNAPSHOT_UNSUPPORTED
+#else
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define MEM_TAG MEM_TAG_SNAPSHOT
+
+#define SNAPSHOT_MAGIC 0x50534e4d // "MNSP"
+// A viewer gives up on a frame after this many torn reads and keeps its previous snapshot
+#define SNAPSHOT_READ_RETRIES 8
+
+#ifndef SNAPSHOT_UNSUPPORTED
+
+// Segment layout: this header, then the weights and biases of each layer in order
+typedef struct
+{
+    _Atomic uint32_t magic; // Stored last, once the layout fields are valid
+    uint32_t arch[MAX_NET_ARCH_LEN];
+    uint32_t arch_len;
+    uint32_t num_params;
+    _Atomic uint32_t seq; // Odd while the publisher is writing
+    TrainMetrics metrics;
+} SnapshotHeader;
+
+static uint32_t count_params(Net *net)
+{
+    uint32_t count = 0;
+    for (int i = 0; i < net->num_layers; i++)
+    {
+        count += net->layers[i].num_nodes * (net->layers[i].num_inputs + 1);
+    }
+    return count;
+}
+
+static float *snapshot_params(SnapshotHeader *header)
+{
+    return (float *)(header + 1);
+}
+
+// Create (or replace) the segment sized for net and publish its current weights
+bool snapshot_publisher_open(SnapshotChannel *channel, const char *name, Net *net)
+{
+    memset(channel, 0, sizeof(*channel));
+    if (net->num_layers - 1 > MAX_NET_ARCH_LEN)
+        return false;
+
+    // A segment left by an earlier run is unlinked rather than truncated, so viewers still mapping
+    // it keep valid pages; the new one starts zeroed
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+    {
+        perror("shm_open");
+        return false;
+    }
+
+    uint32_t num_params = count_params(net);
+    size_t size = sizeof(SnapshotHeader) + num_params * sizeof(float);
+    if (ftruncate(fd, (off_t)size) != 0)
+    {
+        perror("ftruncate");
+        close(fd);
+        return false;
+    }
+
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+    {
+        perror("mmap");
+        return false;
+    }
+
+    SnapshotHeader *header = (SnapshotHeader *)mem;
+    header->arch_len = net->num_layers - 1;
+    for (int i = 0; i < net->num_layers - 1; i++)
+    {
+        header->arch[i] = net->layers[i].num_nodes;
+    }
+    header->num_params = num_params;
+    atomic_store_explicit(&header->magic, SNAPSHOT_MAGIC, memory_order_release);
+
+    channel->mem = mem;
+    channel->size = size;
+    channel->is_publisher = true;
+    snprintf(channel->name, sizeof(channel->name), "%s", name);
+
+    TrainMetrics metrics = {0};
+    snapshot_publish(channel, net, &metrics);
+    return true;
+}
+
+// Copy the weights into the segment; never blocks, readers detect the overlap and retry
+void snapshot_publish(SnapshotChannel *channel, Net *net, TrainMetrics *metrics)
+{
+    SnapshotHeader *header = (SnapshotHeader *)channel->mem;
+    uint32_t seq = atomic_load_explicit(&header->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&header->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    float *params = snapshot_params(header);
+    for (int i = 0; i < net->num_layers; i++)
+    {
+        Layer *layer = &net->layers[i];
+        for (int j = 0; j < layer->num_nodes; j++)
+        {
+            memcpy(params, layer->w[j], layer->num_inputs * sizeof(float));
+            params += layer->num_inputs;
+        }
+        memcpy(params, layer->b, layer->num_nodes * sizeof(float));
+        params += layer->num_nodes;
+    }
+    header->metrics = *metrics;
+
+    atomic_store_explicit(&header->seq, seq + 2, memory_order_release);
+}
+
+// Attach to a publisher's segment and allocate net with the published architecture
+bool snapshot_viewer_open(SnapshotChannel *channel, const char *name, Net *net)
+{
+    memset(channel, 0, sizeof(*channel));
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        printf("No training run is publishing to %s\n", name);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)st.st_size;
+    void *mem = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+    {
+        perror("mmap");
+        return false;
+    }
+
+    // Any process can write the segment, so its shape is copied once and checked before a net is
+    // built from it
+    SnapshotHeader *header = (SnapshotHeader *)mem;
+    bool valid = atomic_load_explicit(&header->magic, memory_order_acquire) == SNAPSHOT_MAGIC;
+    uint32_t arch[MAX_NET_ARCH_LEN];
+    int arch_len = (int)header->arch_len;
+    uint32_t num_params = header->num_params;
+    valid = valid && arch_len > 0 && arch_len <= MAX_NET_ARCH_LEN;
+    if (valid)
+    {
+        memcpy(arch, header->arch, arch_len * sizeof(uint32_t));
+        valid = net_arch_valid(arch, arch_len) && net_arch_is_dense(arch, arch_len) &&
+                sizeof(SnapshotHeader) + (uint64_t)num_params * sizeof(float) <= size;
+    }
+    if (valid)
+    {
+        // Widths the segment cannot hold are turned away before anything is allocated for them
+        uint64_t expected = 0;
+        uint64_t inputs = MNIST_IMG_DATA_LEN;
+        for (int i = 0; i <= arch_len; i++)
+        {
+            uint64_t nodes = i < arch_len ? arch[i] : MNIST_NUM_LABELS;
+            expected += nodes * (inputs + 1);
+            inputs = nodes;
+        }
+        valid = expected == num_params;
+    }
+    if (!valid)
+    {
+        printf("Invalid snapshot segment: %s\n", name);
+        munmap(mem, size);
+        return false;
+    }
+
+    net_init_mem_arch(net, arch, arch_len, false);
+
+    channel->mem = mem;
+    channel->size = size;
+    channel->staging = (float *)MEM_MALLOC(num_params * sizeof(float));
+    snprintf(channel->name, sizeof(channel->name), "%s", name);
+    return true;
+}
+
+// Copy the latest snapshot into net, returns false when there is nothing new (or only torn reads)
+bool snapshot_read(SnapshotChannel *channel, Net *net, TrainMetrics *metrics)
+{
+    SnapshotHeader *header = (SnapshotHeader *)channel->mem;
+
+    for (int attempt = 0; attempt < SNAPSHOT_READ_RETRIES; attempt++)
+    {
+        uint32_t seq = atomic_load_explicit(&header->seq, memory_order_acquire);
+        if (seq == channel->last_seq)
+            return false;
+        if (seq & 1)
+            continue;
+
+        // Sized by the validated net, not the header a writer could have changed since
+        memcpy(channel->staging, snapshot_params(header), count_params(net) * sizeof(float));
+        TrainMetrics copied = header->metrics;
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&header->seq, memory_order_relaxed) != seq)
+            continue;
+
+        const float *params = channel->staging;
+        for (int i = 0; i < net->num_layers; i++)
+        {
+            Layer *layer = &net->layers[i];
+            for (int j = 0; j < layer->num_nodes; j++)
+            {
+                memcpy(layer->w[j], params, layer->num_inputs * sizeof(float));
+                params += layer->num_inputs;
+            }
+            memcpy(layer->b, params, layer->num_nodes * sizeof(float));
+            params += layer->num_nodes;
+        }
+        net_weights_changed(net);
+
+        if (metrics)
+        {
+            *metrics = copied;
+        }
+        channel->last_seq = seq;
+        return true;
+    }
+    return false;
+}
+
+// Unmap the segment; the publisher also removes its name, live mappings stay valid
+void snapshot_close(SnapshotChannel *channel)
+{
+    if (!channel->mem)
+        return;
+
+    munmap(channel->mem, channel->size);
+    if (channel->is_publisher)
+    {
+        shm_unlink(channel->name);
+    }
+    MEM_FREE(channel->staging);
+    memset(channel, 0, sizeof(*channel));
+}
+
+#else
+
+bool snapshot_publisher_open(SnapshotChannel *channel, const char *name, Net *net)
+{
+    memset(channel, 0, sizeof(*channel));
+    printf("Live snapshots need POSIX shared memory\n");
+    return false;
+}
+
+void snapshot_publish(SnapshotChannel *channel, Net *net, TrainMetrics *metrics)
+{
+}
+
+bool snapshot_viewer_open(SnapshotChannel *channel, const char *name, Net *net)
+{
+    memset(channel, 0, sizeof(*channel));
+    printf("Live snapshots need POSIX shared memory\n");
+    return false;
+}
+
+bool snapshot_read(SnapshotChannel *channel, Net *net, TrainMetrics *metrics)
+{
+    return false;
+}
+
+void snapshot_close(SnapshotChannel *channel)
+{
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "nn.h"
+
+// Training progress published next to the weights
+typedef struct
+{
+    int step;
+    float loss;
+    float accuracy; // Of the last evaluation
+    float learning_rate;
+} TrainMetrics;
+
+// Weight snapshots of a training run in a POSIX shared memory segment. A single
+// publisher writes under a seqlock and never waits; viewers retry until they copy
+// a consistent snapshot.
+typedef struct
+{
+    void *mem;
+    size_t size;
+    bool is_publisher;
+    char name[64];
+    uint32_t last_seq; // Viewer: sequence of the last snapshot copied
+    float *staging;    // Viewer: params are copied here and validated before reaching the net
+} SnapshotChannel;
+
+bool snapshot_publisher_open(SnapshotChannel *channel, const char *name, Net *net);
+void snapshot_publish(SnapshotChannel *channel, Net *net, TrainMetrics *metrics);
+bool snapshot_viewer_open(SnapshotChannel *channel, const char *name, Net *net);
+bool snapshot_read(SnapshotChannel *channel, Net *net, TrainMetrics *metrics);
+void snapshot_close(SnapshotChannel *channel);
+
+#endif
@@ -0,0 +1,345 @@
+#include "sweep.h"
+#include "nn.h"
+#include "train.h"
+#include "bench.h"
+#include "configs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mem.h"
+
+#define MEM_TAG MEM_TAG_TRAIN
+
+// Hyperparameters of one swept model
+typedef struct
+{
+    uint32_t arch[MAX_NET_ARCH_LEN];
+    int arch_len;
+    float learning_rate;
+    float dropout_rate;
+} SweepModel;
+
+void stacked_layer_init(StackedLayer *stack, Net *nets, int num_nets)
+{
+    stack->num_nets = num_nets;
+    stack->offsets = (int *)MEM_MALLOC((num_nets + 1) * sizeof(int));
+    stack->offsets[0] = 0;
+    for (int m = 0; m < num_nets; m++)
+    {
+        stack->offsets[m + 1] = stack->offsets[m] + nets[m].layers[0].num_nodes;
+    }
+
+    int width = stack->offsets[num_nets];
+    stack->w_t = (float *)MEM_MALLOC((size_t)MNIST_IMG_DATA_LEN * width * sizeof(float));
+    stack->b = (float *)MEM_MALLOC(width * sizeof(float));
+    stack->grad_w_t = (float *)MEM_CALLOC((size_t)MNIST_IMG_DATA_LEN * width, sizeof(float));
+    stack->grad_b = (float *)MEM_CALLOC(width, sizeof(float));
+    stacked_layer_refresh(stack, nets);
+}
+
+// Copy the first layer weights of every network in, after each weight update
+void stacked_layer_refresh(StackedLayer *stack, Net *nets)
+{
+    int width = stack->offsets[stack->num_nets];
+    for (int m = 0; m < stack->num_nets; m++)
+    {
+        Layer *layer = &nets[m].layers[0];
+        int offset = stack->offsets[m];
+        memcpy(&stack->b[offset], layer->b, layer->num_nodes * sizeof(float));
+        for (int j = 0; j < layer->num_nodes; j++)
+        {
+            const float *row = layer->w[j];
+            for (int k = 0; k < MNIST_IMG_DATA_LEN; k++)
+            {
+                stack->w_t[k * width + offset + j] = row[k];
+            }
+        }
+    }
+}
+
+// Pre-activations of every network's first layer, network m's nodes start at offsets[m]
+void stacked_layer_forward(StackedLayer *stack, const SparseInput *sparse, float *pre_act)
+{
+    int width = stack->offsets[stack->num_nets];
+    memcpy(pre_act, stack->b, width * sizeof(float));
+    for (int n = 0; n < sparse->len; n++)
+    {
+        const float *row = &stack->w_t[sparse->idx[n] * width];
+        float value = sparse->val[n];
+        for (int i = 0; i < width; i++)
+        {
+            pre_act[i] += value * row[i];
+        }
+    }
+}
+
+// Accumulate the first layer gradients of every network, error laid out like the pre-activations
+void stacked_layer_backward(StackedLayer *stack, const SparseInput *sparse, const float *error)
+{
+    int width = stack->offsets[stack->num_nets];
+    for (int i = 0; i < width; i++)
+    {
+        stack->grad_b[i] += error[i];
+    }
+    for (int n = 0; n < sparse->len; n++)
+    {
+        float *row = &stack->grad_w_t[sparse->idx[n] * width];
+        float value = sparse->val[n];
+        for (int i = 0; i < width; i++)
+        {
+            row[i] += value * error[i];
+        }
+    }
+}
+
+// Move the accumulated gradients into each network's first gradient layer and restart accumulation
+void stacked_layer_export_grads(StackedLayer *stack, Net *grads)
+{
+    int width = stack->offsets[stack->num_nets];
+    for (int m = 0; m < stack->num_nets; m++)
+    {
+        Layer *layer = &grads[m].layers[0];
+        int offset = stack->offsets[m];
+        memcpy(layer->b, &stack->grad_b[offset], layer->num_nodes * sizeof(float));
+        for (int j = 0; j < layer->num_nodes; j++)
+        {
+            float *row = layer->w[j];
+            for (int k = 0; k < MNIST_IMG_DATA_LEN; k++)
+            {
+                row[k] = stack->grad_w_t[k * width + offset + j];
+            }
+        }
+    }
+    memset(stack->grad_w_t, 0, (size_t)MNIST_IMG_DATA_LEN * width * sizeof(float));
+    memset(stack->grad_b, 0, width * sizeof(float));
+}
+
+void stacked_layer_free(StackedLayer *stack)
+{
+    MEM_FREE(stack->offsets);
+    MEM_FREE(stack->w_t);
+    MEM_FREE(stack->b);
+    MEM_FREE(stack->grad_w_t);
+    MEM_FREE(stack->grad_b);
+    memset(stack, 0, sizeof(*stack));
+}
+
+// The first layer is skipped, stacked_layer_export_grads overwrites it
+static void net_zero_hidden(Net *net)
+{
+    for (int i = 1; i < net->num_layers; i++)
+    {
+        Layer *layer = &net->layers[i];
+        memset(layer->b, 0, layer->num_nodes * sizeof(float));
+        for (int j = 0; j < layer->num_nodes; j++)
+        {
+            memset(layer->w[j], 0, layer->num_inputs * sizeof(float));
+        }
+    }
+}
+
+static void shuffle_indices(int *order, int len)
+{
+    for (int i = len - 1; i > 0; i--)
+    {
+        int j = rand() % (i + 1);
+        int tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+}
+
+static void format_arch(const SweepModel *model, char *buf, int buf_len)
+{
+    int pos = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < model->arch_len && pos < buf_len; i++)
+    {
+        pos += snprintf(&buf[pos], buf_len - pos, i ? ",%u" : "%u", model->arch[i]);
+    }
+}
+
+// Expand the grid (falling back to base for empty lists), returns the number of models
+static int sweep_models(const TrainConfig *base, const SweepGrid *grid, SweepModel *models)
+{
+    int num_archs = grid->num_archs ? grid->num_archs : 1;
+    int num_lrs = grid->num_learning_rates ? grid->num_learning_rates : 1;
+    int num_dropouts = grid->num_dropout_rates ? grid->num_dropout_rates : 1;
+
+    int count = 0;
+    for (int a = 0; a < num_archs; a++)
+    {
+        for (int l = 0; l < num_lrs; l++)
+        {
+            for (int d = 0; d < num_dropouts; d++)
+            {
+                SweepModel *model = &models[count++];
+                if (grid->num_archs)
+                {
+                    memcpy(model->arch, grid->archs[a], sizeof(model->arch));
+                    model->arch_len = grid->arch_lens[a];
+                }
+                else
+                {
+                    memcpy(model->arch, base->arch, sizeof(model->arch));
+                    model->arch_len = base->arch_len;
+                }
+                model->learning_rate = grid->num_learning_rates ? grid->learning_rates[l] : base->learning_rate;
+                model->dropout_rate = grid->num_dropout_rates ? grid->dropout_rates[d] : DROPOUT_RATE;
+            }
+        }
+    }
+    return count;
+}
+
+// Train every model of the grid in one process on one shuffled, augmented batch stream. The
+// data is loaded and augmented once, and each image's first layer runs forward and backward
+// once for all models.
+void run_sweep(const TrainConfig *base, const SweepGrid *grid)
+{
+    srand(base->seed ? base->seed : (unsigned int)time(NULL));
+
+    SweepModel models[SWEEP_MAX_VALUES * SWEEP_MAX_VALUES * SWEEP_MAX_VALUES];
+    int num_models = sweep_models(base, grid, models);
+
+    printf("Loading Training data ...\n");
+    MnistRecord *train_data = load_mnist_data(MNIST_TRAIN_FILE_PATH, TRAIN_DATA_LEN);
+    if (!train_data)
+        return;
+
+    printf("Loading Testing data ...\n");
+    MnistRecord *test_data = load_mnist_data(MNIST_TEST_FILE_PATH, TEST_DATA_LEN);
+    if (!test_data)
+    {
+        free_mnist_data(train_data);
+        return;
+    }
+
+    int data_len;
+    train_data = augment_training_data(train_data, base->augmentation_count, &data_len);
+
+    Net *nets = (Net *)MEM_CALLOC(num_models, sizeof(Net));
+    Net *grads = (Net *)MEM_CALLOC(num_models, sizeof(Net));
+    for (int m = 0; m < num_models; m++)
+    {
+        net_init_mem_arch(&nets[m], models[m].arch, models[m].arch_len, false);
+        net_init_values(&nets[m]);
+        for (int i = 0; i < nets[m].num_layers; i++)
+        {
+            nets[m].layers[i].dropout_rate = models[m].dropout_rate;
+        }
+        net_init_mem_like(&grads[m], &nets[m], false);
+    }
+
+    StackedLayer stack;
+    stacked_layer_init(&stack, nets, num_models);
+    float *pre_act = (float *)MEM_MALLOC(stack.offsets[num_models] * sizeof(float));
+    float *first_error = (float *)MEM_MALLOC(stack.offsets[num_models] * sizeof(float));
+    float *losses = (float *)MEM_MALLOC(num_models * sizeof(float));
+    printf("Sweeping %d models, stacked first layer is %d nodes wide\n", num_models, stack.offsets[num_models]);
+
+    int *order = (int *)MEM_MALLOC(data_len * sizeof(int));
+    for (int i = 0; i < data_len; i++)
+    {
+        order[i] = i;
+    }
+    shuffle_indices(order, data_len);
+
+    int batch_size = base->batch_size < data_len ? base->batch_size : data_len;
+    int batch_start = 0;
+    double start = get_time_sec();
+    double eval_sec = 0;
+    for (int step = 0; step < base->num_steps; step++)
+    {
+        // New epoch: reshuffle the shared stream
+        if (batch_start + batch_size > data_len)
+        {
+            shuffle_indices(order, data_len);
+            batch_start = 0;
+        }
+
+        for (int m = 0; m < num_models; m++)
+        {
+            net_zero_hidden(&grads[m]);
+            losses[m] = 0;
+        }
+
+        for (int s = 0; s < batch_size; s++)
+        {
+            MnistRecord *record = &train_data[order[batch_start + s]];
+            SparseInput sparse;
+            sparse_input_compress(record->pixels, MNIST_IMG_DATA_LEN, &sparse);
+            stacked_layer_forward(&stack, &sparse, pre_act);
+
+            for (int m = 0; m < num_models; m++)
+            {
+                float **activations = net_forward_pre_activations(&nets[m], record->pixels,
+                                                                  &pre_act[stack.offsets[m]], true);
+                losses[m] += net_backward_hidden(&nets[m], activations, record->label, &grads[m],
+                                                 &first_error[stack.offsets[m]]);
+                net_free_activations(&nets[m], activations);
+            }
+            stacked_layer_backward(&stack, &sparse, first_error);
+        }
+        batch_start += batch_size;
+        stacked_layer_export_grads(&stack, grads);
+
+        for (int m = 0; m < num_models; m++)
+        {
+            train_apply_gradients(&nets[m], &grads[m], batch_size, models[m].learning_rate);
+        }
+        stacked_layer_refresh(&stack, nets);
+
+        // Every 250 steps, print each model's accuracy
+        if (step % 250 == 0 || step == base->num_steps - 1)
+        {
+            double eval_start = get_time_sec();
+            printf("Step: %d, Accuracy:", step);
+            for (int m = 0; m < num_models; m++)
+            {
+                printf(" %.4f", calc_net_accuracy(test_data, &nets[m]));
+            }
+            printf(", Loss:");
+            for (int m = 0; m < num_models; m++)
+            {
+                printf(" %.4f", losses[m] / batch_size);
+            }
+            printf("\n");
+            eval_sec += get_time_sec() - eval_start;
+        }
+    }
+    // Throughput counts training only, not the accuracy checks
+    double elapsed = get_time_sec() - start - eval_sec;
+
+    printf("%-6s %-16s %-8s %-8s %-9s %s\n", "model", "arch", "lr", "dropout", "accuracy", "saved to");
+    for (int m = 0; m < num_models; m++)
+    {
+        char arch[64];
+        char path[256];
+        format_arch(&models[m], arch, sizeof(arch));
+        snprintf(path, sizeof(path), "%s/sweep_%d.json", NETWORK_SAVE_DIRECTORY, m);
+        float accuracy = calc_net_accuracy(test_data, &nets[m]);
+        bool saved = net_save(&nets[m], path);
+        printf("%-6d %-16s %-8g %-8g %-9.4f %s\n", m, arch, models[m].learning_rate, models[m].dropout_rate, accuracy,
+               saved ? path : "(save failed)");
+    }
+    double model_imgs = (double)num_models * base->num_steps * batch_size;
+    printf("Trained %d models x %d steps in %.2f s (%.0f model-imgs/s)\n", num_models, base->num_steps, elapsed,
+           elapsed > 0 ? model_imgs / elapsed : 0.0);
+
+    for (int m = 0; m < num_models; m++)
+    {
+        net_free(&nets[m]);
+        net_free(&grads[m]);
+    }
+    stacked_layer_free(&stack);
+    MEM_FREE(nets);
+    MEM_FREE(grads);
+    MEM_FREE(pre_act);
+    MEM_FREE(first_error);
+    MEM_FREE(losses);
+    MEM_FREE(order);
+    free_mnist_data(train_data);
+    free_mnist_data(test_data);
+}
@@ -0,0 +1,45 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include "nn.h"
+#include "train.h"
+
+// Most values per swept hyperparameter
+#define SWEEP_MAX_VALUES 8
+
+// Hyperparameter grid, every combination is trained as one model. An empty list sweeps
+// only the TrainConfig value.
+typedef struct
+{
+    uint32_t archs[SWEEP_MAX_VALUES][MAX_NET_ARCH_LEN];
+    int arch_lens[SWEEP_MAX_VALUES];
+    int num_archs;
+    float learning_rates[SWEEP_MAX_VALUES];
+    int num_learning_rates;
+    float dropout_rates[SWEEP_MAX_VALUES];
+    int num_dropout_rates;
+} SweepGrid;
+
+// First layers of several networks side by side. They all read the same pixels, so one pass
+// over an image's nonzero pixels fills every network's pre-activations with wide row updates,
+// and one more accumulates every network's weight gradient.
+typedef struct
+{
+    int num_nets;
+    int *offsets; // First column of each network, num_nets + 1 entries
+    float *w_t;   // MNIST_IMG_DATA_LEN rows of offsets[num_nets] columns
+    float *b;
+    float *grad_w_t; // Same layout as w_t
+    float *grad_b;
+} StackedLayer;
+
+void stacked_layer_init(StackedLayer *stack, Net *nets, int num_nets);
+void stacked_layer_refresh(StackedLayer *stack, Net *nets);
+void stacked_layer_forward(StackedLayer *stack, const SparseInput *sparse, float *pre_act);
+void stacked_layer_backward(StackedLayer *stack, const SparseInput *sparse, const float *error);
+void stacked_layer_export_grads(StackedLayer *stack, Net *grads);
+void stacked_layer_free(StackedLayer *stack);
+
+void run_sweep(const TrainConfig *base, const SweepGrid *grid);
+
+#endif
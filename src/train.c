@@ -1,27 +1,34 @@
 #include "train.h"
 #include "nn.h"
 #include "configs.h"
+#include "distill.h"
+#include "snapshot.h"
+#include "augment.h"
+#include "bench.h"
+#include "dataset.h"
+#include "tune.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include "mem.h"
 
-// Load MNIST Data from CSV
-MnistRecord *load_mnist_data(const char *path, int size)
+#define MEM_TAG MEM_TAG_TRAIN
+
+// Decode up to size records of an MNIST CSV into data
+bool read_mnist_csv(const char *path, MnistRecord *data, int size)
 {
     FILE *file = fopen(path, "r");
     if (!file)
     {
         printf("Failed to open file: %s\n", path);
-        return NULL;
+        return false;
     }
 
     char line[4096];                 // Buffer for each line
     fgets(line, sizeof(line), file); // Skip header line
 
-    MnistRecord *data = (MnistRecord *)malloc(size * sizeof(MnistRecord));
-
     for (int i = 0; i < size; i++)
     {
         if (!fgets(line, sizeof(line), file))
@@ -43,48 +50,209 @@ MnistRecord *load_mnist_data(const char *path, int size)
     }
 
     fclose(file);
+    return true;
+}
+
+// Load MNIST Data from CSV, or from the attached shared dataset (read-only) when it has the file.
+// Release with free_mnist_data.
+MnistRecord *load_mnist_data(const char *path, int size)
+{
+    MnistRecord *shared = dataset_lookup(path, size);
+    if (shared)
+        return shared;
+
+    MnistRecord *data = (MnistRecord *)MEM_MALLOC(size * sizeof(MnistRecord));
+    if (!read_mnist_csv(path, data, size))
+    {
+        MEM_FREE(data);
+        return NULL;
+    }
     return data;
 }
 
-// Perform one training step
-float train_step(Net *net, MnistRecord *batch, int batch_size, float learning_rate)
+void free_mnist_data(MnistRecord *data)
+{
+    if (!dataset_owns(data))
+    {
+        MEM_FREE(data);
+    }
+}
+
+static void layer_apply_gradients(Layer *layer, const Layer *grad_layer, int batch_size, float learning_rate)
+{
+    for (int j = 0; j < layer->num_rows; j++)
+    {
+        layer->b[j] -= learning_rate * grad_layer->b[j] / batch_size;
+        for (int k = 0; k < layer->row_len; k++)
+        {
+            layer->w[j][k] -= learning_rate * grad_layer->w[j][k] / batch_size;
+        }
+    }
+}
+
+// Update weights and biases based on gradients summed over batch_size samples
+void train_apply_gradients(Net *net, Net *grad, int batch_size, float learning_rate)
+{
+    for (int i = 0; i < net->num_layers; i++)
+    {
+        layer_apply_gradients(&net->layers[i], &grad->layers[i], batch_size, learning_rate);
+    }
+    for (int i = 0; i < net->num_exits && i < grad->num_exits; i++)
+    {
+        layer_apply_gradients(&net->exits[i], &grad->exits[i], batch_size, learning_rate);
+    }
+
+    net_weights_changed(net);
+}
+
+// Perform one training step, distilling from teacher_logits when given
+static float train_step_impl(Net *net, MnistRecord *batch, const float *teacher_logits, int batch_size, float learning_rate, float temperature, float alpha)
 {
     Net grad = {}; // Temporary structure to hold gradients
-    net_init_mem(&grad, true);
+    net_init_mem_like(&grad, net, true);
 
     float total_loss = 0.0f;
 
     // Backpropagate and accumulate gradients for the entire batch
     for (int i = 0; i < batch_size; i++)
     {
-        float loss = net_backward(net, &batch[i], &grad, NULL, true);
+        float loss;
+        if (teacher_logits)
+        {
+            const float *logits = &teacher_logits[i * MNIST_NUM_LABELS];
+            loss = net_backward_distill(net, &batch[i], logits, temperature, alpha, &grad, true);
+        }
+        else
+        {
+            loss = net_backward(net, &batch[i], &grad, NULL, true);
+        }
         total_loss += loss;
     }
 
-    // Update weights and biases based on averaged gradients
-    for (int i = 0; i < sizeof(NET_ARCH) / sizeof(NET_ARCH[0]) + 1; i++)
-    { // Dynamically determine the number of layers
-        Layer *net_layer = &net->layers[i];
-        Layer *grad_layer = &grad.layers[i];
+    train_apply_gradients(net, &grad, batch_size, learning_rate);
+    net_free(&grad);
+    return total_loss / batch_size;
+}
 
-        for (int j = 0; j < sizeof(net_layer->b) / sizeof(float); j++)
-        {
-            net_layer->b[j] -= learning_rate * grad_layer->b[j] / batch_size;
-            for (int k = 0; k < sizeof(net_layer->w[j]) / sizeof(float); k++)
-            {
-                net_layer->w[j][k] -= learning_rate * grad_layer->w[j][k] / batch_size;
-            }
-        }
+// Perform one training step
+float train_step(Net *net, MnistRecord *batch, int batch_size, float learning_rate)
+{
+    return train_step_impl(net, batch, NULL, batch_size, learning_rate, 1, 0);
+}
+
+// Perform one training step on batch_size examples drawn from data by the sampler, each weighted to
+// keep the gradient unbiased, and feed their losses back to it. Examples below skip_loss mostly
+// skip the backward pass; num_backward receives how many ran it.
+float train_step_sampled(Net *net, MnistRecord *data, LossSampler *sampler, int batch_size, float learning_rate, float skip_loss, int *num_backward)
+{
+    Net grad = {};
+    net_init_mem_like(&grad, net, true);
+
+    float total_loss = 0.0f;
+    *num_backward = 0;
+    for (int i = 0; i < batch_size; i++)
+    {
+        float weight;
+        int index = loss_sampler_draw(sampler, &weight);
+        bool backward_ran;
+        float loss = net_backward_weighted(net, &data[index], &grad, weight, skip_loss, true, &backward_ran);
+        loss_sampler_update(sampler, index, loss);
+        *num_backward += backward_ran;
+        total_loss += loss;
     }
 
+    train_apply_gradients(net, &grad, batch_size, learning_rate);
     net_free(&grad);
     return total_loss / batch_size;
 }
 
+// Perform one training step against the teacher's soft targets (batch_size x MNIST_NUM_LABELS logits)
+float train_step_distill(Net *net, MnistRecord *batch, const float *teacher_logits, int batch_size, float learning_rate, float temperature, float alpha)
+{
+    return train_step_impl(net, batch, teacher_logits, batch_size, learning_rate, temperature, alpha);
+}
+
+// Keep every stride-th activation of net in training and print the memory saved against the
+// layer forwards the backward pass recomputes in exchange
+void train_set_checkpointing(Net *net, int stride)
+{
+    if (stride <= 1)
+        return;
+
+    int all_floats = net_activation_floats(net);
+    net->checkpoint_stride = stride;
+    int num_recomputed = 0;
+    for (int i = 1; i < net->num_layers; i++)
+    {
+        num_recomputed += i % stride != 0;
+    }
+    printf("Checkpointing every %d layers: %.1f KB of activations per example instead of %.1f KB, "
+           "recomputing %d of %d layer forwards\n",
+           stride, net_activation_floats(net) * sizeof(float) / 1024.0, all_floats * sizeof(float) / 1024.0,
+           num_recomputed, net->num_layers);
+}
+
+// Default training configuration from configs.h
+TrainConfig train_config_default()
+{
+    TrainConfig cfg = {
+        .num_steps = NUM_STEPS,
+        .batch_size = BATCH_SIZE,
+        .learning_rate = LEARNING_RATE,
+        .augmentation_count = DATA_AUGMENTATION_COUNT,
+        .save_path = NETWORK_SAVE_FILE_PATH,
+        .seed = 0,
+        .arch_len = sizeof(NET_ARCH) / sizeof(NET_ARCH[0]),
+        .teacher_path = NULL,
+        .teacher_cache_path = TEACHER_LOGITS_CACHE_FILE_PATH,
+        .temperature = DISTILL_TEMPERATURE,
+        .distill_alpha = DISTILL_ALPHA,
+        .live_name = NULL,
+        .importance_sampling = false,
+        .skip_loss = 0,
+        .exit_heads = false,
+        .checkpoint_stride = 0,
+        .tuning_path = TUNING_FILE_PATH,
+    };
+    memcpy(cfg.arch, NET_ARCH, sizeof(NET_ARCH));
+    return cfg;
+}
+
+// Append augmentation_count transformed copies of the TRAIN_DATA_LEN original records
+MnistRecord *augment_training_data(MnistRecord *train_data, int augmentation_count, int *data_len)
+{
+    printf("Augmenting training data ...\n");
+    AugmentRng rng;
+    augment_rng_seed(&rng, (uint64_t)rand());
+    *data_len = TRAIN_DATA_LEN * (1 + augmentation_count);
+    if (dataset_owns(train_data))
+    {
+        // Shared records are read-only, the augmented set needs a private copy
+        if (augmentation_count == 0)
+            return train_data;
+        MnistRecord *copy = (MnistRecord *)MEM_MALLOC(*data_len * sizeof(MnistRecord));
+        memcpy(copy, train_data, TRAIN_DATA_LEN * sizeof(MnistRecord));
+        train_data = copy;
+    }
+    else
+    {
+        train_data = (MnistRecord *)MEM_REALLOC(train_data, *data_len * sizeof(MnistRecord));
+    }
+    double augment_start = get_time_sec();
+    for (int i = TRAIN_DATA_LEN; i < *data_len; i++)
+    {
+        augment_mnist_record(&train_data[i % TRAIN_DATA_LEN], &rng, &train_data[i]);
+    }
+    double augment_sec = get_time_sec() - augment_start;
+    printf("Done Augmenting, train data len: %d, test data len: %d (%.0f imgs/s)\n", *data_len, TEST_DATA_LEN,
+           augment_sec > 0 ? (*data_len - TRAIN_DATA_LEN) / augment_sec : 0.0);
+    return train_data;
+}
+
 // Train the neural network
-void train()
+void train(TrainConfig *cfg)
 {
-    srand((unsigned int)time(NULL));
+    srand(cfg->seed ? cfg->seed : (unsigned int)time(NULL));
 
     printf("Loading Training data ...\n");
     MnistRecord *train_data = load_mnist_data(MNIST_TRAIN_FILE_PATH, TRAIN_DATA_LEN);
@@ -96,58 +264,136 @@ void train()
     if (!test_data)
         return;
 
-    // Augment training data
-    printf("Augmenting training data ...\n");
-    int data_len = TRAIN_DATA_LEN;
-    for (int n = 0; n <= DATA_AUGMENTATION_COUNT; n++)
+    // Distillation: teacher logits of the base training set are cached on disk
+    Net teacher = {};
+    float *teacher_logits = NULL;
+    if (cfg->teacher_path)
     {
-        for (int i = data_len - 1; i >= 0; i--)
+        if (!net_load(&teacher, cfg->teacher_path))
         {
-            MnistRecord augmented = augment_mnist_record(&train_data[i]);
-            data_len++;
-            train_data = (MnistRecord *)realloc(train_data, data_len * sizeof(MnistRecord));
-            train_data[data_len - 1] = augmented;
+            printf("Failed to load teacher network: %s\n", cfg->teacher_path);
+            free_mnist_data(train_data);
+            free_mnist_data(test_data);
+            return;
         }
+        printf("Teacher accuracy: %.4f\n", calc_net_accuracy(test_data, &teacher));
+        teacher_logits = distill_teacher_logits(&teacher, train_data, TRAIN_DATA_LEN, cfg->teacher_cache_path);
+    }
+
+    int data_len;
+    train_data = augment_training_data(train_data, cfg->augmentation_count, &data_len);
+
+    // Augmented images differ per run, so their teacher logits are only kept in memory
+    if (teacher_logits)
+    {
+        teacher_logits = (float *)MEM_REALLOC(teacher_logits, (size_t)data_len * MNIST_NUM_LABELS * sizeof(float));
+        distill_compute_logits(&teacher, &train_data[TRAIN_DATA_LEN], data_len - TRAIN_DATA_LEN,
+                               &teacher_logits[TRAIN_DATA_LEN * MNIST_NUM_LABELS]);
+        net_free(&teacher);
     }
-    printf("Done Augmenting, train data len: %d, test data len: %d\n", data_len, TEST_DATA_LEN);
 
     // Initialize neural network
     Net net = {};
-    net_init_mem(&net, false);
+    net_init_mem_arch(&net, cfg->arch, cfg->arch_len, false);
+    if (cfg->exit_heads)
+    {
+        net_add_exits(&net);
+    }
     net_init_values(&net);
+    tune_load_net(cfg->tuning_path, &net);
+    train_set_checkpointing(&net, cfg->checkpoint_stride);
+
+    // Live viewers attach to the snapshot segment, publishing never waits on them
+    SnapshotChannel live = {};
+    TrainMetrics metrics = {};
+    if (cfg->live_name && snapshot_publisher_open(&live, cfg->live_name, &net))
+    {
+        printf("Publishing live snapshots to %s\n", cfg->live_name);
+    }
+
+    // Importance sampling tracks a loss per example, in place of walking the data in order
+    LossSampler sampler = {};
+    long long num_backward = 0;
+    if (cfg->importance_sampling)
+    {
+        loss_sampler_init(&sampler, data_len, SAMPLER_UNIFORM_MIX);
+    }
 
     // Training loop
     int batch_start = 0;
-    int steps = NUM_STEPS;
-    float learning_rate = LEARNING_RATE;
+    int steps = cfg->num_steps;
+    float learning_rate = cfg->learning_rate;
 
     for (int step = 0; step < steps; step++)
     {
         MnistRecord *batch = &train_data[batch_start];
-        batch_start = (batch_start + BATCH_SIZE) % data_len;
+        int batch_size = cfg->batch_size;
+        if (batch_start + batch_size > data_len)
+        {
+            batch_size = data_len - batch_start;
+        }
+        batch_start = (batch_start + batch_size) % data_len;
 
-        float loss = train_step(&net, batch, BATCH_SIZE, learning_rate);
+        float loss;
+        if (sampler.len)
+        {
+            int step_backward;
+            loss = train_step_sampled(&net, train_data, &sampler, cfg->batch_size, learning_rate, cfg->skip_loss, &step_backward);
+            num_backward += step_backward;
+        }
+        else if (teacher_logits)
+        {
+            const float *batch_logits = &teacher_logits[(size_t)(batch - train_data) * MNIST_NUM_LABELS];
+            loss = train_step_distill(&net, batch, batch_logits, batch_size, learning_rate, cfg->temperature, cfg->distill_alpha);
+        }
+        else
+        {
+            loss = train_step(&net, batch, batch_size, learning_rate);
+        }
 
         // Every 250 steps, print accuracy and learning rate
         if (step % 250 == 0)
         {
             float accuracy = calc_net_accuracy(test_data, &net);
-            printf("Step: %d, Accuracy: %.4f, Loss: %.4f, Learning Rate: %.4f\n", step, accuracy, loss, learning_rate);
+            printf("Step: %d, Accuracy: %.4f, Loss: %.4f, Learning Rate: %.4f", step, accuracy, loss, learning_rate);
+            if (sampler.len)
+            {
+                printf(", Backward passes: %lld", num_backward);
+            }
+            printf("\n");
+            metrics.accuracy = accuracy;
+            mem_report();
+        }
+
+        if (live.mem && step % LIVE_SNAPSHOT_INTERVAL == 0)
+        {
+            metrics.step = step;
+            metrics.loss = loss;
+            metrics.learning_rate = learning_rate;
+            snapshot_publish(&live, &net, &metrics);
         }
 
         // Every 2500 steps, save the network
         if (step % 2500 == 0)
         {
-            if (!net_save(&net))
+            if (!net_save(&net, cfg->save_path))
             {
                 printf("Failed to save network\n");
             }
         }
     }
 
+    if (!net_save(&net, cfg->save_path))
+    {
+        printf("Failed to save network\n");
+    }
+
+    snapshot_close(&live);
+    loss_sampler_free(&sampler);
     net_free(&net);
-    free(train_data);
-    free(test_data);
+    MEM_FREE(teacher_logits);
+    free_mnist_data(train_data);
+    free_mnist_data(test_data);
 }
 
 // Calculate the network's accuracy on a test dataset
@@ -158,92 +404,19 @@ float calc_net_accuracy(MnistRecord *test_dataset, Net *net)
     for (int i = 0; i < TEST_DATA_LEN; i++)
     {
         float **predictions = net_forward(net, &test_dataset[i], NULL, false);
-        int predicted_label = get_prediction_index(predictions[sizeof(NET_ARCH) / sizeof(NET_ARCH[0])]); // Dynamically determine last layer
+        int predicted_label = get_prediction_index(predictions[net->num_layers]);
 
         if (predicted_label == test_dataset[i].label)
         {
             correct_count++;
         }
 
-        free(predictions); // Free predictions after each iteration
+        net_free_activations(net, predictions);
     }
 
     return (float)correct_count / TEST_DATA_LEN;
 }
 
-// Augment an MNIST record (rotate, shift)
-MnistRecord augment_mnist_record(MnistRecord *record)
-{
-    MnistRecord augmented;
-    augmented.label = record->label;
-
-    int augmentation = rand() % 2;
-    if (augmentation == 0)
-    {
-        float angle = ((float)rand() / RAND_MAX) * 30.0f - 15.0f;
-        memcpy(augmented.pixels, rotate_image(record->pixels, angle), MNIST_IMG_DATA_LEN * sizeof(float));
-    }
-    else
-    {
-        int dx = (rand() % 7) - 3;
-        int dy = (rand() % 7) - 3;
-        memcpy(augmented.pixels, shift_image(record->pixels, dx, dy), MNIST_IMG_DATA_LEN * sizeof(float));
-    }
-
-    return augmented;
-}
-
-// Rotate an image by a given angle
-float *rotate_image(float *pixels, float angle)
-{
-    static float result[MNIST_IMG_DATA_LEN];
-    memset(result, 0, MNIST_IMG_DATA_LEN * sizeof(float));
-
-    float center = (float)MNIST_IMG_SIZE / 2.0f;
-    float radians = angle * M_PI / 180.0f;
-    float cos_a = cosf(radians);
-    float sin_a = sinf(radians);
-
-    for (int y = 0; y < MNIST_IMG_SIZE; y++)
-    {
-        for (int x = 0; x < MNIST_IMG_SIZE; x++)
-        {
-            int new_x = (int)((x - center) * cos_a - (y - center) * sin_a + center);
-            int new_y = (int)((x - center) * sin_a + (y - center) * cos_a + center);
-
-            if (new_x >= 0 && new_x < MNIST_IMG_SIZE && new_y >= 0 && new_y < MNIST_IMG_SIZE)
-            {
-                result[y * MNIST_IMG_SIZE + x] = pixels[new_y * MNIST_IMG_SIZE + new_x];
-            }
-        }
-    }
-
-    return result;
-}
-
-// Shift an image by a given dx and dy
-float *shift_image(float *pixels, int dx, int dy)
-{
-    static float result[MNIST_IMG_DATA_LEN];
-    memset(result, 0, MNIST_IMG_DATA_LEN * sizeof(float));
-
-    for (int y = 0; y < MNIST_IMG_SIZE; y++)
-    {
-        for (int x = 0; x < MNIST_IMG_SIZE; x++)
-        {
-            int new_x = x + dx;
-            int new_y = y + dy;
-
-            if (new_x >= 0 && new_x < MNIST_IMG_SIZE && new_y >= 0 && new_y < MNIST_IMG_SIZE)
-            {
-                result[y * MNIST_IMG_SIZE + x] = pixels[new_y * MNIST_IMG_SIZE + new_x];
-            }
-        }
-    }
-
-    return result;
-}
-
 // Get the predicted index from softmax outputs
 int get_prediction_index(float *preds)
 {
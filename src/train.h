@@ -2,14 +2,42 @@
 #define TRAIN_H
 
 #include "nn.h"
+#include "sampler.h"
 
+typedef struct
+{
+    int num_steps;
+    int batch_size;
+    float learning_rate;
+    int augmentation_count;
+    const char *save_path;
+    unsigned int seed; // 0 seeds from the clock
+    uint32_t arch[MAX_NET_ARCH_LEN];
+    int arch_len;
+    const char *teacher_path; // Distill from this network when set
+    const char *teacher_cache_path;
+    float temperature;
+    float distill_alpha;
+    const char *live_name; // Publish weight snapshots to this shared memory segment when set
+    bool importance_sampling; // Draw examples in proportion to their last loss instead of in order
+    float skip_loss;          // Importance sampling: examples below this loss skip the backward pass
+    bool exit_heads;          // Train an early-exit head on every hidden layer along with the network
+    int checkpoint_stride;    // Keep every n-th activation through the forward pass and recompute the rest, <= 1 keeps all
+    const char *tuning_path; // Autotuned kernel choices to apply when the file has this machine and arch
+} TrainConfig;
+
+bool read_mnist_csv(const char *path, MnistRecord *data, int size);
 MnistRecord *load_mnist_data(const char *path, int size);
-void train();
+void free_mnist_data(MnistRecord *data);
+TrainConfig train_config_default();
+MnistRecord *augment_training_data(MnistRecord *train_data, int augmentation_count, int *data_len);
+void train(TrainConfig *cfg);
+void train_apply_gradients(Net *net, Net *grad, int batch_size, float learning_rate);
+void train_set_checkpointing(Net *net, int stride);
+float train_step(Net *net, MnistRecord *batch, int batch_size, float learning_rate);
+float train_step_sampled(Net *net, MnistRecord *data, LossSampler *sampler, int batch_size, float learning_rate, float skip_loss, int *num_backward);
+float train_step_distill(Net *net, MnistRecord *batch, const float *teacher_logits, int batch_size, float learning_rate, float temperature, float alpha);
 float calc_net_accuracy(MnistRecord *test_dataset, Net *net);
-MnistRecord augment_mnist_record(MnistRecord *record);
-float *rotate_image(float *pixels, float angle);
-float *shift_image(float *pixels, int dx, int dy);
-float *add_noise(float *pixels, float noise_level);
 int get_prediction_index(float *preds);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,414 @@
+#include "tune.h"
+#include "nn.h"
+#include "train.h"
+#include "bench.h"
+#include "parallel.h"
+#include "numa.h"
+#include "configs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mem.h"
+
+#ifndef _WIN32
+#include <sys/utsname.h>
+#endif
+
+#define MEM_TAG MEM_TAG_BENCH
+
+// The sparse input threshold is searched over densities 1/N .. N/N
+#define TUNE_NUM_DENSITIES 20
+#define TUNE_LINE_LEN 1024
+#define TUNE_NUM_FIELDS 6
+
+// Indexed by BackpropKernel
+static const char *KERNEL_NAMES[] = {"rows", "transposed", "strided"};
+#define TUNE_NUM_KERNELS (int)(sizeof(KERNEL_NAMES) / sizeof(KERNEL_NAMES[0]))
+
+// The CPU model of the first processor in /proc/cpuinfo, under the first of these field names
+// the architecture reports
+static void read_cpu_model(char *out, int len)
+{
+    static const char *fields[] = {"model name", "cpu model", "Hardware", "CPU part"};
+    const int num_fields = (int)(sizeof(fields) / sizeof(fields[0]));
+    snprintf(out, len, "unknown");
+
+    FILE *file = fopen("/proc/cpuinfo", "r");
+    if (!file)
+        return;
+    char line[TUNE_LINE_LEN];
+    int found = num_fields;
+    while (found > 0 && fgets(line, sizeof(line), file))
+    {
+        char *colon = strchr(line, ':');
+        for (int f = 0; f < found && colon; f++)
+        {
+            if (strncmp(line, fields[f], strlen(fields[f])) == 0)
+            {
+                const char *value = colon + 1;
+                while (*value == ' ')
+                {
+                    value++;
+                }
+                snprintf(out, len, "%s", value);
+                found = f;
+                break;
+            }
+        }
+    }
+    fclose(file);
+
+    // Keep the cache file's tab separated fields intact
+    out[strcspn(out, "\r\n")] = '\0';
+    for (char *c = out; *c; c++)
+    {
+        if (*c == '\t')
+            *c = ' ';
+    }
+}
+
+static void read_machine(char *out, int len)
+{
+#ifndef _WIN32
+    struct utsname name;
+    if (uname(&name) == 0)
+    {
+        snprintf(out, len, "%s", name.machine);
+        return;
+    }
+#endif
+    snprintf(out, len, "unknown");
+}
+
+// Key and default choices for the given hidden layer sizes on this machine
+void tune_entry_init(TuningEntry *entry, const uint32_t *arch, int arch_len)
+{
+    memset(entry, 0, sizeof(*entry));
+    read_cpu_model(entry->cpu_model, TUNE_NAME_LEN);
+    read_machine(entry->machine, TUNE_NAME_LEN);
+    entry->arch_len = arch_len < MAX_NET_ARCH_LEN ? arch_len : MAX_NET_ARCH_LEN;
+    memcpy(entry->arch, arch, entry->arch_len * sizeof(uint32_t));
+    entry->sparse_input_threshold = SPARSE_INPUT_DENSITY_THRESHOLD;
+    for (int i = 0; i <= entry->arch_len; i++)
+    {
+        entry->backprop_kernels[i] = BACKPROP_KERNEL_ROWS;
+    }
+    entry->train_threads = 1;
+}
+
+void tune_entry_init_net(TuningEntry *entry, const Net *net)
+{
+    uint32_t arch[MAX_NET_ARCH_LEN];
+    int arch_len = net->num_layers - 1 < MAX_NET_ARCH_LEN ? net->num_layers - 1 : MAX_NET_ARCH_LEN;
+    for (int i = 0; i < arch_len; i++)
+    {
+        arch[i] = layer_arch(&net->layers[i]);
+    }
+    tune_entry_init(entry, arch, arch_len);
+}
+
+// "cpu model<TAB>machine<TAB>32,24,16", the part of a cache line that must match
+static void format_key(const TuningEntry *entry, char *out, int len)
+{
+    int n = snprintf(out, len, "%s\t%s\t", entry->cpu_model, entry->machine);
+    for (int i = 0; i < entry->arch_len && n < len; i++)
+    {
+        n += snprintf(out + n, len - n, i == 0 ? "%u" : ",%u", entry->arch[i]);
+    }
+}
+
+// Split a cache line into its tab separated fields in place, returns the count
+static int split_fields(char *line, char **fields)
+{
+    line[strcspn(line, "\r\n")] = '\0';
+    int count = 0;
+    char *p = line;
+    while (count < TUNE_NUM_FIELDS)
+    {
+        fields[count++] = p;
+        p = strchr(p, '\t');
+        if (!p)
+            break;
+        *p++ = '\0';
+    }
+    return count;
+}
+
+// Fill entry's choices from the cache line with its key, false when there is none
+bool tune_lookup(const char *path, TuningEntry *entry)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return false;
+
+    char key[TUNE_LINE_LEN];
+    format_key(entry, key, sizeof(key));
+    size_t key_len = strlen(key);
+    char line[TUNE_LINE_LEN];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), file))
+    {
+        // The key is the first three fields
+        if (line[0] == '#' || strncmp(line, key, key_len) != 0 || line[key_len] != '\t')
+            continue;
+        char *fields[TUNE_NUM_FIELDS];
+        if (split_fields(line, fields) != TUNE_NUM_FIELDS)
+            continue;
+
+        // Comma separated kernel names, one per layer
+        BackpropKernel kernels[MAX_NET_ARCH_LEN + 1];
+        int num_kernels = 0;
+        for (char *name = strtok(fields[4], ","); name && num_kernels <= entry->arch_len; name = strtok(NULL, ","))
+        {
+            int k = 0;
+            while (k < TUNE_NUM_KERNELS && strcmp(name, KERNEL_NAMES[k]) != 0)
+            {
+                k++;
+            }
+            if (k == TUNE_NUM_KERNELS)
+                break;
+            kernels[num_kernels++] = (BackpropKernel)k;
+        }
+        int threads = atoi(fields[5]);
+        if (num_kernels != entry->arch_len + 1 || threads < 1)
+            continue;
+
+        entry->sparse_input_threshold = strtof(fields[3], NULL);
+        memcpy(entry->backprop_kernels, kernels, num_kernels * sizeof(BackpropKernel));
+        entry->train_threads = threads;
+        found = true;
+    }
+    fclose(file);
+    return found;
+}
+
+// Replace the cache line with entry's key, or add one. The file is rewritten next to the old
+// one and renamed over it, so a concurrent reader sees either version whole.
+bool tune_store(const char *path, const TuningEntry *entry)
+{
+    char key[TUNE_LINE_LEN];
+    format_key(entry, key, sizeof(key));
+    char tmp_path[TUNE_LINE_LEN];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *out = fopen(tmp_path, "w");
+    if (!out)
+    {
+        perror(tmp_path);
+        return false;
+    }
+    fprintf(out, "# cpu model\tmachine\thidden layers\tsparse input threshold\tbackprop kernels\ttrain threads\n");
+
+    FILE *in = fopen(path, "r");
+    if (in)
+    {
+        char line[TUNE_LINE_LEN];
+        size_t key_len = strlen(key);
+        while (fgets(line, sizeof(line), in))
+        {
+            bool same_key = strncmp(line, key, key_len) == 0 && line[key_len] == '\t';
+            if (line[0] != '#' && !same_key)
+            {
+                fputs(line, out);
+            }
+        }
+        fclose(in);
+    }
+
+    fprintf(out, "%s\t%.2f\t", key, entry->sparse_input_threshold);
+    for (int i = 0; i <= entry->arch_len; i++)
+    {
+        fprintf(out, i == 0 ? "%s" : ",%s", KERNEL_NAMES[entry->backprop_kernels[i]]);
+    }
+    fprintf(out, "\t%d\n", entry->train_threads);
+
+    bool ok = fclose(out) == 0;
+    if (ok && rename(tmp_path, path) != 0)
+    {
+        perror(path);
+        ok = false;
+    }
+    if (!ok)
+    {
+        remove(tmp_path);
+    }
+    return ok;
+}
+
+void tune_apply(const TuningEntry *entry, Net *net)
+{
+    net->sparse_input_threshold = entry->sparse_input_threshold;
+    for (int i = 0; i < net->num_layers && i <= entry->arch_len; i++)
+    {
+        net->layers[i].backprop_kernel = entry->backprop_kernels[i];
+    }
+}
+
+// Apply the cached choices for net's shape on this machine, if autotune stored any in path
+bool tune_load_net(const char *path, Net *net)
+{
+    if (!path)
+        return false;
+    TuningEntry entry;
+    tune_entry_init_net(&entry, net);
+    if (!tune_lookup(path, &entry))
+        return false;
+    tune_apply(&entry, net);
+    printf("Using kernels tuned for %s from %s\n", entry.cpu_model, path);
+    return true;
+}
+
+// Synthetic records with about density of their pixels inked
+static void fill_tune_records(MnistRecord *records, int len, float density)
+{
+    for (int i = 0; i < len; i++)
+    {
+        records[i].label = (uint8_t)(i % MNIST_NUM_LABELS);
+        for (int j = 0; j < MNIST_IMG_DATA_LEN; j++)
+        {
+            bool is_ink = (float)rand() / RAND_MAX < density;
+            records[i].pixels[j] = is_ink ? (float)rand() / RAND_MAX : 0.0f;
+        }
+    }
+}
+
+// Inference time in us per image
+static double time_forward(Net *net, MnistRecord *records, int num_records, int iters)
+{
+    double start = get_time_sec();
+    for (int i = 0; i < iters; i++)
+    {
+        net_free_activations(net, net_forward(net, &records[i % num_records], NULL, false));
+    }
+    return (get_time_sec() - start) * 1e6 / iters;
+}
+
+// Time the first layer's dense and sparse paths over a sweep of input densities. Both compress
+// the input as the auto mode does; the threshold is the density up to which sparse stays ahead.
+static float tune_sparse_threshold(Net *net, int iters)
+{
+    int num_records = BATCH_SIZE;
+    MnistRecord *records = (MnistRecord *)MEM_MALLOC(num_records * sizeof(MnistRecord));
+    int density_iters = iters / TUNE_NUM_DENSITIES > num_records ? iters / TUNE_NUM_DENSITIES : num_records;
+    SparseInputMode saved_mode = net->sparse_input_mode;
+    float saved_threshold = net->sparse_input_threshold;
+    net->sparse_input_mode = SPARSE_INPUT_AUTO;
+
+    printf("%-22s %8s %8s\n", "forward us (density)", "dense", "sparse");
+    float threshold = 0;
+    bool sparse_ahead = true;
+    for (int d = 1; d <= TUNE_NUM_DENSITIES; d++)
+    {
+        float density = (float)d / TUNE_NUM_DENSITIES;
+        fill_tune_records(records, num_records, density);
+        net->sparse_input_threshold = -1;
+        double dense_us = time_forward(net, records, num_records, density_iters);
+        net->sparse_input_threshold = 1;
+        double sparse_us = time_forward(net, records, num_records, density_iters);
+        printf("%-22.2f %8.3f %8.3f\n", density, dense_us, sparse_us);
+
+        sparse_ahead = sparse_ahead && sparse_us < dense_us;
+        if (sparse_ahead)
+        {
+            threshold = density;
+        }
+    }
+
+    net->sparse_input_mode = saved_mode;
+    net->sparse_input_threshold = saved_threshold;
+    MEM_FREE(records);
+    return threshold;
+}
+
+// Time every backward error kernel on one layer and return the fastest
+static BackpropKernel tune_backprop_kernel(Layer *layer, int iters)
+{
+    // About half the nodes are inactive ReLUs with zero error, as in bench
+    float *error = (float *)MEM_MALLOC(layer->num_nodes * sizeof(float));
+    float *prev_error = (float *)MEM_MALLOC(layer->num_inputs * sizeof(float));
+    for (int j = 0; j < layer->num_nodes; j++)
+    {
+        error[j] = rand() % 2 ? (float)rand() / RAND_MAX - 0.5f : 0.0f;
+    }
+
+    int layer_iters = (int)((long long)iters * 1000 / (layer->num_inputs * layer->num_nodes)) + 1;
+    double us[TUNE_NUM_KERNELS];
+    BackpropKernel best = BACKPROP_KERNEL_ROWS;
+    for (int k = 0; k < TUNE_NUM_KERNELS; k++)
+    {
+        us[k] = bench_time_backprop_kernel(layer, error, prev_error, (BackpropKernel)k, layer_iters);
+        if (us[k] < us[best])
+        {
+            best = (BackpropKernel)k;
+        }
+    }
+
+    char shape[32];
+    snprintf(shape, sizeof(shape), "%d x %d", layer->num_inputs, layer->num_nodes);
+    printf("%-22s %8.3f %8.3f %8.3f  %s\n", shape, us[BACKPROP_KERNEL_ROWS], us[BACKPROP_KERNEL_TRANSPOSED],
+           us[BACKPROP_KERNEL_STRIDED], KERNEL_NAMES[best]);
+
+    MEM_FREE(error);
+    MEM_FREE(prev_error);
+    return best;
+}
+
+// Threaded training throughput for powers of two up to every CPU, returns the fastest count
+static int tune_train_threads(Net *net, int iters)
+{
+    NumaTopology topo;
+    numa_topology_read(&topo);
+    int max_threads = topo.num_cpus < BATCH_SIZE ? topo.num_cpus : BATCH_SIZE;
+    numa_topology_free(&topo);
+
+    int num_records = BATCH_SIZE;
+    MnistRecord *records = (MnistRecord *)MEM_MALLOC(num_records * sizeof(MnistRecord));
+    fill_tune_records(records, num_records, 0.2f);
+    TrainConfig cfg = train_config_default();
+    cfg.num_steps = iters / num_records > 0 ? iters / num_records : 1;
+    cfg.batch_size = num_records;
+    cfg.save_path = NULL;
+
+    printf("%-22s %12s\n", "train threads", "imgs/s");
+    int best = 1;
+    double best_rate = 0;
+    for (int threads = 1;; threads = threads * 2 < max_threads ? threads * 2 : max_threads)
+    {
+        Net copy = {};
+        net_copy(&copy, net);
+        double elapsed = threaded_train(&copy, records, num_records, NULL, &cfg, threads, PLACEMENT_LOCAL);
+        net_free(&copy);
+
+        double rate = (double)cfg.num_steps * (num_records / threads) * threads / elapsed;
+        printf("%-22d %12.1f\n", threads, rate);
+        if (rate > best_rate)
+        {
+            best = threads;
+            best_rate = rate;
+        }
+        if (threads >= max_threads)
+            break;
+    }
+
+    MEM_FREE(records);
+    return best;
+}
+
+// Measure every tunable choice for net on this machine into entry
+void run_autotune(Net *net, TuningEntry *entry, int iters)
+{
+    tune_entry_init_net(entry, net);
+    printf("Tuning for %s (%s)\n", entry->cpu_model, entry->machine);
+
+    entry->sparse_input_threshold = tune_sparse_threshold(net, iters);
+    printf("Sparse input threshold: %.2f\n", entry->sparse_input_threshold);
+
+    printf("%-22s %8s %8s %8s\n", "backprop us (in x out)", "rows", "transp", "strided");
+    // The first layer never propagates an error further back
+    for (int i = 1; i < net->num_layers; i++)
+    {
+        entry->backprop_kernels[i] = tune_backprop_kernel(&net->layers[i], iters);
+    }
+
+    entry->train_threads = tune_train_threads(net, iters);
+    printf("Train threads: %d\n", entry->train_threads);
+}
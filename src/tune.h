@@ -0,0 +1,30 @@
+#ifndef TUNE_H
+#define TUNE_H
+
+#include <stdbool.h>
+#include "nn.h"
+
+#define TUNE_NAME_LEN 128
+
+// Kernel choices autotune measured fastest for one network shape on one machine. The cache file
+// holds one entry per line, keyed by the first three fields.
+typedef struct
+{
+    char cpu_model[TUNE_NAME_LEN]; // From /proc/cpuinfo
+    char machine[TUNE_NAME_LEN];   // Instruction set from uname, e.g. x86_64
+    uint32_t arch[MAX_NET_ARCH_LEN];
+    int arch_len;
+    float sparse_input_threshold;
+    BackpropKernel backprop_kernels[MAX_NET_ARCH_LEN + 1];
+    int train_threads;
+} TuningEntry;
+
+void tune_entry_init(TuningEntry *entry, const uint32_t *arch, int arch_len);
+void tune_entry_init_net(TuningEntry *entry, const Net *net);
+bool tune_lookup(const char *path, TuningEntry *entry);
+bool tune_store(const char *path, const TuningEntry *entry);
+void tune_apply(const TuningEntry *entry, Net *net);
+bool tune_load_net(const char *path, Net *net);
+void run_autotune(Net *net, TuningEntry *entry, int iters);
+
+#endif
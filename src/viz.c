@@ -7,24 +7,143 @@
 #include "configs.h"
 #include "nn.h"
 #include "train.h"
+#include "scene.h"
+#include "gui.h"
+#include "snapshot.h"
+#include "mem.h"
+
+// Compute runs on a worker thread where threads are available, inline in viz_update otherwise
+#if !defined(__EMSCRIPTEN__)
+#define VIZ_THREADED
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#endif
 
 #define SPACING 1.0
 #define COLOR_WEIGHTS WHITE
 #define COLOR_ACTIVATION ORANGE
 #define COLOR_GRAD GREEN
+#define PADDING_2D 30
+#define INPUT_GRID_CELL_SIZE 8
+// Edits touching more pixels than this rerun the first layer in full
+#define INCREMENTAL_MAX_CHANGED (MNIST_IMG_DATA_LEN / 4)
 
-int activations_len = 0; 
-int shapes_len = 0;  
+#define MEM_TAG MEM_TAG_VIZ
 
+// What the renderer asks the compute side for
+typedef struct
+{
+    int test_idx;      // Test image to show when flags.load_test_imgs
+    MnistRecord input; // Drawn input otherwise
+    Flags flags;
+    Thresholds thresholds;
+} VizRequest;
+
+// Everything the renderer draws from, immutable once published
+typedef struct
+{
+    SceneFrame scene;
+    MnistRecord input;
+    float preds[MNIST_NUM_LABELS];
+    int prediction_idx;
+    TrainMetrics metrics;
+} VizFrame;
+
+// Set in the shared slot index while it holds a frame the renderer has not taken yet
+#define FRAME_FRESH 4
+
+// Triple buffer: the compute side fills back and swaps it into the shared slot, the renderer
+// swaps its front buffer with the shared slot whenever that holds a fresher frame. Neither side
+// ever waits for the other.
+typedef struct
+{
+    VizFrame frames[3];
+#ifdef VIZ_THREADED
+    atomic_int shared;
+#else
+    int shared;
+#endif
+    int front;
+    int back;
+    bool has_frame; // Renderer: front holds a published frame
+} FrameBuffer;
+
+// Render thread state
 Camera3D g_camera3d;
 float g_cam_angle = 0;
 MnistRecord g_img_input;
 Flags g_flags;
 Thresholds g_thresholds;
+Scene g_scene; // Static layout is shared read-only, the draw order belongs to the renderer
+FrameBuffer g_frames;
+VizRequest g_last_request;
+
+// Compute state, only touched by the worker once it runs
 Net g_net;
+VizCache g_cache;
+SnapshotChannel g_live; // Attached to a training run when mem is set
+TrainMetrics g_live_metrics;
+MnistRecord *g_test_data;
+
+#ifdef VIZ_THREADED
+typedef struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    VizRequest request;
+    int request_version;
+    bool quit;
+    bool is_running;
+    atomic_bool failed; // Test data could not be loaded
+} VizWorker;
+
+VizWorker g_worker = {.lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER};
+
+static void *viz_worker_main(void *arg);
+#endif
+
+static void update_viz_cache(const MnistRecord *input, const int *changed, int num_changed);
+static void draw_3d(VizFrame *frame);
+static void draw_live_status(TrainMetrics *metrics);
+
+// Compute side: hand the back buffer over and continue in the previously shared one
+static void frame_buffer_publish(FrameBuffer *fb)
+{
+#ifdef VIZ_THREADED
+    fb->back = atomic_exchange(&fb->shared, fb->back | FRAME_FRESH) & ~FRAME_FRESH;
+#else
+    int shared = fb->shared;
+    fb->shared = fb->back | FRAME_FRESH;
+    fb->back = shared & ~FRAME_FRESH;
+#endif
+}
+
+// Renderer: switch to the latest published frame, NULL until the first one
+static VizFrame *frame_buffer_acquire(FrameBuffer *fb)
+{
+#ifdef VIZ_THREADED
+    if (atomic_load(&fb->shared) & FRAME_FRESH)
+    {
+        fb->front = atomic_exchange(&fb->shared, fb->front) & ~FRAME_FRESH;
+        fb->has_frame = true;
+    }
+#else
+    if (fb->shared & FRAME_FRESH)
+    {
+        int shared = fb->shared;
+        fb->shared = fb->front;
+        fb->front = shared & ~FRAME_FRESH;
+        fb->has_frame = true;
+    }
+#endif
+    return fb->has_frame ? &fb->frames[fb->front] : NULL;
+}
 
-// Init visualization
-bool viz_init()
+// Init visualization of a saved network, or of a training run publishing to live_name
+bool viz_init(const char *model_path, const char *live_name)
 {
     // Initialize Raylib window
     InitWindow(WINDOW_W, WINDOW_H, "NN");
@@ -32,11 +151,41 @@ bool viz_init()
     SetTargetFPS(FPS);
 
     // Load neural network
-    if (!net_load(&g_net))
+    if (live_name)
+    {
+        if (!snapshot_viewer_open(&g_live, live_name, &g_net))
+        {
+            return true;
+        }
+        snapshot_read(&g_live, &g_net, &g_live_metrics);
+    }
+    else if (!net_load(&g_net, model_path))
+    {
+        printf("Failed to load network: %s\n", model_path);
+        return true;
+    }
+    if (!net_is_dense(&g_net))
     {
+        printf("viz needs a network of dense layers only\n");
+        net_free(&g_net);
         return true;
     }
 
+    // Buffers for the cached inference results, sized once per model
+    net_init_mem_like(&g_cache.grads, &g_net, false);
+    net_init_mem_like(&g_cache.contribs, &g_net, false);
+    viz_invalidate_cache();
+
+    // Static scene layout, and instance buffers for each of the three frames
+    scene_init(&g_scene, &g_net);
+    for (int i = 0; i < 3; i++)
+    {
+        scene_frame_init(&g_scene, &g_frames.frames[i].scene);
+    }
+    g_frames.front = 0;
+    g_frames.shared = 1;
+    g_frames.back = 2;
+
     // Camera setup
     reset_cam();
 
@@ -52,12 +201,59 @@ bool viz_init()
     g_thresholds.connections = 25;
     g_thresholds.weight_cloud = 50;
 
+#ifdef VIZ_THREADED
+    // The worker loads the test data itself, so the window is responsive right away
+    g_worker.request_version = 0;
+    g_worker.quit = false;
+    g_worker.is_running = pthread_create(&g_worker.thread, NULL, viz_worker_main, NULL) == 0;
+    if (!g_worker.is_running)
+    {
+        printf("Failed to start the viz compute thread\n");
+        return true;
+    }
+#else
+    g_test_data = load_mnist_data(MNIST_TEST_FILE_PATH, TEST_DATA_LEN);
+    if (!g_test_data)
+    {
+        printf("Failed to read MNIST test data file\n");
+        return true;
+    }
+#endif
+
     return false;
 }
 
 // Deinit visualization
 void viz_deinit()
 {
+#ifdef VIZ_THREADED
+    if (g_worker.is_running)
+    {
+        pthread_mutex_lock(&g_worker.lock);
+        g_worker.quit = true;
+        pthread_cond_signal(&g_worker.changed);
+        pthread_mutex_unlock(&g_worker.lock);
+        pthread_join(g_worker.thread, NULL);
+        g_worker.is_running = false;
+    }
+#endif
+    free_mnist_data(g_test_data);
+    g_test_data = NULL;
+
+    if (g_cache.activations)
+    {
+        net_free_activations(&g_net, g_cache.activations);
+        g_cache.activations = NULL;
+    }
+    net_incremental_free(&g_cache.inc);
+    net_free(&g_cache.grads);
+    net_free(&g_cache.contribs);
+    for (int i = 0; i < 3; i++)
+    {
+        scene_frame_free(&g_frames.frames[i].scene);
+    }
+    scene_free(&g_scene);
+    snapshot_close(&g_live);
     net_free(&g_net);
     CloseWindow();
 }
@@ -65,14 +261,150 @@ void viz_deinit()
 // Check for window close
 bool is_viz_terminate()
 {
+#ifdef VIZ_THREADED
+    if (atomic_load(&g_worker.failed))
+        return true;
+#endif
     return WindowShouldClose();
 }
 
-// Update visualization logic
-void viz_update(MnistRecord *test_img)
+// Compute side: bring the cache up to date with a request and publish a frame built from it
+static void viz_compute_frame(VizRequest *request, bool is_new_request)
+{
+    bool is_dirty = is_new_request;
+
+    // Pick up the training run's latest weights
+    if (g_live.mem && snapshot_read(&g_live, &g_net, &g_live_metrics))
+    {
+        g_cache.weights_version++;
+        viz_invalidate_cache();
+        is_dirty = true;
+    }
+
+    MnistRecord *input = request->flags.load_test_imgs ? &g_test_data[request->test_idx % TEST_DATA_LEN] : &request->input;
+
+    // Only rerun inference when the input changed since the last computation
+    if (!g_cache.is_valid)
+    {
+        update_viz_cache(input, NULL, MNIST_IMG_DATA_LEN);
+        is_dirty = true;
+    }
+    else
+    {
+        int changed[MNIST_IMG_DATA_LEN];
+        int num_changed = 0;
+        for (int i = 0; i < MNIST_IMG_DATA_LEN; i++)
+        {
+            if (input->pixels[i] != g_cache.input.pixels[i])
+            {
+                changed[num_changed++] = i;
+            }
+        }
+        if (num_changed > 0 || input->label != g_cache.input.label)
+        {
+            update_viz_cache(input, changed, num_changed);
+            is_dirty = true;
+        }
+    }
+
+    if (!is_dirty)
+        return;
+
+    VizFrame *frame = &g_frames.frames[g_frames.back];
+    scene_update(&g_scene, &frame->scene, &g_net, &g_cache, &request->flags, &request->thresholds);
+    frame->input = g_cache.input;
+    memcpy(frame->preds, g_cache.activations[g_net.num_layers], sizeof(frame->preds));
+    frame->prediction_idx = g_cache.prediction_idx;
+    frame->metrics = g_live_metrics;
+    frame_buffer_publish(&g_frames);
+}
+
+#ifdef VIZ_THREADED
+// Compute worker: waits for new requests (or polls the live snapshot) and publishes frames
+static void *viz_worker_main(void *arg)
 {
-    // Handle keyboard inputs
+    mem_scope_begin(MEM_TAG_VIZ);
+    g_test_data = load_mnist_data(MNIST_TEST_FILE_PATH, TEST_DATA_LEN);
+    if (!g_test_data)
+    {
+        printf("Failed to read MNIST test data file\n");
+        atomic_store(&g_worker.failed, true);
+        return NULL;
+    }
+
+    int seen_version = 0;
+    while (true)
+    {
+        pthread_mutex_lock(&g_worker.lock);
+        while (!g_worker.quit && g_worker.request_version == seen_version)
+        {
+            if (!g_live.mem)
+            {
+                pthread_cond_wait(&g_worker.changed, &g_worker.lock);
+                continue;
+            }
+
+            // Watching a training run: wake up once per frame to check for new weights
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 1000000000L / FPS;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            if (pthread_cond_timedwait(&g_worker.changed, &g_worker.lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+        if (g_worker.quit)
+        {
+            pthread_mutex_unlock(&g_worker.lock);
+            break;
+        }
+        bool is_new_request = g_worker.request_version != seen_version;
+        VizRequest request = g_worker.request;
+        seen_version = g_worker.request_version;
+        pthread_mutex_unlock(&g_worker.lock);
+
+        viz_compute_frame(&request, is_new_request);
+    }
+    return NULL;
+}
+#endif
+
+// Hand the current inputs to the compute side, only when something changed
+static void post_viz_request(int test_idx)
+{
+    VizRequest request;
+    memset(&request, 0, sizeof(request)); // Padding included, requests are compared bytewise
+    request.test_idx = test_idx;
+    if (!g_flags.load_test_imgs)
+    {
+        request.input = g_img_input;
+    }
+    request.flags = g_flags;
+    request.thresholds = g_thresholds;
+
+    bool is_new_request = memcmp(&request, &g_last_request, sizeof(request)) != 0;
+    g_last_request = request;
+
+#ifdef VIZ_THREADED
+    if (is_new_request)
+    {
+        pthread_mutex_lock(&g_worker.lock);
+        g_worker.request = request;
+        g_worker.request_version++;
+        pthread_cond_signal(&g_worker.changed);
+        pthread_mutex_unlock(&g_worker.lock);
+    }
+#else
+    viz_compute_frame(&request, is_new_request);
+#endif
+}
+
+// Update visualization logic, showing test image test_idx while test images are enabled
+void viz_update(int test_idx)
+{
+    // Handle keyboard inputs and drawing into the input grid
     handle_keyboard_input();
+    handle_mouse_drawing();
 
     // Update camera position if rotating
     if (g_flags.cam_rotate)
@@ -86,37 +418,159 @@ void viz_update(MnistRecord *test_img)
         UpdateCamera(&g_camera3d, CAMERA_FREE);
     }
 
-    // Load test image if flag is set
-    if (g_flags.load_test_imgs)
+    post_viz_request(test_idx);
+
+    // Draw the latest completed frame, whatever the compute side is busy with
+    VizFrame *frame = frame_buffer_acquire(&g_frames);
+    if (frame && g_flags.load_test_imgs)
+    {
+        g_img_input = frame->input;
+    }
+
+    BeginDrawing();
+    ClearBackground(BLUE);
+    if (frame)
+    {
+        draw_3d(frame);
+        draw_2d(frame->prediction_idx, frame->preds);
+        if (g_live.mem)
+        {
+            draw_live_status(&frame->metrics);
+        }
+    }
+    else
+    {
+        DrawText("Loading ...", PADDING_2D, PADDING_2D, 20, WHITE);
+    }
+    EndDrawing();
+}
+
+// Force the next computed frame to rerun inference (e.g. after the model changed)
+void viz_invalidate_cache()
+{
+    g_cache.is_valid = false;
+}
+
+// Zero the weights and biases of layers first_layer.. of a network used as an accumulator
+static void clear_net_values_from(Net *net, int first_layer)
+{
+    for (int i = first_layer; i < net->num_layers; i++)
     {
-        memcpy(g_img_input.pixels, test_img->pixels, sizeof(test_img->pixels));
+        Layer *layer = &net->layers[i];
+        memset(layer->b, 0, layer->num_nodes * sizeof(float));
+        for (int j = 0; j < layer->num_nodes; j++)
+        {
+            memset(layer->w[j], 0, layer->num_inputs * sizeof(float));
+        }
     }
+}
 
-    // Initialize gradient and contribution networks
-    Net grad_net = {};
-    Net contrib_net = {};
-    net_init_mem(&grad_net, true);
-    net_init_mem(&contrib_net, true);
+static void clear_net_values(Net *net)
+{
+    clear_net_values_from(net, 0);
+}
 
-    // Run inference, calculate gradients, and activations
-    float **activations;
-    float loss = net_backward(&g_net, &g_img_input, &grad_net, &contrib_net, false);
-    activations = net_forward(&g_net, &g_img_input, &contrib_net, false);
-    float *preds = activations[activations_len - 1];
-    int prediction_idx = get_prediction_index(preds);
+// Recompute activations, gradients and contributions for input into the persistent cache,
+// small edits only pay for the changed first layer columns
+static void update_viz_cache(const MnistRecord *input, const int *changed, int num_changed)
+{
+    bool is_full = !g_cache.is_valid || changed == NULL || num_changed > INCREMENTAL_MAX_CHANGED;
+    Layer *first = &g_net.layers[0];
+    Layer *first_grads = &g_cache.grads.layers[0];
+    Layer *first_contribs = &g_cache.contribs.layers[0];
 
-    // Prepare visualization data
-    for (int i = 0; i < sizeof(grad_net.layers); i++)
+    // Activations
+    if (is_full)
+    {
+        net_incremental_init(&g_net, &g_cache.inc, input->pixels);
+    }
+    else
     {
-        normalize_values(grad_net.layers[i].w[0], sizeof(grad_net.layers[i].w[0]));
+        float values[MNIST_IMG_DATA_LEN];
+        for (int n = 0; n < num_changed; n++)
+        {
+            values[n] = input->pixels[changed[n]];
+        }
+        net_incremental_set_pixels(&g_net, &g_cache.inc, changed, values, num_changed);
     }
 
-    // Draw the 3D and 2D visualizations
-    BeginDrawing();
-    ClearBackground(BLUE);
-    draw_3d(activations, &grad_net, &contrib_net, prediction_idx);
-    draw_2d(prediction_idx, preds);
-    EndDrawing();
+    if (g_cache.activations)
+    {
+        net_free_activations(&g_net, g_cache.activations);
+    }
+    g_cache.activations = net_incremental_forward(&g_net, &g_cache.inc);
+    g_cache.prediction_idx = get_prediction_index(g_cache.activations[g_net.num_layers]);
+
+    // Gradients: first layer entries are only nonzero in the columns of nonzero pixels
+    if (is_full)
+    {
+        clear_net_values(&g_cache.grads);
+    }
+    else
+    {
+        clear_net_values_from(&g_cache.grads, 1);
+        memset(first_grads->b, 0, first_grads->num_nodes * sizeof(float));
+        for (int j = 0; j < first_grads->num_nodes; j++)
+        {
+            for (int n = 0; n < g_cache.input_nz.len; n++)
+            {
+                first_grads->w[j][g_cache.input_nz.idx[n]] = 0;
+            }
+        }
+    }
+    net_backward_activations(&g_net, g_cache.activations, input->label, &g_cache.grads);
+    sparse_input_compress(input->pixels, MNIST_IMG_DATA_LEN, &g_cache.input_nz);
+
+    // Contribution of each input to each node: weight times input activation
+    for (int i = is_full ? 0 : 1; i < g_net.num_layers; i++)
+    {
+        Layer *layer = &g_net.layers[i];
+        float *input = g_cache.activations[i];
+        for (int j = 0; j < layer->num_nodes; j++)
+        {
+            for (int k = 0; k < layer->num_inputs; k++)
+            {
+                g_cache.contribs.layers[i].w[j][k] = layer->w[j][k] * input[k];
+            }
+        }
+    }
+    if (!is_full)
+    {
+        for (int j = 0; j < first->num_nodes; j++)
+        {
+            for (int n = 0; n < num_changed; n++)
+            {
+                int k = changed[n];
+                first_contribs->w[j][k] = first->w[j][k] * input->pixels[k];
+            }
+        }
+    }
+
+    // Prepare visualization data, the first layer rows only over their nonzero columns
+    for (int j = 0; j < first_grads->num_nodes; j++)
+    {
+        float sum = 0;
+        for (int n = 0; n < g_cache.input_nz.len; n++)
+        {
+            sum += first_grads->w[j][g_cache.input_nz.idx[n]];
+        }
+        for (int n = 0; sum != 0 && n < g_cache.input_nz.len; n++)
+        {
+            first_grads->w[j][g_cache.input_nz.idx[n]] /= sum;
+        }
+    }
+    for (int i = 1; i < g_cache.grads.num_layers; i++)
+    {
+        Layer *grad_layer = &g_cache.grads.layers[i];
+        for (int j = 0; j < grad_layer->num_nodes; j++)
+        {
+            normalize_values(grad_layer->w[j], grad_layer->num_inputs);
+        }
+    }
+
+    g_cache.input = *input;
+    g_cache.generation++;
+    g_cache.is_valid = true;
 }
 
 // Reset camera settings
@@ -133,64 +587,70 @@ void reset_cam()
 // Draw 2D visualization elements (e.g. prediction graph, input grid)
 void draw_2d(int pred_idx, float *preds)
 {
-    const int PADDING = 30;
     const int GRAPH_HEIGHT = 100;
 
-    int input_grid_width = MNIST_IMG_SIZE * 8;
-    int input_grid_start_y = GetRenderHeight() - input_grid_width - PADDING;
+    int input_grid_width = MNIST_IMG_SIZE * INPUT_GRID_CELL_SIZE;
+    int input_grid_start_y = GetRenderHeight() - input_grid_width - PADDING_2D;
 
     // Draw GUI and bar graph
-    draw_bar_graph(preds, PADDING, input_grid_start_y - GRAPH_HEIGHT, input_grid_width + PADDING, GRAPH_HEIGHT);
-    draw_2d_image_input_grid(PADDING, input_grid_start_y);
-    DrawFPS(GetRenderWidth() - 100, PADDING);
+    draw_bar_graph(preds, PADDING_2D, input_grid_start_y - GRAPH_HEIGHT, input_grid_width + PADDING_2D, GRAPH_HEIGHT);
+    draw_2d_image_input_grid(PADDING_2D, input_grid_start_y);
+    show_gui((bool *)&g_flags, (float *)&g_thresholds, reset_cam);
+    DrawFPS(GetRenderWidth() - 100, PADDING_2D);
 }
 
-// Draw 3D visualization elements
-void draw_3d(float ***activations, Net *grads, Net *contribs, int prediction_idx)
+// Draw the progress of the training run being watched
+static void draw_live_status(TrainMetrics *metrics)
 {
-    BeginMode3D(g_camera3d);
-
-    Shape *shapes = NULL;     // Dynamic array of shapes
-    SceneObject *objs = NULL; // Dynamic array of scene objects
+    char status[128];
+    snprintf(status, sizeof(status), "Step %d  Loss %.4f  Accuracy %.4f  LR %.4f", metrics->step,
+             metrics->loss, metrics->accuracy, metrics->learning_rate);
+    DrawText(status, GetRenderWidth() - MeasureText(status, 20) - PADDING_2D, GetRenderHeight() - PADDING_2D - 20, 20, WHITE);
+}
 
-    // Collect 3D shapes
-    collect_3d_shapes(&shapes, grads, contribs, activations, prediction_idx);
+// Draw a bar per label with its probability
+void draw_bar_graph(float *values, int x_offset, int y_offset, int graph_width, int graph_height)
+{
+    const int LABEL_HEIGHT = 20;
+    int bar_slot = graph_width / MNIST_NUM_LABELS;
+    int max_bar_height = graph_height - LABEL_HEIGHT;
+    int pred_idx = get_prediction_index(values);
 
-    // Sort and draw shapes
-    for (int i = 0; i < shapes_len; i++)
+    for (int i = 0; i < MNIST_NUM_LABELS; i++)
     {
-        if (shapes[i].cube.pos.x > 0)
-        {
-            DrawCube(shapes[i].cube.pos, SPACING, SPACING, SPACING, shapes[i].cube.color);
-        }
-        if (shapes[i].line.start.x > 0)
-        {
-            DrawLine3D(shapes[i].line.start, shapes[i].line.end, shapes[i].line.color);
-        }
-        if (shapes[i].cuboid.pos.x > 0)
-        {
-            DrawCubeWiresV(shapes[i].cuboid.pos, shapes[i].cuboid.size, shapes[i].cuboid.color);
-        }
+        int bar_height = (int)(values[i] * max_bar_height);
+        int x = x_offset + i * bar_slot;
+        Color color = i == pred_idx ? COLOR_ACTIVATION : COLOR_WEIGHTS;
+        DrawRectangle(x + 2, y_offset + max_bar_height - bar_height, bar_slot - 4, bar_height, color);
+
+        char label[4];
+        sprintf(label, "%d", i);
+        DrawText(label, x + bar_slot / 2 - MeasureText(label, 20) / 2, y_offset + max_bar_height, 20, WHITE);
     }
-
-    EndMode3D();
 }
 
-// Collect 3D shapes for visualization
-void collect_3d_shapes(Shape **shapes, Net *grads, Net *contribs, float ***activations, int prediction_idx)
+// Draw the input image as a grid of grayscale cells
+void draw_2d_image_input_grid(int x_offset, int y_offset)
 {
-    // Implementation based on layers, gradients, and contributions (converted from Odin)
-    // Here, shapes array would be filled with Cube, Line, and Cuboid based on layers
+    const int CELL_SIZE = INPUT_GRID_CELL_SIZE;
 
-    // Placeholder for logic:
-    for (int i = 0; i < sizeof(grads->layers); i++)
+    for (int y = 0; y < MNIST_IMG_SIZE; y++)
     {
-        Shape new_shape = {};
-        // Fill new_shape with the cube/line/cuboid information
-        // Then append the shape to the shapes array
-        *shapes = realloc(*shapes, (i + 1) * sizeof(Shape));
-        (*shapes)[i] = new_shape;
+        for (int x = 0; x < MNIST_IMG_SIZE; x++)
+        {
+            unsigned char v = (unsigned char)(g_img_input.pixels[y * MNIST_IMG_SIZE + x] * 255);
+            DrawRectangle(x_offset + x * CELL_SIZE, y_offset + y * CELL_SIZE, CELL_SIZE, CELL_SIZE, (Color){v, v, v, 255});
+        }
     }
+    DrawRectangleLines(x_offset, y_offset, MNIST_IMG_SIZE * CELL_SIZE, MNIST_IMG_SIZE * CELL_SIZE, WHITE);
+}
+
+// Draw 3D visualization elements
+static void draw_3d(VizFrame *frame)
+{
+    BeginMode3D(g_camera3d);
+    scene_draw(&g_scene, &frame->scene, &g_flags, &g_camera3d);
+    EndMode3D();
 }
 
 // Handle keyboard inputs
@@ -210,6 +670,41 @@ void handle_keyboard_input()
     }
 }
 
+// Paint into the input grid with the left mouse button
+void handle_mouse_drawing()
+{
+    if (!IsMouseButtonDown(MOUSE_LEFT_BUTTON))
+        return;
+
+    int grid_width = MNIST_IMG_SIZE * INPUT_GRID_CELL_SIZE;
+    int grid_x = PADDING_2D;
+    int grid_y = GetRenderHeight() - grid_width - PADDING_2D;
+    Vector2 mouse = GetMousePosition();
+    if (!CheckCollisionPointRec(mouse, (Rectangle){grid_x, grid_y, grid_width, grid_width}))
+        return;
+
+    // Drawing replaces the test image stream
+    g_flags.load_test_imgs = false;
+
+    int cx = (int)(mouse.x - grid_x) / INPUT_GRID_CELL_SIZE;
+    int cy = (int)(mouse.y - grid_y) / INPUT_GRID_CELL_SIZE;
+    for (int dy = -1; dy <= 1; dy++)
+    {
+        for (int dx = -1; dx <= 1; dx++)
+        {
+            int x = cx + dx;
+            int y = cy + dy;
+            if (x < 0 || x >= MNIST_IMG_SIZE || y < 0 || y >= MNIST_IMG_SIZE)
+                continue;
+
+            // Soft brush: full ink in the center, partial on the direct neighbours
+            float ink = (dx == 0 && dy == 0) ? 1.0f : (dx == 0 || dy == 0) ? 0.5f : 0.0f;
+            float *pixel = &g_img_input.pixels[y * MNIST_IMG_SIZE + x];
+            *pixel = fmaxf(*pixel, ink);
+        }
+    }
+}
+
 // Normalize values for activations and gradients
 void normalize_values(float *values, int len)
 {
@@ -218,6 +713,8 @@ void normalize_values(float *values, int len)
     {
         sum += values[i];
     }
+    if (sum == 0)
+        return;
 
     for (int i = 0; i < len; i++)
     {
@@ -238,4 +735,30 @@ float calc_vec3_dist_squared(Vector3 a, Vector3 b)
 float map_threshold_value(float value, float x, float y)
 {
     return x + ((value / 100.0f) * (y - x));
-}
\ No newline at end of file
+}
+
+// Run the visualization loop
+void run_viz(const char *model_path, const char *live_name)
+{
+    // Viz Init
+    if (viz_init(model_path, live_name))
+    {
+        return; // Exit if initialization failed
+    }
+    atexit(viz_deinit); // Ensure cleanup happens on exit
+
+    int frame_idx = 0;
+    int img_idx = 0;
+
+    // Simulation loop
+    while (!is_viz_terminate())
+    {
+        frame_idx = (frame_idx + 1) % 15;
+        if (frame_idx == 0)
+        {
+            img_idx = (img_idx + 1) % TEST_DATA_LEN;
+        }
+
+        viz_update(img_idx);
+    }
+}
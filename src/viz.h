@@ -5,17 +5,19 @@
 #include <raylib.h>
 #include "nn.h"
 
+// Same order as the GUI checkboxes, which address the flags as an array
 typedef struct
 {
     bool cam_rotate;
-    bool draw_connections;
-    bool draw_cubes;
     bool draw_cube_lines;
-    bool draw_node_activations;
+    bool draw_cubes;
     bool draw_weight_cloud;
+    bool draw_node_activations;
+    bool draw_connections;
     bool load_test_imgs;
 } Flags;
 
+// Slider values in [0, 100], same order as the GUI sliders
 typedef struct
 {
     float weight_cloud;
@@ -34,53 +36,36 @@ typedef struct
     Color grid_color;
 } LayerViz;
 
+// Inference results reused across frames, recomputed only when the input or model changes
 typedef struct
 {
-    Vector3 pos;
-    Color color;
-    int layer_index;
-} Cube;
-
-typedef struct
-{
-    Vector3 start;
-    Vector3 end;
-    Color color;
-} Line;
-
-typedef struct
-{
-    Vector3 pos;
-    Vector3 size;
-    Color color;
-    bool is_activated;
-} Cuboid;
-
-typedef union
-{
-    Cube cube;
-    Line line;
-    Cuboid cuboid;
-} Shape;
-
-typedef struct
-{
-    Shape shape;
-    float dist_to_cam;
-} SceneObject;
+    Net grads;
+    Net contribs;
+    float **activations;
+    int prediction_idx;
+    MnistRecord input;
+    IncrementalInput inc;  // First layer state for cheap pixel edits
+    SparseInput input_nz;  // Nonzero pixels of input, the only first layer gradient columns set
+    int generation;        // Bumped on every recompute so consumers can skip unchanged frames
+    int weights_version;   // Bumped when the network weights change (live snapshots)
+    bool is_valid;
+} VizCache;
 
-bool viz_init();
+void run_viz(const char *model_path, const char *live_name);
+bool viz_init(const char *model_path, const char *live_name);
 void viz_deinit();
 bool is_viz_terminate();
-void viz_update(MnistRecord *test_img);
+void viz_update(int test_idx);
+void viz_invalidate_cache();
 void reset_cam();
 
 void handle_keyboard_input();
-void draw_3d(float ***activations, Net *grads, Net *contribs, int prediction_idx);
+void handle_mouse_drawing();
 void draw_2d(int pred_idx, float *preds);
 void draw_bar_graph(float *values, int x_offset, int y_offset, int graph_width, int graph_height);
 void draw_2d_image_input_grid(int x_offset, int y_offset);
-void collect_3d_shapes(Shape **shapes, Net *grads, Net *contribs, float ***activations, int prediction_idx);
 void normalize_values(float *values, int len);
+float calc_vec3_dist_squared(Vector3 a, Vector3 b);
+float map_threshold_value(float value, float x, float y);
 
 #endif
\ No newline at end of file
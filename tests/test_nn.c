@@ -0,0 +1,1562 @@
+// Numerical regression tests for the network core: finite-difference gradient
+// checks, optimized kernels against a scalar reference, and seeded determinism.
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "nn.h"
+#include "train.h"
+#include "prune.h"
+#include "server.h"
+#include "augment.h"
+#include "sweep.h"
+#include "parallel.h"
+#include "tune.h"
+#include "ensemble.h"
+#include "dataset.h"
+#include "configs.h"
+
+#define FORWARD_TOLERANCE 1e-5
+#define GRAD_EPSILON 1e-3f
+#define GRAD_TOLERANCE 2e-2
+#define GRAD_KINK_THRESHOLD 1e-4
+
+static int g_num_checks = 0;
+static int g_num_failures = 0;
+
+#define CHECK(cond, ...)                                       \
+    do                                                         \
+    {                                                          \
+        g_num_checks++;                                        \
+        if (!(cond))                                           \
+        {                                                      \
+            g_num_failures++;                                  \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);        \
+            printf(__VA_ARGS__);                               \
+            printf("\n");                                      \
+        }                                                      \
+    } while (0)
+
+// Small architectures used by every test (hidden layer sizes only)
+typedef struct
+{
+    uint32_t arch[4];
+    int arch_len;
+} TestArch;
+
+static const TestArch TEST_ARCHS[] = {
+    {{8}, 1},
+    {{12, 6}, 2},
+    {{5, 7, 6}, 3},
+};
+#define NUM_TEST_ARCHS (int)(sizeof(TEST_ARCHS) / sizeof(TEST_ARCHS[0]))
+
+// MNIST-like synthetic image: mostly blank with ~20% ink
+static void fill_test_record(MnistRecord *record, uint8_t label)
+{
+    record->label = label;
+    for (int i = 0; i < MNIST_IMG_DATA_LEN; i++)
+    {
+        record->pixels[i] = rand() % 5 == 0 ? (float)rand() / RAND_MAX : 0.0f;
+    }
+}
+
+static void init_test_net(Net *net, const TestArch *arch)
+{
+    net_init_mem_arch(net, arch->arch, arch->arch_len, false);
+    net_init_values(net);
+}
+
+// Straightforward double precision forward pass used as the scalar reference
+static void reference_forward(Net *net, const float *pixels, double *out)
+{
+    double buf_a[MNIST_IMG_DATA_LEN];
+    double buf_b[MNIST_IMG_DATA_LEN];
+    double *input = buf_a;
+    double *output = buf_b;
+
+    for (int i = 0; i < MNIST_IMG_DATA_LEN; i++)
+    {
+        input[i] = pixels[i];
+    }
+
+    for (int l = 0; l < net->num_layers; l++)
+    {
+        Layer *layer = &net->layers[l];
+        for (int j = 0; j < layer->num_nodes; j++)
+        {
+            double sum = layer->b[j];
+            for (int k = 0; k < layer->num_inputs; k++)
+            {
+                sum += (double)layer->w[j][k] * input[k];
+            }
+            output[j] = sum;
+        }
+
+        if (layer->activation == RELU)
+        {
+            for (int j = 0; j < layer->num_nodes; j++)
+            {
+                output[j] = output[j] > 0 ? output[j] : 0;
+            }
+        }
+        else
+        {
+            double max_val = output[0];
+            for (int j = 1; j < layer->num_nodes; j++)
+            {
+                max_val = fmax(max_val, output[j]);
+            }
+            double sum = 0;
+            for (int j = 0; j < layer->num_nodes; j++)
+            {
+                output[j] = exp(output[j] - max_val);
+                sum += output[j];
+            }
+            for (int j = 0; j < layer->num_nodes; j++)
+            {
+                output[j] /= sum;
+            }
+        }
+
+        double *tmp = input;
+        input = output;
+        output = tmp;
+    }
+
+    memcpy(out, input, MNIST_NUM_LABELS * sizeof(double));
+}
+
+static double forward_loss(Net *net, MnistRecord *record)
+{
+    float **activations = net_forward(net, record, NULL, false);
+    double loss = -log(activations[net->num_layers][record->label]);
+    net_free_activations(net, activations);
+    return loss;
+}
+
+typedef double (*LossFn)(Net *net, MnistRecord *record);
+
+// Compare one analytic gradient entry of loss_fn against a central finite difference
+static void check_grad_entry(Net *net, MnistRecord *record, LossFn loss_fn, float *param, float analytic, const char *what,
+                             int l, int j, int k)
+{
+    float saved = *param;
+    *param = saved + GRAD_EPSILON;
+    net_weights_changed(net);
+    double loss_plus = loss_fn(net, record);
+    *param = saved - GRAD_EPSILON;
+    net_weights_changed(net);
+    double loss_minus = loss_fn(net, record);
+    *param = saved;
+    net_weights_changed(net);
+
+    // Skip entries whose perturbation crosses a ReLU kink, the loss is not differentiable there
+    double curvature = fabs(loss_plus + loss_minus - 2.0 * loss_fn(net, record));
+    if (curvature > GRAD_KINK_THRESHOLD)
+        return;
+
+    double numeric = (loss_plus - loss_minus) / (2.0 * GRAD_EPSILON);
+    double err = fabs(numeric - analytic) / fmax(1.0, fabs(numeric) + fabs(analytic));
+    CHECK(err < GRAD_TOLERANCE, "%s grad layer %d [%d][%d]: analytic %g numeric %g", what, l, j, k, analytic, numeric);
+}
+
+// Kernel selections that must all agree with the scalar reference
+static const SparseInputMode TEST_SPARSE_MODES[] = {SPARSE_INPUT_NEVER, SPARSE_INPUT_ALWAYS, SPARSE_INPUT_AUTO};
+#define NUM_TEST_SPARSE_MODES (int)(sizeof(TEST_SPARSE_MODES) / sizeof(TEST_SPARSE_MODES[0]))
+
+static void test_forward_matches_reference()
+{
+    for (int a = 0; a < NUM_TEST_ARCHS * NUM_TEST_SPARSE_MODES; a++)
+    {
+        Net net = {};
+        init_test_net(&net, &TEST_ARCHS[a % NUM_TEST_ARCHS]);
+        net.sparse_input_mode = TEST_SPARSE_MODES[a / NUM_TEST_ARCHS];
+
+        for (int n = 0; n < 8; n++)
+        {
+            MnistRecord record;
+            fill_test_record(&record, (uint8_t)(n % MNIST_NUM_LABELS));
+
+            double expected[MNIST_NUM_LABELS];
+            reference_forward(&net, record.pixels, expected);
+
+            float **activations = net_forward(&net, &record, NULL, false);
+            float *preds = activations[net.num_layers];
+            for (int i = 0; i < MNIST_NUM_LABELS; i++)
+            {
+                CHECK(fabs(preds[i] - expected[i]) < FORWARD_TOLERANCE,
+                      "arch %d forward output %d: got %g expected %g", a, i, preds[i], expected[i]);
+            }
+            net_free_activations(&net, activations);
+        }
+
+        net_free(&net);
+    }
+}
+
+static void test_backward_gradients()
+{
+    for (int a = 0; a < NUM_TEST_ARCHS * NUM_TEST_SPARSE_MODES; a++)
+    {
+        Net net = {};
+        Net grad = {};
+        init_test_net(&net, &TEST_ARCHS[a % NUM_TEST_ARCHS]);
+        net.sparse_input_mode = TEST_SPARSE_MODES[a / NUM_TEST_ARCHS];
+        net_init_mem_like(&grad, &net, false);
+
+        MnistRecord record;
+        fill_test_record(&record, (uint8_t)(a % MNIST_NUM_LABELS));
+
+        float loss = net_backward(&net, &record, &grad, NULL, false);
+        CHECK(fabs(loss - forward_loss(&net, &record)) < 1e-4, "arch %d backward loss differs from forward loss", a);
+
+        for (int l = 0; l < net.num_layers; l++)
+        {
+            Layer *layer = &net.layers[l];
+            for (int j = 0; j < layer->num_nodes; j++)
+            {
+                check_grad_entry(&net, &record, forward_loss, &layer->b[j], grad.layers[l].b[j], "bias", l, j, 0);
+
+                // The first layer is wide, so only sample a few of its columns
+                int step = l == 0 ? 37 : 1;
+                for (int k = j % step; k < layer->num_inputs; k += step)
+                {
+                    check_grad_entry(&net, &record, forward_loss, &layer->w[j][k], grad.layers[l].w[j][k], "weight", l, j, k);
+                }
+            }
+        }
+
+        net_free(&grad);
+        net_free(&net);
+    }
+}
+
+// Train a few steps from a fixed seed and return the resulting network
+static void train_seeded(Net *net, unsigned int seed)
+{
+    srand(seed);
+    net_init_mem_arch(net, TEST_ARCHS[1].arch, TEST_ARCHS[1].arch_len, false);
+    net_init_values(net);
+
+    MnistRecord batch[BATCH_SIZE];
+    for (int i = 0; i < BATCH_SIZE; i++)
+    {
+        fill_test_record(&batch[i], (uint8_t)(i % MNIST_NUM_LABELS));
+    }
+
+    for (int step = 0; step < 10; step++)
+    {
+        train_step(net, batch, BATCH_SIZE, LEARNING_RATE);
+    }
+}
+
+static bool nets_bitwise_equal(Net *a, Net *b)
+{
+    if (a->num_layers != b->num_layers)
+        return false;
+
+    for (int l = 0; l < a->num_layers; l++)
+    {
+        Layer *la = &a->layers[l];
+        Layer *lb = &b->layers[l];
+        if (layer_arch(la) != layer_arch(lb) || la->num_inputs != lb->num_inputs)
+            return false;
+        if (memcmp(la->b, lb->b, la->num_rows * sizeof(float)) != 0)
+            return false;
+        for (int j = 0; j < la->num_rows; j++)
+        {
+            if (memcmp(la->w[j], lb->w[j], la->row_len * sizeof(float)) != 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+// Dense and sparse first layer kernels stay consistent after weight updates
+// Distillation loss recomputed from the network outputs in double precision
+static double distill_loss(Net *net, MnistRecord *record, const float *teacher_logits, double temperature, double alpha)
+{
+    float student_logits[MNIST_NUM_LABELS];
+    net_forward_logits(net, record, student_logits);
+
+    double student_max = student_logits[0];
+    double teacher_max = teacher_logits[0];
+    for (int i = 1; i < MNIST_NUM_LABELS; i++)
+    {
+        student_max = fmax(student_max, student_logits[i]);
+        teacher_max = fmax(teacher_max, teacher_logits[i]);
+    }
+
+    double student_sum = 0, teacher_sum = 0, hard_sum = 0;
+    for (int i = 0; i < MNIST_NUM_LABELS; i++)
+    {
+        student_sum += exp((student_logits[i] - student_max) / temperature);
+        teacher_sum += exp((teacher_logits[i] - teacher_max) / temperature);
+        hard_sum += exp(student_logits[i] - student_max);
+    }
+
+    double kl = 0;
+    for (int i = 0; i < MNIST_NUM_LABELS; i++)
+    {
+        double log_teacher = (teacher_logits[i] - teacher_max) / temperature - log(teacher_sum);
+        double log_student = (student_logits[i] - student_max) / temperature - log(student_sum);
+        kl += exp(log_teacher) * (log_teacher - log_student);
+    }
+    double hard = -((student_logits[record->label] - student_max) - log(hard_sum));
+
+    return alpha * temperature * temperature * kl + (1 - alpha) * hard;
+}
+
+static void test_distill_gradients()
+{
+    const float temperature = 3.0f;
+    const float alpha = 0.7f;
+
+    Net teacher = {};
+    Net student = {};
+    Net grad = {};
+    init_test_net(&teacher, &TEST_ARCHS[1]);
+    init_test_net(&student, &TEST_ARCHS[0]);
+    net_init_mem_like(&grad, &student, false);
+
+    MnistRecord record;
+    fill_test_record(&record, 4);
+    float teacher_logits[MNIST_NUM_LABELS];
+    net_forward_logits(&teacher, &record, teacher_logits);
+
+    float loss = net_backward_distill(&student, &record, teacher_logits, temperature, alpha, &grad, false);
+    CHECK(fabs(loss - distill_loss(&student, &record, teacher_logits, temperature, alpha)) < 1e-4,
+          "distillation loss differs from reference");
+
+    for (int l = 0; l < student.num_layers; l++)
+    {
+        Layer *layer = &student.layers[l];
+        for (int j = 0; j < layer->num_nodes; j++)
+        {
+            int k = (j * 131) % layer->num_inputs;
+            float *params[2] = {&layer->b[j], &layer->w[j][k]};
+            float analytic[2] = {grad.layers[l].b[j], grad.layers[l].w[j][k]};
+            for (int p = 0; p < 2; p++)
+            {
+                float saved = *params[p];
+                *params[p] = saved + GRAD_EPSILON;
+                net_weights_changed(&student);
+                double loss_plus = distill_loss(&student, &record, teacher_logits, temperature, alpha);
+                *params[p] = saved - GRAD_EPSILON;
+                net_weights_changed(&student);
+                double loss_minus = distill_loss(&student, &record, teacher_logits, temperature, alpha);
+                *params[p] = saved;
+                net_weights_changed(&student);
+
+                double numeric = (loss_plus - loss_minus) / (2.0 * GRAD_EPSILON);
+                double err = fabs(numeric - analytic[p]) / fmax(1.0, fabs(numeric) + fabs(analytic[p]));
+                CHECK(err < GRAD_TOLERANCE, "distill grad layer %d node %d param %d: analytic %g numeric %g",
+                      l, j, p, analytic[p], numeric);
+            }
+        }
+    }
+
+    net_free(&grad);
+    net_free(&student);
+    net_free(&teacher);
+}
+
+static void test_sparse_input_after_update()
+{
+    Net net = {};
+    init_test_net(&net, &TEST_ARCHS[0]);
+    net.sparse_input_mode = SPARSE_INPUT_ALWAYS;
+
+    MnistRecord record;
+    fill_test_record(&record, 3);
+
+    // Build the transposed copy, then change a weight of a nonzero input
+    net_free_activations(&net, net_forward(&net, &record, NULL, false));
+    int k = 0;
+    while (record.pixels[k] == 0)
+        k++;
+    net.layers[0].w[0][k] += 0.5f;
+    net_weights_changed(&net);
+
+    double expected[MNIST_NUM_LABELS];
+    reference_forward(&net, record.pixels, expected);
+    float **activations = net_forward(&net, &record, NULL, false);
+    for (int i = 0; i < MNIST_NUM_LABELS; i++)
+    {
+        CHECK(fabs(activations[net.num_layers][i] - expected[i]) < FORWARD_TOLERANCE,
+              "sparse forward output %d stale after weight update", i);
+    }
+    net_free_activations(&net, activations);
+    net_free(&net);
+}
+
+// CSR, block-sparse and dense kernels agree with the reference on pruned networks
+static void test_pruned_kernels_match_reference()
+{
+    const SparseFormat formats[] = {SPARSE_FORMAT_DENSE, SPARSE_FORMAT_CSR, SPARSE_FORMAT_BSR};
+    const int batch = 6; // Covers the dense kernel's four-sample blocks and the remainder
+
+    for (int a = 0; a < NUM_TEST_ARCHS * 2; a++)
+    {
+        Net net = {};
+        bool by_block = a >= NUM_TEST_ARCHS;
+        init_test_net(&net, &TEST_ARCHS[a % NUM_TEST_ARCHS]);
+        float achieved = net_prune_magnitude(&net, 0.8f, by_block);
+        CHECK(by_block || fabs(achieved - 0.8f) < 0.01f, "arch %d pruned to %.3f instead of 0.8", a, achieved);
+        CHECK(achieved > 0.5f, "arch %d only pruned to %.3f", a, achieved);
+
+        float inputs[6 * MNIST_IMG_DATA_LEN];
+        double expected[6][MNIST_NUM_LABELS];
+        for (int s = 0; s < batch; s++)
+        {
+            MnistRecord record;
+            fill_test_record(&record, 0);
+            memcpy(&inputs[s * MNIST_IMG_DATA_LEN], record.pixels, sizeof(record.pixels));
+            reference_forward(&net, record.pixels, expected[s]);
+        }
+
+        for (int f = 0; f < 3; f++)
+        {
+            PrunedNet pnet = {};
+            pruned_net_init(&pnet, &net, formats[f]);
+            float probs[6 * MNIST_NUM_LABELS];
+            pruned_net_forward(&pnet, inputs, batch, probs);
+            for (int s = 0; s < batch; s++)
+            {
+                for (int i = 0; i < MNIST_NUM_LABELS; i++)
+                {
+                    CHECK(fabs(probs[s * MNIST_NUM_LABELS + i] - expected[s][i]) < FORWARD_TOLERANCE,
+                          "arch %d format %d sample %d output %d differs from reference", a, f, s, i);
+                }
+            }
+            pruned_net_free(&pnet);
+        }
+
+        net_free(&net);
+    }
+}
+
+// Incremental pixel edits give the same outputs and gradients as a full forward pass
+static void test_incremental_forward()
+{
+    Net net = {};
+    Net grad_full = {};
+    Net grad_inc = {};
+    init_test_net(&net, &TEST_ARCHS[1]);
+    net_init_mem_like(&grad_full, &net, false);
+    net_init_mem_like(&grad_inc, &net, false);
+
+    MnistRecord record;
+    fill_test_record(&record, 5);
+    IncrementalInput inc = {};
+    net_incremental_init(&net, &inc, record.pixels);
+
+    // Enough edits to cross INCREMENTAL_REFRESH_INTERVAL at least once
+    int num_rounds = INCREMENTAL_REFRESH_INTERVAL / 8 + 50;
+    for (int round = 0; round < num_rounds; round++)
+    {
+        int idx[12];
+        float values[12];
+        for (int n = 0; n < 12; n++)
+        {
+            idx[n] = rand() % MNIST_IMG_DATA_LEN;
+            values[n] = rand() % 3 == 0 ? 0.0f : (float)rand() / RAND_MAX;
+            record.pixels[idx[n]] = values[n];
+        }
+        net_incremental_set_pixels(&net, &inc, idx, values, 12);
+
+        if (round % 64 != 0 && round != num_rounds - 1)
+            continue;
+
+        double expected[MNIST_NUM_LABELS];
+        reference_forward(&net, record.pixels, expected);
+        float **activations = net_incremental_forward(&net, &inc);
+        for (int i = 0; i < MNIST_NUM_LABELS; i++)
+        {
+            CHECK(fabs(activations[net.num_layers][i] - expected[i]) < FORWARD_TOLERANCE,
+                  "incremental forward round %d output %d: got %g expected %g", round, i, activations[net.num_layers][i], expected[i]);
+        }
+        net_free_activations(&net, activations);
+    }
+
+    // Gradients from the incremental activations match net_backward
+    float **activations = net_incremental_forward(&net, &inc);
+    float loss_inc = net_backward_activations(&net, activations, record.label, &grad_inc);
+    float loss_full = net_backward(&net, &record, &grad_full, NULL, false);
+    net_free_activations(&net, activations);
+    CHECK(fabs(loss_inc - loss_full) < 1e-4, "incremental loss %g differs from %g", loss_inc, loss_full);
+    for (int l = 0; l < net.num_layers; l++)
+    {
+        for (int j = 0; j < net.layers[l].num_nodes; j++)
+        {
+            for (int k = 0; k < net.layers[l].num_inputs; k++)
+            {
+                float a = grad_inc.layers[l].w[j][k];
+                float b = grad_full.layers[l].w[j][k];
+                if (fabs(a - b) > 1e-4 * fmax(1.0, fabs(b)))
+                {
+                    CHECK(false, "incremental grad layer %d [%d][%d]: %g vs %g", l, j, k, a, b);
+                }
+            }
+        }
+    }
+
+    net_incremental_free(&inc);
+    net_free(&grad_inc);
+    net_free(&grad_full);
+    net_free(&net);
+}
+
+// Stacked first layers give every network the pre-activations and gradients it computes alone
+static void test_stacked_layer()
+{
+    Net nets[NUM_TEST_ARCHS] = {};
+    Net grads[NUM_TEST_ARCHS] = {};
+    Net refs[NUM_TEST_ARCHS] = {};
+    for (int m = 0; m < NUM_TEST_ARCHS; m++)
+    {
+        init_test_net(&nets[m], &TEST_ARCHS[m]);
+        net_init_mem_like(&grads[m], &nets[m], false);
+        net_init_mem_like(&refs[m], &nets[m], false);
+    }
+
+    StackedLayer stack;
+    stacked_layer_init(&stack, nets, NUM_TEST_ARCHS);
+    int width = stack.offsets[NUM_TEST_ARCHS];
+    float *pre_act = (float *)malloc(width * sizeof(float));
+    float *first_error = (float *)malloc(width * sizeof(float));
+
+    for (int s = 0; s < 3; s++)
+    {
+        MnistRecord record;
+        fill_test_record(&record, (uint8_t)(s + 2));
+        SparseInput sparse;
+        sparse_input_compress(record.pixels, MNIST_IMG_DATA_LEN, &sparse);
+        stacked_layer_forward(&stack, &sparse, pre_act);
+
+        for (int m = 0; m < NUM_TEST_ARCHS; m++)
+        {
+            float **activations = net_forward_pre_activations(&nets[m], record.pixels, &pre_act[stack.offsets[m]], false);
+            float loss = net_backward_hidden(&nets[m], activations, record.label, &grads[m], &first_error[stack.offsets[m]]);
+            float loss_ref = net_backward(&nets[m], &record, &refs[m], NULL, false);
+            net_free_activations(&nets[m], activations);
+            CHECK(fabs(loss - loss_ref) < 1e-4, "stacked net %d sample %d loss %g vs %g", m, s, loss, loss_ref);
+        }
+        stacked_layer_backward(&stack, &sparse, first_error);
+    }
+    stacked_layer_export_grads(&stack, grads);
+
+    for (int m = 0; m < NUM_TEST_ARCHS; m++)
+    {
+        for (int l = 0; l < nets[m].num_layers; l++)
+        {
+            Layer *layer = &nets[m].layers[l];
+            for (int j = 0; j < layer->num_nodes; j++)
+            {
+                float a = grads[m].layers[l].b[j];
+                float b = refs[m].layers[l].b[j];
+                CHECK(fabs(a - b) < 1e-4 * fmax(1.0, fabs(b)), "stacked net %d bias grad layer %d [%d]: %g vs %g", m, l, j, a, b);
+                for (int k = 0; k < layer->num_inputs; k++)
+                {
+                    a = grads[m].layers[l].w[j][k];
+                    b = refs[m].layers[l].w[j][k];
+                    if (fabs(a - b) > 1e-4 * fmax(1.0, fabs(b)))
+                    {
+                        CHECK(false, "stacked net %d grad layer %d [%d][%d]: %g vs %g", m, l, j, k, a, b);
+                    }
+                }
+            }
+        }
+    }
+
+    free(pre_act);
+    free(first_error);
+    stacked_layer_free(&stack);
+    for (int m = 0; m < NUM_TEST_ARCHS; m++)
+    {
+        net_free(&nets[m]);
+        net_free(&grads[m]);
+        net_free(&refs[m]);
+    }
+}
+
+// Softmax of an exit head over a hidden layer output, in double precision
+static void exit_head_probs(const Layer *head, const float *input, double *probs)
+{
+    double max_val = -INFINITY;
+    for (int j = 0; j < head->num_nodes; j++)
+    {
+        probs[j] = head->b[j];
+        for (int k = 0; k < head->num_inputs; k++)
+        {
+            probs[j] += (double)head->w[j][k] * input[k];
+        }
+        max_val = fmax(max_val, probs[j]);
+    }
+    double sum = 0;
+    for (int j = 0; j < head->num_nodes; j++)
+    {
+        probs[j] = exp(probs[j] - max_val);
+        sum += probs[j];
+    }
+    for (int j = 0; j < head->num_nodes; j++)
+    {
+        probs[j] /= sum;
+    }
+}
+
+// Output cross entropy plus EXIT_LOSS_WEIGHT times each exit head's
+static double exit_joint_loss(Net *net, MnistRecord *record)
+{
+    float **activations = net_forward(net, record, NULL, false);
+    double loss = -log(activations[net->num_layers][record->label]);
+    for (int e = 0; e < net->num_exits; e++)
+    {
+        double probs[MNIST_NUM_LABELS];
+        exit_head_probs(&net->exits[e], activations[e + 1], probs);
+        loss -= EXIT_LOSS_WEIGHT * log(probs[record->label]);
+    }
+    net_free_activations(net, activations);
+    return loss;
+}
+
+static const float EXIT_TEST_THRESHOLDS[] = {0, 0.15f, 0.3f, 1.5f};
+#define NUM_EXIT_TEST_THRESHOLDS (int)(sizeof(EXIT_TEST_THRESHOLDS) / sizeof(EXIT_TEST_THRESHOLDS[0]))
+
+// Exit heads train on the joint loss, stop inference at the first confident head and survive a save
+static void test_early_exit()
+{
+    const char *path = "test_nn_exits.json";
+    Net net = {};
+    Net grad = {};
+    net_init_mem_arch(&net, TEST_ARCHS[2].arch, TEST_ARCHS[2].arch_len, false);
+    net_add_exits(&net);
+    net_init_values(&net);
+    net_init_mem_like(&grad, &net, false);
+    CHECK(net.num_exits == net.num_layers - 1 && grad.num_exits == net.num_exits, "exit heads not allocated");
+
+    MnistRecord record;
+    fill_test_record(&record, 3);
+    net_backward(&net, &record, &grad, NULL, false);
+    for (int l = 0; l < net.num_layers; l++)
+    {
+        Layer *layer = &net.layers[l];
+        for (int j = 0; j < layer->num_nodes; j++)
+        {
+            int k = (j * 131) % layer->num_inputs;
+            check_grad_entry(&net, &record, exit_joint_loss, &layer->b[j], grad.layers[l].b[j], "joint bias", l, j, 0);
+            check_grad_entry(&net, &record, exit_joint_loss, &layer->w[j][k], grad.layers[l].w[j][k], "joint weight", l, j, k);
+        }
+    }
+    for (int e = 0; e < net.num_exits; e++)
+    {
+        Layer *head = &net.exits[e];
+        for (int j = 0; j < head->num_nodes; j++)
+        {
+            int k = j % head->num_inputs;
+            check_grad_entry(&net, &record, exit_joint_loss, &head->b[j], grad.exits[e].b[j], "exit bias", e, j, 0);
+            check_grad_entry(&net, &record, exit_joint_loss, &head->w[j][k], grad.exits[e].w[j][k], "exit weight", e, j, k);
+        }
+    }
+
+    CHECK(net_save(&net, path), "net_save with exits failed");
+    Net loaded = {};
+    CHECK(net_load(&loaded, path) && loaded.num_exits == net.num_exits, "exit heads not loaded");
+    for (int e = 0; e < net.num_exits && e < loaded.num_exits; e++)
+    {
+        CHECK(memcmp(net.exits[e].b, loaded.exits[e].b, MNIST_NUM_LABELS * sizeof(float)) == 0 &&
+                  memcmp(net.exits[e].w[1], loaded.exits[e].w[1], net.exits[e].num_inputs * sizeof(float)) == 0,
+              "exit %d differs after loading", e);
+    }
+
+    // The first head whose top probability reaches the threshold decides, else the output layer
+    for (int n = 0; n < 8; n++)
+    {
+        fill_test_record(&record, (uint8_t)n);
+        float **activations = net_forward(&net, &record, NULL, false);
+        for (int t = 0; t < NUM_EXIT_TEST_THRESHOLDS; t++)
+        {
+            int expected_layers = net.num_layers;
+            int expected = get_prediction_index(activations[net.num_layers]);
+            for (int e = 0; e < net.num_exits; e++)
+            {
+                double probs[MNIST_NUM_LABELS];
+                exit_head_probs(&net.exits[e], activations[e + 1], probs);
+                int best = 0;
+                for (int i = 1; i < MNIST_NUM_LABELS; i++)
+                {
+                    best = probs[i] > probs[best] ? i : best;
+                }
+                if (probs[best] >= EXIT_TEST_THRESHOLDS[t])
+                {
+                    expected_layers = e + 1;
+                    expected = best;
+                    break;
+                }
+            }
+
+            int layers_run;
+            int prediction = net_predict_early_exit(&loaded, &record, EXIT_TEST_THRESHOLDS[t], &layers_run);
+            CHECK(prediction == expected && layers_run == expected_layers,
+                  "early exit at %g: got %d after %d layers, expected %d after %d", EXIT_TEST_THRESHOLDS[t], prediction,
+                  layers_run, expected, expected_layers);
+        }
+        net_free_activations(&net, activations);
+    }
+
+    remove(path);
+    net_free(&loaded);
+    net_free(&grad);
+    net_free(&net);
+}
+
+#define SAMPLER_TEST_LEN 8
+#define SAMPLER_TEST_DRAWS 200000
+
+// Draws follow the mixed loss distribution, their weights undo it, and a weighted backward pass
+// scales the gradients
+static void test_loss_sampler()
+{
+    LossSampler sampler;
+    loss_sampler_init(&sampler, SAMPLER_TEST_LEN, 0.25f);
+    double total = 0;
+    for (int i = 0; i < SAMPLER_TEST_LEN; i++)
+    {
+        loss_sampler_update(&sampler, i, 0.5f * i); // Example 0 only comes up in uniform draws
+        total += 0.5 * i;
+    }
+
+    int counts[SAMPLER_TEST_LEN] = {0};
+    double weighted_sum = 0; // Of each index, which should average to the plain mean
+    for (int d = 0; d < SAMPLER_TEST_DRAWS; d++)
+    {
+        float weight;
+        int index = loss_sampler_draw(&sampler, &weight);
+        counts[index]++;
+        weighted_sum += weight * index;
+    }
+    for (int i = 0; i < SAMPLER_TEST_LEN; i++)
+    {
+        double expected = 0.25 / SAMPLER_TEST_LEN + 0.75 * 0.5 * i / total;
+        double observed = (double)counts[i] / SAMPLER_TEST_DRAWS;
+        CHECK(fabs(observed - expected) < 0.01, "example %d drawn %.4f of the time, expected %.4f", i, observed, expected);
+    }
+    double mean = (SAMPLER_TEST_LEN - 1) / 2.0;
+    CHECK(fabs(weighted_sum / SAMPLER_TEST_DRAWS - mean) < 0.05, "weighted draws average %.4f, expected %.4f",
+          weighted_sum / SAMPLER_TEST_DRAWS, mean);
+    loss_sampler_free(&sampler);
+
+    Net net = {};
+    Net grad = {};
+    Net weighted = {};
+    init_test_net(&net, &TEST_ARCHS[1]);
+    net_init_mem_like(&grad, &net, false);
+    net_init_mem_like(&weighted, &net, false);
+    MnistRecord record;
+    fill_test_record(&record, 3);
+    float loss = net_backward(&net, &record, &grad, NULL, false);
+    bool backward_ran;
+    float weighted_loss = net_backward_weighted(&net, &record, &weighted, 2.5f, 0, false, &backward_ran);
+    CHECK(backward_ran && loss == weighted_loss, "weighted backward changed the loss or skipped");
+    double max_diff = 0;
+    for (int l = 0; l < net.num_layers; l++)
+    {
+        for (int j = 0; j < net.layers[l].num_nodes; j++)
+        {
+            max_diff = fmax(max_diff, fabs(weighted.layers[l].b[j] - 2.5f * grad.layers[l].b[j]));
+        }
+    }
+    CHECK(max_diff < FORWARD_TOLERANCE, "weighted bias gradients off by %g", max_diff);
+    net_free(&net);
+    net_free(&grad);
+    net_free(&weighted);
+}
+
+static void test_training_determinism()
+{
+    Net first = {};
+    Net second = {};
+    train_seeded(&first, 1234);
+    train_seeded(&second, 1234);
+    CHECK(nets_bitwise_equal(&first, &second), "training with the same seed is not bitwise reproducible");
+    net_free(&first);
+    net_free(&second);
+}
+
+// Conv and pooling layers: both conv kernels agree, their gradients match finite differences, and
+// the layers survive a save/load roundtrip
+static const uint32_t CONV_TEST_ARCH[] = {ARCH_CONV(3, 3, 1, 1), ARCH_POOL(LAYER_MAX_POOL, 2), ARCH_CONV(4, 3, 2, 0),
+                                          ARCH_POOL(LAYER_AVG_POOL, 2), 6};
+#define CONV_TEST_ARCH_LEN (int)(sizeof(CONV_TEST_ARCH) / sizeof(CONV_TEST_ARCH[0]))
+
+static void set_conv_kernel(Net *net, ConvKernel kernel)
+{
+    for (int l = 0; l < net->num_layers; l++)
+    {
+        net->layers[l].conv_kernel = kernel;
+    }
+}
+
+static void test_conv_layers()
+{
+    const ConvKernel kernels[] = {CONV_KERNEL_IM2COL, CONV_KERNEL_DIRECT};
+    const char *path = "test_nn_conv.json";
+
+    CHECK(net_arch_valid(CONV_TEST_ARCH, CONV_TEST_ARCH_LEN), "conv test arch rejected");
+    CHECK(!net_arch_is_dense(CONV_TEST_ARCH, CONV_TEST_ARCH_LEN), "conv test arch reported dense");
+    const uint32_t bad_arch[] = {ARCH_CONV(4, 3, 2, 0), ARCH_POOL(LAYER_MAX_POOL, 15), 6};
+    CHECK(!net_arch_valid(bad_arch, 3), "pooling larger than its input accepted");
+
+    Net net = {};
+    Net grads[2] = {};
+    net_init_mem_arch(&net, CONV_TEST_ARCH, CONV_TEST_ARCH_LEN, false);
+    net_init_values(&net);
+    CHECK(net.layers[1].conv.out_h == 14 && net.layers[2].conv.out_h == 6 && net.layers[3].conv.out_h == 3,
+          "conv test arch spatial sizes");
+
+    MnistRecord record;
+    fill_test_record(&record, 3);
+
+    float *outputs[2];
+    for (int c = 0; c < 2; c++)
+    {
+        set_conv_kernel(&net, kernels[c]);
+        net_init_mem_like(&grads[c], &net, false);
+        float **activations = net_forward(&net, &record, NULL, false);
+        outputs[c] = (float *)malloc(MNIST_NUM_LABELS * sizeof(float));
+        memcpy(outputs[c], activations[net.num_layers], MNIST_NUM_LABELS * sizeof(float));
+        net_free_activations(&net, activations);
+
+        float loss = net_backward(&net, &record, &grads[c], NULL, false);
+        CHECK(fabs(loss - forward_loss(&net, &record)) < 1e-4, "conv kernel %d backward loss differs from forward loss", c);
+    }
+
+    for (int i = 0; i < MNIST_NUM_LABELS; i++)
+    {
+        CHECK(fabs(outputs[0][i] - outputs[1][i]) < FORWARD_TOLERANCE, "conv kernels disagree on output %d: %g vs %g", i,
+              outputs[0][i], outputs[1][i]);
+    }
+    for (int l = 0; l < net.num_layers; l++)
+    {
+        Layer *layer = &net.layers[l];
+        if (layer->type != LAYER_CONV)
+            continue;
+        for (int j = 0; j < layer->num_rows; j++)
+        {
+            CHECK(fabs(grads[0].layers[l].b[j] - grads[1].layers[l].b[j]) < FORWARD_TOLERANCE,
+                  "conv kernels disagree on layer %d bias grad %d", l, j);
+            for (int k = 0; k < layer->row_len; k++)
+            {
+                CHECK(fabs(grads[0].layers[l].w[j][k] - grads[1].layers[l].w[j][k]) < FORWARD_TOLERANCE,
+                      "conv kernels disagree on layer %d weight grad [%d][%d]", l, j, k);
+            }
+        }
+    }
+
+    for (int l = 0; l < net.num_layers; l++)
+    {
+        Layer *layer = &net.layers[l];
+        for (int j = 0; j < layer->num_rows; j++)
+        {
+            check_grad_entry(&net, &record, forward_loss, &layer->b[j], grads[1].layers[l].b[j], "conv bias", l, j, 0);
+            for (int k = j % 3; k < layer->row_len; k += 3)
+            {
+                check_grad_entry(&net, &record, forward_loss, &layer->w[j][k], grads[1].layers[l].w[j][k], "conv weight",
+                                 l, j, k);
+            }
+        }
+    }
+
+    Net loaded = {};
+    CHECK(net_save(&net, path), "conv net_save failed");
+    CHECK(net_load(&loaded, path), "conv net_load failed");
+    CHECK(nets_bitwise_equal(&net, &loaded), "loaded conv network differs from saved network");
+    if (loaded.num_layers == net.num_layers)
+    {
+        float **activations = net_forward(&loaded, &record, NULL, false);
+        CHECK(memcmp(activations[loaded.num_layers], outputs[0], MNIST_NUM_LABELS * sizeof(float)) == 0,
+              "loaded conv network predicts differently");
+        net_free_activations(&loaded, activations);
+    }
+
+    remove(path);
+    for (int c = 0; c < 2; c++)
+    {
+        free(outputs[c]);
+        net_free(&grads[c]);
+    }
+    net_free(&loaded);
+    net_free(&net);
+}
+
+// Checkpointed training recomputes bitwise the same gradients as keeping every activation,
+// dropout included, while holding fewer activations
+#define CHECKPOINT_TEST_DROPOUT 0.3f
+#define CHECKPOINT_TEST_SEED 77
+
+static void test_checkpointing()
+{
+    for (int a = 0; a < 2; a++)
+    {
+        Net net = {};
+        if (a == 0)
+        {
+            net_init_mem_arch(&net, TEST_ARCHS[2].arch, TEST_ARCHS[2].arch_len, false);
+        }
+        else
+        {
+            net_init_mem_arch(&net, CONV_TEST_ARCH, CONV_TEST_ARCH_LEN, false);
+        }
+        net_init_values(&net);
+        for (int l = 0; l < net.num_layers; l++)
+        {
+            net.layers[l].dropout_rate = CHECKPOINT_TEST_DROPOUT;
+        }
+        int all_floats = net_activation_floats(&net);
+
+        MnistRecord record;
+        fill_test_record(&record, 5);
+        float teacher_logits[MNIST_NUM_LABELS];
+        for (int i = 0; i < MNIST_NUM_LABELS; i++)
+        {
+            teacher_logits[i] = (float)rand() / RAND_MAX * 4 - 2;
+        }
+
+        Net expected[2] = {};
+        float expected_loss[2];
+        for (int d = 0; d < 2; d++)
+        {
+            net_init_mem_like(&expected[d], &net, false);
+            srand(CHECKPOINT_TEST_SEED);
+            expected_loss[d] = d == 0 ? net_backward(&net, &record, &expected[d], NULL, true)
+                                      : net_backward_distill(&net, &record, teacher_logits, 2, 0.5f, &expected[d], true);
+        }
+
+        for (int stride = 2; stride <= 3; stride++)
+        {
+            net.checkpoint_stride = stride;
+            CHECK(net_activation_floats(&net) < all_floats, "arch %d stride %d keeps no fewer activations", a, stride);
+            for (int d = 0; d < 2; d++)
+            {
+                Net grad = {};
+                net_init_mem_like(&grad, &net, false);
+                srand(CHECKPOINT_TEST_SEED);
+                float loss = d == 0 ? net_backward(&net, &record, &grad, NULL, true)
+                                    : net_backward_distill(&net, &record, teacher_logits, 2, 0.5f, &grad, true);
+                CHECK(loss == expected_loss[d], "arch %d stride %d loss %d: %g vs %g", a, stride, d, loss, expected_loss[d]);
+                CHECK(nets_bitwise_equal(&grad, &expected[d]), "arch %d stride %d gradients %d differ", a, stride, d);
+                net_free(&grad);
+            }
+        }
+
+        net_free(&expected[0]);
+        net_free(&expected[1]);
+        net_free(&net);
+    }
+}
+
+// Ensembles average every model's probabilities over the views, however the images are batched
+// and threaded; conv models take the per-image path
+#define ENSEMBLE_TEST_IMAGES 37
+
+static void test_ensemble()
+{
+    Net models[3] = {};
+    init_test_net(&models[0], &TEST_ARCHS[0]);
+    init_test_net(&models[1], &TEST_ARCHS[1]);
+    net_init_mem_arch(&models[2], CONV_TEST_ARCH, CONV_TEST_ARCH_LEN, false);
+    net_init_values(&models[2]);
+
+    MnistRecord *records = (MnistRecord *)malloc(ENSEMBLE_TEST_IMAGES * sizeof(MnistRecord));
+    for (int i = 0; i < ENSEMBLE_TEST_IMAGES; i++)
+    {
+        fill_test_record(&records[i], (uint8_t)(i % MNIST_NUM_LABELS));
+    }
+    float probs[ENSEMBLE_TEST_IMAGES * MNIST_NUM_LABELS];
+    float other[ENSEMBLE_TEST_IMAGES * MNIST_NUM_LABELS];
+
+    // With the image as the only view, the plain mean of the models' outputs
+    Ensemble ens;
+    ensemble_init(&ens, models, 3, 1, 8, 1);
+    ensemble_predict(&ens, records, ENSEMBLE_TEST_IMAGES, probs);
+    int num_correct = 0;
+    for (int i = 0; i < ENSEMBLE_TEST_IMAGES; i++)
+    {
+        double expected[MNIST_NUM_LABELS] = {0};
+        for (int m = 0; m < 3; m++)
+        {
+            float **activations = net_forward(&models[m], &records[i], NULL, false);
+            for (int j = 0; j < MNIST_NUM_LABELS; j++)
+            {
+                expected[j] += activations[models[m].num_layers][j] / 3.0;
+            }
+            net_free_activations(&models[m], activations);
+        }
+        for (int j = 0; j < MNIST_NUM_LABELS; j++)
+        {
+            CHECK(fabs(probs[i * MNIST_NUM_LABELS + j] - expected[j]) < FORWARD_TOLERANCE,
+                  "ensemble image %d class %d: %g vs %g", i, j, probs[i * MNIST_NUM_LABELS + j], expected[j]);
+        }
+        num_correct += get_prediction_index(&probs[i * MNIST_NUM_LABELS]) == records[i].label;
+    }
+    CHECK(ensemble_accuracy(&ens, records, ENSEMBLE_TEST_IMAGES) == (float)num_correct / ENSEMBLE_TEST_IMAGES,
+          "ensemble accuracy disagrees with its predictions");
+    ensemble_free(&ens);
+
+    // Every view: other batch sizes and threads give the same probabilities and accuracy
+    Ensemble small;
+    Ensemble threaded;
+    ensemble_init(&small, models, 3, TTA_MAX_VIEWS, 5, 1);
+    ensemble_init(&threaded, models, 3, TTA_MAX_VIEWS, 16, 3);
+    ensemble_predict(&small, records, ENSEMBLE_TEST_IMAGES, probs);
+    ensemble_predict(&threaded, records, ENSEMBLE_TEST_IMAGES, other);
+    for (int i = 0; i < ENSEMBLE_TEST_IMAGES; i++)
+    {
+        double sum = 0;
+        for (int j = 0; j < MNIST_NUM_LABELS; j++)
+        {
+            int k = i * MNIST_NUM_LABELS + j;
+            sum += probs[k];
+            CHECK(fabs(probs[k] - other[k]) < FORWARD_TOLERANCE, "ensemble batching changes image %d class %d", i, j);
+        }
+        CHECK(fabs(sum - 1) < 1e-4, "ensemble image %d probabilities sum to %g", i, sum);
+    }
+    CHECK(ensemble_accuracy(&small, records, ENSEMBLE_TEST_IMAGES) ==
+              ensemble_accuracy(&threaded, records, ENSEMBLE_TEST_IMAGES),
+          "threaded ensemble accuracy differs");
+    ensemble_free(&small);
+    ensemble_free(&threaded);
+
+    free(records);
+    for (int m = 0; m < 3; m++)
+    {
+        net_free(&models[m]);
+    }
+}
+
+static void test_save_load_roundtrip()
+{
+    const char *path = "test_nn_roundtrip.json";
+    Net net = {};
+    Net loaded = {};
+    init_test_net(&net, &TEST_ARCHS[2]);
+
+    CHECK(net_save(&net, path), "net_save failed");
+    CHECK(net_load(&loaded, path), "net_load failed");
+    CHECK(nets_bitwise_equal(&net, &loaded), "loaded network differs from saved network");
+    for (int l = 0; l < net.num_layers && l < loaded.num_layers; l++)
+    {
+        CHECK(net.layers[l].activation == loaded.layers[l].activation, "layer %d activation differs", l);
+    }
+
+    remove(path);
+    net_free(&net);
+    net_free(&loaded);
+}
+
+// Every backward error kernel matches a double precision reference, zero errors included
+static void test_backprop_kernels()
+{
+    const BackpropKernel kernels[] = {BACKPROP_KERNEL_ROWS, BACKPROP_KERNEL_TRANSPOSED, BACKPROP_KERNEL_STRIDED};
+
+    for (int a = 0; a < NUM_TEST_ARCHS; a++)
+    {
+        Net net = {};
+        init_test_net(&net, &TEST_ARCHS[a]);
+        for (int l = 1; l < net.num_layers; l++)
+        {
+            Layer *layer = &net.layers[l];
+            float error[MNIST_NUM_LABELS * 2];
+            for (int j = 0; j < layer->num_nodes; j++)
+            {
+                error[j] = j % 3 == 0 ? 0.0f : (float)rand() / RAND_MAX - 0.5f;
+            }
+
+            for (int k = 0; k < 3; k++)
+            {
+                float prev_error[16];
+                layer_backprop_error(layer, error, prev_error, kernels[k]);
+                for (int i = 0; i < layer->num_inputs; i++)
+                {
+                    double expected = 0;
+                    for (int j = 0; j < layer->num_nodes; j++)
+                    {
+                        expected += (double)error[j] * layer->w[j][i];
+                    }
+                    CHECK(fabs(prev_error[i] - expected) < FORWARD_TOLERANCE,
+                          "arch %d layer %d kernel %d input %d: %g vs %g", a, l, k, i, prev_error[i], expected);
+                }
+            }
+        }
+        net_free(&net);
+    }
+}
+
+// Resampling through composed maps agrees with direct pixel moves, and seeded augmentation repeats
+static void test_augment_kernels()
+{
+    MnistRecord record;
+    fill_test_record(&record, 3);
+    float out[MNIST_IMG_DATA_LEN];
+
+    AugmentParams identity = augment_params_identity();
+    augment_image(record.pixels, &identity, NULL, out);
+    CHECK(memcmp(out, record.pixels, sizeof(out)) == 0, "identity augmentation changed the image");
+
+    shift_image(record.pixels, 2, -3, out);
+    for (int y = 0; y < MNIST_IMG_SIZE; y++)
+    {
+        for (int x = 0; x < MNIST_IMG_SIZE; x++)
+        {
+            int sx = x - 2, sy = y + 3;
+            bool inside = sx >= 0 && sx < MNIST_IMG_SIZE && sy >= 0 && sy < MNIST_IMG_SIZE;
+            float expected = inside ? record.pixels[sy * MNIST_IMG_SIZE + sx] : 0.0f;
+            CHECK(fabsf(out[y * MNIST_IMG_SIZE + x] - expected) < 1e-6f, "shift pixel (%d, %d) is %g instead of %g",
+                  x, y, out[y * MNIST_IMG_SIZE + x], expected);
+        }
+    }
+
+    // A quarter turn maps pixel centers onto pixel centers, so bilinear sampling is exact
+    rotate_image(record.pixels, 90, out);
+    int num_rotate_errors = 0;
+    for (int y = 0; y < MNIST_IMG_SIZE; y++)
+    {
+        for (int x = 0; x < MNIST_IMG_SIZE; x++)
+        {
+            float expected = record.pixels[(MNIST_IMG_SIZE - 1 - x) * MNIST_IMG_SIZE + y];
+            num_rotate_errors += fabsf(out[y * MNIST_IMG_SIZE + x] - expected) > 1e-4f;
+        }
+    }
+    CHECK(num_rotate_errors == 0, "quarter turn differs from a pixel rotation at %d pixels", num_rotate_errors);
+
+    MnistRecord first, second;
+    AugmentRng rng_a, rng_b;
+    augment_rng_seed(&rng_a, 99);
+    augment_rng_seed(&rng_b, 99);
+    augment_mnist_record(&record, &rng_a, &first);
+    augment_mnist_record(&record, &rng_b, &second);
+    CHECK(memcmp(&first.pixels, &second.pixels, sizeof(first.pixels)) == 0, "seeded augmentation is not reproducible");
+    CHECK(first.label == record.label, "augmentation changed the label");
+
+    // Noise keeps blank pixels blank and ink in range
+    memcpy(out, record.pixels, sizeof(out));
+    add_noise(out, 0.5f, 7);
+    int num_noise_errors = 0;
+    for (int i = 0; i < MNIST_IMG_DATA_LEN; i++)
+    {
+        num_noise_errors += record.pixels[i] == 0 ? out[i] != 0 : out[i] < 0 || out[i] > 1;
+    }
+    CHECK(num_noise_errors == 0, "noise left %d pixels blank-inked or out of range", num_noise_errors);
+}
+
+#define SERVER_TEST_CLIENTS 4
+#define SERVER_TEST_REQUESTS 5
+
+typedef struct
+{
+    const ServerConfig *config;
+    Net *net;
+    int index;
+    int num_mismatches;
+    bool failed;
+} ServerTestClient;
+
+static void *server_test_client(void *arg)
+{
+    ServerTestClient *client = (ServerTestClient *)arg;
+    int fd = server_connect(client->config);
+    if (fd < 0)
+    {
+        client->failed = true;
+        return NULL;
+    }
+
+    for (int r = 0; r < SERVER_TEST_REQUESTS; r++)
+    {
+        uint8_t pixels[MNIST_IMG_DATA_LEN];
+        float values[MNIST_IMG_DATA_LEN];
+        for (int i = 0; i < MNIST_IMG_DATA_LEN; i++)
+        {
+            pixels[i] = (uint8_t)((i * 7 + r * 13 + client->index) % 5 == 0 ? (i * 31 + r) % 256 : 0);
+            values[i] = pixels[i] / 255.0f;
+        }
+
+        float probs[MNIST_NUM_LABELS];
+        double expected[MNIST_NUM_LABELS];
+        if (!server_classify(fd, pixels, probs))
+        {
+            client->failed = true;
+            break;
+        }
+        reference_forward(client->net, values, expected);
+        for (int i = 0; i < MNIST_NUM_LABELS; i++)
+        {
+            client->num_mismatches += fabs(probs[i] - expected[i]) >= FORWARD_TOLERANCE;
+        }
+    }
+    server_disconnect(fd);
+    return NULL;
+}
+
+// Concurrent clients of the local server get the same probabilities as the reference forward pass
+static void test_server_matches_reference()
+{
+    Net net = {};
+    init_test_net(&net, &TEST_ARCHS[1]);
+
+    ServerConfig config = server_config_default();
+    config.socket_path = "test_nn_server.sock";
+    config.num_workers = 2;
+    config.max_batch = 3;
+    config.max_latency_us = 2000; // Long enough for the clients' requests to share batches
+    Server *server = server_start(&net, &config);
+    CHECK(server != NULL, "server failed to start");
+    if (!server)
+    {
+        net_free(&net);
+        return;
+    }
+
+    pthread_t threads[SERVER_TEST_CLIENTS];
+    ServerTestClient clients[SERVER_TEST_CLIENTS];
+    for (int c = 0; c < SERVER_TEST_CLIENTS; c++)
+    {
+        clients[c] = (ServerTestClient){&config, &net, c, 0, false};
+        pthread_create(&threads[c], NULL, server_test_client, &clients[c]);
+    }
+    for (int c = 0; c < SERVER_TEST_CLIENTS; c++)
+    {
+        pthread_join(threads[c], NULL);
+        CHECK(!clients[c].failed, "server client %d lost its connection", c);
+        CHECK(clients[c].num_mismatches == 0, "server client %d got %d outputs differing from reference", c,
+              clients[c].num_mismatches);
+    }
+
+    ServerStats stats;
+    server_get_stats(server, &stats);
+    CHECK(stats.num_requests == SERVER_TEST_CLIENTS * SERVER_TEST_REQUESTS, "server counted %llu requests",
+          (unsigned long long)stats.num_requests);
+    CHECK(stats.num_batches < stats.num_requests, "server never batched concurrent requests");
+
+    server_stop(server);
+    net_free(&net);
+}
+
+#define ALLREDUCE_TEST_RANKS 3
+#define ALLREDUCE_TEST_LEN 1001 // Uneven chunks
+#define ALLREDUCE_TEST_PORT 29700
+
+typedef struct
+{
+    ShmRing *ring; // NULL for TCP
+    int rank;
+    float data[ALLREDUCE_TEST_LEN];
+    bool ok;
+} AllReduceTestRank;
+
+static void *allreduce_test_rank(void *arg)
+{
+    AllReduceTestRank *rank = (AllReduceTestRank *)arg;
+    Comm comm;
+    bool joined = rank->ring ? comm_init_shm(&comm, rank->ring, rank->rank)
+                             : comm_init_tcp(&comm, rank->rank, ALLREDUCE_TEST_RANKS, NULL, ALLREDUCE_TEST_PORT);
+    rank->ok = joined;
+    if (!joined)
+        return NULL;
+    // Twice, so mailboxes and sockets are reused
+    for (int round = 0; round < 2 && rank->ok; round++)
+    {
+        for (int i = 0; i < ALLREDUCE_TEST_LEN; i++)
+        {
+            rank->data[i] = (float)(rank->rank + 1) * i + round;
+        }
+        rank->ok = comm_allreduce(&comm, rank->data, ALLREDUCE_TEST_LEN);
+    }
+    comm_close(&comm);
+    return NULL;
+}
+
+// Ring all-reduce over both transports, with ranks as threads
+static void test_allreduce()
+{
+    for (int transport = 0; transport < 2; transport++)
+    {
+        ShmRing *ring = transport == 0 ? shm_ring_create(ALLREDUCE_TEST_RANKS, ALLREDUCE_TEST_LEN) : NULL;
+        AllReduceTestRank ranks[ALLREDUCE_TEST_RANKS];
+        pthread_t threads[ALLREDUCE_TEST_RANKS];
+        for (int r = 0; r < ALLREDUCE_TEST_RANKS; r++)
+        {
+            ranks[r].ring = ring;
+            ranks[r].rank = r;
+            pthread_create(&threads[r], NULL, allreduce_test_rank, &ranks[r]);
+        }
+        for (int r = 0; r < ALLREDUCE_TEST_RANKS; r++)
+        {
+            pthread_join(threads[r], NULL);
+            CHECK(ranks[r].ok, "all-reduce transport %d rank %d failed", transport, r);
+        }
+
+        // Integer sums are exact, so every rank must match them bit for bit
+        int num_wrong = 0;
+        for (int r = 0; r < ALLREDUCE_TEST_RANKS; r++)
+        {
+            for (int i = 0; i < ALLREDUCE_TEST_LEN; i++)
+            {
+                float expected = 6.0f * i + ALLREDUCE_TEST_RANKS;
+                num_wrong += ranks[r].data[i] != expected;
+            }
+        }
+        CHECK(num_wrong == 0, "all-reduce transport %d: %d wrong sums", transport, num_wrong);
+        shm_ring_destroy(ring);
+    }
+}
+
+#define THREADED_TEST_THREADS 3
+#define THREADED_TEST_PER_THREAD 2
+#define THREADED_TEST_SHARD_LEN 4
+#define THREADED_TEST_RECORDS (THREADED_TEST_THREADS * THREADED_TEST_SHARD_LEN)
+#define THREADED_TEST_STEPS 5
+#define THREADED_TEST_SEED 91
+
+// Threaded training under either placement matches train_step on the batches its shards add up to
+static void test_threaded_train()
+{
+    MnistRecord records[THREADED_TEST_RECORDS];
+    for (int i = 0; i < THREADED_TEST_RECORDS; i++)
+    {
+        fill_test_record(&records[i], (uint8_t)(i % MNIST_NUM_LABELS));
+    }
+    Net initial = {};
+    init_test_net(&initial, &TEST_ARCHS[1]);
+    for (int l = 0; l < initial.num_layers; l++)
+    {
+        initial.layers[l].dropout_rate = 0;
+    }
+
+    Net reference = {};
+    net_copy(&reference, &initial);
+    for (int step = 0; step < THREADED_TEST_STEPS; step++)
+    {
+        MnistRecord batch[THREADED_TEST_THREADS * THREADED_TEST_PER_THREAD];
+        for (int t = 0; t < THREADED_TEST_THREADS; t++)
+        {
+            for (int i = 0; i < THREADED_TEST_PER_THREAD; i++)
+            {
+                int shard_pos = (step * THREADED_TEST_PER_THREAD + i) % THREADED_TEST_SHARD_LEN;
+                batch[t * THREADED_TEST_PER_THREAD + i] = records[t * THREADED_TEST_SHARD_LEN + shard_pos];
+            }
+        }
+        train_step(&reference, batch, THREADED_TEST_THREADS * THREADED_TEST_PER_THREAD, LEARNING_RATE);
+    }
+
+    TrainConfig cfg = train_config_default();
+    cfg.num_steps = THREADED_TEST_STEPS;
+    cfg.batch_size = THREADED_TEST_THREADS * THREADED_TEST_PER_THREAD;
+    cfg.learning_rate = LEARNING_RATE;
+    cfg.save_path = NULL;
+    for (int placement = PLACEMENT_LOCAL; placement <= PLACEMENT_INTERLEAVED; placement++)
+    {
+        Net net = {};
+        net_copy(&net, &initial);
+        threaded_train(&net, records, THREADED_TEST_RECORDS, NULL, &cfg, THREADED_TEST_THREADS, (MemPlacement)placement);
+
+        double max_diff = 0;
+        for (int l = 0; l < net.num_layers; l++)
+        {
+            Layer *layer = &net.layers[l];
+            for (int j = 0; j < layer->num_nodes; j++)
+            {
+                max_diff = fmax(max_diff, fabs(layer->b[j] - reference.layers[l].b[j]));
+                for (int k = 0; k < layer->num_inputs; k++)
+                {
+                    max_diff = fmax(max_diff, fabs(layer->w[j][k] - reference.layers[l].w[j][k]));
+                    max_diff = fmax(max_diff, fabs(layer->w_t[k * layer->num_nodes + j] - layer->w[j][k]));
+                }
+            }
+        }
+        CHECK(max_diff < FORWARD_TOLERANCE, "threaded training (placement %d) is off by %g", placement, max_diff);
+        net_free(&net);
+    }
+
+    // With dropout, each worker draws from its own stream seeded through rand(), so one seed
+    // replays the run bitwise
+    Net runs[2];
+    for (int r = 0; r < 2; r++)
+    {
+        runs[r] = (Net){};
+        net_copy(&runs[r], &initial);
+        for (int l = 0; l < runs[r].num_layers - 1; l++)
+        {
+            runs[r].layers[l].dropout_rate = CHECKPOINT_TEST_DROPOUT;
+        }
+        srand(THREADED_TEST_SEED);
+        threaded_train(&runs[r], records, THREADED_TEST_RECORDS, NULL, &cfg, THREADED_TEST_THREADS, PLACEMENT_LOCAL);
+    }
+    CHECK(nets_bitwise_equal(&runs[0], &runs[1]), "threaded training with dropout is not reproducible");
+    net_free(&runs[0]);
+    net_free(&runs[1]);
+    net_free(&reference);
+    net_free(&initial);
+}
+
+// Tuning cache entries are found by machine and arch, and storing one replaces only its own line
+static void test_tuning_cache()
+{
+    const char *path = "test_nn_tuning.tsv";
+    remove(path);
+    TuningEntry first;
+    TuningEntry second;
+    tune_entry_init(&first, TEST_ARCHS[1].arch, TEST_ARCHS[1].arch_len);
+    tune_entry_init(&second, TEST_ARCHS[2].arch, TEST_ARCHS[2].arch_len);
+    CHECK(!tune_lookup(path, &first), "lookup in a missing tuning file succeeded");
+
+    first.sparse_input_threshold = 0.25f;
+    first.backprop_kernels[1] = BACKPROP_KERNEL_TRANSPOSED;
+    first.train_threads = 4;
+    second.backprop_kernels[3] = BACKPROP_KERNEL_STRIDED;
+    CHECK(tune_store(path, &first) && tune_store(path, &second), "tune_store failed");
+    first.train_threads = 2;
+    CHECK(tune_store(path, &first), "tune_store failed to replace an entry");
+
+    TuningEntry found;
+    tune_entry_init(&found, TEST_ARCHS[1].arch, TEST_ARCHS[1].arch_len);
+    CHECK(tune_lookup(path, &found), "stored tuning entry not found");
+    CHECK(found.sparse_input_threshold == 0.25f && found.backprop_kernels[1] == BACKPROP_KERNEL_TRANSPOSED &&
+              found.backprop_kernels[2] == BACKPROP_KERNEL_ROWS && found.train_threads == 2,
+          "tuning entry read back differently");
+    tune_entry_init(&found, TEST_ARCHS[2].arch, TEST_ARCHS[2].arch_len);
+    CHECK(tune_lookup(path, &found) && found.backprop_kernels[3] == BACKPROP_KERNEL_STRIDED,
+          "replacing one tuning entry lost another");
+    tune_entry_init(&found, TEST_ARCHS[0].arch, TEST_ARCHS[0].arch_len);
+    CHECK(!tune_lookup(path, &found), "tuning entry found for an arch never tuned");
+
+    Net net = {};
+    init_test_net(&net, &TEST_ARCHS[1]);
+    CHECK(tune_load_net(path, &net), "tune_load_net found no entry");
+    CHECK(net.sparse_input_threshold == 0.25f && net.layers[1].backprop_kernel == BACKPROP_KERNEL_TRANSPOSED,
+          "tuning not applied to the network");
+    net_free(&net);
+    remove(path);
+}
+
+#define DATASET_TEST_TRAIN_LEN 5
+#define DATASET_TEST_TEST_LEN 3
+
+// Pixel k of record i of the synthetic dataset CSVs, before normalization
+static int dataset_test_pixel(int i, int k)
+{
+    return (i * 37 + k) % 256;
+}
+
+static void write_dataset_test_csv(const char *path, int len, int label_offset)
+{
+    FILE *file = fopen(path, "w");
+    fprintf(file, "label,pixels\n");
+    for (int i = 0; i < len; i++)
+    {
+        fprintf(file, "%d", (label_offset + i) % MNIST_NUM_LABELS);
+        for (int k = 0; k < MNIST_IMG_DATA_LEN; k++)
+        {
+            fprintf(file, ",%d", dataset_test_pixel(label_offset + i, k));
+        }
+        fprintf(file, "\n");
+    }
+    fclose(file);
+}
+
+static bool dataset_records_match(const MnistRecord *data, int len, int label_offset)
+{
+    for (int i = 0; i < len; i++)
+    {
+        if (data[i].label != (label_offset + i) % MNIST_NUM_LABELS)
+            return false;
+        for (int k = 0; k < MNIST_IMG_DATA_LEN; k++)
+        {
+            if (data[i].pixels[k] != dataset_test_pixel(label_offset + i, k) / 255.0f)
+                return false;
+        }
+    }
+    return true;
+}
+
+// A published dataset is found by its CSV paths once attached, maps read-only, and is gone after
+// unpublishing
+static void test_dataset_publish_attach()
+{
+    const char *name = "/tmp/test_nn_dataset";
+    const char *train_path = "/tmp/test_nn_dataset_train.csv";
+    const char *test_path = "/tmp/test_nn_dataset_test.csv";
+    write_dataset_test_csv(train_path, DATASET_TEST_TRAIN_LEN, 0);
+    write_dataset_test_csv(test_path, DATASET_TEST_TEST_LEN, DATASET_TEST_TRAIN_LEN);
+
+    CHECK(!dataset_attach(""), "attached a dataset with an empty name");
+    CHECK(dataset_publish_csv(name, train_path, DATASET_TEST_TRAIN_LEN, test_path, DATASET_TEST_TEST_LEN),
+          "dataset_publish_csv failed");
+    CHECK(dataset_attach(name), "dataset_attach failed");
+
+    MnistRecord *train = load_mnist_data(train_path, DATASET_TEST_TRAIN_LEN);
+    MnistRecord *test = dataset_lookup(test_path, DATASET_TEST_TEST_LEN);
+    CHECK(train && dataset_owns(train), "load_mnist_data did not return the attached train records");
+    CHECK(test && dataset_owns(test), "attached test records not found");
+    CHECK(!dataset_lookup(test_path, DATASET_TEST_TEST_LEN + 1), "lookup returned more records than published");
+    if (train && test)
+    {
+        CHECK(dataset_records_match(train, DATASET_TEST_TRAIN_LEN, 0), "attached train records differ from the CSV");
+        CHECK(dataset_records_match(test, DATASET_TEST_TEST_LEN, DATASET_TEST_TRAIN_LEN),
+              "attached test records differ from the CSV");
+
+        // A write to the attached pages faults, so the writer never exits cleanly (sanitizers catch
+        // the signal and exit with an error instead)
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            ((volatile MnistRecord *)train)->label = 0xff;
+            _exit(0);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        CHECK(!WIFEXITED(status) || WEXITSTATUS(status) != 0, "writing to the attached dataset did not fault");
+    }
+    free_mnist_data(train);
+
+    dataset_detach();
+    CHECK(!dataset_lookup(train_path, DATASET_TEST_TRAIN_LEN), "records found after detaching");
+    CHECK(dataset_unpublish(name), "dataset_unpublish failed");
+    CHECK(access(name, F_OK) != 0, "dataset file left after unpublishing");
+    remove(train_path);
+    remove(test_path);
+}
+
+int main()
+{
+    srand(42);
+
+    test_forward_matches_reference();
+    test_backward_gradients();
+    test_backprop_kernels();
+    test_distill_gradients();
+    test_sparse_input_after_update();
+    test_pruned_kernels_match_reference();
+    test_incremental_forward();
+    test_stacked_layer();
+    test_early_exit();
+    test_conv_layers();
+    test_checkpointing();
+    test_ensemble();
+    test_loss_sampler();
+    test_training_determinism();
+    test_save_load_roundtrip();
+    test_augment_kernels();
+    test_server_matches_reference();
+    test_allreduce();
+    test_threaded_train();
+    test_tuning_cache();
+    test_dataset_publish_attach();
+
+    printf("%d checks, %d failures\n", g_num_checks, g_num_failures);
+    return g_num_failures == 0 ? 0 : 1;
+}